@@ -0,0 +1,515 @@
+/*
+ * vhost-user block device backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "qemu/config-file.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/throttle.h"
+#include "qemu/timer.h"
+#include "qapi/qmp/qstring.h"
+#include "qom/object_interfaces.h"
+#include "sysemu/block-backend.h"
+#include "block/block.h"
+#include "crypto/init.h"
+#include "trace/control.h"
+
+#include <getopt.h>
+#include <sched.h>
+
+#include "vhost-user-blk.h"
+
+#define VUB_OPT_CACHE              256
+#define VUB_OPT_AIO                257
+#define VUB_OPT_DISCARD            258
+#define VUB_OPT_OBJECT             259
+#define VUB_OPT_IMAGE_OPTS         260
+#define VUB_OPT_THROTTLE           261
+#define VUB_OPT_CPU                262
+#define VUB_OPT_POLL_MAX_NS        263
+
+#define VUB_DEFAULT_POLL_MAX_NS    32768
+#define VUB_MAX_QUEUES             256  /* the vring index is 8 bits wide */
+
+static enum { RUNNING, TERMINATE } state;
+
+/* The thread that runs the rings and the block layer */
+typedef struct VubIOThread {
+    QemuThread thread;
+    AioContext *ctx;
+    VubDev *dev;
+    int64_t poll_max_ns;
+    bool stopping;
+} VubIOThread;
+
+static __thread AioContext *my_aio_context;
+
+AioContext *qemu_get_current_aio_context(void)
+{
+    return my_aio_context ? my_aio_context : qemu_get_aio_context();
+}
+
+static void usage(const char *name)
+{
+    (printf) (
+"Usage: %s [OPTIONS] -k PATH FILE\n"
+"QEMU vhost-user block device backend\n"
+"\n"
+"  -h, --help                display this help and exit\n"
+"\n"
+"Connection properties:\n"
+"  -k, --socket=PATH         path to the unix socket to listen on\n"
+"  -q, --num-queues=NUM      number of request queues (default 1)\n"
+"  -S, --serial=STRING       serial number reported to the guest\n"
+"\n"
+"Request processing:\n"
+"      --cpu=CPU             pin the I/O thread to host CPU number CPU\n"
+"      --poll-max-ns=NS      busy-poll the rings for up to NS nanoseconds\n"
+"                            before sleeping, 0 disables polling\n"
+"                            (default %d)\n"
+"      --throttle=OPTS       limit I/O, OPTS is a comma-separated list of\n"
+"                            [iops|bps]-[total|read|write]=LIMIT and\n"
+"                            group=NAME\n"
+"\n"
+"General purpose options:\n"
+"  --object type,id=ID,...   define an object such as 'secret' for providing\n"
+"                            passwords and/or encryption keys\n"
+"  -T, --trace [[enable=]<pattern>][,events=<file>][,file=<file>]\n"
+"                            specify tracing options\n"
+"\n"
+"Block device options:\n"
+"  -f, --format=FORMAT       set image format (raw, qcow2, ...)\n"
+"  -r, --read-only           export read-only\n"
+"  -n, --nocache             disable host cache\n"
+"      --cache=MODE          set cache mode (none, writeback, ...)\n"
+"      --aio=MODE            set AIO mode (native or threads)\n"
+"      --discard=MODE        set discard mode (ignore, unmap)\n"
+"      --image-opts          treat FILE as a full set of image options\n"
+"\n"
+"Report bugs to <qemu-devel@nongnu.org>\n"
+    , name, VUB_DEFAULT_POLL_MAX_NS);
+}
+
+static void termsig_handler(int signum)
+{
+    atomic_set(&state, TERMINATE);
+    qemu_notify_event();
+}
+
+static QemuOptsList file_opts = {
+    .name = "file",
+    .implied_opt_name = "file",
+    .head = QTAILQ_HEAD_INITIALIZER(file_opts.head),
+    .desc = {
+        /* no elements => accept any params */
+        { /* end of list */ }
+    },
+};
+
+static QemuOptsList qemu_object_opts = {
+    .name = "object",
+    .implied_opt_name = "qom-type",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_object_opts.head),
+    .desc = {
+        { }
+    },
+};
+
+static QemuOptsList throttle_opts = {
+    .name = "throttle",
+    .head = QTAILQ_HEAD_INITIALIZER(throttle_opts.head),
+    .desc = {
+        { .name = "bps-total", .type = QEMU_OPT_NUMBER },
+        { .name = "bps-read", .type = QEMU_OPT_NUMBER },
+        { .name = "bps-write", .type = QEMU_OPT_NUMBER },
+        { .name = "iops-total", .type = QEMU_OPT_NUMBER },
+        { .name = "iops-read", .type = QEMU_OPT_NUMBER },
+        { .name = "iops-write", .type = QEMU_OPT_NUMBER },
+        { .name = "group", .type = QEMU_OPT_STRING },
+        { /* end of list */ }
+    },
+};
+
+static void throttle_config_from_opts(ThrottleConfig *cfg, QemuOpts *opts)
+{
+    throttle_config_init(cfg);
+    cfg->buckets[THROTTLE_BPS_TOTAL].avg =
+        qemu_opt_get_number(opts, "bps-total", 0);
+    cfg->buckets[THROTTLE_BPS_READ].avg =
+        qemu_opt_get_number(opts, "bps-read", 0);
+    cfg->buckets[THROTTLE_BPS_WRITE].avg =
+        qemu_opt_get_number(opts, "bps-write", 0);
+    cfg->buckets[THROTTLE_OPS_TOTAL].avg =
+        qemu_opt_get_number(opts, "iops-total", 0);
+    cfg->buckets[THROTTLE_OPS_READ].avg =
+        qemu_opt_get_number(opts, "iops-read", 0);
+    cfg->buckets[THROTTLE_OPS_WRITE].avg =
+        qemu_opt_get_number(opts, "iops-write", 0);
+}
+
+/*
+ * Busy-poll the rings with guest notifications off, for as long as there
+ * is work and then for up to poll_max_ns more.
+ */
+static void vub_io_thread_poll(VubIOThread *t)
+{
+    int64_t deadline;
+    bool progress;
+
+    aio_context_acquire(t->ctx);
+    vub_dev_set_notification(t->dev, false);
+    aio_context_release(t->ctx);
+
+    deadline = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + t->poll_max_ns;
+    do {
+        /* Release the context between rounds so that the main loop can
+         * process protocol messages.
+         */
+        aio_context_acquire(t->ctx);
+        progress = !aio_external_disabled(t->ctx) && vub_dev_poll(t->dev);
+        aio_context_release(t->ctx);
+
+        progress |= aio_poll(t->ctx, false);
+        if (progress) {
+            deadline = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                       t->poll_max_ns;
+        }
+    } while (!atomic_read(&t->stopping) &&
+             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < deadline);
+
+    aio_context_acquire(t->ctx);
+    vub_dev_set_notification(t->dev, true);
+    if (!aio_external_disabled(t->ctx)) {
+        /* Catch requests queued while notifications were off */
+        vub_dev_poll(t->dev);
+    }
+    aio_context_release(t->ctx);
+}
+
+static void *vub_io_thread_run(void *opaque)
+{
+    VubIOThread *t = opaque;
+
+    rcu_register_thread();
+    my_aio_context = t->ctx;
+
+    while (!atomic_read(&t->stopping)) {
+        if (t->poll_max_ns) {
+            vub_io_thread_poll(t);
+        }
+        aio_poll(t->ctx, true);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    BlockBackend *blk;
+    VubDev *dev;
+    VubIOThread io_thread = {
+        .poll_max_ns = VUB_DEFAULT_POLL_MAX_NS,
+    };
+    const char *sopt = "hk:q:S:f:rnT:";
+    struct option lopt[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "socket", required_argument, NULL, 'k' },
+        { "num-queues", required_argument, NULL, 'q' },
+        { "serial", required_argument, NULL, 'S' },
+        { "cpu", required_argument, NULL, VUB_OPT_CPU },
+        { "poll-max-ns", required_argument, NULL, VUB_OPT_POLL_MAX_NS },
+        { "throttle", required_argument, NULL, VUB_OPT_THROTTLE },
+        { "object", required_argument, NULL, VUB_OPT_OBJECT },
+        { "trace", required_argument, NULL, 'T' },
+        { "format", required_argument, NULL, 'f' },
+        { "read-only", no_argument, NULL, 'r' },
+        { "nocache", no_argument, NULL, 'n' },
+        { "cache", required_argument, NULL, VUB_OPT_CACHE },
+        { "aio", required_argument, NULL, VUB_OPT_AIO },
+        { "discard", required_argument, NULL, VUB_OPT_DISCARD },
+        { "image-opts", no_argument, NULL, VUB_OPT_IMAGE_OPTS },
+        { NULL, 0, NULL, 0 }
+    };
+    int ch;
+    int opt_ind = 0;
+    int flags = BDRV_O_RDWR;
+    bool seen_cache = false;
+    bool seen_discard = false;
+    bool seen_aio = false;
+    bool writethrough = true;
+    bool imageOpts = false;
+    const char *sockpath = NULL;
+    const char *serial = NULL;
+    const char *fmt = NULL;
+    char *trace_file = NULL;
+    unsigned long num_queues = 1;
+    long cpu = -1;
+    QemuOpts *throttle = NULL;
+    QDict *options = NULL;
+    Error *local_err = NULL;
+    struct sigaction sa_sigterm;
+
+    memset(&sa_sigterm, 0, sizeof(sa_sigterm));
+    sa_sigterm.sa_handler = termsig_handler;
+    sigaction(SIGTERM, &sa_sigterm, NULL);
+    sigaction(SIGINT, &sa_sigterm, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    module_call_init(MODULE_INIT_TRACE);
+    qcrypto_init(&error_fatal);
+
+    module_call_init(MODULE_INIT_QOM);
+    qemu_add_opts(&qemu_object_opts);
+    qemu_add_opts(&qemu_trace_opts);
+    qemu_init_exec_dir(argv[0]);
+
+    while ((ch = getopt_long(argc, argv, sopt, lopt, &opt_ind)) != -1) {
+        switch (ch) {
+        case 'n':
+            optarg = (char *) "none";
+            /* fallthrough */
+        case VUB_OPT_CACHE:
+            if (seen_cache) {
+                error_report("-n and --cache can only be specified once");
+                exit(EXIT_FAILURE);
+            }
+            seen_cache = true;
+            if (bdrv_parse_cache_mode(optarg, &flags, &writethrough) == -1) {
+                error_report("Invalid cache mode `%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case VUB_OPT_AIO:
+            if (seen_aio) {
+                error_report("--aio can only be specified once");
+                exit(EXIT_FAILURE);
+            }
+            seen_aio = true;
+            if (!strcmp(optarg, "native")) {
+                flags |= BDRV_O_NATIVE_AIO;
+            } else if (strcmp(optarg, "threads")) {
+                error_report("invalid aio mode `%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case VUB_OPT_DISCARD:
+            if (seen_discard) {
+                error_report("--discard can only be specified once");
+                exit(EXIT_FAILURE);
+            }
+            seen_discard = true;
+            if (bdrv_parse_discard_flags(optarg, &flags) == -1) {
+                error_report("Invalid discard mode `%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'k':
+            sockpath = optarg;
+            break;
+        case 'q':
+            if (qemu_strtoul(optarg, NULL, 0, &num_queues) < 0 ||
+                num_queues < 1 || num_queues > VUB_MAX_QUEUES) {
+                error_report("Number of queues must be between 1 and %d",
+                             VUB_MAX_QUEUES);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            serial = optarg;
+            break;
+        case VUB_OPT_CPU:
+            if (qemu_strtol(optarg, NULL, 0, &cpu) < 0 || cpu < 0 ||
+                cpu >= CPU_SETSIZE) {
+                error_report("Invalid CPU number `%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case VUB_OPT_POLL_MAX_NS:
+            if (qemu_strtoll(optarg, NULL, 0, &io_thread.poll_max_ns) < 0 ||
+                io_thread.poll_max_ns < 0) {
+                error_report("Invalid polling time `%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case VUB_OPT_THROTTLE:
+            throttle = qemu_opts_parse_noisily(&throttle_opts, optarg, false);
+            if (!throttle) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'r':
+            flags &= ~BDRV_O_RDWR;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+            break;
+        case '?':
+            error_report("Try `%s --help' for more information.", argv[0]);
+            exit(EXIT_FAILURE);
+        case VUB_OPT_OBJECT: {
+            QemuOpts *opts;
+            opts = qemu_opts_parse_noisily(&qemu_object_opts,
+                                           optarg, true);
+            if (!opts) {
+                exit(EXIT_FAILURE);
+            }
+        }   break;
+        case VUB_OPT_IMAGE_OPTS:
+            imageOpts = true;
+            break;
+        case 'T':
+            g_free(trace_file);
+            trace_file = trace_opt_parse(optarg);
+            break;
+        }
+    }
+
+    if ((argc - optind) != 1) {
+        error_report("Invalid number of arguments");
+        error_printf("Try `%s --help' for more information.\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (!sockpath) {
+        error_report("A socket path must be given with -k");
+        exit(EXIT_FAILURE);
+    }
+
+    if (qemu_opts_foreach(&qemu_object_opts,
+                          user_creatable_add_opts_foreach,
+                          NULL, NULL)) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (!trace_init_backends()) {
+        exit(1);
+    }
+    trace_init_file(trace_file);
+    qemu_set_log(LOG_TRACE);
+
+    if (qemu_init_main_loop(&local_err)) {
+        error_report_err(local_err);
+        exit(EXIT_FAILURE);
+    }
+    bdrv_init();
+    atexit(bdrv_close_all);
+
+    if (imageOpts) {
+        QemuOpts *opts;
+        if (fmt) {
+            error_report("--image-opts and -f are mutually exclusive");
+            exit(EXIT_FAILURE);
+        }
+        opts = qemu_opts_parse_noisily(&file_opts, argv[optind], true);
+        if (!opts) {
+            qemu_opts_reset(&file_opts);
+            exit(EXIT_FAILURE);
+        }
+        options = qemu_opts_to_qdict(opts, NULL);
+        qemu_opts_reset(&file_opts);
+        blk = blk_new_open(NULL, NULL, options, flags, &local_err);
+    } else {
+        if (fmt) {
+            options = qdict_new();
+            qdict_put(options, "driver", qstring_from_str(fmt));
+        }
+        blk = blk_new_open(argv[optind], NULL, options, flags, &local_err);
+    }
+
+    if (!blk) {
+        error_reportf_err(local_err, "Failed to blk_new_open '%s': ",
+                          argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    blk_set_enable_write_cache(blk, !writethrough);
+
+    if (throttle) {
+        ThrottleConfig cfg;
+        const char *group = qemu_opt_get(throttle, "group");
+
+        throttle_config_from_opts(&cfg, throttle);
+        if (!throttle_is_valid(&cfg, &local_err)) {
+            error_report_err(local_err);
+            exit(EXIT_FAILURE);
+        }
+        blk_io_limits_enable(blk, group ? group : "vhost-user-blk");
+        blk_set_io_limits(blk, &cfg);
+        qemu_opts_del(throttle);
+    }
+
+    /* From here on the block backend belongs to the I/O thread */
+    io_thread.ctx = aio_context_new(&local_err);
+    if (!io_thread.ctx) {
+        error_report_err(local_err);
+        exit(EXIT_FAILURE);
+    }
+    aio_context_acquire(io_thread.ctx);
+    blk_set_aio_context(blk, io_thread.ctx);
+    aio_context_release(io_thread.ctx);
+
+    dev = vub_dev_new(blk, io_thread.ctx, num_queues, serial);
+    if (vub_dev_listen(dev, sockpath, &local_err) < 0) {
+        error_report_err(local_err);
+        exit(EXIT_FAILURE);
+    }
+
+    io_thread.dev = dev;
+    qemu_thread_create(&io_thread.thread, "vub-io", vub_io_thread_run,
+                       &io_thread, QEMU_THREAD_JOINABLE);
+    if (cpu >= 0) {
+        cpu_set_t set;
+        int ret;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        ret = pthread_setaffinity_np(io_thread.thread.thread, sizeof(set),
+                                     &set);
+        if (ret) {
+            error_report("Could not pin the I/O thread to CPU %ld: %s",
+                         cpu, strerror(ret));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* now when the initialization is (almost) complete, chdir("/")
+     * to free any busy filesystems */
+    if (chdir("/") < 0) {
+        error_report("Could not chdir to root directory: %s",
+                     strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    while (atomic_read(&state) == RUNNING) {
+        main_loop_wait(false);
+    }
+
+    /* The I/O thread polls the rings, stop it before they go away */
+    atomic_set(&io_thread.stopping, true);
+    aio_notify(io_thread.ctx);
+    qemu_thread_join(&io_thread.thread);
+
+    vub_dev_free(dev);
+
+    aio_context_acquire(io_thread.ctx);
+    blk_set_aio_context(blk, qemu_get_aio_context());
+    aio_context_release(io_thread.ctx);
+    aio_context_unref(io_thread.ctx);
+
+    blk_unref(blk);
+    exit(EXIT_SUCCESS);
+}
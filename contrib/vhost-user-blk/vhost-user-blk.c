@@ -0,0 +1,1173 @@
+/*
+ * vhost-user block device backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <linux/vhost.h>
+
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "block/block.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "standard-headers/linux/virtio_config.h"
+#include "standard-headers/linux/virtio_ring.h"
+
+#include "vhost-user-blk.h"
+
+/* The vhost-user protocol, see docs/specs/vhost-user.txt */
+
+#define VHOST_MEMORY_MAX_NREGIONS    8
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+#define VHOST_USER_MAX_CONFIG_SIZE   256
+
+enum VhostUserProtocolFeature {
+    VHOST_USER_PROTOCOL_F_MQ = 0,
+    VHOST_USER_PROTOCOL_F_LOG_SHMFD = 1,
+    VHOST_USER_PROTOCOL_F_RARP = 2,
+    VHOST_USER_PROTOCOL_F_REPLY_ACK = 3,
+    VHOST_USER_PROTOCOL_F_CONFIG = 9,
+};
+
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_SEND_RARP = 19,
+    VHOST_USER_GET_CONFIG = 24,
+    VHOST_USER_MAX
+} VhostUserRequest;
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserConfig {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_MAX_CONFIG_SIZE];
+} VhostUserConfig;
+
+typedef struct VhostUserMsg {
+    VhostUserRequest request;
+
+#define VHOST_USER_VERSION_MASK     (0x3)
+#define VHOST_USER_REPLY_MASK       (0x1 << 2)
+#define VHOST_USER_NEED_REPLY_MASK  (0x1 << 3)
+    uint32_t flags;
+    uint32_t size; /* the following payload size */
+    union {
+#define VHOST_USER_VRING_IDX_MASK   (0xff)
+#define VHOST_USER_VRING_NOFD_MASK  (0x1 << 8)
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        VhostUserMemory memory;
+        VhostUserConfig config;
+    } payload;
+} QEMU_PACKED VhostUserMsg;
+
+static VhostUserMsg m __attribute__ ((unused));
+#define VHOST_USER_HDR_SIZE (sizeof(m.request) \
+                            + sizeof(m.flags) \
+                            + sizeof(m.size))
+
+#define VHOST_USER_PAYLOAD_SIZE (sizeof(m) - VHOST_USER_HDR_SIZE)
+
+#define VHOST_USER_VERSION    (0x1)
+
+#define VUB_PROTOCOL_FEATURES                          \
+    ((1ULL << VHOST_USER_PROTOCOL_F_MQ) |              \
+     (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) |       \
+     (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))
+
+#define VUB_MAX_QUEUE_SIZE 32768
+
+typedef struct VubDevRegion {
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t qva;               /* address in the master */
+    uint64_t mmap_offset;
+    uint64_t mmap_addr;
+} VubDevRegion;
+
+typedef struct VubVirtq {
+    VubDev *dev;
+    unsigned int index;
+    unsigned int num;
+
+    /* Ring addresses in the master, and where they are mapped here */
+    struct vhost_vring_addr addr;
+    bool has_addr;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+
+    uint16_t last_avail_idx;
+    uint16_t used_idx;
+    uint16_t signalled_used;
+    bool signalled_used_valid;
+    bool notification;
+
+    bool started;
+    bool enabled;
+    int kick_fd;
+    int call_fd;
+
+    /* Completions are signalled once per event loop iteration */
+    QEMUBH *notify_bh;
+    unsigned int inflight;
+} VubVirtq;
+
+struct VubDev {
+    BlockBackend *blk;
+    AioContext *ctx;
+    char *serial;
+    uint16_t num_queues;
+    VubVirtq *vqs;
+    bool polling;
+
+    char *sock_path;
+    int listen_fd;
+    int sock_fd;
+    uint64_t features;
+    uint64_t protocol_features;
+
+    unsigned int nregions;
+    VubDevRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+};
+
+typedef struct VubReq {
+    VubVirtq *vq;
+    unsigned int head;
+    uint32_t in_len;            /* bytes written to the guest */
+    uint8_t *status;
+    struct virtio_blk_outhdr out;
+    QEMUIOVector qiov;
+    unsigned int out_num;
+    unsigned int in_num;
+    struct iovec iov[VUB_SEG_MAX + 2];  /* out_num, then in_num entries */
+} VubReq;
+
+static bool vub_has_feature(VubDev *dev, unsigned int fbit)
+{
+    return !!(dev->features & (1ULL << fbit));
+}
+
+static void *vub_gpa_to_va(VubDev *dev, uint64_t gpa, uint64_t len)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        VubDevRegion *r = &dev->regions[i];
+
+        if (gpa >= r->gpa && gpa - r->gpa < r->size &&
+            len <= r->size - (gpa - r->gpa)) {
+            return (void *)(uintptr_t)(r->mmap_addr + r->mmap_offset +
+                                       gpa - r->gpa);
+        }
+    }
+    return NULL;
+}
+
+static void *vub_qva_to_va(VubDev *dev, uint64_t qva, uint64_t len)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        VubDevRegion *r = &dev->regions[i];
+
+        if (qva >= r->qva && qva - r->qva < r->size &&
+            len <= r->size - (qva - r->qva)) {
+            return (void *)(uintptr_t)(r->mmap_addr + r->mmap_offset +
+                                       qva - r->qva);
+        }
+    }
+    return NULL;
+}
+
+static void vub_unmap_regions(VubDev *dev)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        VubDevRegion *r = &dev->regions[i];
+
+        munmap((void *)(uintptr_t)r->mmap_addr, r->size + r->mmap_offset);
+    }
+    dev->nregions = 0;
+}
+
+/* Virtqueues */
+
+static uint16_t *vub_used_event(VubVirtq *vq)
+{
+    return &vq->avail->ring[vq->num];
+}
+
+static uint16_t *vub_avail_event(VubVirtq *vq)
+{
+    return (uint16_t *)&vq->used->ring[vq->num];
+}
+
+static int vub_virtq_map_rings(VubVirtq *vq)
+{
+    VubDev *dev = vq->dev;
+
+    vq->desc = vub_qva_to_va(dev, vq->addr.desc_user_addr,
+                             vq->num * sizeof(struct vring_desc));
+    vq->avail = vub_qva_to_va(dev, vq->addr.avail_user_addr,
+                              sizeof(struct vring_avail) +
+                              (vq->num + 1) * sizeof(uint16_t));
+    vq->used = vub_qva_to_va(dev, vq->addr.used_user_addr,
+                             sizeof(struct vring_used) +
+                             vq->num * sizeof(struct vring_used_elem) +
+                             sizeof(uint16_t));
+    if (!vq->desc || !vq->avail || !vq->used) {
+        vq->desc = NULL;
+        vq->avail = NULL;
+        vq->used = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void vub_virtq_fail(VubVirtq *vq, const char *msg)
+{
+    error_report("vhost-user-blk: %s, stopping virtqueue %u", msg, vq->index);
+    vq->started = false;
+}
+
+static bool vub_virtq_empty(VubVirtq *vq)
+{
+    return le16_to_cpu(atomic_read(&vq->avail->idx)) == vq->last_avail_idx;
+}
+
+static void vub_virtq_set_notification(VubVirtq *vq, bool enable)
+{
+    vq->notification = enable;
+    if (vub_has_feature(vq->dev, VIRTIO_RING_F_EVENT_IDX)) {
+        if (enable) {
+            *vub_avail_event(vq) = cpu_to_le16(vq->last_avail_idx);
+        }
+    } else {
+        vq->used->flags = cpu_to_le16(enable ? 0 : VRING_USED_F_NO_NOTIFY);
+    }
+    if (enable) {
+        /* Expose avail event/used flags before checking avail idx */
+        smp_mb();
+    }
+}
+
+static void vub_virtq_notify(VubVirtq *vq)
+{
+    uint16_t old, new;
+    bool valid;
+
+    if (vq->call_fd < 0 || !vq->avail) {
+        return;
+    }
+
+    /* Make used idx visible before reading used event/avail flags */
+    smp_mb();
+    if (vub_has_feature(vq->dev, VIRTIO_RING_F_EVENT_IDX)) {
+        old = vq->signalled_used;
+        valid = vq->signalled_used_valid;
+        new = vq->signalled_used = vq->used_idx;
+        vq->signalled_used_valid = true;
+        if (valid &&
+            !vring_need_event(le16_to_cpu(*vub_used_event(vq)), new, old)) {
+            return;
+        }
+    } else if (le16_to_cpu(vq->avail->flags) & VRING_AVAIL_F_NO_INTERRUPT) {
+        return;
+    }
+    eventfd_write(vq->call_fd, 1);
+}
+
+static void vub_virtq_notify_bh(void *opaque)
+{
+    vub_virtq_notify(opaque);
+}
+
+static void vub_virtq_push(VubVirtq *vq, unsigned int head, uint32_t len)
+{
+    struct vring_used_elem *elem = &vq->used->ring[vq->used_idx % vq->num];
+
+    elem->id = cpu_to_le32(head);
+    elem->len = cpu_to_le32(len);
+    /* Fill in the element before publishing it */
+    smp_wmb();
+    vq->used_idx++;
+    atomic_set(&vq->used->idx, cpu_to_le16(vq->used_idx));
+
+    vq->inflight--;
+    qemu_bh_schedule(vq->notify_bh);
+}
+
+static int vub_virtq_map_desc(VubVirtq *vq, unsigned int head, VubReq *req)
+{
+    VubDev *dev = vq->dev;
+    struct vring_desc *desc = vq->desc;
+    unsigned int max = vq->num;
+    unsigned int i = head;
+    unsigned int count = 0;
+    uint16_t flags;
+
+    if (le16_to_cpu(desc[i].flags) & VRING_DESC_F_INDIRECT) {
+        uint32_t len = le32_to_cpu(desc[i].len);
+
+        if (!vub_has_feature(dev, VIRTIO_RING_F_INDIRECT_DESC) ||
+            !len || len % sizeof(struct vring_desc)) {
+            return -1;
+        }
+        desc = vub_gpa_to_va(dev, le64_to_cpu(desc[i].addr), len);
+        if (!desc) {
+            return -1;
+        }
+        max = len / sizeof(struct vring_desc);
+        i = 0;
+    }
+
+    do {
+        struct iovec *iov;
+        uint32_t len;
+
+        if (i >= max || ++count > max ||
+            req->out_num + req->in_num == ARRAY_SIZE(req->iov)) {
+            return -1;
+        }
+
+        flags = le16_to_cpu(desc[i].flags);
+        if (flags & VRING_DESC_F_INDIRECT) {
+            return -1;
+        }
+        if (flags & VRING_DESC_F_WRITE) {
+            req->in_num++;
+        } else if (req->in_num) {
+            /* Device-readable buffers must come first */
+            return -1;
+        } else {
+            req->out_num++;
+        }
+
+        len = le32_to_cpu(desc[i].len);
+        iov = &req->iov[req->out_num + req->in_num - 1];
+        iov->iov_base = vub_gpa_to_va(dev, le64_to_cpu(desc[i].addr), len);
+        iov->iov_len = len;
+        if (!iov->iov_base) {
+            return -1;
+        }
+
+        i = le16_to_cpu(desc[i].next);
+    } while (flags & VRING_DESC_F_NEXT);
+
+    return 0;
+}
+
+static VubReq *vub_virtq_pop(VubVirtq *vq)
+{
+    uint16_t avail_idx;
+    unsigned int head;
+    VubReq *req;
+
+    avail_idx = le16_to_cpu(atomic_read(&vq->avail->idx));
+    if (avail_idx == vq->last_avail_idx) {
+        return NULL;
+    }
+    if ((uint16_t)(avail_idx - vq->last_avail_idx) > vq->num) {
+        vub_virtq_fail(vq, "avail index out of range");
+        return NULL;
+    }
+
+    /* Read the ring entry after the index that covers it */
+    smp_rmb();
+    head = le16_to_cpu(vq->avail->ring[vq->last_avail_idx % vq->num]);
+    if (head >= vq->num) {
+        vub_virtq_fail(vq, "descriptor head out of range");
+        return NULL;
+    }
+
+    req = g_new(VubReq, 1);
+    req->vq = vq;
+    req->head = head;
+    req->out_num = 0;
+    req->in_num = 0;
+    if (vub_virtq_map_desc(vq, head, req) < 0) {
+        g_free(req);
+        vub_virtq_fail(vq, "invalid descriptor chain");
+        return NULL;
+    }
+
+    vq->last_avail_idx++;
+    if (vq->notification && vub_has_feature(vq->dev, VIRTIO_RING_F_EVENT_IDX)) {
+        *vub_avail_event(vq) = cpu_to_le16(vq->last_avail_idx);
+    }
+    vq->inflight++;
+    return req;
+}
+
+/* Requests */
+
+static void vub_req_complete(VubReq *req, uint8_t status)
+{
+    *req->status = status;
+    vub_virtq_push(req->vq, req->head, req->in_len);
+    g_free(req);
+}
+
+static void vub_req_rw_complete(void *opaque, int ret)
+{
+    VubReq *req = opaque;
+
+    if (ret < 0) {
+        error_report("vhost-user-blk: I/O error: %s", strerror(-ret));
+    }
+    vub_req_complete(req, ret < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK);
+}
+
+static bool vub_sector_range_ok(VubDev *dev, uint64_t sector, size_t size)
+{
+    uint64_t nb_sectors = size >> BDRV_SECTOR_BITS;
+    uint64_t total_sectors;
+
+    if (size & (BDRV_SECTOR_SIZE - 1) ||
+        nb_sectors > BDRV_REQUEST_MAX_SECTORS) {
+        return false;
+    }
+    blk_get_geometry(dev->blk, &total_sectors);
+    return sector <= total_sectors && nb_sectors <= total_sectors - sector;
+}
+
+static void vub_req_submit(VubReq *req)
+{
+    VubDev *dev = req->vq->dev;
+    struct iovec *out_iov = req->iov;
+    struct iovec *in_iov = req->iov + req->out_num;
+    unsigned int out_num = req->out_num;
+    unsigned int in_num = req->in_num;
+    struct iovec *last;
+    uint64_t sector;
+    uint32_t type;
+
+    if (iov_to_buf(out_iov, out_num, 0, &req->out, sizeof(req->out)) !=
+        sizeof(req->out) || !in_num || !in_iov[in_num - 1].iov_len) {
+        /* Nowhere to put the status: give the buffers back as they are */
+        error_report("vhost-user-blk: malformed request");
+        vub_virtq_push(req->vq, req->head, 0);
+        g_free(req);
+        return;
+    }
+
+    last = &in_iov[in_num - 1];
+    req->status = (uint8_t *)last->iov_base + last->iov_len - 1;
+    req->in_len = 1;
+    iov_discard_front(&out_iov, &out_num, sizeof(req->out));
+    iov_discard_back(in_iov, &in_num, 1);
+
+    type = le32_to_cpu(req->out.type);
+    sector = le64_to_cpu(req->out.sector);
+
+    switch (type & ~VIRTIO_BLK_T_BARRIER) {
+    case VIRTIO_BLK_T_IN:
+        qemu_iovec_init_external(&req->qiov, in_iov, in_num);
+        if (!vub_sector_range_ok(dev, sector, req->qiov.size)) {
+            vub_req_complete(req, VIRTIO_BLK_S_IOERR);
+            break;
+        }
+        req->in_len += req->qiov.size;
+        blk_aio_preadv(dev->blk, sector << BDRV_SECTOR_BITS, &req->qiov, 0,
+                       vub_req_rw_complete, req);
+        break;
+    case VIRTIO_BLK_T_OUT:
+        qemu_iovec_init_external(&req->qiov, out_iov, out_num);
+        if (blk_is_read_only(dev->blk) ||
+            !vub_sector_range_ok(dev, sector, req->qiov.size)) {
+            vub_req_complete(req, VIRTIO_BLK_S_IOERR);
+            break;
+        }
+        blk_aio_pwritev(dev->blk, sector << BDRV_SECTOR_BITS, &req->qiov, 0,
+                        vub_req_rw_complete, req);
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        blk_aio_flush(dev->blk, vub_req_rw_complete, req);
+        break;
+    case VIRTIO_BLK_T_GET_ID: {
+        char id[VIRTIO_BLK_ID_BYTES];
+
+        /* No terminating NUL when the serial takes all of the bytes */
+        strncpy(id, dev->serial ? dev->serial : "", sizeof(id));
+        req->in_len += iov_from_buf(in_iov, in_num, 0, id, sizeof(id));
+        vub_req_complete(req, VIRTIO_BLK_S_OK);
+        break;
+    }
+    default:
+        vub_req_complete(req, VIRTIO_BLK_S_UNSUPP);
+        break;
+    }
+}
+
+static bool vub_virtq_handle(VubVirtq *vq)
+{
+    VubDev *dev = vq->dev;
+    bool progress = false;
+    VubReq *req;
+
+    if (!vq->started || !vq->enabled) {
+        return false;
+    }
+
+    blk_io_plug(dev->blk);
+    do {
+        if (!dev->polling) {
+            vub_virtq_set_notification(vq, false);
+        }
+        while ((req = vub_virtq_pop(vq))) {
+            vub_req_submit(req);
+            progress = true;
+        }
+        if (dev->polling || !vq->started) {
+            break;
+        }
+        vub_virtq_set_notification(vq, true);
+    } while (!vub_virtq_empty(vq));
+    blk_io_unplug(dev->blk);
+
+    return progress;
+}
+
+static void vub_virtq_kick(void *opaque)
+{
+    VubVirtq *vq = opaque;
+    eventfd_t kick;
+
+    if (eventfd_read(vq->kick_fd, &kick) < 0 && errno != EAGAIN) {
+        error_report("vhost-user-blk: failed to read kick: %s",
+                     strerror(errno));
+    }
+    vub_virtq_handle(vq);
+}
+
+/* Called with the AioContext of the device acquired */
+static void vub_virtq_start(VubVirtq *vq)
+{
+    VubDev *dev = vq->dev;
+
+    if (!vq->num || !vq->avail) {
+        error_report("vhost-user-blk: virtqueue %u started before its "
+                     "rings were set up", vq->index);
+        return;
+    }
+
+    vq->used_idx = le16_to_cpu(vq->used->idx);
+    vq->signalled_used_valid = false;
+    vq->started = true;
+    vub_virtq_set_notification(vq, !dev->polling);
+    aio_set_fd_handler(dev->ctx, vq->kick_fd, true, vub_virtq_kick, NULL, vq);
+
+    /* Pick up whatever the guest queued before the kick fd was set */
+    eventfd_write(vq->kick_fd, 1);
+}
+
+/* Called with the AioContext of the device acquired */
+static void vub_virtq_stop(VubVirtq *vq)
+{
+    VubDev *dev = vq->dev;
+    bool notify = vq->started || vq->inflight;
+
+    if (vq->kick_fd >= 0) {
+        aio_set_fd_handler(dev->ctx, vq->kick_fd, true, NULL, NULL, NULL);
+        close(vq->kick_fd);
+        vq->kick_fd = -1;
+    }
+    vq->started = false;
+
+    if (vq->inflight) {
+        blk_drain(dev->blk);
+    }
+    assert(!vq->inflight);
+
+    qemu_bh_cancel(vq->notify_bh);
+    if (notify) {
+        vub_virtq_notify(vq);
+    }
+}
+
+/* Called with the AioContext of the device acquired */
+static void vub_virtq_reset(VubVirtq *vq)
+{
+    vub_virtq_stop(vq);
+    if (vq->call_fd >= 0) {
+        close(vq->call_fd);
+        vq->call_fd = -1;
+    }
+    vq->num = 0;
+    vq->has_addr = false;
+    vq->desc = NULL;
+    vq->avail = NULL;
+    vq->used = NULL;
+    vq->last_avail_idx = 0;
+    vq->enabled = true;
+}
+
+void vub_dev_set_notification(VubDev *dev, bool enable)
+{
+    unsigned int i;
+
+    dev->polling = !enable;
+    for (i = 0; i < dev->num_queues; i++) {
+        if (dev->vqs[i].started) {
+            vub_virtq_set_notification(&dev->vqs[i], enable);
+        }
+    }
+}
+
+bool vub_dev_poll(VubDev *dev)
+{
+    bool progress = false;
+    unsigned int i;
+
+    for (i = 0; i < dev->num_queues; i++) {
+        progress |= vub_virtq_handle(&dev->vqs[i]);
+    }
+    return progress;
+}
+
+/* Protocol messages */
+
+static uint64_t vub_get_features(VubDev *dev)
+{
+    uint64_t features;
+
+    features = (1ULL << VIRTIO_F_VERSION_1) |
+               (1ULL << VIRTIO_RING_F_INDIRECT_DESC) |
+               (1ULL << VIRTIO_RING_F_EVENT_IDX) |
+               (1ULL << VIRTIO_BLK_F_SEG_MAX) |
+               (1ULL << VIRTIO_BLK_F_BLK_SIZE) |
+               (1ULL << VIRTIO_BLK_F_FLUSH) |
+               (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+    if (dev->num_queues > 1) {
+        features |= 1ULL << VIRTIO_BLK_F_MQ;
+    }
+    if (blk_is_read_only(dev->blk)) {
+        features |= 1ULL << VIRTIO_BLK_F_RO;
+    }
+    return features;
+}
+
+/* Called with the AioContext of the device acquired */
+static void vub_get_config(VubDev *dev, struct virtio_blk_config *blkcfg)
+{
+    uint64_t capacity;
+
+    memset(blkcfg, 0, sizeof(*blkcfg));
+    blk_get_geometry(dev->blk, &capacity);
+    blkcfg->capacity = cpu_to_le64(capacity);
+    blkcfg->seg_max = cpu_to_le32(VUB_SEG_MAX);
+    blkcfg->blk_size = cpu_to_le32(BDRV_SECTOR_SIZE);
+    blkcfg->wce = blk_enable_write_cache(dev->blk);
+    blkcfg->num_queues = cpu_to_le16(dev->num_queues);
+}
+
+static int vub_set_mem_table(VubDev *dev, VhostUserMsg *msg,
+                             int *fds, int fd_num)
+{
+    VhostUserMemory *memory = &msg->payload.memory;
+    unsigned int i;
+    int ret = 0;
+
+    if (memory->nregions > VHOST_MEMORY_MAX_NREGIONS ||
+        memory->nregions != fd_num) {
+        error_report("vhost-user-blk: bad memory table");
+        return -1;
+    }
+
+    aio_context_acquire(dev->ctx);
+
+    /* Requests in flight point to the old mappings */
+    blk_drain(dev->blk);
+    vub_unmap_regions(dev);
+
+    for (i = 0; i < memory->nregions; i++) {
+        VhostUserMemoryRegion *msg_region = &memory->regions[i];
+        VubDevRegion *r = &dev->regions[i];
+        void *addr;
+
+        addr = mmap(NULL, msg_region->memory_size + msg_region->mmap_offset,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+        if (addr == MAP_FAILED) {
+            error_report("vhost-user-blk: failed to map guest memory: %s",
+                         strerror(errno));
+            vub_unmap_regions(dev);
+            ret = -1;
+            break;
+        }
+
+        r->gpa = msg_region->guest_phys_addr;
+        r->size = msg_region->memory_size;
+        r->qva = msg_region->userspace_addr;
+        r->mmap_offset = msg_region->mmap_offset;
+        r->mmap_addr = (uintptr_t)addr;
+        dev->nregions++;
+    }
+
+    for (i = 0; i < dev->num_queues; i++) {
+        VubVirtq *vq = &dev->vqs[i];
+
+        if (vq->has_addr && vub_virtq_map_rings(vq) < 0 && vq->started) {
+            vub_virtq_fail(vq, "rings not in guest memory");
+        }
+    }
+
+    aio_context_release(dev->ctx);
+    return ret;
+}
+
+static VubVirtq *vub_msg_vq(VubDev *dev, unsigned int index)
+{
+    if (index >= dev->num_queues) {
+        error_report("vhost-user-blk: invalid virtqueue %u", index);
+        return NULL;
+    }
+    return &dev->vqs[index];
+}
+
+/*
+ * Handle a message from the master.  @fds that are kept are replaced
+ * with -1 so that the caller does not close them.
+ *
+ * Returns 1 if @msg was filled with a reply, 0 on success and -1 on
+ * failure.
+ */
+static int vub_process_msg(VubDev *dev, VhostUserMsg *msg,
+                           int *fds, int fd_num)
+{
+    VubVirtq *vq;
+    int ret = 0;
+
+    switch (msg->request) {
+    case VHOST_USER_GET_FEATURES:
+        msg->payload.u64 = vub_get_features(dev);
+        msg->size = sizeof(msg->payload.u64);
+        return 1;
+    case VHOST_USER_SET_FEATURES:
+        aio_context_acquire(dev->ctx);
+        dev->features = msg->payload.u64 & vub_get_features(dev);
+        aio_context_release(dev->ctx);
+        return 0;
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        msg->payload.u64 = VUB_PROTOCOL_FEATURES;
+        msg->size = sizeof(msg->payload.u64);
+        return 1;
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        dev->protocol_features = msg->payload.u64 & VUB_PROTOCOL_FEATURES;
+        return 0;
+    case VHOST_USER_GET_QUEUE_NUM:
+        msg->payload.u64 = dev->num_queues;
+        msg->size = sizeof(msg->payload.u64);
+        return 1;
+    case VHOST_USER_SET_OWNER:
+        return 0;
+    case VHOST_USER_RESET_OWNER: {
+        unsigned int i;
+
+        aio_context_acquire(dev->ctx);
+        for (i = 0; i < dev->num_queues; i++) {
+            vub_virtq_reset(&dev->vqs[i]);
+        }
+        dev->features = 0;
+        aio_context_release(dev->ctx);
+        return 0;
+    }
+    case VHOST_USER_SET_MEM_TABLE:
+        return vub_set_mem_table(dev, msg, fds, fd_num);
+    case VHOST_USER_SET_VRING_NUM:
+        vq = vub_msg_vq(dev, msg->payload.state.index);
+        /* The ring indexes wrap at 2^16, so the size must divide it */
+        if (!vq || vq->started || !is_power_of_2(msg->payload.state.num) ||
+            msg->payload.state.num > VUB_MAX_QUEUE_SIZE) {
+            return -1;
+        }
+        vq->num = msg->payload.state.num;
+        return 0;
+    case VHOST_USER_SET_VRING_ADDR:
+        vq = vub_msg_vq(dev, msg->payload.addr.index);
+        if (!vq || vq->started) {
+            return -1;
+        }
+        vq->addr = msg->payload.addr;
+        vq->has_addr = true;
+        if (vub_virtq_map_rings(vq) < 0) {
+            error_report("vhost-user-blk: rings of virtqueue %u are not in "
+                         "guest memory", vq->index);
+            return -1;
+        }
+        return 0;
+    case VHOST_USER_SET_VRING_BASE:
+        vq = vub_msg_vq(dev, msg->payload.state.index);
+        if (!vq || vq->started) {
+            return -1;
+        }
+        vq->last_avail_idx = msg->payload.state.num;
+        return 0;
+    case VHOST_USER_GET_VRING_BASE:
+        vq = vub_msg_vq(dev, msg->payload.state.index);
+        if (!vq) {
+            return -1;
+        }
+        aio_context_acquire(dev->ctx);
+        vub_virtq_stop(vq);
+        if (vq->call_fd >= 0) {
+            close(vq->call_fd);
+            vq->call_fd = -1;
+        }
+        msg->payload.state.num = vq->last_avail_idx;
+        aio_context_release(dev->ctx);
+        msg->size = sizeof(msg->payload.state);
+        return 1;
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR: {
+        bool nofd = msg->payload.u64 & VHOST_USER_VRING_NOFD_MASK;
+
+        vq = vub_msg_vq(dev, msg->payload.u64 & VHOST_USER_VRING_IDX_MASK);
+        if (!vq || nofd != !fd_num || fd_num > 1) {
+            return -1;
+        }
+        if (msg->request == VHOST_USER_SET_VRING_ERR) {
+            return 0;
+        }
+        if (msg->request == VHOST_USER_SET_VRING_KICK && nofd) {
+            /* The rings would have to be polled all the time */
+            error_report("vhost-user-blk: virtqueue %u has no kick eventfd, "
+                         "ioeventfd is required", vq->index);
+            return -1;
+        }
+
+        aio_context_acquire(dev->ctx);
+        if (msg->request == VHOST_USER_SET_VRING_KICK) {
+            vub_virtq_stop(vq);
+            vq->kick_fd = fds[0];
+            fds[0] = -1;
+            vub_virtq_start(vq);
+        } else {
+            if (vq->call_fd >= 0) {
+                close(vq->call_fd);
+            }
+            vq->call_fd = nofd ? -1 : fds[0];
+            if (!nofd) {
+                fds[0] = -1;
+            }
+        }
+        aio_context_release(dev->ctx);
+        return 0;
+    }
+    case VHOST_USER_SET_VRING_ENABLE:
+        vq = vub_msg_vq(dev, msg->payload.state.index);
+        if (!vq) {
+            return -1;
+        }
+        aio_context_acquire(dev->ctx);
+        vq->enabled = msg->payload.state.num;
+        if (vq->enabled && vq->started) {
+            eventfd_write(vq->kick_fd, 1);
+        }
+        aio_context_release(dev->ctx);
+        return 0;
+    case VHOST_USER_GET_CONFIG: {
+        struct virtio_blk_config blkcfg;
+        VhostUserConfig *config = &msg->payload.config;
+
+        if (config->size > sizeof(config->region) ||
+            config->offset > sizeof(blkcfg) ||
+            config->size > sizeof(blkcfg) - config->offset) {
+            return -1;
+        }
+        aio_context_acquire(dev->ctx);
+        vub_get_config(dev, &blkcfg);
+        aio_context_release(dev->ctx);
+        memcpy(config->region, (uint8_t *)&blkcfg + config->offset,
+               config->size);
+        msg->size = offsetof(VhostUserConfig, region) + config->size;
+        return 1;
+    }
+    default:
+        /* Dirty logging and the rest of the protocol are not offered */
+        error_report("vhost-user-blk: unsupported request %d", msg->request);
+        ret = -1;
+        break;
+    }
+
+    return ret;
+}
+
+static int vub_read_full(int fd, void *buf, size_t count)
+{
+    while (count) {
+        ssize_t ret = read(fd, buf, count);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        buf += ret;
+        count -= ret;
+    }
+    return 0;
+}
+
+static int vub_msg_read(int fd, VhostUserMsg *msg, int *fds, int *fd_num)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))] = { };
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = VHOST_USER_HDR_SIZE,
+    };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+    int i;
+
+    do {
+        ret = recvmsg(fd, &mh, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    *fd_num = 0;
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *fd_num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *fd_num * sizeof(int));
+            break;
+        }
+    }
+
+    if (ret != VHOST_USER_HDR_SIZE) {
+        if (ret < 0) {
+            error_report("vhost-user-blk: failed to read message: %s",
+                         strerror(errno));
+        }
+        goto fail;
+    }
+
+    if (mh.msg_flags & MSG_CTRUNC) {
+        /* Some descriptors were dropped by the kernel, do not guess */
+        error_report("vhost-user-blk: too many file descriptors");
+        goto fail;
+    }
+
+    if ((msg->flags & VHOST_USER_VERSION_MASK) != VHOST_USER_VERSION ||
+        msg->size > VHOST_USER_PAYLOAD_SIZE) {
+        error_report("vhost-user-blk: bad message header");
+        goto fail;
+    }
+
+    if (msg->size && vub_read_full(fd, &msg->payload, msg->size) < 0) {
+        error_report("vhost-user-blk: failed to read message payload");
+        goto fail;
+    }
+    return 0;
+
+fail:
+    for (i = 0; i < *fd_num; i++) {
+        close(fds[i]);
+    }
+    *fd_num = 0;
+    return -1;
+}
+
+static int vub_msg_write(int fd, VhostUserMsg *msg)
+{
+    size_t size = VHOST_USER_HDR_SIZE + msg->size;
+
+    msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+    if (qemu_write_full(fd, msg, size) != size) {
+        error_report("vhost-user-blk: failed to send reply: %s",
+                     strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void vub_accept(void *opaque);
+
+static void vub_client_close(VubDev *dev)
+{
+    unsigned int i;
+
+    qemu_set_fd_handler(dev->sock_fd, NULL, NULL, NULL);
+    close(dev->sock_fd);
+    dev->sock_fd = -1;
+
+    aio_context_acquire(dev->ctx);
+    for (i = 0; i < dev->num_queues; i++) {
+        vub_virtq_reset(&dev->vqs[i]);
+    }
+    vub_unmap_regions(dev);
+    dev->features = 0;
+    aio_context_release(dev->ctx);
+    dev->protocol_features = 0;
+
+    if (dev->listen_fd >= 0) {
+        qemu_set_fd_handler(dev->listen_fd, vub_accept, NULL, dev);
+    }
+}
+
+static void vub_client_read(void *opaque)
+{
+    VubDev *dev = opaque;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    VhostUserMsg msg;
+    int fd_num, i, ret;
+
+    if (vub_msg_read(dev->sock_fd, &msg, fds, &fd_num) < 0) {
+        vub_client_close(dev);
+        return;
+    }
+
+    ret = vub_process_msg(dev, &msg, fds, fd_num);
+    for (i = 0; i < fd_num; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+
+    if (ret <= 0) {
+        if (!(msg.flags & VHOST_USER_NEED_REPLY_MASK) ||
+            !(dev->protocol_features &
+              (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK))) {
+            return;
+        }
+        msg.payload.u64 = ret < 0;
+        msg.size = sizeof(msg.payload.u64);
+    }
+    if (vub_msg_write(dev->sock_fd, &msg) < 0) {
+        vub_client_close(dev);
+    }
+}
+
+static void vub_accept(void *opaque)
+{
+    VubDev *dev = opaque;
+    int fd;
+
+    fd = qemu_accept(dev->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            error_report("vhost-user-blk: accept failed: %s",
+                         strerror(errno));
+        }
+        return;
+    }
+
+    /* Serve one master at a time */
+    qemu_set_fd_handler(dev->listen_fd, NULL, NULL, NULL);
+    dev->sock_fd = fd;
+    qemu_set_fd_handler(fd, vub_client_read, NULL, dev);
+}
+
+VubDev *vub_dev_new(BlockBackend *blk, AioContext *ctx, uint16_t num_queues,
+                    const char *serial)
+{
+    VubDev *dev = g_new0(VubDev, 1);
+    unsigned int i;
+
+    dev->blk = blk;
+    dev->ctx = ctx;
+    dev->serial = g_strdup(serial);
+    dev->num_queues = num_queues;
+    dev->listen_fd = -1;
+    dev->sock_fd = -1;
+
+    dev->vqs = g_new0(VubVirtq, num_queues);
+    for (i = 0; i < num_queues; i++) {
+        VubVirtq *vq = &dev->vqs[i];
+
+        vq->dev = dev;
+        vq->index = i;
+        vq->enabled = true;
+        vq->kick_fd = -1;
+        vq->call_fd = -1;
+        vq->notify_bh = aio_bh_new(ctx, vub_virtq_notify_bh, vq);
+    }
+    return dev;
+}
+
+int vub_dev_listen(VubDev *dev, const char *path, Error **errp)
+{
+    dev->listen_fd = unix_listen(path, NULL, 0, errp);
+    if (dev->listen_fd < 0) {
+        return -1;
+    }
+    dev->sock_path = g_strdup(path);
+    qemu_set_fd_handler(dev->listen_fd, vub_accept, NULL, dev);
+    return 0;
+}
+
+void vub_dev_free(VubDev *dev)
+{
+    unsigned int i;
+
+    if (dev->listen_fd >= 0) {
+        qemu_set_fd_handler(dev->listen_fd, NULL, NULL, NULL);
+        close(dev->listen_fd);
+        dev->listen_fd = -1;
+        unlink(dev->sock_path);
+    }
+    if (dev->sock_fd >= 0) {
+        vub_client_close(dev);
+    }
+
+    for (i = 0; i < dev->num_queues; i++) {
+        qemu_bh_delete(dev->vqs[i].notify_bh);
+    }
+    g_free(dev->vqs);
+    g_free(dev->sock_path);
+    g_free(dev->serial);
+    g_free(dev);
+}
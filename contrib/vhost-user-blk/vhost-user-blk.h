@@ -0,0 +1,90 @@
+/*
+ * vhost-user block device backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#ifndef VHOST_USER_BLK_H
+#define VHOST_USER_BLK_H
+
+/**
+ * The vhost-user-blk daemon exports a BlockBackend to a single vhost-user
+ * master (QEMU's vhost-user-blk device) at a time.  The master connects to
+ * a unix socket in listen mode and hands over its guest memory and the
+ * eventfds of each virtqueue; requests are then taken straight from the
+ * shared rings and submitted to the block layer.
+ *
+ * The protocol is handled in the main loop, while the rings and the block
+ * layer are driven from the AioContext passed to vub_dev_new(), which is
+ * normally run by a dedicated thread.  Protocol messages that touch the
+ * rings acquire that AioContext.
+ */
+
+#include "block/aio.h"
+#include "sysemu/block-backend.h"
+
+/**
+ * Largest number of data segments in a request, as advertised in seg_max
+ */
+#define VUB_SEG_MAX 126
+
+typedef struct VubDev VubDev;
+
+/**
+ * Create a vhost-user-blk device
+ *
+ * @blk:        the block backend to export, already in @ctx
+ * @ctx:        the AioContext that processes the virtqueues
+ * @num_queues: number of request queues offered to the guest
+ * @serial:     string returned by VIRTIO_BLK_T_GET_ID, may be NULL
+ *
+ * Returns: the new device
+ */
+VubDev *vub_dev_new(BlockBackend *blk, AioContext *ctx, uint16_t num_queues,
+                    const char *serial);
+
+/**
+ * Listen for vhost-user masters
+ *
+ * @dev:  the device
+ * @path: path of the unix socket to create
+ * @errp: error object
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int vub_dev_listen(VubDev *dev, const char *path, Error **errp);
+
+/**
+ * Disconnect the master and release all resources of the device
+ *
+ * The socket created by vub_dev_listen() is unlinked.
+ *
+ * @dev: the device
+ */
+void vub_dev_free(VubDev *dev);
+
+/**
+ * Enable or disable guest notifications on all running virtqueues
+ *
+ * Notifications are disabled while the I/O thread busy-polls the rings.
+ * Must be called from the device's AioContext.
+ *
+ * @dev:    the device
+ * @enable: whether the guest should kick the device
+ */
+void vub_dev_set_notification(VubDev *dev, bool enable);
+
+/**
+ * Process the requests available in all running virtqueues
+ *
+ * Must be called from the device's AioContext.
+ *
+ * @dev: the device
+ *
+ * Returns: true if any request was processed
+ */
+bool vub_dev_poll(VubDev *dev);
+
+#endif /* VHOST_USER_BLK_H */
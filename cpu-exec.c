@@ -290,11 +290,18 @@ static bool tb_cmp(const void *p, const void *d)
     return false;
 }
 
+/* Only the vCPU thread writes its own statistics */
+static inline void tb_stats_inc(unsigned long *counter)
+{
+    atomic_set(counter, *counter + 1);
+}
+
 static TranslationBlock *tb_htable_lookup(CPUState *cpu,
                                           target_ulong pc,
                                           target_ulong cs_base,
                                           uint32_t flags)
 {
+    TranslationBlock *tb, **entry;
     tb_page_addr_t phys_pc;
     struct tb_desc desc;
     uint32_t h;
@@ -306,7 +313,23 @@ static TranslationBlock *tb_htable_lookup(CPUState *cpu,
     phys_pc = get_page_addr_code(desc.env, pc);
     desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
     h = tb_hash_func(phys_pc, pc, flags);
-    return qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
+
+    /* The per-vCPU cache saves walking the shared hash table buckets,
+     * e.g. after a TLB flush has emptied tb_jmp_cache.
+     */
+    entry = &cpu->tb_phys_cache[h & (TB_PHYS_CACHE_SIZE - 1)];
+    tb = atomic_rcu_read(entry);
+    if (tb && tb_cmp(tb, &desc)) {
+        tb_stats_inc(&cpu->tb_stats.phys_cache_hits);
+        return tb;
+    }
+
+    tb_stats_inc(&cpu->tb_stats.htable_lookups);
+    tb = qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
+    if (tb) {
+        atomic_set(entry, tb);
+    }
+    return tb;
 }
 
 static inline TranslationBlock *tb_find(CPUState *cpu,
@@ -344,6 +367,7 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
             if (!tb) {
                 /* if no translated code available, then translate it now */
                 tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
+                tb_stats_inc(&cpu->tb_stats.translations);
             }
 
             mmap_unlock();
@@ -351,6 +375,8 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
 
         /* We add the TB in the virtual pc hash table for the fast lookup */
         atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
+    } else {
+        tb_stats_inc(&cpu->tb_stats.jmp_cache_hits);
     }
 #ifndef CONFIG_USER_ONLY
     /* We don't take care of direct jumps when address mapping changes in
@@ -361,7 +387,12 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
         last_tb = NULL;
     }
 #endif
-    /* See if we can patch the calling TB. */
+    /* See if we can patch the calling TB.  If another vCPU has already
+     * done it, don't bother taking tb_lock just to find that out.
+     */
+    if (last_tb && atomic_read(&last_tb->jmp_list_next[tb_exit])) {
+        last_tb = NULL;
+    }
     if (last_tb && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
         if (!have_tb_lock) {
             tb_lock();
@@ -180,8 +180,18 @@ struct AddressSpaceDispatch {
     PhysPageEntry phys_map;
     PhysPageMap map;
     AddressSpace *as;
+
+    /* Address spaces that render to the same FlatView share its dispatch
+     * (see mem_begin); @as is the one that built it.  Protected by the BQL.
+     */
+    struct FlatView *view;
+    unsigned ref;
+    bool compacted;
 };
 
+/* Shareable dispatches, keyed by FlatView */
+static GHashTable *shared_dispatch;
+
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
     MemoryRegion iomem;
@@ -1021,7 +1031,7 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
 }
 
 /* Called from RCU critical section */
-hwaddr memory_region_section_get_iotlb(CPUState *cpu,
+hwaddr memory_region_section_get_iotlb(CPUState *cpu, int asidx,
                                        MemoryRegionSection *section,
                                        target_ulong vaddr,
                                        hwaddr paddr, hwaddr xlat,
@@ -1042,7 +1052,10 @@ hwaddr memory_region_section_get_iotlb(CPUState *cpu,
     } else {
         AddressSpaceDispatch *d;
 
-        d = atomic_rcu_read(&section->address_space->dispatch);
+        /* @section comes from the CPU's dispatch, which may be shared with
+         * (and built by) section->address_space.
+         */
+        d = atomic_rcu_read(&cpu->cpu_ases[asidx].memory_dispatch);
         iotlb = section - d->map.sections;
         iotlb += xlat;
     }
@@ -1175,6 +1188,11 @@ static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
     MemoryRegionSection now = *section, remain = *section;
     Int128 page_size = int128_make64(TARGET_PAGE_SIZE);
 
+    if (d->as != as || d->compacted) {
+        /* Shared or reused dispatch, already filled in by its builder */
+        return;
+    }
+
     if (now.offset_within_address_space & ~TARGET_PAGE_MASK) {
         uint64_t left = TARGET_PAGE_ALIGN(now.offset_within_address_space)
                        - now.offset_within_address_space;
@@ -2338,12 +2356,62 @@ static void io_mem_init(void)
                           NULL, UINT64_MAX);
 }
 
+/* A dispatch built by another address space can be reused as long as that
+ * one keeps the same view, because the subpages in it access memory through
+ * their builder.  memory.c sends all the address spaces sharing a view
+ * through begin/commit when one of them leaves it, so that they can check
+ * again.
+ */
+static bool address_space_dispatch_reusable(AddressSpaceDispatch *d,
+                                            AddressSpace *as,
+                                            struct FlatView *view)
+{
+    AddressSpace *owner = d->as;
+
+    if (!owner) {
+        return false;
+    }
+    if (owner == as) {
+        /* Our own, complete dispatch and our view did not change */
+        return d->compacted && as->current_map == view;
+    }
+    return (owner->next_map ? owner->next_map : owner->current_map) == view;
+}
+
+static void address_space_dispatch_free(AddressSpaceDispatch *d);
+
+static void address_space_dispatch_unref(AddressSpaceDispatch *d)
+{
+    if (--d->ref) {
+        return;
+    }
+    if (d->view && g_hash_table_lookup(shared_dispatch, d->view) == d) {
+        g_hash_table_remove(shared_dispatch, d->view);
+    }
+    call_rcu(d, address_space_dispatch_free, rcu);
+}
+
 static void mem_begin(MemoryListener *listener)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
-    AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
+    struct FlatView *view = as->next_map;
+    AddressSpaceDispatch *d;
     uint16_t n;
 
+    /* The view being installed is only known during a transaction commit;
+     * outside of one (listener registration) build a private dispatch.
+     */
+    if (view && shared_dispatch) {
+        d = g_hash_table_lookup(shared_dispatch, view);
+        if (d && address_space_dispatch_reusable(d, as, view)) {
+            d->ref++;
+            as->next_dispatch = d;
+            return;
+        }
+    }
+
+    d = g_new0(AddressSpaceDispatch, 1);
+
     n = dummy_section(&d->map, as, &io_mem_unassigned);
     assert(n == PHYS_SECTION_UNASSIGNED);
     n = dummy_section(&d->map, as, &io_mem_notdirty);
@@ -2355,6 +2423,14 @@ static void mem_begin(MemoryListener *listener)
 
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
     d->as = as;
+    d->ref = 1;
+    if (view) {
+        if (!shared_dispatch) {
+            shared_dispatch = g_hash_table_new(g_direct_hash, g_direct_equal);
+        }
+        d->view = view;
+        g_hash_table_insert(shared_dispatch, view, d);
+    }
     as->next_dispatch = d;
 }
 
@@ -2370,11 +2446,17 @@ static void mem_commit(MemoryListener *listener)
     AddressSpaceDispatch *cur = as->dispatch;
     AddressSpaceDispatch *next = as->next_dispatch;
 
-    phys_page_compact_all(next, next->map.nodes_nb);
+    /* All sections are in by now, even for a shared dispatch: the first
+     * address space to commit compacts it.
+     */
+    if (!next->compacted) {
+        phys_page_compact_all(next, next->map.nodes_nb);
+        next->compacted = true;
+    }
 
     atomic_rcu_set(&as->dispatch, next);
     if (cur) {
-        call_rcu(cur, address_space_dispatch_free, rcu);
+        address_space_dispatch_unref(cur);
     }
 }
 
@@ -2411,7 +2493,21 @@ void address_space_init_dispatch(AddressSpace *as)
 
 void address_space_unregister(AddressSpace *as)
 {
+    AddressSpaceDispatch *d = as->dispatch;
+
     memory_listener_unregister(&as->dispatch_listener);
+
+    /* Other address spaces may still use a dispatch built by @as.  Its
+     * view is empty by now (address_space_destroy cleared the root), so
+     * it has no subpages pointing back to @as; just stop sharing it.
+     */
+    if (d && d->as == as) {
+        if (d->view && g_hash_table_lookup(shared_dispatch, d->view) == d) {
+            g_hash_table_remove(shared_dispatch, d->view);
+        }
+        d->view = NULL;
+        d->as = NULL;
+    }
 }
 
 void address_space_destroy_dispatch(AddressSpace *as)
@@ -2420,7 +2516,7 @@ void address_space_destroy_dispatch(AddressSpace *as)
 
     atomic_rcu_set(&as->dispatch, NULL);
     if (d) {
-        call_rcu(d, address_space_dispatch_free, rcu);
+        address_space_dispatch_unref(d);
     }
 }
 
@@ -3652,6 +3748,108 @@ void stq_be_phys(AddressSpace *as, hwaddr addr, uint64_t val)
     address_space_stq_be(as, addr, val, MEMTXATTRS_UNSPECIFIED, NULL);
 }
 
+void address_space_cache_init(MemoryRegionCache *cache, AddressSpace *as,
+                              hwaddr addr, hwaddr len, bool is_write)
+{
+    MemoryRegion *mr;
+    hwaddr xlat, l = len;
+
+    *cache = MEMORY_REGION_CACHE_INVALID;
+    cache->as = as;
+    cache->addr = addr;
+    cache->len = len;
+
+    /* The Xen map cache can move RAM around behind our back */
+    if (!len || xen_enabled()) {
+        return;
+    }
+
+    rcu_read_lock();
+    mr = address_space_translate(as, addr, &xlat, &l, is_write);
+    if (l == len && memory_access_is_direct(mr, is_write)) {
+        memory_region_ref(mr);
+        cache->mr = mr;
+        cache->xlat = xlat;
+        cache->ptr = qemu_map_ram_ptr(mr->ram_block, xlat);
+    }
+    rcu_read_unlock();
+}
+
+void address_space_cache_invalidate(MemoryRegionCache *cache, hwaddr addr,
+                                    hwaddr access_len)
+{
+    assert(addr < cache->len && access_len <= cache->len - addr);
+    if (cache->ptr) {
+        invalidate_and_set_dirty(cache->mr, cache->xlat + addr, access_len);
+    }
+}
+
+void address_space_cache_destroy(MemoryRegionCache *cache)
+{
+    if (cache->mr) {
+        memory_region_unref(cache->mr);
+    }
+    *cache = MEMORY_REGION_CACHE_INVALID;
+}
+
+void address_space_write_cached(MemoryRegionCache *cache, hwaddr addr,
+                                const void *buf, int len)
+{
+    assert(addr < cache->len && len <= cache->len - addr);
+    if (likely(cache->ptr)) {
+        memcpy(cache->ptr + addr, buf, len);
+        invalidate_and_set_dirty(cache->mr, cache->xlat + addr, len);
+    } else {
+        address_space_write(cache->as, cache->addr + addr,
+                            MEMTXATTRS_UNSPECIFIED, buf, len);
+    }
+}
+
+static inline void address_space_stw_cached_internal(MemoryRegionCache *cache,
+                                                     hwaddr addr, uint32_t val,
+                                                     MemTxAttrs attrs,
+                                                     MemTxResult *result,
+                                                     enum device_endian endian)
+{
+    assert(addr < cache->len && 2 <= cache->len - addr);
+    if (unlikely(!cache->ptr)) {
+        if (endian == DEVICE_LITTLE_ENDIAN) {
+            address_space_stw_le(cache->as, cache->addr + addr, val,
+                                 attrs, result);
+        } else {
+            address_space_stw_be(cache->as, cache->addr + addr, val,
+                                 attrs, result);
+        }
+        return;
+    }
+
+    if (endian == DEVICE_LITTLE_ENDIAN) {
+        stw_le_p(cache->ptr + addr, val);
+    } else {
+        stw_be_p(cache->ptr + addr, val);
+    }
+    invalidate_and_set_dirty(cache->mr, cache->xlat + addr, 2);
+    if (result) {
+        *result = MEMTX_OK;
+    }
+}
+
+void address_space_stw_le_cached(MemoryRegionCache *cache, hwaddr addr,
+                                 uint32_t val, MemTxAttrs attrs,
+                                 MemTxResult *result)
+{
+    address_space_stw_cached_internal(cache, addr, val, attrs, result,
+                                      DEVICE_LITTLE_ENDIAN);
+}
+
+void address_space_stw_be_cached(MemoryRegionCache *cache, hwaddr addr,
+                                 uint32_t val, MemTxAttrs attrs,
+                                 MemTxResult *result)
+{
+    address_space_stw_cached_internal(cache, addr, val, attrs, result,
+                                      DEVICE_BIG_ENDIAN);
+}
+
 /* virtual memory access for debug (includes writing to ROM) */
 int cpu_memory_rw_debug(CPUState *cpu, target_ulong addr,
                         uint8_t *buf, int len, int is_write)
@@ -83,6 +83,8 @@ this code that are retained.
  * target-dependent and needs the TARGET_* macros.
  */
 #include "qemu/osdep.h"
+#include <math.h>
+#include <float.h>
 
 #include "fpu/softfloat.h"
 
@@ -105,6 +107,81 @@ this code that are retained.
 *----------------------------------------------------------------------------*/
 #include "softfloat-specialize.h"
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path.
+|
+| When the result of an operation cannot differ from what the host FPU
+| computes, run the operation natively instead of in software.  That is the
+| case when:
+|  - rounding is to nearest-even, the host FPU default;
+|  - the inexact flag is already raised, so that we need not find out
+|    whether this operation is exact (most code raises it early and only
+|    ever clears it when explicitly asked to);
+|  - the inputs are zero or normal, so that NaN propagation, input
+|    denormal flushing and the related flags are not involved;
+|  - the result is neither tiny nor zero, so that underflow detection and
+|    output flushing are not involved.  An infinite result from finite
+|    inputs is an overflow and only needs the flag raised.
+| Anything else falls back to the software implementation.
+|
+| This needs a host whose float and double arithmetic is plain IEEE single
+| and double precision, without excess precision (as with the x87 FPU).
+*----------------------------------------------------------------------------*/
+#if defined(__FLT_EVAL_METHOD__) && __FLT_EVAL_METHOD__ == 0
+#define USE_HOST_FPU 1
+#else
+#define USE_HOST_FPU 0
+#endif
+
+typedef union {
+    float32 s;
+    float h;
+} union_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} union_float64;
+
+static inline bool can_use_host_fpu(const float_status *status)
+{
+    return USE_HOST_FPU
+        && (status->float_exception_flags & float_flag_inexact)
+        && status->float_rounding_mode == float_round_nearest_even;
+}
+
+static inline bool float32_is_zero_or_normal(float32 a)
+{
+    int aExp = (float32_val(a) >> 23) & 0xFF;
+
+    return aExp ? aExp != 0xFF : (float32_val(a) & 0x7FFFFFFF) == 0;
+}
+
+static inline bool float64_is_zero_or_normal(float64 a)
+{
+    int aExp = (float64_val(a) >> 52) & 0x7FF;
+
+    return aExp ? aExp != 0x7FF : (float64_val(a) << 1) == 0;
+}
+
+static inline bool float32_host_result_ok(float r, float_status *status)
+{
+    if (unlikely(isinf(r))) {
+        float_raise(float_flag_overflow, status);
+        return true;
+    }
+    return fabsf(r) > FLT_MIN;
+}
+
+static inline bool float64_host_result_ok(double r, float_status *status)
+{
+    if (unlikely(isinf(r))) {
+        float_raise(float_flag_overflow, status);
+        return true;
+    }
+    return fabs(r) > DBL_MIN;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the fraction bits of the half-precision floating-point value `a'.
 *----------------------------------------------------------------------------*/
@@ -2164,7 +2241,8 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_add(float32 a, float32 b, float_status *status)
+static float32 soft_float32_add(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a, status);
@@ -2181,13 +2259,30 @@ float32 float32_add(float32 a, float32 b, float_status *status)
 
 }
 
+float32 float32_add(float32 a, float32 b, float_status *status)
+{
+    if (can_use_host_fpu(status) && float32_is_zero_or_normal(a)
+        && float32_is_zero_or_normal(b)) {
+        union_float32 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h + ub.h;
+        if (float32_host_result_ok(ur.h, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float32_add(a, b, status);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of subtracting the single-precision floating-point values
 | `a' and `b'.  The operation is performed according to the IEC/IEEE Standard
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sub(float32 a, float32 b, float_status *status)
+static float32 soft_float32_sub(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a, status);
@@ -2204,13 +2299,30 @@ float32 float32_sub(float32 a, float32 b, float_status *status)
 
 }
 
+float32 float32_sub(float32 a, float32 b, float_status *status)
+{
+    if (can_use_host_fpu(status) && float32_is_zero_or_normal(a)
+        && float32_is_zero_or_normal(b)) {
+        union_float32 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h - ub.h;
+        if (float32_host_result_ok(ur.h, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float32_sub(a, b, status);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of multiplying the single-precision floating-point values
 | `a' and `b'.  The operation is performed according to the IEC/IEEE Standard
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_mul(float32 a, float32 b, float_status *status)
+static float32 soft_float32_mul(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -2269,13 +2381,30 @@ float32 float32_mul(float32 a, float32 b, float_status *status)
 
 }
 
+float32 float32_mul(float32 a, float32 b, float_status *status)
+{
+    if (can_use_host_fpu(status) && float32_is_zero_or_normal(a)
+        && float32_is_zero_or_normal(b)) {
+        union_float32 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h * ub.h;
+        if (float32_host_result_ok(ur.h, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float32_mul(a, b, status);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of dividing the single-precision floating-point value `a'
 | by the corresponding value `b'.  The operation is performed according to the
 | IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_div(float32 a, float32 b, float_status *status)
+static float32 soft_float32_div(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -2339,6 +2468,22 @@ float32 float32_div(float32 a, float32 b, float_status *status)
 
 }
 
+float32 float32_div(float32 a, float32 b, float_status *status)
+{
+    if (can_use_host_fpu(status) && float32_is_zero_or_normal(a)
+        && float32_is_zero_or_normal(b) && !float32_is_zero(b)) {
+        union_float32 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h / ub.h;
+        if (float32_host_result_ok(ur.h, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float32_div(a, b, status);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the remainder of the single-precision floating-point value `a'
 | with respect to the corresponding value `b'.  The operation is performed
@@ -2673,7 +2818,7 @@ float32 float32_muladd(float32 a, float32 b, float32 c, int flags,
 | Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sqrt(float32 a, float_status *status)
+static float32 soft_float32_sqrt(float32 a, float_status *status)
 {
     flag aSign;
     int aExp, zExp;
@@ -2724,6 +2869,21 @@ float32 float32_sqrt(float32 a, float_status *status)
 
 }
 
+float32 float32_sqrt(float32 a, float_status *status)
+{
+    if (can_use_host_fpu(status) && float32_is_zero_or_normal(a)
+        && !float32_is_neg(a)) {
+        union_float32 ua, ur;
+
+        ua.s = a;
+        ur.h = sqrtf(ua.h);
+        if (float32_host_result_ok(ur.h, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float32_sqrt(a, status);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the binary exponential of the single-precision floating-point value
 | `a'. The operation is performed according to the IEC/IEEE Standard for
@@ -3959,7 +4119,8 @@ static float64 subFloat64Sigs(float64 a, float64 b, flag zSign,
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_add(float64 a, float64 b, float_status *status)
+static float64 soft_float64_add(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a, status);
@@ -3976,13 +4137,30 @@ float64 float64_add(float64 a, float64 b, float_status *status)
 
 }
 
+float64 float64_add(float64 a, float64 b, float_status *status)
+{
+    if (can_use_host_fpu(status) && float64_is_zero_or_normal(a)
+        && float64_is_zero_or_normal(b)) {
+        union_float64 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h + ub.h;
+        if (float64_host_result_ok(ur.h, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float64_add(a, b, status);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of subtracting the double-precision floating-point values
 | `a' and `b'.  The operation is performed according to the IEC/IEEE Standard
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sub(float64 a, float64 b, float_status *status)
+static float64 soft_float64_sub(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a, status);
@@ -3999,13 +4177,30 @@ float64 float64_sub(float64 a, float64 b, float_status *status)
 
 }
 
+float64 float64_sub(float64 a, float64 b, float_status *status)
+{
+    if (can_use_host_fpu(status) && float64_is_zero_or_normal(a)
+        && float64_is_zero_or_normal(b)) {
+        union_float64 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h - ub.h;
+        if (float64_host_result_ok(ur.h, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float64_sub(a, b, status);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of multiplying the double-precision floating-point values
 | `a' and `b'.  The operation is performed according to the IEC/IEEE Standard
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_mul(float64 a, float64 b, float_status *status)
+static float64 soft_float64_mul(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -4062,13 +4257,30 @@ float64 float64_mul(float64 a, float64 b, float_status *status)
 
 }
 
+float64 float64_mul(float64 a, float64 b, float_status *status)
+{
+    if (can_use_host_fpu(status) && float64_is_zero_or_normal(a)
+        && float64_is_zero_or_normal(b)) {
+        union_float64 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h * ub.h;
+        if (float64_host_result_ok(ur.h, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float64_mul(a, b, status);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of dividing the double-precision floating-point value `a'
 | by the corresponding value `b'.  The operation is performed according to
 | the IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_div(float64 a, float64 b, float_status *status)
+static float64 soft_float64_div(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -4140,6 +4352,22 @@ float64 float64_div(float64 a, float64 b, float_status *status)
 
 }
 
+float64 float64_div(float64 a, float64 b, float_status *status)
+{
+    if (can_use_host_fpu(status) && float64_is_zero_or_normal(a)
+        && float64_is_zero_or_normal(b) && !float64_is_zero(b)) {
+        union_float64 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h / ub.h;
+        if (float64_host_result_ok(ur.h, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float64_div(a, b, status);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the remainder of the double-precision floating-point value `a'
 | with respect to the corresponding value `b'.  The operation is performed
@@ -4481,7 +4709,7 @@ float64 float64_muladd(float64 a, float64 b, float64 c, int flags,
 | Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sqrt(float64 a, float_status *status)
+static float64 soft_float64_sqrt(float64 a, float_status *status)
 {
     flag aSign;
     int aExp, zExp;
@@ -4529,6 +4757,21 @@ float64 float64_sqrt(float64 a, float_status *status)
 
 }
 
+float64 float64_sqrt(float64 a, float_status *status)
+{
+    if (can_use_host_fpu(status) && float64_is_zero_or_normal(a)
+        && !float64_is_neg(a)) {
+        union_float64 ua, ur;
+
+        ua.s = a;
+        ur.h = sqrt(ua.h);
+        if (float64_host_result_ok(ur.h, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float64_sqrt(a, status);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the binary log of the double-precision floating-point value `a'.
 | The operation is performed according to the IEC/IEEE Standard for Binary
@@ -26,55 +26,242 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+/*
+ * The virtqueues of a device can be spread over several IOThreads.  The
+ * BlockBackend stays in the AioContext of the first one, which the others
+ * acquire to submit requests.  Only the thread that owns a virtqueue
+ * touches its vring: requests completed by another thread are handed back
+ * through a lockless list, and pushed by the owner's bottom half.
+ */
+typedef struct VirtIOBlockDataPlaneThread {
+    VirtIOBlockDataPlane *s;
+    IOThread *iothread;             /* NULL for the main loop */
+    AioContext *ctx;
+    QEMUBH *bh;                     /* bh for guest notification */
+    unsigned long *pending_vqs;     /* queues to look at in bh, atomic */
+} VirtIOBlockDataPlaneThread;
+
+typedef struct VirtIOBlockDataPlaneQueue {
+    VirtQueue *vq;
+    int owner;                      /* index in threads, written with BQL */
+    bool notify;                    /* requests pushed since last irq */
+    QSLIST_HEAD(, VirtIOBlockReq) done; /* completed by other threads */
+} VirtIOBlockDataPlaneQueue;
+
 struct VirtIOBlockDataPlane {
     bool starting;
     bool stopping;
 
     VirtIOBlkConf *conf;
     VirtIODevice *vdev;
-    QEMUBH *bh;                     /* bh for guest notification */
-    unsigned long *batch_notify_vqs;
 
     /* Note that these EventNotifiers are assigned by value.  This is
      * fine as long as you do not call event_notifier_cleanup on them
      * (because you don't own the file descriptor or handle; you just
      * use it).
      */
-    IOThread *iothread;
-    AioContext *ctx;
+    AioContext *ctx;                /* AioContext of the BlockBackend */
+    VirtIOBlockDataPlaneThread *threads;
+    int nthreads;
+    VirtIOBlockDataPlaneQueue *queues;
 };
 
+static VirtIOBlockDataPlaneQueue *vq_to_queue(VirtIOBlockDataPlane *s,
+                                              VirtQueue *vq)
+{
+    return &s->queues[virtio_get_queue_index(vq)];
+}
+
+/* Have the bh of @t look at queue @i */
+static void virtio_blk_data_plane_kick(VirtIOBlockDataPlaneThread *t,
+                                       unsigned i)
+{
+    atomic_or(&t->pending_vqs[BIT_WORD(i)], BIT_MASK(i));
+    qemu_bh_schedule(t->bh);
+}
+
+/* Context: owner of @q, or QEMU global mutex and owner's AioContext held */
+static void virtio_blk_data_plane_flush_vq(VirtIOBlockDataPlane *s,
+                                           VirtIOBlockDataPlaneQueue *q)
+{
+    QSLIST_HEAD(, VirtIOBlockReq) done;
+    QSLIST_HEAD(, VirtIOBlockReq) reqs = QSLIST_HEAD_INITIALIZER(reqs);
+    VirtIOBlockReq *req;
+
+    QSLIST_MOVE_ATOMIC(&done, &q->done);
+
+    /* The list is LIFO, push in completion order */
+    while ((req = QSLIST_FIRST(&done)) != NULL) {
+        QSLIST_REMOVE_HEAD(&done, done_next);
+        QSLIST_INSERT_HEAD(&reqs, req, done_next);
+    }
+    while ((req = QSLIST_FIRST(&reqs)) != NULL) {
+        QSLIST_REMOVE_HEAD(&reqs, done_next);
+        virtio_blk_push_request(req);
+        q->notify = true;
+    }
+
+    if (q->notify) {
+        q->notify = false;
+        virtio_notify_irqfd(s->vdev, q->vq);
+    }
+}
+
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
-    set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
-    qemu_bh_schedule(s->bh);
+    VirtIOBlockDataPlaneQueue *q = vq_to_queue(s, vq);
+
+    q->notify = true;
+    virtio_blk_data_plane_kick(&s->threads[q->owner],
+                               virtio_get_queue_index(vq));
 }
 
 static void notify_guest_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneThread *t = opaque;
+    VirtIOBlockDataPlane *s = t->s;
     unsigned nvqs = s->conf->num_queues;
-    unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
-    memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
-    memset(s->batch_notify_vqs, 0, sizeof(bitmap));
-
-    for (j = 0; j < nvqs; j += BITS_PER_LONG) {
-        unsigned long bits = bitmap[j];
+    for (j = 0; j < BITS_TO_LONGS(nvqs); j++) {
+        unsigned long bits = atomic_xchg(&t->pending_vqs[j], 0);
 
         while (bits != 0) {
-            unsigned i = j + ctzl(bits);
-            VirtQueue *vq = virtio_get_queue(s->vdev, i);
+            unsigned i = j * BITS_PER_LONG + ctzl(bits);
+            VirtIOBlockDataPlaneQueue *q = &s->queues[i];
 
-            virtio_notify_irqfd(s->vdev, vq);
+            /* A queue that moved away was kicked on its new owner */
+            if (&s->threads[atomic_read(&q->owner)] == t) {
+                virtio_blk_data_plane_flush_vq(s, q);
+            }
 
             bits &= bits - 1; /* clear right-most bit */
         }
     }
 }
 
+/* Whether requests of @vq can be pushed to the vring from this thread */
+bool virtio_blk_data_plane_owns_vq(VirtIOBlockDataPlane *s, VirtQueue *vq)
+{
+    VirtIOBlockDataPlaneQueue *q = vq_to_queue(s, vq);
+
+    return s->threads[atomic_read(&q->owner)].ctx ==
+           qemu_get_current_aio_context();
+}
+
+/* Hand a completed request over to the owner of its virtqueue */
+void virtio_blk_data_plane_complete(VirtIOBlockDataPlane *s,
+                                    VirtIOBlockReq *req)
+{
+    VirtIOBlockDataPlaneQueue *q = vq_to_queue(s, req->vq);
+
+    /* Pairs with atomic_mb_set() in virtio_blk_data_plane_move_vq() */
+    QSLIST_INSERT_HEAD_ATOMIC(&q->done, req, done_next);
+    virtio_blk_data_plane_kick(&s->threads[atomic_read(&q->owner)],
+                               q - s->queues);
+}
+
+static IOThread *virtio_blk_data_plane_find_iothread(const char *id)
+{
+    Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                id);
+
+    return obj ? (IOThread *)object_dynamic_cast(obj, TYPE_IOTHREAD) : NULL;
+}
+
+/* Parse a colon-separated list of iothread ids, one per virtqueue */
+static bool virtio_blk_data_plane_parse_vq_iothreads(VirtIOBlockDataPlane *s,
+                                                     const char *mapping,
+                                                     int *owners,
+                                                     Error **errp)
+{
+    unsigned nvqs = s->conf->num_queues;
+    char **ids = g_strsplit(mapping, ":", -1);
+    bool ret = false;
+    unsigned i;
+    int j;
+
+    if (g_strv_length(ids) != nvqs) {
+        error_setg(errp, "vq-iothreads must list one iothread for each of "
+                   "the %u virtqueues", nvqs);
+        goto out;
+    }
+
+    for (i = 0; i < nvqs; i++) {
+        IOThread *iothread = virtio_blk_data_plane_find_iothread(ids[i]);
+
+        for (j = 0; j < s->nthreads; j++) {
+            if (iothread && s->threads[j].iothread == iothread) {
+                break;
+            }
+        }
+        if (j == s->nthreads) {
+            error_setg(errp, "vq-iothreads: '%s' is not the device's "
+                       "iothread nor listed in iothreads", ids[i]);
+            goto out;
+        }
+        owners[i] = j;
+    }
+    ret = true;
+
+out:
+    g_strfreev(ids);
+    return ret;
+}
+
+static int virtio_blk_data_plane_init_threads(VirtIOBlockDataPlane *s,
+                                              Error **errp)
+{
+    VirtIOBlkConf *conf = s->conf;
+    char **ids = NULL;
+    int i, j, n = 1;
+
+    if (conf->iothreads) {
+        ids = g_strsplit(conf->iothreads, ":", -1);
+        n += g_strv_length(ids);
+    }
+
+    s->threads = g_new0(VirtIOBlockDataPlaneThread, n);
+    s->threads[0].iothread = conf->iothread;
+    for (i = 1; i < n; i++) {
+        IOThread *iothread = virtio_blk_data_plane_find_iothread(ids[i - 1]);
+
+        if (!iothread) {
+            error_setg(errp, "iothreads: '%s' is not an iothread",
+                       ids[i - 1]);
+            g_strfreev(ids);
+            return -1;
+        }
+        for (j = 0; j < i; j++) {
+            if (s->threads[j].iothread == iothread) {
+                error_setg(errp, "iothreads: '%s' is listed twice",
+                           ids[i - 1]);
+                g_strfreev(ids);
+                return -1;
+            }
+        }
+        s->threads[i].iothread = iothread;
+    }
+    g_strfreev(ids);
+
+    for (i = 0; i < n; i++) {
+        VirtIOBlockDataPlaneThread *t = &s->threads[i];
+
+        t->s = s;
+        if (t->iothread) {
+            object_ref(OBJECT(t->iothread));
+            t->ctx = iothread_get_aio_context(t->iothread);
+        } else {
+            t->ctx = qemu_get_aio_context();
+        }
+        t->bh = aio_bh_new(t->ctx, notify_guest_bh, t);
+        t->pending_vqs = bitmap_new(conf->num_queues);
+    }
+    s->nthreads = n;
+    return 0;
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -83,6 +270,8 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned i, nvqs = conf->num_queues;
+    int *owners;
 
     *dataplane = NULL;
 
@@ -105,6 +294,9 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
             error_prepend(errp, "cannot start virtio-blk dataplane: ");
             return;
         }
+    } else if (conf->iothreads || conf->vq_iothreads) {
+        error_setg(errp, "iothreads and vq-iothreads require iothread");
+        return;
     }
     /* Don't try if transport does not support notifiers. */
     if (!virtio_device_ioeventfd_enabled(vdev)) {
@@ -114,16 +306,34 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
+    s->queues = g_new0(VirtIOBlockDataPlaneQueue, nvqs);
 
-    if (conf->iothread) {
-        s->iothread = conf->iothread;
-        object_ref(OBJECT(s->iothread));
-        s->ctx = iothread_get_aio_context(s->iothread);
+    if (virtio_blk_data_plane_init_threads(s, errp) < 0) {
+        virtio_blk_data_plane_destroy(s);
+        return;
+    }
+    s->ctx = s->threads[0].ctx;
+
+    /* Spread the queues over the threads unless told otherwise */
+    owners = g_new(int, nvqs);
+    if (conf->vq_iothreads) {
+        if (!virtio_blk_data_plane_parse_vq_iothreads(s, conf->vq_iothreads,
+                                                      owners, errp)) {
+            g_free(owners);
+            virtio_blk_data_plane_destroy(s);
+            return;
+        }
     } else {
-        s->ctx = qemu_get_aio_context();
+        for (i = 0; i < nvqs; i++) {
+            owners[i] = i % s->nthreads;
+        }
+    }
+    for (i = 0; i < nvqs; i++) {
+        s->queues[i].vq = virtio_get_queue(vdev, i);
+        s->queues[i].owner = owners[i];
+        QSLIST_INIT(&s->queues[i].done);
     }
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
-    s->batch_notify_vqs = bitmap_new(conf->num_queues);
+    g_free(owners);
 
     *dataplane = s;
 }
@@ -132,6 +342,7 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    int i;
 
     if (!s) {
         return;
@@ -139,11 +350,17 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
-    g_free(s->batch_notify_vqs);
-    qemu_bh_delete(s->bh);
-    if (s->iothread) {
-        object_unref(OBJECT(s->iothread));
+    for (i = 0; i < s->nthreads; i++) {
+        VirtIOBlockDataPlaneThread *t = &s->threads[i];
+
+        g_free(t->pending_vqs);
+        qemu_bh_delete(t->bh);
+        if (t->iothread) {
+            object_unref(OBJECT(t->iothread));
+        }
     }
+    g_free(s->threads);
+    g_free(s->queues);
     g_free(s);
 }
 
@@ -151,11 +368,92 @@ static void virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
                                                 VirtQueue *vq)
 {
     VirtIOBlock *s = (VirtIOBlock *)vdev;
+    VirtIOBlockDataPlane *dp = s->dataplane;
 
     assert(s->dataplane);
     assert(s->dataplane_started);
 
+    /* Threads other than the BlockBackend's submit under its lock */
+    aio_context_acquire(dp->ctx);
     virtio_blk_handle_vq(s, vq);
+    aio_context_release(dp->ctx);
+}
+
+/*
+ * Move virtqueue @i to thread @owner.  The old owner stops handling it
+ * with its AioContext held, so that it is not in the middle of popping or
+ * pushing.  Completions that race with the move land in the queue's list,
+ * which the new owner drains.
+ *
+ * Context: QEMU global mutex held
+ */
+static void virtio_blk_data_plane_move_vq(VirtIOBlockDataPlane *s,
+                                          unsigned i, int owner)
+{
+    VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+    VirtIOBlockDataPlaneThread *old = &s->threads[q->owner];
+    VirtIOBlockDataPlaneThread *new = &s->threads[owner];
+
+    if (q->owner == owner) {
+        return;
+    }
+
+    if (!vblk->dataplane_started || vblk->dataplane_disabled) {
+        q->owner = owner;
+        return;
+    }
+
+    trace_virtio_blk_data_plane_move_vq(s, i, old->ctx, new->ctx);
+
+    aio_context_acquire(old->ctx);
+    virtio_queue_aio_set_host_notifier_handler(q->vq, old->ctx, NULL);
+    atomic_mb_set(&q->owner, owner);
+    aio_context_release(old->ctx);
+
+    aio_context_acquire(new->ctx);
+    virtio_queue_aio_set_host_notifier_handler(q->vq, new->ctx,
+            virtio_blk_data_plane_handle_output);
+    aio_context_release(new->ctx);
+
+    /* Push what completed in between and pick up new requests */
+    virtio_blk_data_plane_kick(new, i);
+    event_notifier_set(virtio_queue_get_host_notifier(q->vq));
+}
+
+/* Context: QEMU global mutex held */
+char *virtio_blk_data_plane_get_vq_iothreads(VirtIOBlockDataPlane *s)
+{
+    GString *str = g_string_new("");
+    unsigned i;
+
+    if (!s->threads[0].iothread) {
+        return g_string_free(str, false);
+    }
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        char *id = iothread_get_id(s->threads[s->queues[i].owner].iothread);
+
+        g_string_append_printf(str, "%s%s", i ? ":" : "", id);
+        g_free(id);
+    }
+    return g_string_free(str, false);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_blk_data_plane_set_vq_iothreads(VirtIOBlockDataPlane *s,
+                                            const char *mapping,
+                                            Error **errp)
+{
+    unsigned i, nvqs = s->conf->num_queues;
+    int *owners = g_new(int, nvqs);
+
+    if (virtio_blk_data_plane_parse_vq_iothreads(s, mapping, owners, errp)) {
+        for (i = 0; i < nvqs; i++) {
+            virtio_blk_data_plane_move_vq(s, i, owners[i]);
+        }
+    }
+    g_free(owners);
 }
 
 /* Context: QEMU global mutex held */
@@ -209,14 +507,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
-        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+        AioContext *ctx = s->threads[q->owner].ctx;
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -249,20 +548,31 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    aio_context_acquire(s->ctx);
-
     /* Stop notifications for new requests from guest */
     for (i = 0; i < nvqs; i++) {
-        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+        AioContext *ctx = s->threads[q->owner].ctx;
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->vq, ctx, NULL);
+        aio_context_release(ctx);
     }
 
     /* Drain and switch bs back to the QEMU main loop */
+    aio_context_acquire(s->ctx);
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
-
     aio_context_release(s->ctx);
 
+    /* Push requests that completed away from their owner */
+    for (i = 0; i < nvqs; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+        AioContext *ctx = s->threads[q->owner].ctx;
+
+        aio_context_acquire(ctx);
+        virtio_blk_data_plane_flush_vq(s, q);
+        aio_context_release(ctx);
+    }
+
     for (i = 0; i < nvqs; i++) {
         virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
     }
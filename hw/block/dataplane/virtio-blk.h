@@ -24,6 +24,13 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   Error **errp);
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s);
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq);
+bool virtio_blk_data_plane_owns_vq(VirtIOBlockDataPlane *s, VirtQueue *vq);
+void virtio_blk_data_plane_complete(VirtIOBlockDataPlane *s,
+                                    struct VirtIOBlockReq *req);
+char *virtio_blk_data_plane_get_vq_iothreads(VirtIOBlockDataPlane *s);
+void virtio_blk_data_plane_set_vq_iothreads(VirtIOBlockDataPlane *s,
+                                            const char *mapping,
+                                            Error **errp);
 
 int virtio_blk_data_plane_start(VirtIODevice *vdev);
 void virtio_blk_data_plane_stop(VirtIODevice *vdev);
@@ -18,6 +18,10 @@
  * Usage: add options:
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *
+ * num_queues=<n> sets the number of queue pairs, including the admin one.
+ * iothreads=<id1>:<id2>:... runs the I/O queue pairs in IOThreads instead
+ * of the main loop, spreading them round-robin over the listed threads.
  */
 
 #include "qemu/osdep.h"
@@ -26,12 +30,23 @@
 #include "hw/pci/msix.h"
 #include "hw/pci/pci.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/kvm.h"
+#include "sysemu/iothread.h"
 #include "qapi/error.h"
 #include "qapi/visitor.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "sysemu/block-backend.h"
 
 #include "nvme.h"
 
+/* Submission queue entries fetched with a single DMA */
+#define NVME_SQ_BATCH 32
+
+/* SGL descriptors read at once, and a bound on segment chains */
+#define NVME_SGL_BATCH 32
+#define NVME_SGL_MAX_SEGMENTS 1024
+
 static void nvme_process_sq(void *opaque);
 
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
@@ -60,21 +75,179 @@ static void nvme_inc_sq_head(NvmeSQueue *sq)
 
 static uint8_t nvme_cq_full(NvmeCQueue *cq)
 {
-    return (cq->tail + 1) % cq->size == cq->head;
+    return (cq->tail + 1) % cq->size == atomic_read(&cq->head);
 }
 
 static uint8_t nvme_sq_empty(NvmeSQueue *sq)
 {
-    return sq->head == sq->tail;
+    return sq->head == atomic_read(&sq->tail);
+}
+
+/*
+ * With a doorbell buffer the guest writes the doorbells to memory, and
+ * only rings the real ones when they pass the event index that the
+ * controller publishes.
+ */
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t v;
+
+    if (sq->db_addr) {
+        pci_dma_read(&sq->ctrl->parent_obj, sq->db_addr, &v, sizeof(v));
+        v = le32_to_cpu(v);
+        if (v < sq->size) {
+            atomic_set(&sq->tail, v);
+        }
+    }
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(atomic_read(&sq->tail));
+
+    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t v;
+
+    if (cq->db_addr) {
+        pci_dma_read(&cq->ctrl->parent_obj, cq->db_addr, &v, sizeof(v));
+        v = le32_to_cpu(v);
+        if (v < cq->size) {
+            atomic_set(&cq->head, v);
+        }
+    }
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    uint32_t v = cpu_to_le32(atomic_read(&cq->head));
+
+    pci_dma_write(&cq->ctrl->parent_obj, cq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_irq_raise(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (msix_enabled(&(n->parent_obj))) {
+        msix_notify(&(n->parent_obj), cq->vector);
+    } else {
+        pci_irq_pulse(&n->parent_obj);
+    }
+}
+
+static void nvme_irq_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    nvme_irq_raise(cq->ctrl, cq);
 }
 
 static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
 {
-    if (cq->irq_enabled) {
-        if (msix_enabled(&(n->parent_obj))) {
-            msix_notify(&(n->parent_obj), cq->vector);
-        } else {
-            pci_irq_pulse(&n->parent_obj);
+    if (!cq->irq_enabled) {
+        return;
+    }
+
+    /* Outside the main loop the interrupt cannot be raised directly */
+    if (cq->ctx == qemu_get_aio_context()) {
+        nvme_irq_raise(n, cq);
+    } else if (cq->irqfd) {
+        event_notifier_set(&n->vectors[cq->vector].notifier);
+    } else {
+        qemu_bh_schedule(cq->irq_bh);
+    }
+}
+
+/*
+ * MSI-X vectors of queue pairs that run in IOThreads are delivered with
+ * KVM irqfds.  As in virtio-pci, the irqfd is detached while the vector
+ * is masked, and the event is then reported in the pending bit array.
+ */
+static bool nvme_vector_use(NvmeCtrl *n, unsigned vector)
+{
+    NvmeVector *v = &n->vectors[vector];
+    int ret;
+
+    if (v->users == 0) {
+        if (event_notifier_init(&v->notifier, 0) < 0) {
+            return false;
+        }
+        ret = kvm_irqchip_add_msi_route(kvm_state, vector, &n->parent_obj);
+        if (ret < 0) {
+            event_notifier_cleanup(&v->notifier);
+            return false;
+        }
+        v->virq = ret;
+        if (!msix_is_masked(&n->parent_obj, vector) &&
+            kvm_irqchip_add_irqfd_notifier_gsi(kvm_state, &v->notifier, NULL,
+                                               v->virq) < 0) {
+            kvm_irqchip_release_virq(kvm_state, v->virq);
+            event_notifier_cleanup(&v->notifier);
+            return false;
+        }
+    }
+    v->users++;
+    return true;
+}
+
+static void nvme_vector_release(NvmeCtrl *n, unsigned vector)
+{
+    NvmeVector *v = &n->vectors[vector];
+
+    if (--v->users == 0) {
+        if (!msix_is_masked(&n->parent_obj, vector)) {
+            kvm_irqchip_remove_irqfd_notifier_gsi(kvm_state, &v->notifier,
+                                                  v->virq);
+        }
+        kvm_irqchip_release_virq(kvm_state, v->virq);
+        event_notifier_cleanup(&v->notifier);
+    }
+}
+
+static int nvme_vector_unmask(PCIDevice *dev, unsigned vector, MSIMessage msg)
+{
+    NvmeCtrl *n = NVME(dev);
+    NvmeVector *v = &n->vectors[vector];
+    int ret;
+
+    if (!v->users) {
+        return 0;
+    }
+
+    ret = kvm_irqchip_update_msi_route(kvm_state, v->virq, msg, dev);
+    if (ret < 0) {
+        return ret;
+    }
+    kvm_irqchip_commit_routes(kvm_state);
+    return kvm_irqchip_add_irqfd_notifier_gsi(kvm_state, &v->notifier, NULL,
+                                              v->virq);
+}
+
+static void nvme_vector_mask(PCIDevice *dev, unsigned vector)
+{
+    NvmeCtrl *n = NVME(dev);
+    NvmeVector *v = &n->vectors[vector];
+
+    if (v->users) {
+        kvm_irqchip_remove_irqfd_notifier_gsi(kvm_state, &v->notifier,
+                                              v->virq);
+    }
+}
+
+static void nvme_vector_poll(PCIDevice *dev, unsigned int vector_start,
+                             unsigned int vector_end)
+{
+    NvmeCtrl *n = NVME(dev);
+    unsigned int vector;
+
+    for (vector = vector_start; vector < vector_end; vector++) {
+        NvmeVector *v = &n->vectors[vector];
+
+        if (v->users && msix_is_masked(dev, vector) &&
+            event_notifier_test_and_clear(&v->notifier)) {
+            msix_set_pending(dev, vector);
         }
     }
 }
@@ -144,6 +317,130 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     return NVME_INVALID_FIELD | NVME_DNR;
 }
 
+static uint16_t nvme_map_sgl_data(QEMUSGList *qsg, NvmeSglDescriptor *segment,
+    uint32_t nsgld, uint32_t *len)
+{
+    uint32_t i;
+
+    for (i = 0; i < nsgld; i++) {
+        uint64_t addr = le64_to_cpu(segment[i].addr);
+        uint32_t dlen = le32_to_cpu(segment[i].len);
+        uint32_t trans_len;
+
+        switch (NVME_SGL_TYPE(segment[i].type)) {
+        case NVME_SGL_DESCR_TYPE_DATA_BLOCK:
+            break;
+        case NVME_SGL_DESCR_TYPE_SEGMENT:
+        case NVME_SGL_DESCR_TYPE_LAST_SEGMENT:
+            return NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+        default:
+            return NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+        }
+
+        trans_len = MIN(*len, dlen);
+        if (trans_len) {
+            qemu_sglist_add(qsg, addr, trans_len);
+            *len -= trans_len;
+        }
+    }
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_map_sgl(QEMUSGList *qsg, NvmeSglDescriptor sgl,
+    uint32_t len, NvmeCtrl *n)
+{
+    NvmeSglDescriptor segment[NVME_SGL_BATCH];
+    uint8_t type = NVME_SGL_TYPE(sgl.type);
+    unsigned int nsegs = 0;
+    uint16_t status;
+
+    pci_dma_sglist_init(qsg, &n->parent_obj, 1);
+
+    if (type == NVME_SGL_DESCR_TYPE_DATA_BLOCK) {
+        status = nvme_map_sgl_data(qsg, &sgl, 1, &len);
+        if (status) {
+            goto unmap;
+        }
+    } else if (type != NVME_SGL_DESCR_TYPE_SEGMENT &&
+               type != NVME_SGL_DESCR_TYPE_LAST_SEGMENT) {
+        status = NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+        goto unmap;
+    }
+
+    /* Only the last descriptor of a segment may point to the next one */
+    while (type == NVME_SGL_DESCR_TYPE_SEGMENT ||
+           type == NVME_SGL_DESCR_TYPE_LAST_SEGMENT) {
+        uint64_t addr = le64_to_cpu(sgl.addr);
+        uint32_t slen = le32_to_cpu(sgl.len);
+        uint32_t nsgld = slen / sizeof(NvmeSglDescriptor);
+        uint8_t next_type;
+
+        if (!nsgld || slen % sizeof(NvmeSglDescriptor) ||
+            ++nsegs > NVME_SGL_MAX_SEGMENTS) {
+            status = NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+            goto unmap;
+        }
+
+        while (nsgld > NVME_SGL_BATCH) {
+            pci_dma_read(&n->parent_obj, addr, segment, sizeof(segment));
+            status = nvme_map_sgl_data(qsg, segment, NVME_SGL_BATCH, &len);
+            if (status) {
+                goto unmap;
+            }
+            nsgld -= NVME_SGL_BATCH;
+            addr += sizeof(segment);
+        }
+
+        pci_dma_read(&n->parent_obj, addr, segment,
+                     nsgld * sizeof(NvmeSglDescriptor));
+        sgl = segment[nsgld - 1];
+        next_type = NVME_SGL_TYPE(sgl.type);
+        if (next_type == NVME_SGL_DESCR_TYPE_SEGMENT ||
+            next_type == NVME_SGL_DESCR_TYPE_LAST_SEGMENT) {
+            if (type == NVME_SGL_DESCR_TYPE_LAST_SEGMENT) {
+                status = NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+                goto unmap;
+            }
+            nsgld--;
+        }
+
+        status = nvme_map_sgl_data(qsg, segment, nsgld, &len);
+        if (status) {
+            goto unmap;
+        }
+        type = next_type;
+    }
+
+    if (len) {
+        status = NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+        goto unmap;
+    }
+    return NVME_SUCCESS;
+
+ unmap:
+    qemu_sglist_destroy(qsg);
+    return status;
+}
+
+static uint16_t nvme_map_dptr(QEMUSGList *qsg, NvmeCmd *cmd, uint32_t len,
+    NvmeCtrl *n)
+{
+    NvmeSglDescriptor sgl;
+
+    switch (NVME_CMD_FLAGS_PSDT(cmd->fuse)) {
+    case NVME_PSDT_PRP:
+        return nvme_map_prp(qsg, le64_to_cpu(cmd->prp1),
+                            le64_to_cpu(cmd->prp2), len, n);
+    case NVME_PSDT_SGL_MPTR_CONTIGUOUS:
+    case NVME_PSDT_SGL_MPTR_SGL:
+        /* The SGL descriptor takes the place of both PRP entries */
+        memcpy(&sgl, &cmd->prp1, sizeof(sgl));
+        return nvme_map_sgl(qsg, sgl, len, n);
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+}
+
 static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     uint64_t prp1, uint64_t prp2)
 {
@@ -160,18 +457,27 @@ static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     return NVME_SUCCESS;
 }
 
-static void nvme_post_cqes(void *opaque)
+static void nvme_post_cqes(NvmeCQueue *cq)
 {
-    NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
 
+    nvme_update_cq_head(cq);
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
         hwaddr addr;
 
         if (nvme_cq_full(cq)) {
-            break;
+            /* Ask the guest to ring once it has consumed some entries */
+            if (!cq->ei_addr) {
+                break;
+            }
+            nvme_update_cq_eventidx(cq);
+            smp_mb();
+            nvme_update_cq_head(cq);
+            if (nvme_cq_full(cq)) {
+                break;
+            }
         }
 
         QTAILQ_REMOVE(&cq->req_list, req, entry);
@@ -183,9 +489,37 @@ static void nvme_post_cqes(void *opaque)
         nvme_inc_cq_tail(cq);
         pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
             sizeof(req->cqe));
+        if (QTAILQ_EMPTY(&sq->req_list)) {
+            /* The submission queue may have stopped for lack of requests */
+            qemu_bh_schedule(sq->bh);
+        }
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
     }
-    nvme_isr_notify(n, cq);
+    if (cq->tail != atomic_read(&cq->head)) {
+        nvme_isr_notify(n, cq);
+    }
+}
+
+/* Collect the requests that other AioContexts completed */
+static void nvme_cq_flush_done(NvmeCQueue *cq)
+{
+    QSLIST_HEAD(, NvmeRequest) done;
+    NvmeRequest *req;
+
+    QSLIST_MOVE_ATOMIC(&done, &cq->done);
+    while ((req = QSLIST_FIRST(&done)) != NULL) {
+        QSLIST_REMOVE_HEAD(&done, done_next);
+        QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
+        QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
+    }
+}
+
+static void nvme_cq_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    nvme_cq_flush_done(cq);
+    nvme_post_cqes(cq);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -193,7 +527,7 @@ static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
     assert(cq->cqid == req->sq->cqid);
     QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
     QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
-    timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    qemu_bh_schedule(cq->bh);
 }
 
 static void nvme_rw_cb(void *opaque, int ret)
@@ -213,7 +547,17 @@ static void nvme_rw_cb(void *opaque, int ret)
     if (req->has_sg) {
         qemu_sglist_destroy(&req->qsg);
     }
-    nvme_enqueue_req_completion(cq, req);
+
+    /*
+     * The BlockBackend may live in another IOThread than the queue pair,
+     * whose lists are then only touched by the completion queue's BH.
+     */
+    if (cq->ctx == qemu_get_current_aio_context()) {
+        nvme_enqueue_req_completion(cq, req);
+    } else {
+        QSLIST_INSERT_HEAD_ATOMIC(&cq->done, req, done_next);
+        qemu_bh_schedule(cq->bh);
+    }
 }
 
 static uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
@@ -233,8 +577,7 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
     uint32_t nlb  = le32_to_cpu(rw->nlb) + 1;
     uint64_t slba = le64_to_cpu(rw->slba);
-    uint64_t prp1 = le64_to_cpu(rw->prp1);
-    uint64_t prp2 = le64_to_cpu(rw->prp2);
+    uint16_t status;
 
     uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
     uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
@@ -248,9 +591,10 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
         return NVME_LBA_RANGE | NVME_DNR;
     }
 
-    if (nvme_map_prp(&req->qsg, prp1, prp2, data_size, n)) {
+    status = nvme_map_dptr(&req->qsg, cmd, data_size, n);
+    if (status) {
         block_acct_invalid(blk_get_stats(n->conf.blk), acct);
-        return NVME_INVALID_FIELD | NVME_DNR;
+        return status;
     }
 
     assert((nlb << data_shift) == req->qsg.size);
@@ -287,11 +631,147 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     }
 }
 
+static AioContext *nvme_queue_ctx(NvmeCtrl *n, uint16_t qid)
+{
+    /* The admin queue pair always stays in the main loop */
+    if (!qid || !n->num_iothreads) {
+        return qemu_get_aio_context();
+    }
+    return iothread_get_aio_context(n->iothread[(qid - 1) % n->num_iothreads]);
+}
+
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+static void nvme_cq_notifier(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_cq_bh(cq);
+    }
+}
+
+/*
+ * The value written to a doorbell is lost with an ioeventfd, so this is
+ * only done once the guest maintains the shadow doorbells.
+ */
+static void nvme_sq_ioeventfd_enable(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    /* A new Doorbell Buffer Config only moves the shadow doorbells */
+    if (sq->ioeventfd_enabled) {
+        return;
+    }
+    if (!kvm_eventfds_enabled() || event_notifier_init(&sq->notifier, 0)) {
+        return;
+    }
+    memory_region_add_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                              false, 0, &sq->notifier);
+    aio_context_acquire(sq->ctx);
+    aio_set_event_notifier(sq->ctx, &sq->notifier, true, nvme_sq_notifier);
+    aio_context_release(sq->ctx);
+    sq->ioeventfd_enabled = true;
+}
+
+static void nvme_sq_ioeventfd_disable(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    if (!sq->ioeventfd_enabled) {
+        return;
+    }
+    aio_context_acquire(sq->ctx);
+    aio_set_event_notifier(sq->ctx, &sq->notifier, true, NULL);
+    aio_context_release(sq->ctx);
+    memory_region_del_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                              false, 0, &sq->notifier);
+    event_notifier_cleanup(&sq->notifier);
+    sq->ioeventfd_enabled = false;
+}
+
+static void nvme_cq_ioeventfd_enable(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (cq->ioeventfd_enabled) {
+        return;
+    }
+    if (!kvm_eventfds_enabled() || event_notifier_init(&cq->notifier, 0)) {
+        return;
+    }
+    memory_region_add_eventfd(&n->iomem, 0x1000 + (cq->cqid << 3) + 4, 4,
+                              false, 0, &cq->notifier);
+    aio_context_acquire(cq->ctx);
+    aio_set_event_notifier(cq->ctx, &cq->notifier, true, nvme_cq_notifier);
+    aio_context_release(cq->ctx);
+    cq->ioeventfd_enabled = true;
+}
+
+static void nvme_cq_ioeventfd_disable(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (!cq->ioeventfd_enabled) {
+        return;
+    }
+    aio_context_acquire(cq->ctx);
+    aio_set_event_notifier(cq->ctx, &cq->notifier, true, NULL);
+    aio_context_release(cq->ctx);
+    memory_region_del_eventfd(&n->iomem, 0x1000 + (cq->cqid << 3) + 4, 4,
+                              false, 0, &cq->notifier);
+    event_notifier_cleanup(&cq->notifier);
+    cq->ioeventfd_enabled = false;
+}
+
+static void nvme_sq_set_dbbuf(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    nvme_sq_ioeventfd_enable(n, sq);
+}
+
+static void nvme_cq_set_dbbuf(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + 4;
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + 4;
+    nvme_cq_ioeventfd_enable(n, cq);
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
+    AioContext *blk_ctx = blk_get_aio_context(n->conf.blk);
+    NvmeCQueue *cq = n->cq[sq->cqid];
+    NvmeRequest *req, *next;
+
+    nvme_sq_ioeventfd_disable(n, sq);
+
+    /* The queue pair's AioContext must be taken before the BlockBackend's */
+    aio_context_acquire(sq->ctx);
+    aio_context_acquire(blk_ctx);
+    for (;;) {
+        nvme_cq_flush_done(cq);
+        if (QTAILQ_EMPTY(&sq->out_req_list)) {
+            break;
+        }
+        req = QTAILQ_FIRST(&sq->out_req_list);
+        assert(req->aiocb);
+        blk_aio_cancel(req->aiocb);
+    }
+    aio_context_release(blk_ctx);
+
+    QTAILQ_REMOVE(&cq->sq_list, sq, entry);
+    nvme_post_cqes(cq);
+    QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
+        if (req->sq == sq) {
+            QTAILQ_REMOVE(&cq->req_list, req, entry);
+            QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        }
+    }
+
+    qemu_bh_delete(sq->bh);
     n->sq[sq->sqid] = NULL;
-    timer_del(sq->timer);
-    timer_free(sq->timer);
+    aio_context_release(sq->ctx);
+
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -301,35 +781,13 @@ static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
 {
     NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
-    NvmeRequest *req, *next;
-    NvmeSQueue *sq;
-    NvmeCQueue *cq;
     uint16_t qid = le16_to_cpu(c->qid);
 
     if (!qid || nvme_check_sqid(n, qid)) {
         return NVME_INVALID_QID | NVME_DNR;
     }
 
-    sq = n->sq[qid];
-    while (!QTAILQ_EMPTY(&sq->out_req_list)) {
-        req = QTAILQ_FIRST(&sq->out_req_list);
-        assert(req->aiocb);
-        blk_aio_cancel(req->aiocb);
-    }
-    if (!nvme_check_cqid(n, sq->cqid)) {
-        cq = n->cq[sq->cqid];
-        QTAILQ_REMOVE(&cq->sq_list, sq, entry);
-
-        nvme_post_cqes(cq);
-        QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
-            if (req->sq == sq) {
-                QTAILQ_REMOVE(&cq->req_list, req, entry);
-                QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
-            }
-        }
-    }
-
-    nvme_free_sq(sq, n);
+    nvme_free_sq(n->sq[qid], n);
     return NVME_SUCCESS;
 }
 
@@ -339,12 +797,17 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     int i;
     NvmeCQueue *cq;
 
+    assert(n->cq[cqid]);
+    cq = n->cq[cqid];
+
     sq->ctrl = n;
     sq->dma_addr = dma_addr;
     sq->sqid = sqid;
     sq->size = size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
+    sq->db_addr = sq->ei_addr = 0;
+    sq->ioeventfd_enabled = false;
     sq->io_req = g_new(NvmeRequest, sq->size);
 
     QTAILQ_INIT(&sq->req_list);
@@ -353,12 +816,17 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
 
-    assert(n->cq[cqid]);
-    cq = n->cq[cqid];
+    /* A submission queue runs where its completion queue does */
+    sq->ctx = cq->ctx;
+    sq->bh = aio_bh_new(sq->ctx, nvme_process_sq, sq);
+
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+
+    if (sqid && n->dbbuf_enabled) {
+        nvme_sq_set_dbbuf(n, sq);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -394,9 +862,19 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
 
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
+    nvme_cq_ioeventfd_disable(n, cq);
+
+    aio_context_acquire(cq->ctx);
+    qemu_bh_delete(cq->bh);
     n->cq[cq->cqid] = NULL;
-    timer_del(cq->timer);
-    timer_free(cq->timer);
+    aio_context_release(cq->ctx);
+
+    if (cq->irq_bh) {
+        qemu_bh_delete(cq->irq_bh);
+    }
+    if (cq->irqfd) {
+        nvme_vector_release(n, cq->vector);
+    }
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -432,11 +910,30 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->db_addr = cq->ei_addr = 0;
+    cq->ioeventfd_enabled = false;
+    cq->irqfd = false;
+    cq->irq_bh = NULL;
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
+    QSLIST_INIT(&cq->done);
     msix_vector_use(&n->parent_obj, cq->vector);
+
+    cq->ctx = nvme_queue_ctx(n, cqid);
+    cq->bh = aio_bh_new(cq->ctx, nvme_cq_bh, cq);
+    if (cq->ctx != qemu_get_aio_context() && irq_enabled) {
+        if (n->vectors && msix_enabled(&n->parent_obj) &&
+            nvme_vector_use(n, vector)) {
+            cq->irqfd = true;
+        } else {
+            cq->irq_bh = qemu_bh_new(nvme_irq_bh, cq);
+        }
+    }
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+
+    if (cqid && n->dbbuf_enabled) {
+        nvme_cq_set_dbbuf(n, cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -458,7 +955,7 @@ static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
     if (!prp1) {
         return NVME_INVALID_FIELD | NVME_DNR;
     }
-    if (vector > n->num_queues) {
+    if (vector >= n->num_queues) {
         return NVME_INVALID_IRQ_VECTOR | NVME_DNR;
     }
     if (!(NVME_CQ_FLAGS_PC(qflags))) {
@@ -548,7 +1045,7 @@ static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         result = blk_enable_write_cache(n->conf.blk);
         break;
     case NVME_NUMBER_OF_QUEUES:
-        result = cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
+        result = cpu_to_le32((n->num_queues - 2) | ((n->num_queues - 2) << 16));
         break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
@@ -562,14 +1059,18 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     uint32_t dw10 = le32_to_cpu(cmd->cdw10);
     uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    AioContext *ctx;
 
     switch (dw10) {
     case NVME_VOLATILE_WRITE_CACHE:
+        ctx = blk_get_aio_context(n->conf.blk);
+        aio_context_acquire(ctx);
         blk_set_enable_write_cache(n->conf.blk, dw11 & 1);
+        aio_context_release(ctx);
         break;
     case NVME_NUMBER_OF_QUEUES:
         req->cqe.result =
-            cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
+            cpu_to_le32((n->num_queues - 2) | ((n->num_queues - 2) << 16));
         break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
@@ -577,6 +1078,47 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    uint32_t v;
+    int i;
+
+    if (!dbs_addr || dbs_addr & (n->page_size - 1) ||
+        !eis_addr || eis_addr & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    /* Drivers keep ringing the admin queue doorbells, so it is left alone */
+    for (i = 1; i < n->num_queues; i++) {
+        NvmeSQueue *sq = n->sq[i];
+        NvmeCQueue *cq = n->cq[i];
+
+        if (cq) {
+            aio_context_acquire(cq->ctx);
+            nvme_cq_set_dbbuf(n, cq);
+            v = cpu_to_le32(atomic_read(&cq->head));
+            pci_dma_write(&n->parent_obj, cq->db_addr, &v, sizeof(v));
+            nvme_update_cq_eventidx(cq);
+            aio_context_release(cq->ctx);
+        }
+        if (sq) {
+            aio_context_acquire(sq->ctx);
+            nvme_sq_set_dbbuf(n, sq);
+            v = cpu_to_le32(atomic_read(&sq->tail));
+            pci_dma_write(&n->parent_obj, sq->db_addr, &v, sizeof(v));
+            nvme_update_sq_eventidx(sq);
+            aio_context_release(sq->ctx);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -594,6 +1136,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -604,34 +1148,66 @@ static void nvme_process_sq(void *opaque)
     NvmeSQueue *sq = opaque;
     NvmeCtrl *n = sq->ctrl;
     NvmeCQueue *cq = n->cq[sq->cqid];
+    AioContext *blk_ctx = NULL;
 
     uint16_t status;
-    hwaddr addr;
-    NvmeCmd cmd;
+    uint32_t head, tail, nr, i;
+    NvmeCmd cmds[NVME_SQ_BATCH];
     NvmeRequest *req;
 
-    while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
-        addr = sq->dma_addr + sq->head * n->sqe_size;
-        pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
-        nvme_inc_sq_head(sq);
+    if (sq->sqid) {
+        blk_ctx = blk_get_aio_context(n->conf.blk);
+        aio_context_acquire(blk_ctx);
+    }
 
-        req = QTAILQ_FIRST(&sq->req_list);
-        QTAILQ_REMOVE(&sq->req_list, req, entry);
-        QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
-        memset(&req->cqe, 0, sizeof(req->cqe));
-        req->cqe.cid = cmd.cid;
+    nvme_update_sq_tail(sq);
+    for (;;) {
+        if (nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list)) {
+            /* Ask the guest to ring again, and catch what it queued since */
+            if (!sq->ei_addr) {
+                break;
+            }
+            nvme_update_sq_eventidx(sq);
+            smp_mb();
+            nvme_update_sq_tail(sq);
+            if (nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list)) {
+                break;
+            }
+        }
 
-        status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
-            nvme_admin_cmd(n, &cmd, req);
-        if (status != NVME_NO_COMPLETE) {
-            req->status = status;
-            nvme_enqueue_req_completion(cq, req);
+        /* Fetch the entries up to the tail or the end of the ring at once */
+        head = sq->head;
+        tail = atomic_read(&sq->tail);
+        nr = MIN(tail > head ? tail - head : sq->size - head, NVME_SQ_BATCH);
+        pci_dma_read(&n->parent_obj, sq->dma_addr + head * n->sqe_size,
+                     (void *)cmds, nr * sizeof(cmds[0]));
+
+        for (i = 0; i < nr && !QTAILQ_EMPTY(&sq->req_list); i++) {
+            nvme_inc_sq_head(sq);
+
+            req = QTAILQ_FIRST(&sq->req_list);
+            QTAILQ_REMOVE(&sq->req_list, req, entry);
+            QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
+            memset(&req->cqe, 0, sizeof(req->cqe));
+            req->cqe.cid = cmds[i].cid;
+
+            status = sq->sqid ? nvme_io_cmd(n, &cmds[i], req) :
+                nvme_admin_cmd(n, &cmds[i], req);
+            if (status != NVME_NO_COMPLETE) {
+                req->status = status;
+                nvme_enqueue_req_completion(cq, req);
+            }
         }
     }
+
+    if (blk_ctx) {
+        aio_context_release(blk_ctx);
+    }
 }
 
 static void nvme_clear_ctrl(NvmeCtrl *n)
 {
+    AioContext *ctx;
     int i;
 
     for (i = 0; i < n->num_queues; i++) {
@@ -644,8 +1220,13 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
             nvme_free_cq(n->cq[i], n);
         }
     }
+    n->dbbuf_enabled = false;
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
 
+    ctx = blk_get_aio_context(n->conf.blk);
+    aio_context_acquire(ctx);
     blk_flush(n->conf.blk);
+    aio_context_release(ctx);
     n->bar.cc = 0;
 }
 
@@ -754,6 +1335,7 @@ static uint64_t nvme_mmio_read(void *opaque, hwaddr addr, unsigned size)
 static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 {
     uint32_t qid;
+    uint32_t v;
 
     if (addr & ((1 << 2) - 1)) {
         return;
@@ -761,7 +1343,6 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
     if (((addr - 0x1000) >> 2) & 1) {
         uint16_t new_head = val & 0xffff;
-        int start_sqs;
         NvmeCQueue *cq;
 
         qid = (addr - (0x1000 + (1 << 2))) >> 3;
@@ -774,19 +1355,12 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
-        start_sqs = nvme_cq_full(cq) ? 1 : 0;
-        cq->head = new_head;
-        if (start_sqs) {
-            NvmeSQueue *sq;
-            QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-            }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-        }
-
-        if (cq->tail != cq->head) {
-            nvme_isr_notify(n, cq);
+        if (cq->db_addr) {
+            v = cpu_to_le32(new_head);
+            pci_dma_write(&n->parent_obj, cq->db_addr, &v, sizeof(v));
         }
+        atomic_set(&cq->head, new_head);
+        qemu_bh_schedule(cq->bh);
     } else {
         uint16_t new_tail = val & 0xffff;
         NvmeSQueue *sq;
@@ -801,8 +1375,12 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
-        sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        if (sq->db_addr) {
+            v = cpu_to_le32(new_tail);
+            pci_dma_write(&n->parent_obj, sq->db_addr, &v, sizeof(v));
+        }
+        atomic_set(&sq->tail, new_tail);
+        qemu_bh_schedule(sq->bh);
     }
 }
 
@@ -827,10 +1405,49 @@ static const MemoryRegionOps nvme_mmio_ops = {
     },
 };
 
+static int nvme_init_iothreads(NvmeCtrl *n)
+{
+    char **ids;
+    int i;
+
+    if (!n->iothreads) {
+        return 0;
+    }
+
+    ids = g_strsplit(n->iothreads, ":", -1);
+    n->num_iothreads = g_strv_length(ids);
+    n->iothread = g_new0(IOThread *, n->num_iothreads);
+    for (i = 0; i < n->num_iothreads; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    ids[i]);
+
+        obj = obj ? object_dynamic_cast(obj, TYPE_IOTHREAD) : NULL;
+        if (!obj) {
+            error_report("nvme: iothreads: '%s' is not an iothread", ids[i]);
+            goto fail;
+        }
+        object_ref(obj);
+        n->iothread[i] = IOTHREAD(obj);
+    }
+    g_strfreev(ids);
+    return 0;
+
+fail:
+    while (--i >= 0) {
+        object_unref(OBJECT(n->iothread[i]));
+    }
+    g_free(n->iothread);
+    n->iothread = NULL;
+    n->num_iothreads = 0;
+    g_strfreev(ids);
+    return -1;
+}
+
 static int nvme_init(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
     NvmeIdCtrl *id = &n->id_ctrl;
+    Error *local_err = NULL;
 
     int i;
     int64_t bs_size;
@@ -852,6 +1469,21 @@ static int nvme_init(PCIDevice *pci_dev)
     blkconf_blocksizes(&n->conf);
     blkconf_apply_backend_options(&n->conf);
 
+    /* The doorbell buffer has room for 512 queue pairs in a page */
+    if (n->num_queues < 2 || n->num_queues > 512) {
+        error_report("nvme: num_queues must be between 2 and 512");
+        return -1;
+    }
+    /* Block jobs may not expect the BlockBackend to leave the main loop */
+    if (n->iothreads &&
+        blk_op_is_blocked(n->conf.blk, BLOCK_OP_TYPE_DATAPLANE, &local_err)) {
+        error_reportf_err(local_err, "nvme: cannot use iothreads: ");
+        return -1;
+    }
+    if (nvme_init_iothreads(n)) {
+        return -1;
+    }
+
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
     pci_config_set_prog_interface(pci_dev->config, 0x2);
@@ -859,7 +1491,6 @@ static int nvme_init(PCIDevice *pci_dev)
     pcie_endpoint_cap_init(&n->parent_obj, 0x80);
 
     n->num_namespaces = 1;
-    n->num_queues = 64;
     n->reg_size = pow2ceil(0x1004 + 2 * (n->num_queues + 1) * 4);
     n->ns_size = bs_size / (uint64_t)n->num_namespaces;
 
@@ -873,6 +1504,11 @@ static int nvme_init(PCIDevice *pci_dev)
         PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64,
         &n->iomem);
     msix_init_exclusive_bar(&n->parent_obj, n->num_queues, 4);
+    if (n->num_iothreads && kvm_msi_via_irqfd_enabled()) {
+        n->vectors = g_new0(NvmeVector, n->num_queues);
+        msix_set_vector_notifiers(&n->parent_obj, nvme_vector_unmask,
+                                  nvme_vector_mask, nvme_vector_poll);
+    }
 
     id->vid = cpu_to_le16(pci_get_word(pci_conf + PCI_VENDOR_ID));
     id->ssvid = cpu_to_le16(pci_get_word(pci_conf + PCI_SUBSYSTEM_VENDOR_ID));
@@ -883,12 +1519,13 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
     id->cqes = (0x4 << 4) | 0x4;
     id->nn = cpu_to_le32(n->num_namespaces);
+    id->sgls = cpu_to_le32(NVME_SGLS_SUPPORTED);
     id->psd[0].mp = cpu_to_le16(0x9c4);
     id->psd[0].enlat = cpu_to_le32(0x10);
     id->psd[0].exlat = cpu_to_le32(0x4);
@@ -921,6 +1558,15 @@ static int nvme_init(PCIDevice *pci_dev)
             cpu_to_le64(n->ns_size >>
                 id_ns->lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds);
     }
+
+    /* The I/O queue pairs submit from their IOThreads into this one */
+    if (n->num_iothreads) {
+        AioContext *ctx = iothread_get_aio_context(n->iothread[0]);
+
+        aio_context_acquire(ctx);
+        blk_set_aio_context(n->conf.blk, ctx);
+        aio_context_release(ctx);
+    }
     return 0;
 }
 
@@ -929,15 +1575,33 @@ static void nvme_exit(PCIDevice *pci_dev)
     NvmeCtrl *n = NVME(pci_dev);
 
     nvme_clear_ctrl(n);
+    if (n->num_iothreads) {
+        AioContext *ctx = iothread_get_aio_context(n->iothread[0]);
+        int i;
+
+        aio_context_acquire(ctx);
+        blk_set_aio_context(n->conf.blk, qemu_get_aio_context());
+        aio_context_release(ctx);
+        for (i = 0; i < n->num_iothreads; i++) {
+            object_unref(OBJECT(n->iothread[i]));
+        }
+        g_free(n->iothread);
+    }
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
+    if (n->vectors) {
+        msix_unset_vector_notifiers(pci_dev);
+        g_free(n->vectors);
+    }
     msix_uninit_exclusive_bar(pci_dev);
 }
 
 static Property nvme_props[] = {
     DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+    DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
+    DEFINE_PROP_STRING("iothreads", NvmeCtrl, iothreads),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -155,6 +155,30 @@ typedef struct NvmeCmd {
     uint32_t    cdw15;
 } NvmeCmd;
 
+#define NVME_CMD_FLAGS_PSDT(flags)  ((flags >> 6) & 0x3)
+
+enum NvmePsdt {
+    NVME_PSDT_PRP                   = 0x0,
+    NVME_PSDT_SGL_MPTR_CONTIGUOUS   = 0x1,
+    NVME_PSDT_SGL_MPTR_SGL          = 0x2,
+};
+
+typedef struct NvmeSglDescriptor {
+    uint64_t    addr;
+    uint32_t    len;
+    uint8_t     rsvd[3];
+    uint8_t     type;
+} NvmeSglDescriptor;
+
+#define NVME_SGL_TYPE(type)         ((type >> 4) & 0xf)
+
+enum NvmeSglDescriptorType {
+    NVME_SGL_DESCR_TYPE_DATA_BLOCK      = 0x0,
+    NVME_SGL_DESCR_TYPE_BIT_BUCKET      = 0x1,
+    NVME_SGL_DESCR_TYPE_SEGMENT         = 0x2,
+    NVME_SGL_DESCR_TYPE_LAST_SEGMENT    = 0x3,
+};
+
 enum NvmeAdminCommands {
     NVME_ADM_CMD_DELETE_SQ      = 0x00,
     NVME_ADM_CMD_CREATE_SQ      = 0x01,
@@ -171,6 +195,7 @@ enum NvmeAdminCommands {
     NVME_ADM_CMD_FORMAT_NVM     = 0x80,
     NVME_ADM_CMD_SECURITY_SEND  = 0x81,
     NVME_ADM_CMD_SECURITY_RECV  = 0x82,
+    NVME_ADM_CMD_DBBUF_CONFIG   = 0x7c,
 };
 
 enum NvmeIoCommands {
@@ -359,6 +384,10 @@ enum NvmeStatusCodes {
     NVME_CMD_ABORT_MISSING_FUSE = 0x000a,
     NVME_INVALID_NSID           = 0x000b,
     NVME_CMD_SEQ_ERROR          = 0x000c,
+    NVME_INVALID_SGL_SEG_DESCR  = 0x000d,
+    NVME_INVALID_NUM_SGL_DESCRS = 0x000e,
+    NVME_DATA_SGL_LEN_INVALID   = 0x000f,
+    NVME_SGL_DESCR_TYPE_INVALID = 0x0011,
     NVME_LBA_RANGE              = 0x0080,
     NVME_CAP_EXCEEDED           = 0x0081,
     NVME_NS_NOT_READY           = 0x0082,
@@ -494,7 +523,12 @@ typedef struct NvmeIdCtrl {
     uint8_t     vwc;
     uint16_t    awun;
     uint16_t    awupf;
-    uint8_t     rsvd703[174];
+    uint8_t     nvscc;
+    uint8_t     rsvd531;
+    uint16_t    acwu;
+    uint16_t    rsvd535;
+    uint32_t    sgls;
+    uint8_t     rsvd703[164];
     uint8_t     rsvd2047[1344];
     NvmePSD     psd[32];
     uint8_t     vs[1024];
@@ -504,6 +538,11 @@ enum NvmeIdCtrlOacs {
     NVME_OACS_SECURITY  = 1 << 0,
     NVME_OACS_FORMAT    = 1 << 1,
     NVME_OACS_FW        = 1 << 2,
+    NVME_OACS_DBBUF     = 1 << 8,
+};
+
+enum NvmeIdCtrlSgls {
+    NVME_SGLS_SUPPORTED = 1 << 0,
 };
 
 enum NvmeIdCtrlOncs {
@@ -616,6 +655,7 @@ static inline void _nvme_check_size(void)
     QEMU_BUILD_BUG_ON(sizeof(NvmeCqe) != 16);
     QEMU_BUILD_BUG_ON(sizeof(NvmeDsmRange) != 16);
     QEMU_BUILD_BUG_ON(sizeof(NvmeCmd) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeSglDescriptor) != 16);
     QEMU_BUILD_BUG_ON(sizeof(NvmeDeleteQ) != 64);
     QEMU_BUILD_BUG_ON(sizeof(NvmeCreateCq) != 64);
     QEMU_BUILD_BUG_ON(sizeof(NvmeCreateSq) != 64);
@@ -644,6 +684,7 @@ typedef struct NvmeRequest {
     BlockAcctCookie         acct;
     QEMUSGList              qsg;
     QTAILQ_ENTRY(NvmeRequest)entry;
+    QSLIST_ENTRY(NvmeRequest)done_next;
 } NvmeRequest;
 
 typedef struct NvmeSQueue {
@@ -654,7 +695,13 @@ typedef struct NvmeSQueue {
     uint32_t    tail;
     uint32_t    size;
     uint64_t    dma_addr;
-    QEMUTimer   *timer;
+    /* shadow doorbell and event index, 0 without a doorbell buffer */
+    uint64_t    db_addr;
+    uint64_t    ei_addr;
+    AioContext  *ctx;
+    QEMUBH      *bh;
+    EventNotifier notifier;
+    bool        ioeventfd_enabled;
     NvmeRequest *io_req;
     QTAILQ_HEAD(sq_req_list, NvmeRequest) req_list;
     QTAILQ_HEAD(out_req_list, NvmeRequest) out_req_list;
@@ -671,11 +718,28 @@ typedef struct NvmeCQueue {
     uint32_t    vector;
     uint32_t    size;
     uint64_t    dma_addr;
-    QEMUTimer   *timer;
+    uint64_t    db_addr;
+    uint64_t    ei_addr;
+    /* the queue pair runs here, along with its submission queues */
+    AioContext  *ctx;
+    QEMUBH      *bh;
+    EventNotifier notifier;
+    bool        ioeventfd_enabled;
+    /* interrupts from an IOThread: through irqfd, or else a main loop BH */
+    bool        irqfd;
+    QEMUBH      *irq_bh;
     QTAILQ_HEAD(sq_list, NvmeSQueue) sq_list;
     QTAILQ_HEAD(cq_req_list, NvmeRequest) req_list;
+    /* requests completed in another AioContext */
+    QSLIST_HEAD(, NvmeRequest) done;
 } NvmeCQueue;
 
+typedef struct NvmeVector {
+    EventNotifier notifier;
+    int         virq;
+    int         users;
+} NvmeVector;
+
 typedef struct NvmeNamespace {
     NvmeIdNs        id_ns;
 } NvmeNamespace;
@@ -702,6 +766,13 @@ typedef struct NvmeCtrl {
     uint64_t    ns_size;
 
     char            *serial;
+    char            *iothreads;
+    IOThread        **iothread;
+    uint32_t        num_iothreads;
+    NvmeVector      *vectors;
+    bool            dbbuf_enabled;
+    uint64_t        dbbuf_dbs;
+    uint64_t        dbbuf_eis;
     NvmeNamespace   *namespaces;
     NvmeSQueue      **sq;
     NvmeCQueue      **cq;
@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "qemu-common.h"
 #include "qemu/iov.h"
 #include "qemu/error-report.h"
@@ -38,15 +39,29 @@ static void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
     req->in_len = 0;
     req->next = NULL;
     req->mr_next = NULL;
+    req->deferred = false;
 }
 
 static void virtio_blk_free_request(VirtIOBlockReq *req)
 {
     if (req) {
-        g_free(req);
+        if (req->deferred) {
+            /* Not ours anymore once handed over */
+            virtio_blk_data_plane_complete(req->dev->dataplane, req);
+            return;
+        }
+        virtqueue_free_element(req->vq, req);
     }
 }
 
+/* Push a request that was completed away from its virtqueue's thread */
+void virtio_blk_push_request(VirtIOBlockReq *req)
+{
+    req->deferred = false;
+    virtqueue_push(req->vq, &req->elem, req->in_len);
+    virtio_blk_free_request(req);
+}
+
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlock *s = req->dev;
@@ -55,10 +70,18 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(req->vq, &req->elem, req->in_len);
     if (s->dataplane_started && !s->dataplane_disabled) {
+        if (!virtio_blk_data_plane_owns_vq(s->dataplane, req->vq)) {
+            /* The vring belongs to another thread, which pushes the
+             * request once it is freed.
+             */
+            req->deferred = true;
+            return;
+        }
+        virtqueue_push(req->vq, &req->elem, req->in_len);
         virtio_blk_data_plane_notify(s->dataplane, req->vq);
     } else {
+        virtqueue_push(req->vq, &req->elem, req->in_len);
         virtio_notify(vdev, req->vq);
     }
 }
@@ -189,15 +212,6 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
-{
-    VirtIOBlockReq *req = virtqueue_pop(vq, sizeof(VirtIOBlockReq));
-
-    if (req) {
-        virtio_blk_init_request(s, vq, req);
-    }
-    return req;
-}
 
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
 {
@@ -583,19 +597,31 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
 void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req;
+    VirtIOBlockReq *reqs[VIRTIO_BLK_POP_BATCH];
     MultiReqBuffer mrb = {};
+    unsigned int i, n;
 
     blk_io_plug(s->blk);
 
-    while ((req = virtio_blk_get_request(s, vq))) {
-        if (virtio_blk_handle_request(req, &mrb)) {
-            virtqueue_detach_element(req->vq, &req->elem, 0);
-            virtio_blk_free_request(req);
-            break;
+    do {
+        n = virtqueue_pop_batch(vq, sizeof(VirtIOBlockReq), (void **)reqs,
+                                ARRAY_SIZE(reqs));
+        for (i = 0; i < n; i++) {
+            virtio_blk_init_request(s, vq, reqs[i]);
         }
-    }
+        for (i = 0; i < n; i++) {
+            if (virtio_blk_handle_request(reqs[i], &mrb)) {
+                /* The device is broken, drop the rest of the batch too */
+                for (; i < n; i++) {
+                    virtqueue_detach_element(vq, &reqs[i]->elem, 0);
+                    virtio_blk_free_request(reqs[i]);
+                }
+                goto out;
+            }
+        }
+    } while (n == ARRAY_SIZE(reqs));
 
+out:
     if (mrb.num_reqs) {
         virtio_blk_submit_multireq(s->blk, &mrb);
     }
@@ -831,7 +857,7 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
             qemu_put_be32(f, virtio_get_queue_index(req->vq));
         }
 
-        qemu_put_virtqueue_element(f, &req->elem);
+        qemu_put_virtqueue_element(vdev, f, &req->elem);
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -857,7 +883,7 @@ static int virtio_blk_load_device(VirtIODevice *vdev, QEMUFile *f,
             }
         }
 
-        req = qemu_get_virtqueue_element(f, sizeof(VirtIOBlockReq));
+        req = qemu_get_virtqueue_element(vdev, f, sizeof(VirtIOBlockReq));
         virtio_blk_init_request(s, virtio_get_queue(vdev, vq_idx), req);
         req->next = s->rq;
         s->rq = req;
@@ -944,10 +970,73 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
     virtio_cleanup(vdev);
 }
 
+static void virtio_blk_get_vq_iothreads(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    VirtIOBlock *s = VIRTIO_BLK(obj);
+    char *value;
+
+    if (s->dataplane) {
+        value = virtio_blk_data_plane_get_vq_iothreads(s->dataplane);
+    } else {
+        value = g_strdup(s->conf.vq_iothreads ? s->conf.vq_iothreads : "");
+    }
+    visit_type_str(v, name, &value, errp);
+    g_free(value);
+}
+
+/*
+ * Before realize this only records the initial mapping.  Afterwards the
+ * virtqueues move between the device's IOThreads right away, which lets
+ * management rebalance them with qom-set.
+ */
+static void virtio_blk_set_vq_iothreads(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    VirtIOBlock *s = VIRTIO_BLK(obj);
+    Error *local_err = NULL;
+    char *value;
+
+    visit_type_str(v, name, &value, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if (!DEVICE(obj)->realized) {
+        g_free(s->conf.vq_iothreads);
+        s->conf.vq_iothreads = value;
+        return;
+    }
+
+    if (!s->dataplane || !s->conf.iothread) {
+        error_setg(errp, "vq-iothreads requires iothread");
+    } else {
+        virtio_blk_data_plane_set_vq_iothreads(s->dataplane, value, errp);
+    }
+    g_free(value);
+}
+
+static void virtio_blk_release_vq_iothreads(Object *obj, const char *name,
+                                            void *opaque)
+{
+    VirtIOBlock *s = VIRTIO_BLK(obj);
+
+    g_free(s->conf.vq_iothreads);
+    s->conf.vq_iothreads = NULL;
+}
+
 static void virtio_blk_instance_init(Object *obj)
 {
     VirtIOBlock *s = VIRTIO_BLK(obj);
 
+    object_property_add(obj, "vq-iothreads", "str",
+                        virtio_blk_get_vq_iothreads,
+                        virtio_blk_set_vq_iothreads,
+                        virtio_blk_release_vq_iothreads, NULL, NULL);
+
     object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
                              (Object **)&s->conf.iothread,
                              qdev_prop_allow_set_link_before_realize,
@@ -979,6 +1068,8 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
     DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
+    DEFINE_PROP_STRING("iothreads", VirtIOBlock, conf.iothreads),
+    DEFINE_VIRTIO_IRQ_COALESCE_PROPERTIES(VirtIOBlock, parent_obj.irq_coalesce),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -0,0 +1,223 @@
+/*
+ * QEMU software receive coalescing for TCP/IPv4
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+#include "net_rx_coalesce.h"
+
+#define TCP_HDR_SUM_OFFSET  offsetof(tcp_header, th_sum)
+
+struct NetRxCoalesce {
+    uint8_t *buf;
+    size_t max_size;
+    size_t size;
+
+    uint16_t l4_off;
+    uint16_t hdr_len;
+    uint16_t mss;
+    uint16_t segs;
+    uint32_t next_seq;
+    bool full;
+};
+
+NetRxCoalesce *net_rx_coalesce_new(size_t max_size)
+{
+    NetRxCoalesce *c = g_new0(NetRxCoalesce, 1);
+
+    c->max_size = MIN(max_size, ETH_HLEN + 0xffff);
+    c->buf = g_malloc(c->max_size);
+    return c;
+}
+
+void net_rx_coalesce_free(NetRxCoalesce *c)
+{
+    if (c) {
+        g_free(c->buf);
+        g_free(c);
+    }
+}
+
+/*
+ * Return the TCP header offset if BUF is an unfragmented TCP/IPv4
+ * segment with payload, no flags other than ACK and PSH, and a valid
+ * checksum; 0 otherwise.  *HDR_LEN is set to the full header length.
+ */
+static size_t net_rx_coalesce_parse(const uint8_t *buf, size_t size,
+                                    size_t *hdr_len)
+{
+    const struct ip_header *ip;
+    const tcp_header *tcp;
+    size_t l4_off, l4_len;
+    uint8_t flags;
+
+    if (size < ETH_HLEN + sizeof(*ip) + sizeof(*tcp) ||
+        lduw_be_p(buf + 12) != ETH_P_IP) {
+        return 0;
+    }
+
+    ip = (const struct ip_header *)(buf + ETH_HLEN);
+    l4_off = ETH_HLEN + IP_HDR_GET_LEN(ip);
+    if (IP_HEADER_VERSION(ip) != 4 || IP_HDR_GET_LEN(ip) < sizeof(*ip) ||
+        IP4_IS_FRAGMENT(ip) || ip->ip_p != IP_PROTO_TCP ||
+        be16_to_cpu(ip->ip_len) != size - ETH_HLEN ||
+        l4_off + sizeof(*tcp) > size) {
+        return 0;
+    }
+
+    tcp = (const tcp_header *)(buf + l4_off);
+    flags = be16_to_cpu(tcp->th_offset_flags) & 0xff;
+    if ((flags & ~TH_PUSH) != TH_ACK ||
+        TCP_HEADER_DATA_OFFSET(tcp) < sizeof(*tcp) ||
+        l4_off + TCP_HEADER_DATA_OFFSET(tcp) >= size) {
+        return 0;
+    }
+
+    /* The merged frame goes out with a partial checksum: check now */
+    l4_len = size - l4_off;
+    if (net_checksum_tcpudp(l4_len, IP_PROTO_TCP, (uint8_t *)&ip->ip_src,
+                            (uint8_t *)tcp) != 0) {
+        return 0;
+    }
+
+    *hdr_len = l4_off + TCP_HEADER_DATA_OFFSET(tcp);
+    return l4_off;
+}
+
+static bool net_rx_coalesce_match(NetRxCoalesce *c, const uint8_t *buf,
+                                  size_t size, size_t l4_off, size_t hdr_len)
+{
+    const struct ip_header *pip, *ip;
+    const tcp_header *ptcp, *tcp;
+    size_t len = size - hdr_len;
+    size_t opt_off = l4_off + sizeof(*tcp);
+
+    if (l4_off != c->l4_off || hdr_len != c->hdr_len ||
+        len > c->mss || c->size + len > c->max_size) {
+        return false;
+    }
+
+    pip = (const struct ip_header *)(c->buf + ETH_HLEN);
+    ip = (const struct ip_header *)(buf + ETH_HLEN);
+    ptcp = (const tcp_header *)(c->buf + l4_off);
+    tcp = (const tcp_header *)(buf + l4_off);
+
+    /* Same addresses, same flow, nothing but the payload moves on */
+    return !memcmp(c->buf, buf, 12) &&
+           pip->ip_src == ip->ip_src && pip->ip_dst == ip->ip_dst &&
+           pip->ip_tos == ip->ip_tos && pip->ip_ttl == ip->ip_ttl &&
+           pip->ip_off == ip->ip_off &&
+           ptcp->th_sport == tcp->th_sport &&
+           ptcp->th_dport == tcp->th_dport &&
+           ptcp->th_ack == tcp->th_ack && ptcp->th_win == tcp->th_win &&
+           be32_to_cpu(tcp->th_seq) == c->next_seq &&
+           !memcmp(c->buf + opt_off, buf + opt_off, hdr_len - opt_off);
+}
+
+bool net_rx_coalesce_add(NetRxCoalesce *c, const uint8_t *buf, size_t size)
+{
+    const tcp_header *tcp;
+    size_t l4_off, hdr_len, len;
+
+    if (c->full) {
+        return false;
+    }
+
+    l4_off = net_rx_coalesce_parse(buf, size, &hdr_len);
+    if (!l4_off) {
+        return false;
+    }
+    tcp = (const tcp_header *)(buf + l4_off);
+    len = size - hdr_len;
+
+    if (c->size) {
+        if (!net_rx_coalesce_match(c, buf, size, l4_off, hdr_len)) {
+            return false;
+        }
+        memcpy(c->buf + c->size, buf + hdr_len, len);
+        c->size += len;
+        c->segs++;
+    } else {
+        if (size > c->max_size) {
+            return false;
+        }
+        memcpy(c->buf, buf, size);
+        c->size = size;
+        c->l4_off = l4_off;
+        c->hdr_len = hdr_len;
+        c->mss = len;
+        c->segs = 1;
+    }
+
+    c->next_seq = be32_to_cpu(tcp->th_seq) + len;
+    if (len < c->mss || c->size + c->mss > c->max_size ||
+        (TCP_HEADER_FLAGS(tcp) & TH_PUSH)) {
+        c->full = true;
+    }
+    if (TCP_HEADER_FLAGS(tcp) & TH_PUSH) {
+        /* Carry PSH over to the merged header */
+        ((tcp_header *)(c->buf + l4_off))->th_offset_flags =
+            tcp->th_offset_flags;
+    }
+    return true;
+}
+
+void net_rx_coalesce_reset(NetRxCoalesce *c)
+{
+    c->size = 0;
+    c->full = false;
+}
+
+size_t net_rx_coalesce_pending_size(NetRxCoalesce *c)
+{
+    return c->size;
+}
+
+bool net_rx_coalesce_full(NetRxCoalesce *c)
+{
+    return c->full;
+}
+
+bool net_rx_coalesce_complete(NetRxCoalesce *c, NetRxCoalesceFrame *frame)
+{
+    struct ip_header *ip;
+    tcp_header *tcp;
+    uint32_t sum;
+    uint16_t l4_len;
+
+    if (!c->size) {
+        return false;
+    }
+
+    frame->data = c->buf;
+    frame->size = c->size;
+    frame->hdr_len = c->hdr_len;
+    frame->csum_start = c->l4_off;
+    frame->csum_offset = TCP_HDR_SUM_OFFSET;
+    frame->mss = c->mss;
+    frame->segs = c->segs;
+
+    if (c->segs > 1) {
+        ip = (struct ip_header *)(c->buf + ETH_HLEN);
+        tcp = (tcp_header *)(c->buf + c->l4_off);
+
+        ip->ip_len = cpu_to_be16(c->size - ETH_HLEN);
+        ip->ip_sum = 0;
+        ip->ip_sum = cpu_to_be16(net_raw_checksum((uint8_t *)ip,
+                                                  IP_HDR_GET_LEN(ip)));
+
+        l4_len = c->size - c->l4_off;
+        sum = net_checksum_add(8, (uint8_t *)&ip->ip_src);
+        sum += IP_PROTO_TCP + l4_len;
+        tcp->th_sum = cpu_to_be16((uint16_t)~net_checksum_finish(sum));
+    }
+
+    c->size = 0;
+    c->full = false;
+    return true;
+}
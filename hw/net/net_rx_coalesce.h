@@ -0,0 +1,107 @@
+/*
+ * QEMU software receive coalescing for TCP/IPv4
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef NET_RX_COALESCE_H
+#define NET_RX_COALESCE_H
+
+#include "net/eth.h"
+
+/*
+ * A coalescing context holds at most one frame under construction.
+ * In-order segments of the same TCP flow are appended to it; whatever
+ * cannot be appended must be delivered by the caller after the pending
+ * frame has been completed, so that packet order is preserved.
+ */
+
+typedef struct NetRxCoalesce NetRxCoalesce;
+
+typedef struct NetRxCoalesceFrame {
+    const uint8_t *data;
+    size_t size;
+    uint16_t hdr_len;           /* L2 + L3 + L4 header length */
+    uint16_t csum_start;        /* offset of the TCP header */
+    uint16_t csum_offset;       /* offset of th_sum in the TCP header */
+    uint16_t mss;               /* payload size of the merged segments */
+    uint16_t segs;              /* number of segments merged */
+} NetRxCoalesceFrame;
+
+/**
+ * Allocate a coalescing context
+ *
+ * @max_size:       largest frame that may be built, at most 64KiB
+ *
+ */
+NetRxCoalesce *net_rx_coalesce_new(size_t max_size);
+
+/**
+ * Free a coalescing context, dropping any pending frame
+ *
+ * @c:              context
+ *
+ */
+void net_rx_coalesce_free(NetRxCoalesce *c);
+
+/**
+ * Offer a received frame to the context
+ *
+ * @c:              context
+ * @buf:            frame starting at the Ethernet header
+ * @size:           frame length
+ *
+ * Return:  true if the frame was appended to the pending frame, or
+ *          started a new one if none was pending.  On false the
+ *          pending frame is left alone; to preserve packet order the
+ *          caller must complete and deliver it before delivering @buf.
+ *
+ */
+bool net_rx_coalesce_add(NetRxCoalesce *c, const uint8_t *buf, size_t size);
+
+/**
+ * Drop the pending frame, if any
+ *
+ * @c:              context
+ *
+ */
+void net_rx_coalesce_reset(NetRxCoalesce *c);
+
+/**
+ * Size of the frame under construction
+ *
+ * @c:              context
+ *
+ * Return:  0 if no frame is pending
+ *
+ */
+size_t net_rx_coalesce_pending_size(NetRxCoalesce *c);
+
+/**
+ * Whether the pending frame cannot grow anymore (PSH seen, short
+ * segment or size limit reached) and should be delivered right away
+ *
+ * @c:              context
+ *
+ */
+bool net_rx_coalesce_full(NetRxCoalesce *c);
+
+/**
+ * Complete the pending frame
+ *
+ * Fixes up the IP total length and header checksum, and replaces the
+ * TCP checksum with the pseudo-header sum so that the frame can be
+ * handed over with a "checksum needed" offload indication.  The frame
+ * stays valid until the next call on the context.
+ *
+ * @c:              context
+ * @frame:          filled with the completed frame
+ *
+ * Return:  false if no frame was pending
+ *
+ */
+bool net_rx_coalesce_complete(NetRxCoalesce *c, NetRxCoalesceFrame *frame);
+
+#endif
@@ -30,6 +30,16 @@ enum {
     NET_TX_PKT_PL_START_FRAG
 };
 
+/* Layout of the segments built by software TCP segmentation */
+enum {
+    NET_TX_PKT_SEGMENT_L2_HDR_POS = 0,
+    NET_TX_PKT_SEGMENT_L3_HDR_POS,
+    NET_TX_PKT_SEGMENT_L4_HDR_POS,
+    NET_TX_PKT_SEGMENT_HEADER_NUM
+};
+
+#define NET_TX_PKT_MAX_TCP_HDR_LEN (60)
+
 /* TX packet private context */
 struct NetTxPkt {
     PCIDevice *pci_dev;
@@ -42,6 +52,7 @@ struct NetTxPkt {
     uint32_t max_raw_frags;
 
     struct iovec *vec;
+    struct iovec *seg_vec;
 
     uint8_t l2_hdr[ETH_MAX_L2_HDR_LEN];
     uint8_t l3_hdr[ETH_MAX_IP_DGRAM_LEN];
@@ -69,6 +80,8 @@ void net_tx_pkt_init(struct NetTxPkt **pkt, PCIDevice *pci_dev,
 
     p->raw = g_new(struct iovec, max_frags);
 
+    p->seg_vec = g_new(struct iovec, max_frags + NET_TX_PKT_SEGMENT_HEADER_NUM);
+
     p->max_payload_frags = max_frags;
     p->max_raw_frags = max_frags;
     p->has_virt_hdr = has_virt_hdr;
@@ -85,6 +98,7 @@ void net_tx_pkt_uninit(struct NetTxPkt *pkt)
 {
     if (pkt) {
         g_free(pkt->vec);
+        g_free(pkt->seg_vec);
         g_free(pkt->raw);
         g_free(pkt);
     }
@@ -597,12 +611,107 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
     return true;
 }
 
+/*
+ * Split a TCP GSO frame into MSS sized segments.  Only the headers are
+ * rebuilt for each segment; the payload is referenced in place from the
+ * original iovec and checksummed there, so nothing is copied.
+ */
+static bool net_tx_pkt_do_sw_segmentation(struct NetTxPkt *pkt,
+    NetClientState *nc)
+{
+    struct iovec *seg = pkt->seg_vec;
+    struct iovec *payload = &pkt->vec[NET_TX_PKT_PL_START_FRAG];
+    struct iovec *l3 = &pkt->vec[NET_TX_PKT_L3HDR_FRAG];
+    uint8_t l4_hdr[NET_TX_PKT_MAX_TCP_HDR_LEN] QEMU_ALIGNED(4);
+    tcp_header *tcp = (tcp_header *)l4_hdr;
+    bool is_ip6 = (pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) ==
+                  VIRTIO_NET_HDR_GSO_TCPV6;
+    size_t l4_len = pkt->virt_hdr.hdr_len - pkt->hdr_len;
+    size_t mss = pkt->virt_hdr.gso_size;
+    size_t data_len, offset;
+    uint16_t ip_id, flags;
+    uint32_t seq;
+
+    if (l4_len < sizeof(tcp_header) || l4_len > sizeof(l4_hdr) ||
+        l4_len > pkt->payload_len ||
+        iov_to_buf(payload, pkt->payload_frags, 0, l4_hdr, l4_len) != l4_len) {
+        return false;
+    }
+
+    data_len = pkt->payload_len - l4_len;
+    seq = be32_to_cpu(tcp->th_seq);
+    flags = be16_to_cpu(tcp->th_offset_flags);
+    ip_id = is_ip6 ? 0 : be16_to_cpu(((struct ip_header *)l3->iov_base)->ip_id);
+
+    seg[NET_TX_PKT_SEGMENT_L2_HDR_POS] = pkt->vec[NET_TX_PKT_L2HDR_FRAG];
+    seg[NET_TX_PKT_SEGMENT_L3_HDR_POS] = *l3;
+    seg[NET_TX_PKT_SEGMENT_L4_HDR_POS].iov_base = l4_hdr;
+    seg[NET_TX_PKT_SEGMENT_L4_HDR_POS].iov_len = l4_len;
+
+    offset = 0;
+    do {
+        size_t len = MIN(mss, data_len - offset);
+        bool last = offset + len == data_len;
+        unsigned int cnt;
+        uint32_t csum_cntr, cso;
+
+        cnt = iov_copy(&seg[NET_TX_PKT_SEGMENT_HEADER_NUM],
+                       pkt->max_payload_frags, payload, pkt->payload_frags,
+                       l4_len + offset, len);
+
+        /* FIN and PSH only belong to the last segment */
+        tcp->th_seq = cpu_to_be32(seq + offset);
+        tcp->th_offset_flags = cpu_to_be16(last ? flags :
+                                           flags & ~(TH_FIN | TH_PUSH));
+        tcp->th_sum = 0;
+
+        if (is_ip6) {
+            struct ip6_header *ip6 = l3->iov_base;
+
+            ip6->ip6_ctlun.ip6_un1.ip6_un1_plen =
+                cpu_to_be16(l3->iov_len - sizeof(*ip6) + l4_len + len);
+            csum_cntr = eth_calc_ip6_pseudo_hdr_csum(ip6, l4_len + len,
+                                                     IP_PROTO_TCP, &cso);
+        } else {
+            struct ip_header *ip = l3->iov_base;
+
+            ip->ip_id = cpu_to_be16(ip_id++);
+            ip->ip_len = cpu_to_be16(l3->iov_len + l4_len + len);
+            eth_fix_ip4_checksum(ip, l3->iov_len);
+            csum_cntr = eth_calc_ip4_pseudo_hdr_csum(ip, l4_len + len, &cso);
+        }
+
+        /* The TCP header is a multiple of 4 bytes: no odd offset to carry */
+        csum_cntr += net_checksum_add(l4_len, l4_hdr);
+        csum_cntr += net_checksum_add_iov(&seg[NET_TX_PKT_SEGMENT_HEADER_NUM],
+                                          cnt, 0, len, 0);
+        tcp->th_sum = cpu_to_be16(net_checksum_finish(csum_cntr));
+
+        net_tx_pkt_sendv(pkt, nc, seg, NET_TX_PKT_SEGMENT_HEADER_NUM + cnt);
+
+        offset += len;
+    } while (offset < data_len);
+
+    return true;
+}
+
 bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
 {
+    uint8_t gso_type;
+
     assert(pkt);
 
+    gso_type = pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+
+    /*
+     * TCP segments get their own checksums while being segmented,
+     * summing the whole frame first would be wasted work.
+     */
     if (!pkt->has_virt_hdr &&
-        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM &&
+        !(pkt->virt_hdr.gso_size &&
+          (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 ||
+           gso_type == VIRTIO_NET_HDR_GSO_TCPV6))) {
         net_tx_pkt_do_sw_csum(pkt);
     }
 
@@ -625,6 +734,12 @@ bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
         return true;
     }
 
+    if (pkt->virt_hdr.gso_size &&
+        (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 ||
+         gso_type == VIRTIO_NET_HDR_GSO_TCPV6)) {
+        return net_tx_pkt_do_sw_segmentation(pkt, nc);
+    }
+
     return net_tx_pkt_do_sw_fragmentation(pkt, nc);
 }
 
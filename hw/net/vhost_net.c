@@ -21,6 +21,7 @@
 #include "hw/virtio/virtio-net.h"
 #include "net/vhost_net.h"
 #include "qemu/error-report.h"
+#include "monitor/monitor.h"
 
 
 #ifdef CONFIG_VHOST_NET
@@ -51,6 +52,7 @@ static const int kernel_feature_bits[] = {
     VIRTIO_RING_F_EVENT_IDX,
     VIRTIO_NET_F_MRG_RXBUF,
     VIRTIO_F_VERSION_1,
+    VIRTIO_F_RING_PACKED,
     VHOST_INVALID_FEATURE_BIT
 };
 
@@ -105,6 +107,13 @@ static const int *vhost_net_get_feature_bits(struct vhost_net *net)
 
 uint64_t vhost_net_get_features(struct vhost_net *net, uint64_t features)
 {
+    /*
+     * Where a packed ring stands cannot be recovered after a vhost-user
+     * backend disconnects, see virtio_queue_restore_last_avail_idx.
+     */
+    if (net->nc->info->type == NET_CLIENT_DRIVER_VHOST_USER) {
+        virtio_clear_feature(&features, VIRTIO_F_RING_PACKED);
+    }
     return vhost_get_features(&net->dev, vhost_net_get_feature_bits(net),
             features);
 }
@@ -152,6 +161,7 @@ struct vhost_net *vhost_net_init(VhostNetOptions *options)
     net->dev.max_queues = 1;
     net->dev.nvqs = 2;
     net->dev.vqs = net->vqs;
+    net->dev.find_worker = options->worker_cpu >= 0;
 
     if (backend_kernel) {
         r = vhost_net_get_fd(options->net_backend);
@@ -176,6 +186,15 @@ struct vhost_net *vhost_net_init(VhostNetOptions *options)
     if (r < 0) {
         goto fail;
     }
+    net->dev.inflight = options->inflight;
+    if (options->worker_cpu >= 0) {
+        /* Best effort: the worker may be hidden from us, e.g. by hidepid */
+        r = vhost_dev_set_worker_affinity(&net->dev, options->worker_cpu);
+        if (r < 0) {
+            error_report("warning: vhost-net: cannot move the worker to "
+                         "CPU %d: %s", options->worker_cpu, strerror(-r));
+        }
+    }
     if (backend_kernel) {
         if (!qemu_has_vnet_hdr_len(options->net_backend,
                                sizeof(struct virtio_net_hdr_mrg_rxbuf))) {
@@ -435,6 +454,41 @@ int vhost_set_vring_enable(NetClientState *nc, int enable)
     return 0;
 }
 
+uint32_t vhost_net_get_busyloop_timeout(VHostNetState *net)
+{
+    return net->dev.busyloop_timeout;
+}
+
+int vhost_net_set_busyloop_timeout(VHostNetState *net, uint32_t timeout)
+{
+    return vhost_dev_set_busyloop_timeout(&net->dev, timeout);
+}
+
+void vhost_net_print_info(Monitor *mon, VHostNetState *net)
+{
+    VhostWorkerStats stats;
+    uint16_t avail_idx, used_idx;
+    int i;
+
+    if (vhost_dev_get_worker_stats(&net->dev, &stats) == 0) {
+        monitor_printf(mon, "vhost worker: tid=%d,cpu=%d,utime=%" PRIu64
+                       "ms,stime=%" PRIu64 "ms\n", (int)stats.tid, stats.cpu,
+                       stats.utime_ms, stats.stime_ms);
+    }
+    monitor_printf(mon, "vhost busy-poll: %" PRIu32 "us\n",
+                   net->dev.busyloop_timeout);
+
+    for (i = 0; i < net->dev.nvqs; i++) {
+        if (vhost_virtqueue_get_indices(&net->dev, net->dev.vq_index + i,
+                                        &avail_idx, &used_idx) < 0) {
+            break;
+        }
+        monitor_printf(mon, "vhost %s ring: avail=%u,used=%u,pending=%u\n",
+                       i == 0 ? "rx" : "tx", avail_idx, used_idx,
+                       (uint16_t)(avail_idx - used_idx));
+    }
+}
+
 #else
 uint64_t vhost_net_get_max_queues(VHostNetState *net)
 {
@@ -501,4 +555,18 @@ int vhost_set_vring_enable(NetClientState *nc, int enable)
 {
     return 0;
 }
+
+uint32_t vhost_net_get_busyloop_timeout(VHostNetState *net)
+{
+    return 0;
+}
+
+int vhost_net_set_busyloop_timeout(VHostNetState *net, uint32_t timeout)
+{
+    return -ENOSYS;
+}
+
+void vhost_net_print_info(Monitor *mon, VHostNetState *net)
+{
+}
 #endif
@@ -19,12 +19,15 @@
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
+#include "block/aio.h"
 #include "hw/virtio/virtio-net.h"
 #include "net/vhost_net.h"
 #include "hw/virtio/virtio-bus.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/visitor.h"
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
+#include "net_rx_coalesce.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -36,6 +39,9 @@
 /* for now, only allow larger queues; with virtio-1, guest can downsize */
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 
+/* TX elements taken off the queue per virtqueue_pop_batch() call */
+#define VIRTIO_NET_TX_POP_BATCH 32
+
 /*
  * Calculate the number of bytes up to and including the given 'field' of
  * 'container'.
@@ -107,6 +113,21 @@ static bool virtio_net_started(VirtIONet *n, uint8_t status)
         (n->status & VIRTIO_NET_S_LINK_UP) && vdev->vm_running;
 }
 
+/* Interrupt the guest about a used rx/tx buffer.  From the iothread this
+ * has to go through the guest notifier instead of the irq code.
+ */
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    if (n->dataplane_started) {
+        virtio_notify_irqfd(VIRTIO_DEVICE(n), vq);
+    } else {
+        virtio_notify(VIRTIO_DEVICE(n), vq);
+    }
+}
+
+static void virtio_net_dataplane_start(VirtIONet *n);
+static void virtio_net_dataplane_stop(VirtIONet *n);
+
 static void virtio_net_announce_timer(void *opaque)
 {
     VirtIONet *n = opaque;
@@ -224,10 +245,22 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     VirtIONetQueue *q;
     int i;
     uint8_t queue_status;
+    AioContext *ctx = NULL;
 
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
+    /* Once started, the queues belong to the iothread.  Start it before
+     * and stop it after touching them below, with the AioContext held.
+     */
+    if (n->ctx && virtio_net_started(n, status)) {
+        virtio_net_dataplane_start(n);
+    }
+    if (n->dataplane_started) {
+        ctx = n->ctx;
+        aio_context_acquire(ctx);
+    }
+
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
         bool queue_started;
@@ -264,6 +297,13 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+
+    if (ctx) {
+        aio_context_release(ctx);
+        if (!virtio_net_started(n, status)) {
+            virtio_net_dataplane_stop(n);
+        }
+    }
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -388,6 +428,18 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        /* The rings are reset, so drop what has not reached the guest */
+        q->rx_batch = 0;
+        q->rx_pending = 0;
+        if (q->rsc) {
+            net_rx_coalesce_reset(q->rsc);
+        }
+    }
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -542,8 +594,11 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
 
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
+        /* Coalesced TCP/IPv4 frames are built by virtio-net itself */
+        if (!n->net_conf.rx_coalesce) {
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
+        }
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
     }
@@ -574,6 +629,8 @@ static uint64_t virtio_net_bad_features(VirtIODevice *vdev)
     return features;
 }
 
+static void virtio_net_rsc_flush_all(VirtIONet *n);
+
 static void virtio_net_apply_guest_offloads(VirtIONet *n)
 {
     qemu_set_offload(qemu_get_queue(n->nic)->peer,
@@ -620,6 +677,10 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
         n->curr_guest_offloads =
             virtio_net_guest_offloads_by_features(features);
         virtio_net_apply_guest_offloads(n);
+    } else if (n->net_conf.rx_coalesce) {
+        virtio_net_rsc_flush_all(n);
+        n->curr_guest_offloads =
+            virtio_net_guest_offloads_by_features(features);
     }
 
     for (i = 0;  i < n->max_queues; i++) {
@@ -690,7 +751,7 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
     if (cmd == VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET) {
         uint64_t supported_offloads;
 
-        if (!n->has_vnet_hdr) {
+        if (!n->has_vnet_hdr && !n->net_conf.rx_coalesce) {
             return VIRTIO_NET_ERR;
         }
 
@@ -699,8 +760,12 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
             return VIRTIO_NET_ERR;
         }
 
+        /* Frames being coalesced were built for the old offloads */
+        virtio_net_rsc_flush_all(n);
         n->curr_guest_offloads = offloads;
-        virtio_net_apply_guest_offloads(n);
+        if (n->has_vnet_hdr) {
+            virtio_net_apply_guest_offloads(n);
+        }
 
         return VIRTIO_NET_OK;
     } else {
@@ -894,7 +959,12 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     size_t s;
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
+    AioContext *ctx = n->dataplane_started ? n->ctx : NULL;
 
+    /* The rx filter state is consulted by the iothread.  */
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
     for (;;) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
@@ -936,6 +1006,9 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         g_free(iov2);
         g_free(elem);
     }
+    if (ctx) {
+        aio_context_release(ctx);
+    }
 }
 
 /* RX */
@@ -1029,9 +1102,13 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
 }
 
 static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
-                           const void *buf, size_t size)
+                           const void *buf, size_t size,
+                           struct virtio_net_hdr *rsc_hdr)
 {
-    if (n->has_vnet_hdr) {
+    if (rsc_hdr) {
+        virtio_net_hdr_swap(VIRTIO_DEVICE(n), rsc_hdr);
+        iov_from_buf(iov, iov_cnt, 0, rsc_hdr, sizeof(*rsc_hdr));
+    } else if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
         void *wbuf = (void *)buf;
         work_around_broken_dhclient(wbuf, wbuf + n->host_hdr_len,
@@ -1101,7 +1178,91 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+static void virtio_net_rx_flush(VirtIONetQueue *q)
+{
+    if (q->rx_pending) {
+        virtqueue_flush(q->rx_vq, q->rx_pending);
+        virtio_net_notify(q->n, q->rx_vq);
+        q->rx_pending = 0;
+    }
+}
+
+static bool virtio_net_rx_coalescing(VirtIONet *n)
+{
+    static const uint64_t needed = (1ULL << VIRTIO_NET_F_GUEST_CSUM) |
+                                   (1ULL << VIRTIO_NET_F_GUEST_TSO4);
+
+    return (n->curr_guest_offloads & needed) == needed;
+}
+
+static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
+                                     size_t size,
+                                     struct virtio_net_hdr *rsc_hdr);
+
+/* Hand the frame being coalesced, if any, to the guest */
+static void virtio_net_rsc_flush(NetClientState *nc, VirtIONetQueue *q)
+{
+    struct virtio_net_hdr hdr;
+    NetRxCoalesceFrame frame;
+
+    if (!net_rx_coalesce_complete(q->rsc, &frame)) {
+        return;
+    }
+    if (frame.segs == 1) {
+        virtio_net_do_receive(nc, frame.data, frame.size, NULL);
+        return;
+    }
+    /* Offload changes flush the queues first, see virtio_net_rsc_flush_all */
+    assert(virtio_net_rx_coalescing(q->n));
+
+    hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    hdr.hdr_len = frame.hdr_len;
+    hdr.gso_size = frame.mss;
+    hdr.csum_start = frame.csum_start;
+    hdr.csum_offset = frame.csum_offset;
+    virtio_net_do_receive(nc, frame.data, frame.size, &hdr);
+}
+
+/*
+ * Deliver the frames being coalesced on every queue.  Must be called
+ * before the guest offloads change, since the frames use them.
+ */
+static void virtio_net_rsc_flush_all(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->rsc) {
+            virtio_net_rsc_flush(qemu_get_subqueue(n->nic, i), q);
+            virtio_net_rx_flush(q);
+        }
+    }
+}
+
+static void virtio_net_receive_batch(NetClientState *nc, bool start)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (start) {
+        q->rx_batch++;
+    } else {
+        assert(q->rx_batch > 0);
+        if (--q->rx_batch == 0) {
+            if (q->rsc) {
+                virtio_net_rsc_flush(nc, q);
+            }
+            virtio_net_rx_flush(q);
+        }
+    }
+}
+
+/* RSC_HDR, if not NULL, is the header of a frame built by virtio-net */
+static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
+                                     size_t size,
+                                     struct virtio_net_hdr *rsc_hdr)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1175,7 +1336,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem->in_num, buf, size);
+            receive_header(n, sg, elem->in_num, buf, size, rsc_hdr);
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1212,12 +1373,14 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
 
     for (j = 0; j < i; j++) {
         /* signal other side */
-        virtqueue_fill(q->rx_vq, elems[j], lens[j], j);
+        virtqueue_fill(q->rx_vq, elems[j], lens[j], q->rx_pending + j);
         g_free(elems[j]);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    q->rx_pending += i;
+    if (!q->rx_batch) {
+        virtio_net_rx_flush(q);
+    }
 
     return size;
 
@@ -1230,18 +1393,64 @@ err:
     return err;
 }
 
+/*
+ * Within a batch, in-order segments of one TCP flow are merged into a
+ * single TSO frame before they reach the guest.  The guest buffers for
+ * the frame being built are checked for as it grows, so that flushing
+ * it at the end of the batch cannot fail for lack of space.
+ */
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    size_t pending;
+
+    if (!q->rsc || !q->rx_batch || !virtio_net_rx_coalescing(n)) {
+        if (q->rsc) {
+            virtio_net_rsc_flush(nc, q);
+        }
+        return virtio_net_do_receive(nc, buf, size, NULL);
+    }
+
+    if (!virtio_net_can_receive(nc)) {
+        return -1;
+    }
+
+    pending = net_rx_coalesce_pending_size(q->rsc);
+    if (!virtio_net_has_buffers(q, pending + size + n->guest_hdr_len)) {
+        virtio_net_rsc_flush(nc, q);
+        return virtio_net_do_receive(nc, buf, size, NULL);
+    }
+
+    if (!receive_filter(n, buf, size)) {
+        return size;
+    }
+
+    if (!net_rx_coalesce_add(q->rsc, buf, size)) {
+        virtio_net_rsc_flush(nc, q);
+        if (!net_rx_coalesce_add(q->rsc, buf, size)) {
+            return virtio_net_do_receive(nc, buf, size, NULL);
+        }
+    }
+    if (net_rx_coalesce_full(q->rsc)) {
+        virtio_net_rsc_flush(nc, q);
+    }
+
+    return size;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_free_element(q->tx_vq, q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
@@ -1249,11 +1458,23 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+
+/* Give back the popped elements that were not processed, last one first */
+static void virtio_net_tx_unpop(VirtIONetQueue *q, VirtQueueElement **elems,
+                                unsigned int num)
+{
+    while (num--) {
+        virtqueue_unpop(q->tx_vq, elems[num], 0);
+        virtqueue_free_element(q->tx_vq, elems[num]);
+    }
+}
+
+static int32_t virtio_net_do_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
+    VirtQueueElement *elem, *elems[VIRTIO_NET_TX_POP_BATCH];
+    unsigned int next = 0, num = 0;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -1271,17 +1492,26 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
         struct virtio_net_hdr_mrg_rxbuf mhdr;
 
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
-            break;
+        if (next == num) {
+            /* Never pop more than the rest of the burst */
+            num = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                      (void **)elems,
+                                      MIN(ARRAY_SIZE(elems),
+                                          n->tx_burst - num_packets));
+            next = 0;
+            if (!num) {
+                break;
+            }
         }
+        elem = elems[next++];
 
         out_num = elem->out_num;
         out_sg = elem->out_sg;
         if (out_num < 1) {
             virtio_error(vdev, "virtio-net header not in first element");
             virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_free_element(q->tx_vq, elem);
+            virtio_net_tx_unpop(q, elems + next, num - next);
             return -EINVAL;
         }
 
@@ -1290,7 +1520,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
                 n->guest_hdr_len) {
                 virtio_error(vdev, "virtio-net header incorrect");
                 virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
+                virtqueue_free_element(q->tx_vq, elem);
+                virtio_net_tx_unpop(q, elems + next, num - next);
                 return -EINVAL;
             }
             if (n->needs_vnet_hdr_swap) {
@@ -1329,13 +1560,14 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
+            virtio_net_tx_unpop(q, elems + next, num - next);
             return -EBUSY;
         }
 
 drop:
         virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+        virtio_net_notify(n, q->tx_vq);
+        virtqueue_free_element(q->tx_vq, elem);
 
         if (++num_packets >= n->tx_burst) {
             break;
@@ -1344,6 +1576,21 @@ drop:
     return num_packets;
 }
 
+/* Let the backend push out the whole burst at once */
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+{
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = qemu_get_subqueue(q->n->nic, queue_index);
+    bool batch;
+    int32_t ret;
+
+    batch = qemu_send_batch_begin(nc);
+    ret = virtio_net_do_flush_tx(q);
+    qemu_send_batch_end(nc, batch);
+
+    return ret;
+}
+
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -1481,6 +1728,139 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
     n->vqs[index].n = n;
 }
 
+/* The tx timer or bottom half must run in the AioContext that owns the
+ * queue, the main loop's while the dataplane is stopped.  Re-create it in
+ * CTX, or in the main loop if CTX is NULL, carrying over pending work.
+ * Called with the queue's current AioContext held.
+ */
+static void virtio_net_tx_set_aio_context(VirtIONetQueue *q, AioContext *ctx)
+{
+    if (q->tx_timer) {
+        bool pending = timer_pending(q->tx_timer);
+        int64_t expire = timer_expire_time_ns(q->tx_timer);
+
+        timer_del(q->tx_timer);
+        timer_free(q->tx_timer);
+        if (ctx) {
+            q->tx_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                        virtio_net_tx_timer, q);
+        } else {
+            q->tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                       virtio_net_tx_timer, q);
+        }
+        if (pending) {
+            timer_mod(q->tx_timer, expire);
+        }
+    } else {
+        qemu_bh_delete(q->tx_bh);
+        if (ctx) {
+            q->tx_bh = aio_bh_new(ctx, virtio_net_tx_bh, q);
+        } else {
+            q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        }
+        if (q->tx_waiting) {
+            qemu_bh_schedule(q->tx_bh);
+        }
+    }
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i, r;
+
+    if (n->dataplane_started) {
+        return;
+    }
+
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r < 0) {
+        virtio_error(vdev, "virtio-net failed to set guest notifier (%d)", r);
+        return;
+    }
+
+    r = virtio_device_grab_ioeventfd(vdev);
+    if (r < 0) {
+        virtio_error(vdev, "virtio-net failed to grab host notifiers (%d)", r);
+        goto fail_guest_notifiers;
+    }
+    for (i = 0; i < nvqs; i++) {
+        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, true);
+        if (r < 0) {
+            virtio_error(vdev, "virtio-net failed to set host notifier (%d)",
+                         r);
+            while (i--) {
+                virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+            }
+            virtio_device_release_ioeventfd(vdev);
+            goto fail_guest_notifiers;
+        }
+    }
+
+    aio_context_acquire(n->ctx);
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        qemu_net_set_aio_context(qemu_get_subqueue(n->nic, i), n->ctx);
+        virtio_net_tx_set_aio_context(q, n->ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, n->ctx,
+                                                   virtio_net_handle_rx);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, n->ctx,
+                q->tx_timer ? virtio_net_handle_tx_timer
+                            : virtio_net_handle_tx_bh);
+    }
+    n->dataplane_started = true;
+    aio_context_release(n->ctx);
+
+    /* Kick right away to process buffers already in the vrings */
+    for (i = 0; i < nvqs; i++) {
+        event_notifier_set(virtio_queue_get_host_notifier(
+                               virtio_get_queue(vdev, i)));
+    }
+    return;
+
+fail_guest_notifiers:
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i;
+
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    aio_context_acquire(n->ctx);
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, n->ctx, NULL);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, n->ctx, NULL);
+        virtio_net_tx_set_aio_context(q, NULL);
+        qemu_net_set_aio_context(qemu_get_subqueue(n->nic, i), NULL);
+    }
+    n->dataplane_started = false;
+    aio_context_release(n->ctx);
+
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+    }
+    virtio_device_release_ioeventfd(vdev);
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+}
+
 static void virtio_net_del_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -1695,6 +2075,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1777,6 +2158,39 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+
+    if (n->net_conf.iothread) {
+        BusState *qbus = qdev_get_parent_bus(dev);
+        VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+        if (!k->set_guest_notifiers || !k->ioeventfd_assign ||
+            !virtio_device_ioeventfd_enabled(vdev)) {
+            error_setg(errp, "device is incompatible with iothread "
+                       "(transport does not support notifiers)");
+            virtio_cleanup(vdev);
+            return;
+        }
+        for (i = 0; i < n->nic_conf.peers.queues; i++) {
+            NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+            if (!peer) {
+                continue;
+            }
+            if (!peer->info->aio_context_changed) {
+                error_setg(errp, "netdev '%s' does not support iothread",
+                           peer->name);
+                virtio_cleanup(vdev);
+                return;
+            }
+            if (get_vhost_net(peer)) {
+                error_setg(errp, "iothread cannot be used with vhost");
+                virtio_cleanup(vdev);
+                return;
+            }
+        }
+        n->ctx = iothread_get_aio_context(n->net_conf.iothread);
+    }
+
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->curr_queues = 1;
     n->tx_timeout = n->net_conf.txtimer;
@@ -1819,6 +2233,13 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         n->host_hdr_len = sizeof(struct virtio_net_hdr);
     } else {
         n->host_hdr_len = 0;
+        if (n->net_conf.rx_coalesce) {
+            size_t max = VIRTIO_NET_MAX_BUFSIZE - sizeof(struct virtio_net_hdr);
+
+            for (i = 0; i < n->max_queues; i++) {
+                n->vqs[i].rsc = net_rx_coalesce_new(max);
+            }
+        }
     }
 
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->nic_conf.macaddr.a);
@@ -1860,6 +2281,10 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
         virtio_net_del_queue(n, i);
     }
 
+    for (i = 0; i < n->max_queues; i++) {
+        net_rx_coalesce_free(n->vqs[i].rsc);
+    }
+
     timer_del(n->announce_timer);
     timer_free(n->announce_timer);
     g_free(n->vqs);
@@ -1867,6 +2292,59 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     virtio_cleanup(vdev);
 }
 
+/*
+ * Busy-poll timeout of the vhost backend.  It starts out as the poll-us
+ * of the netdev and can be changed at runtime for all queues at once.
+ */
+static void virtio_net_get_vhost_poll_us(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    VirtIONet *n = VIRTIO_NET(obj);
+    VHostNetState *net = NULL;
+    uint32_t value = 0;
+
+    if (n->nic) {
+        net = get_vhost_net(qemu_get_queue(n->nic)->peer);
+    }
+    if (net) {
+        value = vhost_net_get_busyloop_timeout(net);
+    }
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void virtio_net_set_vhost_poll_us(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    VirtIONet *n = VIRTIO_NET(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+    int i, r;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if (!n->nic || !get_vhost_net(qemu_get_queue(n->nic)->peer)) {
+        error_setg(errp, "vhost-poll-us requires a vhost backend");
+        return;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        VHostNetState *net = get_vhost_net(qemu_get_subqueue(n->nic, i)->peer);
+
+        r = net ? vhost_net_set_busyloop_timeout(net, value) : 0;
+        if (r < 0) {
+            error_setg_errno(errp, -r, "cannot set vhost busy-poll timeout "
+                             "of queue %d", i);
+            return;
+        }
+    }
+}
+
 static void virtio_net_instance_init(Object *obj)
 {
     VirtIONet *n = VIRTIO_NET(obj);
@@ -1879,6 +2357,13 @@ static void virtio_net_instance_init(Object *obj)
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->net_conf.iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
+    object_property_add(obj, "vhost-poll-us", "uint32",
+                        virtio_net_get_vhost_poll_us,
+                        virtio_net_set_vhost_poll_us, NULL, NULL, NULL);
 }
 
 static void virtio_net_pre_save(void *opaque)
@@ -1946,8 +2431,10 @@ static Property virtio_net_properties[] = {
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_BOOL("rx-coalesce", VirtIONet, net_conf.rx_coalesce, false),
     DEFINE_PROP_UINT16("rx_queue_size", VirtIONet, net_conf.rx_queue_size,
                        VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE),
+    DEFINE_VIRTIO_IRQ_COALESCE_PROPERTIES(VirtIONet, parent_obj.irq_coalesce),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -735,6 +735,10 @@ static void virtio_ccw_net_instance_init(Object *obj)
                                 TYPE_VIRTIO_NET);
     object_property_add_alias(obj, "bootindex", OBJECT(&dev->vdev),
                               "bootindex", &error_abort);
+    object_property_add_alias(obj, "iothread", OBJECT(&dev->vdev), "iothread",
+                              &error_abort);
+    object_property_add_alias(obj, "vhost-poll-us", OBJECT(&dev->vdev),
+                              "vhost-poll-us", &error_abort);
 }
 
 static void virtio_ccw_blk_realize(VirtioCcwDevice *ccw_dev, Error **errp)
@@ -756,6 +760,8 @@ static void virtio_ccw_blk_instance_init(Object *obj)
                               &error_abort);
     object_property_add_alias(obj, "bootindex", OBJECT(&dev->vdev),
                               "bootindex", &error_abort);
+    object_property_add_alias(obj, "vq-iothreads", OBJECT(&dev->vdev),
+                              "vq-iothreads", &error_abort);
 }
 
 static void virtio_ccw_serial_realize(VirtioCcwDevice *ccw_dev, Error **errp)
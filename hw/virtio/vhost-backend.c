@@ -34,12 +34,21 @@ static int vhost_kernel_init(struct vhost_dev *dev, void *opaque)
     return 0;
 }
 
+/* Worker threads that already belong to a vhost_dev of this process */
+static GHashTable *vhost_kernel_workers;
+
 static int vhost_kernel_cleanup(struct vhost_dev *dev)
 {
     int fd = (uintptr_t) dev->opaque;
 
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_KERNEL);
 
+    if (dev->worker_tid) {
+        g_hash_table_remove(vhost_kernel_workers,
+                            GINT_TO_POINTER(dev->worker_tid));
+        dev->worker_tid = 0;
+    }
+
     return close(fd);
 }
 
@@ -155,9 +164,96 @@ static int vhost_kernel_get_features(struct vhost_dev *dev,
     return vhost_kernel_call(dev, VHOST_GET_FEATURES, features);
 }
 
+static pid_t vhost_kernel_find_worker_in(const char *dir, const char *comm)
+{
+    GDir *d = g_dir_open(dir, 0, NULL);
+    const char *name;
+    pid_t tid = 0;
+    uint64_t tid_start = 0;
+
+    if (!d) {
+        return 0;
+    }
+
+    while ((name = g_dir_read_name(d))) {
+        char *path, *contents, *end, *p, *q;
+        char **fields;
+        pid_t t = g_ascii_strtoull(name, &end, 10);
+        uint64_t start;
+
+        if (*end || !t ||
+            g_hash_table_lookup(vhost_kernel_workers, GINT_TO_POINTER(t))) {
+            continue;
+        }
+
+        path = g_strdup_printf("%s/%s/stat", dir, name);
+        if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+            g_free(path);
+            continue;
+        }
+        g_free(path);
+
+        /* Fields resume after the command name, starttime is field 22 */
+        p = strchr(contents, '(');
+        q = strrchr(contents, ')');
+        if (p && q && q - p - 1 == strlen(comm) &&
+            !strncmp(p + 1, comm, q - p - 1)) {
+            fields = g_strsplit(q + 1, " ", 0);
+            if (g_strv_length(fields) > 20) {
+                start = g_ascii_strtoull(fields[20], NULL, 10);
+                if (start > tid_start || (start == tid_start && t > tid)) {
+                    tid = t;
+                    tid_start = start;
+                }
+            }
+            g_strfreev(fields);
+        }
+        g_free(contents);
+    }
+
+    g_dir_close(d);
+    return tid;
+}
+
+/*
+ * VHOST_SET_OWNER starts a worker named vhost-<owner pid>.  Since
+ * Linux 6.4 it is a thread of this process, before that a kernel
+ * thread.  Only this process creates workers with that name and ours
+ * was just started, so it is the newest one not claimed by another
+ * vhost_dev.  The workers of devices that do not look for theirs are
+ * never claimed, hence the start time rather than the first match.
+ */
+static void vhost_kernel_find_worker(struct vhost_dev *dev)
+{
+    char *comm = g_strdup_printf("vhost-%d", (int)getpid());
+
+    if (!vhost_kernel_workers) {
+        vhost_kernel_workers = g_hash_table_new(g_direct_hash,
+                                                g_direct_equal);
+    }
+
+    dev->worker_tid = vhost_kernel_find_worker_in("/proc/self/task", comm);
+    if (!dev->worker_tid) {
+        dev->worker_tid = vhost_kernel_find_worker_in("/proc", comm);
+    }
+    if (dev->worker_tid) {
+        g_hash_table_insert(vhost_kernel_workers,
+                            GINT_TO_POINTER(dev->worker_tid),
+                            GINT_TO_POINTER(1));
+    }
+
+    g_free(comm);
+}
+
 static int vhost_kernel_set_owner(struct vhost_dev *dev)
 {
-    return vhost_kernel_call(dev, VHOST_SET_OWNER, NULL);
+    int r = vhost_kernel_call(dev, VHOST_SET_OWNER, NULL);
+
+    /* Scanning /proc is not free, only do it for those who need it */
+    if (!r && dev->find_worker) {
+        vhost_kernel_find_worker(dev);
+    }
+    return r;
 }
 
 static int vhost_kernel_reset_device(struct vhost_dev *dev)
@@ -22,6 +22,7 @@
 #include "qemu/error-report.h"
 #include "qemu/memfd.h"
 #include <linux/vhost.h>
+#include <sched.h>
 #include "exec/address-spaces.h"
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
@@ -869,6 +870,8 @@ static int vhost_virtqueue_start(struct vhost_dev *dev,
     hwaddr s, l, a;
     int r;
     int vhost_vq_index = dev->vhost_ops->vhost_get_vq_index(dev, idx);
+    /* The backend writes used descriptors back into a packed ring */
+    bool packed = virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
     struct vhost_vring_file file = {
         .index = vhost_vq_index
     };
@@ -903,7 +906,7 @@ static int vhost_virtqueue_start(struct vhost_dev *dev,
 
     vq->desc_size = s = l = virtio_queue_get_desc_size(vdev, idx);
     vq->desc_phys = a = virtio_queue_get_desc_addr(vdev, idx);
-    vq->desc = cpu_physical_memory_map(a, &l, 0);
+    vq->desc = cpu_physical_memory_map(a, &l, packed);
     if (!vq->desc || l != s) {
         r = -ENOMEM;
         goto fail_alloc_desc;
@@ -975,7 +978,8 @@ fail_alloc_desc:
     return r;
 }
 
-static void vhost_virtqueue_stop(struct vhost_dev *dev,
+/* Returns false if the backend could not report the ring position */
+static bool vhost_virtqueue_stop(struct vhost_dev *dev,
                                     struct VirtIODevice *vdev,
                                     struct vhost_virtqueue *vq,
                                     unsigned idx)
@@ -984,11 +988,15 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
     struct vhost_vring_state state = {
         .index = vhost_vq_index,
     };
+    bool packed = virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
+    hwaddr desc_size = virtio_queue_get_desc_size(vdev, idx);
     int r;
 
     r = dev->vhost_ops->vhost_get_vring_base(dev, &state);
     if (r < 0) {
         VHOST_OPS_DEBUG("vhost VQ %d ring restore failed: %d", idx, r);
+        /* Connection lost: restart from what the guest has seen used */
+        virtio_queue_restore_last_avail_idx(vdev, idx);
     } else {
         virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     }
@@ -1007,8 +1015,9 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
                               1, virtio_queue_get_used_size(vdev, idx));
     cpu_physical_memory_unmap(vq->avail, virtio_queue_get_avail_size(vdev, idx),
                               0, virtio_queue_get_avail_size(vdev, idx));
-    cpu_physical_memory_unmap(vq->desc, virtio_queue_get_desc_size(vdev, idx),
-                              0, virtio_queue_get_desc_size(vdev, idx));
+    cpu_physical_memory_unmap(vq->desc, desc_size,
+                              packed, packed ? desc_size : 0);
+    return r >= 0;
 }
 
 static void vhost_eventfd_add(MemoryListener *listener,
@@ -1040,7 +1049,7 @@ static int vhost_virtqueue_set_busyloop_timeout(struct vhost_dev *dev,
     r = dev->vhost_ops->vhost_set_vring_busyloop_timeout(dev, &state);
     if (r) {
         VHOST_OPS_DEBUG("vhost_set_vring_busyloop_timeout failed");
-        return r;
+        return -errno;
     }
 
     return 0;
@@ -1129,6 +1138,7 @@ int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
     }
 
     hdev->features = features;
+    hdev->busyloop_timeout = busyloop_timeout;
 
     hdev->memory_listener = (MemoryListener) {
         .begin = vhost_begin,
@@ -1332,6 +1342,57 @@ void vhost_ack_features(struct vhost_dev *hdev, const int *feature_bits,
     }
 }
 
+void vhost_dev_free_inflight(struct vhost_inflight *inflight)
+{
+    if (inflight->addr) {
+        munmap(inflight->addr, inflight->size);
+        inflight->addr = NULL;
+    }
+    if (inflight->fd >= 0) {
+        close(inflight->fd);
+        inflight->fd = -1;
+    }
+}
+
+/*
+ * Hand the in-flight log to the backend before its rings start.  The
+ * backend allocates it the first time; after a reconnect the same
+ * memory is passed back so that pending descriptors can be resubmitted.
+ */
+static int vhost_dev_set_inflight(struct vhost_dev *hdev, VirtIODevice *vdev)
+{
+    uint16_t queue_size = 0;
+    int i, r;
+
+    if (!hdev->inflight || !hdev->vhost_ops->vhost_set_inflight_fd) {
+        return 0;
+    }
+
+    if (!hdev->inflight->addr) {
+        for (i = 0; i < hdev->nvqs; ++i) {
+            queue_size = MAX(queue_size,
+                             virtio_queue_get_num(vdev, hdev->vq_index + i));
+        }
+        r = hdev->vhost_ops->vhost_get_inflight_fd(hdev, queue_size,
+                                                   hdev->inflight);
+        if (r < 0) {
+            VHOST_OPS_DEBUG("vhost_get_inflight_fd failed");
+            return -EIO;
+        }
+        if (!hdev->inflight->addr) {
+            /* not supported by the backend */
+            return 0;
+        }
+    }
+
+    r = hdev->vhost_ops->vhost_set_inflight_fd(hdev, hdev->inflight);
+    if (r < 0) {
+        VHOST_OPS_DEBUG("vhost_set_inflight_fd failed");
+        return -EIO;
+    }
+    return 0;
+}
+
 /* Host notifiers must be enabled at this point. */
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
@@ -1341,6 +1402,7 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     assert(hdev->vhost_ops);
 
     hdev->started = true;
+    hdev->vdev = vdev;
 
     r = vhost_dev_set_features(hdev, hdev->log_enabled);
     if (r < 0) {
@@ -1352,6 +1414,10 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
         r = -errno;
         goto fail_mem;
     }
+    r = vhost_dev_set_inflight(hdev, vdev);
+    if (r < 0) {
+        goto fail_mem;
+    }
     for (i = 0; i < hdev->nvqs; ++i) {
         r = vhost_virtqueue_start(hdev,
                                   vdev,
@@ -1394,26 +1460,49 @@ fail_mem:
 fail_features:
 
     hdev->started = false;
+    hdev->vdev = NULL;
     return r;
 }
 
 /* Host notifiers must be enabled at this point. */
 void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
+    bool synced = true;
     int i;
 
     /* should only be called after backend is connected */
     assert(hdev->vhost_ops);
 
     for (i = 0; i < hdev->nvqs; ++i) {
-        vhost_virtqueue_stop(hdev,
-                             vdev,
-                             hdev->vqs + i,
-                             hdev->vq_index + i);
+        synced &= vhost_virtqueue_stop(hdev,
+                                       vdev,
+                                       hdev->vqs + i,
+                                       hdev->vq_index + i);
+    }
+
+    /*
+     * A backend that reported its ring positions has nothing left in
+     * flight; keep the log only if it went away mid-flight.
+     */
+    if (synced && hdev->inflight) {
+        vhost_dev_free_inflight(hdev->inflight);
     }
 
     vhost_log_put(hdev, true);
     hdev->started = false;
+    hdev->vdev = NULL;
+}
+
+int vhost_dev_get_config(struct vhost_dev *hdev, uint8_t *config,
+                         uint32_t config_len)
+{
+    assert(hdev->vhost_ops);
+
+    if (hdev->vhost_ops->vhost_get_config) {
+        return hdev->vhost_ops->vhost_get_config(hdev, config, config_len);
+    }
+
+    return -1;
 }
 
 int vhost_net_set_backend(struct vhost_dev *hdev,
@@ -1425,3 +1514,100 @@ int vhost_net_set_backend(struct vhost_dev *hdev,
 
     return -1;
 }
+
+int vhost_dev_set_busyloop_timeout(struct vhost_dev *hdev, uint32_t timeout)
+{
+    int i, r;
+
+    for (i = 0; i < hdev->nvqs; ++i) {
+        r = vhost_virtqueue_set_busyloop_timeout(hdev, hdev->vq_index + i,
+                                                 timeout);
+        if (r < 0) {
+            return r;
+        }
+    }
+
+    hdev->busyloop_timeout = timeout;
+    return 0;
+}
+
+int vhost_dev_set_worker_affinity(struct vhost_dev *hdev, int cpu)
+{
+    cpu_set_t set;
+
+    if (!hdev->worker_tid) {
+        return -ENOTSUP;
+    }
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return -EINVAL;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(hdev->worker_tid, sizeof(set), &set) < 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+int vhost_dev_get_worker_stats(struct vhost_dev *hdev,
+                               VhostWorkerStats *stats)
+{
+    char *path, *contents, *p;
+    char **fields;
+    long ticks = sysconf(_SC_CLK_TCK);
+    int r = -EINVAL;
+
+    if (!hdev->worker_tid) {
+        return -ENOTSUP;
+    }
+
+    path = g_strdup_printf("/proc/%d/stat", (int)hdev->worker_tid);
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_free(path);
+        return -ENOENT;
+    }
+    g_free(path);
+
+    /* The command name may contain spaces, fields resume after it.  The
+     * first one left is field 3 of proc(5): utime and stime are fields
+     * 14 and 15, processor is field 39.
+     */
+    p = strrchr(contents, ')');
+    fields = g_strsplit(p ? p + 1 : "", " ", 0);
+    if (ticks > 0 && g_strv_length(fields) > 37) {
+        stats->tid = hdev->worker_tid;
+        stats->utime_ms = g_ascii_strtoull(fields[12], NULL, 10) * 1000
+                          / ticks;
+        stats->stime_ms = g_ascii_strtoull(fields[13], NULL, 10) * 1000
+                          / ticks;
+        stats->cpu = atoi(fields[37]);
+        r = 0;
+    }
+
+    g_strfreev(fields);
+    g_free(contents);
+    return r;
+}
+
+int vhost_virtqueue_get_indices(struct vhost_dev *hdev, int n,
+                                uint16_t *avail_idx, uint16_t *used_idx)
+{
+    struct vhost_virtqueue *vq = hdev->vqs + n - hdev->vq_index;
+
+    assert(n >= hdev->vq_index && n < hdev->vq_index + hdev->nvqs);
+
+    /* Packed rings have no indices, the positions are in the descriptors */
+    if (!hdev->started ||
+        virtio_vdev_has_feature(hdev->vdev, VIRTIO_F_RING_PACKED)) {
+        return -ENOTSUP;
+    }
+
+    /* Both rings start with a 16-bit flags field, followed by the index */
+    *avail_idx = virtio_tswap16(hdev->vdev,
+                                atomic_read((uint16_t *)vq->avail + 1));
+    *used_idx = virtio_tswap16(hdev->vdev,
+                               atomic_read((uint16_t *)vq->used + 1));
+    return 0;
+}
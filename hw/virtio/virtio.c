@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "qemu-common.h"
 #include "cpu.h"
 #include "trace.h"
@@ -20,6 +21,8 @@
 #include "qemu/error-report.h"
 #include "hw/virtio/virtio.h"
 #include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
@@ -59,6 +62,32 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingPackedDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent {
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
+/* A completion held back until virtqueue_flush() on a packed ring */
+typedef struct VRingPackedUsed {
+    uint16_t id;
+    uint16_t ndescs;
+    uint32_t len;
+} VRingPackedUsed;
+
+typedef struct VRingMemoryRegionCaches {
+    struct rcu_head rcu;
+    MemoryRegionCache desc;
+    MemoryRegionCache avail;
+    MemoryRegionCache used;
+} VRingMemoryRegionCaches;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -67,6 +96,7 @@ typedef struct VRing
     hwaddr desc;
     hwaddr avail;
     hwaddr used;
+    VRingMemoryRegionCaches *caches;
 } VRing;
 
 struct VirtQueue
@@ -81,6 +111,31 @@ struct VirtQueue
 
     uint16_t used_idx;
 
+    /* Packed ring only: wrap counters of last_avail_idx and used_idx */
+    bool last_avail_wrap_counter;
+    bool used_wrap_counter;
+
+    /* Packed ring only: completions not yet written by virtqueue_flush */
+    VRingPackedUsed *used_elems;
+
+    /* Elements of elem_pool_sz bytes recycled by virtqueue_free_element */
+    void **elem_pool;
+    unsigned int elem_pool_count;
+    size_t elem_pool_sz;
+
+    /* Interrupt moderation: irq_pending is set while irq_timer holds back
+     * an interrupt.  The timer runs in the main loop, while completions
+     * may come from an iothread through virtio_notify_irqfd(). */
+    QEMUTimer *irq_timer;
+    bool irq_pending;
+    unsigned int irq_batched;
+    int64_t irq_delay_ns;
+    int64_t irq_rate_start;
+    unsigned int irq_rate_count;
+    uint64_t irq_rate;
+    uint64_t irq_raised;
+    uint64_t irq_coalesced;
+
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -103,6 +158,70 @@ struct VirtQueue
     QLIST_ENTRY(VirtQueue) node;
 };
 
+static void virtio_free_region_cache(VRingMemoryRegionCaches *caches)
+{
+    address_space_cache_destroy(&caches->desc);
+    address_space_cache_destroy(&caches->avail);
+    address_space_cache_destroy(&caches->used);
+    g_free(caches);
+}
+
+/*
+ * (Re)build the translations of the rings of queue N, or drop them if
+ * the rings are not set up.  Readers access vring.caches under RCU, so
+ * the old translations stay valid until they are done.  The event index
+ * fields of a split ring are always covered, whether or not the guest
+ * negotiated them.  A packed ring has the device write descriptors, and
+ * its avail and used areas are the driver and device event structures.
+ */
+static void virtio_init_region_cache(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+    VRingMemoryRegionCaches *old = vq->vring.caches;
+    VRingMemoryRegionCaches *new = NULL;
+    bool packed = virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
+    hwaddr event_size = packed ? 0 : sizeof(uint16_t);
+
+    if (vq->vring.num && vq->vring.desc && vq->vring.avail &&
+        vq->vring.used) {
+        new = g_new0(VRingMemoryRegionCaches, 1);
+        address_space_cache_init(&new->desc, &address_space_memory,
+                                 vq->vring.desc,
+                                 virtio_queue_get_desc_size(vdev, n), packed);
+        address_space_cache_init(&new->avail, &address_space_memory,
+                                 vq->vring.avail,
+                                 virtio_queue_get_avail_size(vdev, n) +
+                                 event_size, false);
+        address_space_cache_init(&new->used, &address_space_memory,
+                                 vq->vring.used,
+                                 virtio_queue_get_used_size(vdev, n) +
+                                 event_size, true);
+    }
+
+    atomic_rcu_set(&vq->vring.caches, new);
+    if (old) {
+        call_rcu(old, virtio_free_region_cache, rcu);
+    }
+}
+
+static void virtio_memory_listener_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.caches) {
+            virtio_init_region_cache(vdev, i);
+        }
+    }
+}
+
+/* Must be called within an RCU critical section */
+static inline VRingMemoryRegionCaches *vring_get_region_caches(VirtQueue *vq)
+{
+    return atomic_rcu_read(&vq->vring.caches);
+}
+
 /* virt queue functions */
 void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 {
@@ -116,39 +235,56 @@ void virtio_queue_update_rings(VirtIODevice *vdev, int n)
     vring->used = vring_align(vring->avail +
                               offsetof(VRingAvail, ring[vring->num]),
                               vring->align);
+    virtio_init_region_cache(vdev, n);
 }
 
 static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
-                            hwaddr desc_pa, int i)
+                            MemoryRegionCache *cache, int i)
 {
-    address_space_read(&address_space_memory, desc_pa + i * sizeof(VRingDesc),
-                       MEMTXATTRS_UNSPECIFIED, (void *)desc, sizeof(VRingDesc));
+    address_space_read_cached(cache, i * sizeof(VRingDesc),
+                              desc, sizeof(VRingDesc));
     virtio_tswap64s(vdev, &desc->addr);
     virtio_tswap32s(vdev, &desc->len);
     virtio_tswap16s(vdev, &desc->flags);
     virtio_tswap16s(vdev, &desc->next);
 }
 
+/* Called within rcu_read_lock().  */
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    hwaddr pa = offsetof(VRingAvail, flags);
+
+    if (!caches) {
+        return 0;
+    }
+    return virtio_lduw_phys_cached(vq->vdev, &caches->avail, pa);
 }
 
+/* Called within rcu_read_lock().  */
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    vq->shadow_avail_idx = virtio_lduw_phys(vq->vdev, pa);
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    hwaddr pa = offsetof(VRingAvail, idx);
+
+    if (!caches) {
+        return 0;
+    }
+    vq->shadow_avail_idx = virtio_lduw_phys_cached(vq->vdev, &caches->avail,
+                                                   pa);
     return vq->shadow_avail_idx;
 }
 
+/* Called within rcu_read_lock().  */
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    hwaddr pa = offsetof(VRingAvail, ring[i]);
+
+    if (!caches) {
+        return 0;
+    }
+    return virtio_lduw_phys_cached(vq->vdev, &caches->avail, pa);
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -156,61 +292,206 @@ static inline uint16_t vring_get_used_event(VirtQueue *vq)
     return vring_avail_ring(vq, vq->vring.num);
 }
 
+/* Called within rcu_read_lock().  */
 static inline void vring_used_write(VirtQueue *vq, VRingUsedElem *uelem,
                                     int i)
 {
-    hwaddr pa;
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    hwaddr pa = offsetof(VRingUsed, ring[i]);
+
+    if (!caches) {
+        return;
+    }
     virtio_tswap32s(vq->vdev, &uelem->id);
     virtio_tswap32s(vq->vdev, &uelem->len);
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i]);
-    address_space_write(&address_space_memory, pa, MEMTXATTRS_UNSPECIFIED,
-                       (void *)uelem, sizeof(VRingUsedElem));
+    address_space_write_cached(&caches->used, pa, uelem,
+                               sizeof(VRingUsedElem));
 }
 
+/* Called within rcu_read_lock().  */
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    hwaddr pa = offsetof(VRingUsed, idx);
+
+    if (!caches) {
+        return 0;
+    }
+    return virtio_lduw_phys_cached(vq->vdev, &caches->used, pa);
 }
 
+/* Called within rcu_read_lock().  */
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    hwaddr pa = offsetof(VRingUsed, idx);
+
+    if (caches) {
+        virtio_stw_phys_cached(vq->vdev, &caches->used, pa, val);
+    }
     vq->used_idx = val;
 }
 
+/* Called within rcu_read_lock().  */
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
     VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    hwaddr pa = offsetof(VRingUsed, flags);
+    uint16_t flags;
+
+    if (!caches) {
+        return;
+    }
+    flags = virtio_lduw_phys_cached(vdev, &caches->used, pa);
+    virtio_stw_phys_cached(vdev, &caches->used, pa, flags | mask);
 }
 
+/* Called within rcu_read_lock().  */
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
     VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    hwaddr pa = offsetof(VRingUsed, flags);
+    uint16_t flags;
+
+    if (!caches) {
+        return;
+    }
+    flags = virtio_lduw_phys_cached(vdev, &caches->used, pa);
+    virtio_stw_phys_cached(vdev, &caches->used, pa, flags & ~mask);
 }
 
+/* Called within rcu_read_lock().  */
 static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
 {
+    VRingMemoryRegionCaches *caches;
     hwaddr pa;
+
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        return;
+    }
+    pa = offsetof(VRingUsed, ring[vq->vring.num]);
+    virtio_stw_phys_cached(vq->vdev, &caches->used, pa, val);
 }
 
-void virtio_queue_set_notification(VirtQueue *vq, int enable)
+static void vring_packed_desc_read_flags(VirtIODevice *vdev, uint16_t *flags,
+                                         MemoryRegionCache *cache, int i)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc) + offsetof(VRingPackedDesc, flags);
+
+    *flags = virtio_lduw_phys_cached(vdev, cache, off);
+}
+
+static void vring_packed_desc_read(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                   MemoryRegionCache *cache, int i,
+                                   bool strict_order)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+
+    vring_packed_desc_read_flags(vdev, &desc->flags, cache, i);
+    if (strict_order) {
+        /* The rest of the descriptor is only valid once flags say so */
+        smp_rmb();
+    }
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, addr),
+                              &desc->addr, sizeof(desc->addr));
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, len),
+                              &desc->len, sizeof(desc->len));
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, id),
+                              &desc->id, sizeof(desc->id));
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+}
+
+/* Write a used descriptor; flags go last so the driver never sees it torn */
+static void vring_packed_desc_write(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                    MemoryRegionCache *cache, int i,
+                                    bool strict_order)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+    address_space_write_cached(cache, off + offsetof(VRingPackedDesc, id),
+                               &desc->id, sizeof(desc->id));
+    address_space_write_cached(cache, off + offsetof(VRingPackedDesc, len),
+                               &desc->len, sizeof(desc->len));
+    if (strict_order) {
+        smp_wmb();
+    }
+    virtio_stw_phys_cached(vdev, cache, off + offsetof(VRingPackedDesc, flags),
+                           desc->flags);
+}
+
+static void vring_packed_event_read(VirtIODevice *vdev,
+                                    MemoryRegionCache *cache,
+                                    VRingPackedDescEvent *e)
+{
+    e->flags = virtio_lduw_phys_cached(vdev, cache,
+                                       offsetof(VRingPackedDescEvent, flags));
+    /* Make sure flags is seen before off_wrap */
+    smp_rmb();
+    e->off_wrap = virtio_lduw_phys_cached(vdev, cache,
+                                          offsetof(VRingPackedDescEvent,
+                                                   off_wrap));
+}
+
+static bool is_desc_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+    bool used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+
+    return avail != used && avail == wrap_counter;
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_set_avail_event(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    uint16_t off_wrap = vq->last_avail_idx |
+        vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+
+    if (!vq->notification || !caches) {
+        return;
+    }
+    virtio_stw_phys_cached(vq->vdev, &caches->used,
+                           offsetof(VRingPackedDescEvent, off_wrap),
+                           off_wrap);
+}
+
+/* Called within rcu_read_lock().  */
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    uint16_t flags;
+
+    if (!caches) {
+        return;
+    }
+
+    if (!enable) {
+        flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+        /* Make sure off_wrap is written before flags */
+        smp_wmb();
+        flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+    virtio_stw_phys_cached(vq->vdev, &caches->used,
+                           offsetof(VRingPackedDescEvent, flags), flags);
+}
+
+/* Called within rcu_read_lock().  */
+static void virtio_queue_split_set_notification(VirtQueue *vq, int enable)
 {
-    vq->notification = enable;
     if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
@@ -218,10 +499,23 @@ void virtio_queue_set_notification(VirtQueue *vq, int enable)
     } else {
         vring_used_flags_set_bit(vq, VRING_USED_F_NO_NOTIFY);
     }
+}
+
+void virtio_queue_set_notification(VirtQueue *vq, int enable)
+{
+    vq->notification = enable;
+
+    rcu_read_lock();
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtio_queue_packed_set_notification(vq, enable);
+    } else {
+        virtio_queue_split_set_notification(vq, enable);
+    }
     if (enable) {
         /* Expose avail event/used flags before caller checks the avail idx. */
         smp_mb();
     }
+    rcu_read_unlock();
 }
 
 int virtio_queue_ready(VirtQueue *vq)
@@ -231,13 +525,47 @@ int virtio_queue_ready(VirtQueue *vq)
 
 /* Fetch avail_idx from VQ memory only when we really need to know if
  * guest has added some buffers. */
-int virtio_queue_empty(VirtQueue *vq)
+static int virtio_queue_split_empty(VirtQueue *vq)
 {
+    bool empty;
+
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
     }
 
-    return vring_avail_idx(vq) == vq->last_avail_idx;
+    rcu_read_lock();
+    empty = vring_avail_idx(vq) == vq->last_avail_idx;
+    rcu_read_unlock();
+    return empty;
+}
+
+/* Called within rcu_read_lock().  */
+static int virtio_queue_packed_empty_rcu(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    uint16_t flags;
+
+    if (!caches) {
+        return 1;
+    }
+
+    vring_packed_desc_read_flags(vq->vdev, &flags, &caches->desc,
+                                 vq->last_avail_idx);
+    return !is_desc_avail(flags, vq->last_avail_wrap_counter);
+}
+
+int virtio_queue_empty(VirtQueue *vq)
+{
+    int empty;
+
+    if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_queue_split_empty(vq);
+    }
+
+    rcu_read_lock();
+    empty = virtio_queue_packed_empty_rcu(vq);
+    rcu_read_unlock();
+    return empty;
 }
 
 static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
@@ -275,7 +603,11 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
                               unsigned int len)
 {
-    vq->inuse--;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        vq->inuse -= elem->ndescs;
+    } else {
+        vq->inuse--;
+    }
     virtqueue_unmap_sg(vq, elem, len);
 }
 
@@ -290,7 +622,16 @@ void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
                      unsigned int len)
 {
-    vq->last_avail_idx--;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        if (vq->last_avail_idx < elem->ndescs) {
+            vq->last_avail_idx += vq->vring.num;
+            vq->last_avail_wrap_counter ^= 1;
+        }
+        vq->last_avail_idx -= elem->ndescs;
+        vq->shadow_avail_idx = vq->last_avail_idx;
+    } else {
+        vq->last_avail_idx--;
+    }
     virtqueue_detach_element(vq, elem, len);
 }
 
@@ -304,11 +645,13 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
  * Use virtqueue_unpop() instead if you have a VirtQueueElement.
  *
  * Returns: true on success, false if @num is greater than the number of in use
- * elements.
+ * elements.  Always false on a packed ring, where an element may span any
+ * number of descriptors.
  */
 bool virtqueue_rewind(VirtQueue *vq, unsigned int num)
 {
-    if (num > vq->inuse) {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED) ||
+        num > vq->inuse) {
         return false;
     }
     vq->last_avail_idx -= num;
@@ -316,46 +659,149 @@ bool virtqueue_rewind(VirtQueue *vq, unsigned int num)
     return true;
 }
 
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_split_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                 unsigned int len, unsigned int idx)
 {
     VRingUsedElem uelem;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
-
-    virtqueue_unmap_sg(vq, elem, len);
-
-    if (unlikely(vq->vdev->broken)) {
-        return;
-    }
-
     idx = (idx + vq->used_idx) % vq->vring.num;
 
     uelem.id = elem->index;
     uelem.len = len;
+    rcu_read_lock();
     vring_used_write(vq, &uelem, idx);
+    rcu_read_unlock();
 }
 
-void virtqueue_flush(VirtQueue *vq, unsigned int count)
+/* Used descriptors are written out by virtqueue_flush() */
+static void virtqueue_packed_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                  unsigned int len, unsigned int idx)
 {
-    uint16_t old, new;
+    assert(idx < vq->vring.num);
+    vq->used_elems[idx].id = elem->index;
+    vq->used_elems[idx].len = len;
+    vq->used_elems[idx].ndescs = elem->ndescs;
+}
 
-    if (unlikely(vq->vdev->broken)) {
-        vq->inuse -= count;
-        return;
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, elem, len, idx);
+
+    virtqueue_unmap_sg(vq, elem, len);
+
+    /*
+     * A packed ring records the element even if the device is broken,
+     * because virtqueue_flush needs its descriptor count.
+     */
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_fill(vq, elem, len, idx);
+    } else if (!vq->vdev->broken) {
+        virtqueue_split_fill(vq, elem, len, idx);
     }
+}
+
+static void virtqueue_split_flush(VirtQueue *vq, unsigned int count)
+{
+    uint16_t old, new;
 
     /* Make sure buffer is written before we update index. */
     smp_wmb();
-    trace_virtqueue_flush(vq, count);
     old = vq->used_idx;
     new = old + count;
+    rcu_read_lock();
     vring_used_idx_set(vq, new);
+    rcu_read_unlock();
     vq->inuse -= count;
     if (unlikely((int16_t)(new - vq->signalled_used) < (uint16_t)(new - old)))
         vq->signalled_used_valid = false;
 }
 
+/* Called within rcu_read_lock().  */
+static void virtqueue_packed_fill_desc(VirtQueue *vq,
+                                       const VRingPackedUsed *used,
+                                       unsigned int off, bool strict_order)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    VRingPackedDesc desc = {
+        .id = used->id,
+        .len = used->len,
+    };
+    unsigned int head = vq->used_idx + off;
+    bool wrap_counter = vq->used_wrap_counter;
+
+    if (!caches) {
+        return;
+    }
+
+    if (head >= vq->vring.num) {
+        head -= vq->vring.num;
+        wrap_counter ^= 1;
+    }
+    if (wrap_counter) {
+        desc.flags = (1 << VRING_PACKED_DESC_F_AVAIL) |
+                     (1 << VRING_PACKED_DESC_F_USED);
+    }
+    vring_packed_desc_write(vq->vdev, &desc, &caches->desc, head,
+                            strict_order);
+}
+
+/*
+ * Completions are written one after the other from used_idx on, each
+ * skipping ahead by the number of descriptors its buffer took.  The head
+ * of the batch is written last, so that the driver, which stops at the
+ * first slot that is not used, sees the whole batch at once.
+ */
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    unsigned int i, ndescs;
+
+    if (!count) {
+        return;
+    }
+
+    ndescs = vq->used_elems[0].ndescs;
+    rcu_read_lock();
+    for (i = 1; i < count; i++) {
+        virtqueue_packed_fill_desc(vq, &vq->used_elems[i], ndescs, false);
+        ndescs += vq->used_elems[i].ndescs;
+    }
+    virtqueue_packed_fill_desc(vq, &vq->used_elems[0], 0, true);
+    rcu_read_unlock();
+
+    vq->inuse -= ndescs;
+    vq->used_idx += ndescs;
+    if (vq->used_idx >= vq->vring.num) {
+        vq->used_idx -= vq->vring.num;
+        vq->used_wrap_counter ^= 1;
+        vq->signalled_used_valid = false;
+    }
+}
+
+void virtqueue_flush(VirtQueue *vq, unsigned int count)
+{
+    unsigned int i;
+
+    if (unlikely(vq->vdev->broken)) {
+        if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+            /* inuse counts descriptors, see virtqueue_packed_flush */
+            for (i = 0; i < count; i++) {
+                vq->inuse -= vq->used_elems[i].ndescs;
+            }
+        } else {
+            vq->inuse -= count;
+        }
+        return;
+    }
+
+    trace_virtqueue_flush(vq, count);
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_flush(vq, count);
+    } else {
+        virtqueue_split_flush(vq, count);
+    }
+}
+
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len)
 {
@@ -363,6 +809,7 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+/* Called within rcu_read_lock().  */
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
     uint16_t num_heads = vring_avail_idx(vq) - idx;
@@ -382,6 +829,7 @@ static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
     return num_heads;
 }
 
+/* Called within rcu_read_lock().  */
 static bool virtqueue_get_head(VirtQueue *vq, unsigned int idx,
                                unsigned int *head)
 {
@@ -405,8 +853,8 @@ enum {
 };
 
 static int virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
-                                    hwaddr desc_pa, unsigned int max,
-                                    unsigned int *next)
+                                    MemoryRegionCache *desc_cache,
+                                    unsigned int max, unsigned int *next)
 {
     /* If this descriptor says it doesn't chain, we're done. */
     if (!(desc->flags & VRING_DESC_F_NEXT)) {
@@ -423,26 +871,63 @@ static int virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
         return VIRTQUEUE_READ_DESC_ERROR;
     }
 
-    vring_desc_read(vdev, desc, desc_pa, *next);
+    vring_desc_read(vdev, desc, desc_cache, *next);
     return VIRTQUEUE_READ_DESC_MORE;
 }
 
-void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
-                               unsigned int *out_bytes,
-                               unsigned max_in_bytes, unsigned max_out_bytes)
+/*
+ * A packed chain continues in the next ring slot, wrapping around; an
+ * indirect table is walked in full, without looking at its flags.
+ */
+static int virtqueue_packed_read_next_desc(VirtQueue *vq,
+                                           VRingPackedDesc *desc,
+                                           MemoryRegionCache *desc_cache,
+                                           unsigned int max,
+                                           unsigned int *next,
+                                           bool indirect)
 {
+    /* If this descriptor says it doesn't chain, we're done. */
+    if (!indirect && !(desc->flags & VRING_DESC_F_NEXT)) {
+        return VIRTQUEUE_READ_DESC_DONE;
+    }
+
+    if (++*next == max) {
+        if (indirect) {
+            return VIRTQUEUE_READ_DESC_DONE;
+        }
+        *next = 0;
+    }
+
+    vring_packed_desc_read(vq->vdev, desc, desc_cache, *next, false);
+    return VIRTQUEUE_READ_DESC_MORE;
+}
+
+static void virtqueue_split_get_avail_bytes(VirtQueue *vq,
+                                            unsigned int *in_bytes,
+                                            unsigned int *out_bytes,
+                                            unsigned max_in_bytes,
+                                            unsigned max_out_bytes)
+{
+    VRingMemoryRegionCaches *caches;
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
     unsigned int idx;
     unsigned int total_bufs, in_total, out_total;
     int rc;
 
+    rcu_read_lock();
     idx = vq->last_avail_idx;
-
     total_bufs = in_total = out_total = 0;
+
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        goto err;
+    }
+
     while ((rc = virtqueue_num_heads(vq, idx)) > 0) {
         VirtIODevice *vdev = vq->vdev;
+        MemoryRegionCache *desc_cache = &caches->desc;
         unsigned int max, num_bufs, indirect = 0;
         VRingDesc desc;
-        hwaddr desc_pa;
         unsigned int i;
 
         max = vq->vring.num;
@@ -452,11 +937,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             goto err;
         }
 
-        desc_pa = vq->vring.desc;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vdev, &desc, desc_cache, i);
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
-            if (desc.len % sizeof(VRingDesc)) {
+            if (!desc.len || desc.len % sizeof(VRingDesc)) {
                 virtio_error(vdev, "Invalid size for indirect buffer table");
                 goto err;
             }
@@ -468,11 +952,14 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             }
 
             /* loop over the indirect descriptor table */
+            address_space_cache_init(&indirect_desc_cache,
+                                     &address_space_memory,
+                                     desc.addr, desc.len, false);
+            desc_cache = &indirect_desc_cache;
             indirect = 1;
             max = desc.len / sizeof(VRingDesc);
-            desc_pa = desc.addr;
             num_bufs = i = 0;
-            vring_desc_read(vdev, &desc, desc_pa, i);
+            vring_desc_read(vdev, &desc, desc_cache, i);
         }
 
         do {
@@ -491,13 +978,15 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 goto done;
             }
 
-            rc = virtqueue_read_next_desc(vdev, &desc, desc_pa, max, &i);
+            rc = virtqueue_read_next_desc(vdev, &desc, desc_cache, max, &i);
         } while (rc == VIRTQUEUE_READ_DESC_MORE);
 
         if (rc == VIRTQUEUE_READ_DESC_ERROR) {
             goto err;
         }
 
+        address_space_cache_destroy(&indirect_desc_cache);
+
         if (!indirect)
             total_bufs = num_bufs;
         else
@@ -509,6 +998,112 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     }
 
 done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    rcu_read_unlock();
+    if (in_bytes) {
+        *in_bytes = in_total;
+    }
+    if (out_bytes) {
+        *out_bytes = out_total;
+    }
+    return;
+
+err:
+    in_total = out_total = 0;
+    goto done;
+}
+
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             unsigned int *in_bytes,
+                                             unsigned int *out_bytes,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes)
+{
+    VirtIODevice *vdev = vq->vdev;
+    VRingMemoryRegionCaches *caches;
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    unsigned int idx;
+    unsigned int total_bufs, in_total, out_total;
+    bool wrap_counter;
+    int rc;
+
+    rcu_read_lock();
+    idx = vq->last_avail_idx;
+    wrap_counter = vq->last_avail_wrap_counter;
+    total_bufs = in_total = out_total = 0;
+
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        goto err;
+    }
+
+    while (total_bufs < vq->vring.num) {
+        MemoryRegionCache *desc_cache = &caches->desc;
+        unsigned int max, num_bufs;
+        VRingPackedDesc desc;
+        unsigned int i = idx;
+
+        max = vq->vring.num;
+        num_bufs = total_bufs;
+
+        vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
+        if (!is_desc_avail(desc.flags, wrap_counter)) {
+            break;
+        }
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (!desc.len || desc.len % sizeof(VRingPackedDesc)) {
+                virtio_error(vdev, "Invalid size for indirect buffer table");
+                goto err;
+            }
+
+            /* loop over the indirect descriptor table */
+            address_space_cache_init(&indirect_desc_cache,
+                                     &address_space_memory,
+                                     desc.addr, desc.len, false);
+            desc_cache = &indirect_desc_cache;
+            max = desc.len / sizeof(VRingPackedDesc);
+            num_bufs = i = 0;
+            vring_packed_desc_read(vdev, &desc, desc_cache, i, false);
+        }
+
+        do {
+            /* If we've got too many, that implies a descriptor loop. */
+            if (++num_bufs > max) {
+                virtio_error(vdev, "Looped descriptor");
+                goto err;
+            }
+
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+
+            rc = virtqueue_packed_read_next_desc(vq, &desc, desc_cache, max,
+                                                 &i, desc_cache ==
+                                                 &indirect_desc_cache);
+        } while (rc == VIRTQUEUE_READ_DESC_MORE);
+
+        if (desc_cache == &indirect_desc_cache) {
+            address_space_cache_destroy(&indirect_desc_cache);
+            num_bufs = total_bufs + 1;
+        }
+
+        idx += num_bufs - total_bufs;
+        total_bufs = num_bufs;
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+    }
+
+done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    rcu_read_unlock();
     if (in_bytes) {
         *in_bytes = in_total;
     }
@@ -522,6 +1117,19 @@ err:
     goto done;
 }
 
+void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
+                               unsigned int *out_bytes,
+                               unsigned max_in_bytes, unsigned max_out_bytes)
+{
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_get_avail_bytes(vq, in_bytes, out_bytes,
+                                         max_in_bytes, max_out_bytes);
+    } else {
+        virtqueue_split_get_avail_bytes(vq, in_bytes, out_bytes,
+                                        max_in_bytes, max_out_bytes);
+    }
+}
+
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
                           unsigned int out_bytes)
 {
@@ -610,88 +1218,386 @@ static void virtqueue_map_iovec(struct iovec *sg, hwaddr *addr,
             exit(1);
         }
     }
-}
+}
+
+void virtqueue_map(VirtQueueElement *elem)
+{
+    virtqueue_map_iovec(elem->in_sg, elem->in_addr, &elem->in_num, 1);
+    virtqueue_map_iovec(elem->out_sg, elem->out_addr, &elem->out_num, 0);
+}
+
+/* The size of an element only depends on the total number of segments,
+ * so a buffer sized for N segments fits any in/out split of N.
+ */
+static size_t virtqueue_element_size(size_t sz, unsigned num_sg)
+{
+    VirtQueueElement *elem;
+    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
+    size_t addr_end = in_addr_ofs + num_sg * sizeof(elem->in_addr[0]);
+    size_t in_sg_ofs = QEMU_ALIGN_UP(addr_end, __alignof__(elem->in_sg[0]));
+
+    return in_sg_ofs + num_sg * sizeof(elem->in_sg[0]);
+}
+
+static void *virtqueue_init_element(void *buf, size_t sz,
+                                    unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem = buf;
+    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
+    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
+    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
+    size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
+    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
+
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    elem->pooled = false;
+    elem->in_addr = (void *)elem + in_addr_ofs;
+    elem->out_addr = (void *)elem + out_addr_ofs;
+    elem->in_sg = (void *)elem + in_sg_ofs;
+    elem->out_sg = (void *)elem + out_sg_ofs;
+    return elem;
+}
+
+static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+{
+    assert(sz >= sizeof(VirtQueueElement));
+    return virtqueue_init_element(g_malloc(virtqueue_element_size(sz,
+                                                out_num + in_num)),
+                                  sz, out_num, in_num);
+}
+
+/* Take an element from the queue's pool if it fits, so that steady-state
+ * traffic does not go through the allocator for every request.
+ */
+static void *virtqueue_alloc_pooled_element(VirtQueue *vq, size_t sz,
+                                            unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem;
+    void *buf;
+
+    if (out_num + in_num > VIRTQUEUE_ELEM_POOL_SG ||
+        (vq->elem_pool && vq->elem_pool_sz != sz)) {
+        return virtqueue_alloc_element(sz, out_num, in_num);
+    }
+
+    assert(sz >= sizeof(VirtQueueElement));
+    if (!vq->elem_pool) {
+        vq->elem_pool = g_new(void *, VIRTQUEUE_ELEM_POOL_SIZE);
+        vq->elem_pool_sz = sz;
+    }
+    if (vq->elem_pool_count) {
+        buf = vq->elem_pool[--vq->elem_pool_count];
+    } else {
+        buf = g_malloc(virtqueue_element_size(sz, VIRTQUEUE_ELEM_POOL_SG));
+    }
+    elem = virtqueue_init_element(buf, sz, out_num, in_num);
+    elem->pooled = true;
+    return elem;
+}
+
+/* virtqueue_free_element:
+ * @vq: The #VirtQueue the element was popped from
+ * @elem: The element, as returned by virtqueue_pop() or virtqueue_pop_batch()
+ *
+ * Release an element once the device is done with it, after it has been
+ * pushed or detached.  Pooled elements are kept for the next
+ * virtqueue_pop_batch(); any other element is simply freed, so this can
+ * be used for elements loaded by qemu_get_virtqueue_element() as well.
+ */
+void virtqueue_free_element(VirtQueue *vq, void *elem)
+{
+    VirtQueueElement *e = elem;
+
+    if (!e) {
+        return;
+    }
+    if (e->pooled && vq->elem_pool &&
+        vq->elem_pool_count < VIRTQUEUE_ELEM_POOL_SIZE) {
+        vq->elem_pool[vq->elem_pool_count++] = e;
+        return;
+    }
+    g_free(e);
+}
+
+static void virtqueue_elem_pool_destroy(VirtQueue *vq)
+{
+    while (vq->elem_pool_count) {
+        g_free(vq->elem_pool[--vq->elem_pool_count]);
+    }
+    g_free(vq->elem_pool);
+    vq->elem_pool = NULL;
+    vq->elem_pool_sz = 0;
+}
+
+/* Walk and map the descriptor chain starting at @head.  Called within
+ * rcu_read_lock().
+ */
+static void *virtqueue_split_read_elem(VirtQueue *vq,
+                                       VRingMemoryRegionCaches *caches,
+                                       unsigned int head, size_t sz,
+                                       bool pooled)
+{
+    unsigned int i, max;
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    MemoryRegionCache *desc_cache;
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem = NULL;
+    unsigned out_num, in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingDesc desc;
+    int rc;
+
+    /* When we start there are none of either input nor output. */
+    out_num = in_num = 0;
+
+    max = vq->vring.num;
+
+    i = head;
+    desc_cache = &caches->desc;
+    vring_desc_read(vdev, &desc, desc_cache, i);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (!desc.len || desc.len % sizeof(VRingDesc)) {
+            virtio_error(vdev, "Invalid size for indirect buffer table");
+            goto done;
+        }
+
+        /* loop over the indirect descriptor table */
+        address_space_cache_init(&indirect_desc_cache, &address_space_memory,
+                                 desc.addr, desc.len, false);
+        desc_cache = &indirect_desc_cache;
+        max = desc.len / sizeof(VRingDesc);
+        i = 0;
+        vring_desc_read(vdev, &desc, desc_cache, i);
+    }
+
+    /* Collect all the descriptors */
+    do {
+        bool map_ok;
+
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+                                        iov + out_num,
+                                        VIRTQUEUE_MAX_SIZE - out_num, true,
+                                        desc.addr, desc.len);
+        } else {
+            if (in_num) {
+                virtio_error(vdev, "Incorrect order for descriptors");
+                goto err_undo_map;
+            }
+            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+                                        VIRTQUEUE_MAX_SIZE, false,
+                                        desc.addr, desc.len);
+        }
+        if (!map_ok) {
+            goto err_undo_map;
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if ((in_num + out_num) > max) {
+            virtio_error(vdev, "Looped descriptor");
+            goto err_undo_map;
+        }
+
+        rc = virtqueue_read_next_desc(vdev, &desc, desc_cache, max, &i);
+    } while (rc == VIRTQUEUE_READ_DESC_MORE);
+
+    if (rc == VIRTQUEUE_READ_DESC_ERROR) {
+        goto err_undo_map;
+    }
+
+    /* Now copy what we have collected and mapped */
+    if (pooled) {
+        elem = virtqueue_alloc_pooled_element(vq, sz, out_num, in_num);
+    } else {
+        elem = virtqueue_alloc_element(sz, out_num, in_num);
+    }
+    elem->index = head;
+    elem->ndescs = 1;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
+
+    vq->inuse++;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    return elem;
+
+err_undo_map:
+    virtqueue_undo_map_desc(out_num, in_num, iov);
+    goto done;
+}
+
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+{
+    unsigned int head;
+    VRingMemoryRegionCaches *caches;
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem = NULL;
+
+    if (unlikely(vdev->broken)) {
+        return NULL;
+    }
+    rcu_read_lock();
+    if (virtio_queue_empty(vq)) {
+        goto done;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    if (vq->inuse >= vq->vring.num) {
+        virtio_error(vdev, "Virtqueue size exceeded");
+        goto done;
+    }
+
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        virtio_error(vdev, "Region caches not initialized");
+        goto done;
+    }
+
+    if (!virtqueue_get_head(vq, vq->last_avail_idx++, &head)) {
+        goto done;
+    }
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    elem = virtqueue_split_read_elem(vq, caches, head, sz, false);
+done:
+    rcu_read_unlock();
+    return elem;
+}
+
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
+{
+    uint16_t heads[VIRTQUEUE_MAX_SIZE];
+    unsigned int i, n, start, first;
+    VRingMemoryRegionCaches *caches;
+    VirtIODevice *vdev = vq->vdev;
+    int num_heads;
+
+    if (unlikely(vdev->broken)) {
+        return 0;
+    }
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        rcu_read_unlock();
+        return 0;
+    }
+
+    /* One read of the avail index covers the whole batch; the barrier in
+     * virtqueue_num_heads() orders it before the ring reads below. */
+    num_heads = virtqueue_num_heads(vq, vq->last_avail_idx);
+    if (num_heads <= 0) {
+        rcu_read_unlock();
+        return 0;
+    }
+    if (vq->inuse >= vq->vring.num) {
+        virtio_error(vdev, "Virtqueue size exceeded");
+        rcu_read_unlock();
+        return 0;
+    }
+    n = MIN(num_heads, MIN(max, vq->vring.num - vq->inuse));
 
-void virtqueue_map(VirtQueueElement *elem)
-{
-    virtqueue_map_iovec(elem->in_sg, elem->in_addr, &elem->in_num, 1);
-    virtqueue_map_iovec(elem->out_sg, elem->out_addr, &elem->out_num, 0);
-}
+    /* Fetch all the heads at once, in at most two pieces if the range
+     * wraps around the end of the ring. */
+    start = vq->last_avail_idx % vq->vring.num;
+    first = MIN(n, vq->vring.num - start);
+    address_space_read_cached(&caches->avail,
+                              offsetof(VRingAvail, ring[start]),
+                              heads, first * sizeof(heads[0]));
+    if (first < n) {
+        address_space_read_cached(&caches->avail,
+                                  offsetof(VRingAvail, ring[0]),
+                                  heads + first,
+                                  (n - first) * sizeof(heads[0]));
+    }
 
-static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
-{
-    VirtQueueElement *elem;
-    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
-    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
-    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
-    size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
-    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
-    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+    for (i = 0; i < n; i++) {
+        unsigned int head = virtio_tswap16(vdev, heads[i]);
 
-    assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
-    elem->out_num = out_num;
-    elem->in_num = in_num;
-    elem->in_addr = (void *)elem + in_addr_ofs;
-    elem->out_addr = (void *)elem + out_addr_ofs;
-    elem->in_sg = (void *)elem + in_sg_ofs;
-    elem->out_sg = (void *)elem + out_sg_ofs;
-    return elem;
+        if (head >= vq->vring.num) {
+            virtio_error(vdev, "Guest says index %u is available", head);
+            break;
+        }
+        elems[i] = virtqueue_split_read_elem(vq, caches, head, sz, true);
+        if (!elems[i]) {
+            break;
+        }
+        vq->last_avail_idx++;
+    }
+
+    if (i && virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    rcu_read_unlock();
+    return i;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz, bool pooled)
 {
-    unsigned int i, head, max;
-    hwaddr desc_pa = vq->vring.desc;
+    unsigned int i, max;
+    VRingMemoryRegionCaches *caches;
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    MemoryRegionCache *desc_cache;
     VirtIODevice *vdev = vq->vdev;
-    VirtQueueElement *elem;
-    unsigned out_num, in_num;
+    VirtQueueElement *elem = NULL;
+    unsigned out_num, in_num, elem_entries;
     hwaddr addr[VIRTQUEUE_MAX_SIZE];
     struct iovec iov[VIRTQUEUE_MAX_SIZE];
-    VRingDesc desc;
+    VRingPackedDesc desc;
+    uint16_t id;
     int rc;
 
     if (unlikely(vdev->broken)) {
         return NULL;
     }
-    if (virtio_queue_empty(vq)) {
-        return NULL;
+    rcu_read_lock();
+    if (virtio_queue_packed_empty_rcu(vq)) {
+        goto done;
     }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
 
     /* When we start there are none of either input nor output. */
-    out_num = in_num = 0;
+    out_num = in_num = elem_entries = 0;
 
     max = vq->vring.num;
 
     if (vq->inuse >= vq->vring.num) {
         virtio_error(vdev, "Virtqueue size exceeded");
-        return NULL;
-    }
-
-    if (!virtqueue_get_head(vq, vq->last_avail_idx++, &head)) {
-        return NULL;
-    }
-
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
+        goto done;
     }
 
-    i = head;
-    vring_desc_read(vdev, &desc, desc_pa, i);
+    caches = vring_get_region_caches(vq);
+    i = vq->last_avail_idx;
+    desc_cache = &caches->desc;
+    vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
+    id = desc.id;
     if (desc.flags & VRING_DESC_F_INDIRECT) {
-        if (desc.len % sizeof(VRingDesc)) {
+        if (!desc.len || desc.len % sizeof(VRingPackedDesc)) {
             virtio_error(vdev, "Invalid size for indirect buffer table");
-            return NULL;
+            goto done;
         }
 
         /* loop over the indirect descriptor table */
-        max = desc.len / sizeof(VRingDesc);
-        desc_pa = desc.addr;
+        address_space_cache_init(&indirect_desc_cache, &address_space_memory,
+                                 desc.addr, desc.len, false);
+        desc_cache = &indirect_desc_cache;
+        max = desc.len / sizeof(VRingPackedDesc);
         i = 0;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_packed_desc_read(vdev, &desc, desc_cache, i, false);
     }
 
     /* Collect all the descriptors */
@@ -717,21 +1623,24 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         }
 
         /* If we've got too many, that implies a descriptor loop. */
-        if ((in_num + out_num) > max) {
+        if (++elem_entries > max) {
             virtio_error(vdev, "Looped descriptor");
             goto err_undo_map;
         }
 
-        rc = virtqueue_read_next_desc(vdev, &desc, desc_pa, max, &i);
+        rc = virtqueue_packed_read_next_desc(vq, &desc, desc_cache, max, &i,
+                                             desc_cache ==
+                                             &indirect_desc_cache);
     } while (rc == VIRTQUEUE_READ_DESC_MORE);
 
-    if (rc == VIRTQUEUE_READ_DESC_ERROR) {
-        goto err_undo_map;
-    }
-
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
-    elem->index = head;
+    if (pooled) {
+        elem = virtqueue_alloc_pooled_element(vq, sz, out_num, in_num);
+    } else {
+        elem = virtqueue_alloc_element(sz, out_num, in_num);
+    }
+    elem->index = id;
+    elem->ndescs = desc_cache == &indirect_desc_cache ? 1 : elem_entries;
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -741,14 +1650,67 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         elem->in_sg[i] = iov[out_num + i];
     }
 
-    vq->inuse++;
+    vq->inuse += elem->ndescs;
+    vq->last_avail_idx += elem->ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter ^= 1;
+    }
+    vq->shadow_avail_idx = vq->last_avail_idx;
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+    }
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    rcu_read_unlock();
     return elem;
 
 err_undo_map:
     virtqueue_undo_map_desc(out_num, in_num, iov);
-    return NULL;
+    goto done;
+}
+
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_pop(vq, sz, false);
+    }
+    return virtqueue_split_pop(vq, sz);
+}
+
+/* virtqueue_pop_batch:
+ * @vq: The #VirtQueue
+ * @sz: Size of the element to allocate, as for virtqueue_pop()
+ * @elems: Array receiving the popped elements
+ * @max: Size of @elems
+ *
+ * Pop up to @max elements at once.  On split rings the available index is
+ * read once and the heads are fetched in bulk.  The elements come from a
+ * per-queue pool and must be released with virtqueue_free_element().
+ *
+ * Returns: the number of elements stored in @elems, 0 if the queue is
+ * empty or broken.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int n;
+
+    if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_split_pop_batch(vq, sz, elems, max);
+    }
+
+    /* Packed rings have no separate avail ring to prefetch from */
+    for (n = 0; n < max; n++) {
+        elems[n] = virtqueue_packed_pop(vq, sz, true);
+        if (!elems[n]) {
+            break;
+        }
+    }
+    return n;
 }
 
 /* Reading and writing a structure directly to QEMUFile is *awful*, but
@@ -768,7 +1730,7 @@ typedef struct VirtQueueElementOld {
     struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
 } VirtQueueElementOld;
 
-void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
 {
     VirtQueueElement *elem;
     VirtQueueElementOld data;
@@ -788,6 +1750,12 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
 
     elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
     elem->index = data.index;
+    elem->ndescs = 1;
+
+    /* The guest features are not loaded yet, go by the host ones */
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        elem->ndescs = qemu_get_be32(f);
+    }
 
     for (i = 0; i < elem->in_num; i++) {
         elem->in_addr[i] = data.in_addr[i];
@@ -813,7 +1781,8 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
     return elem;
 }
 
-void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
+                                VirtQueueElement *elem)
 {
     VirtQueueElementOld data;
     int i;
@@ -842,6 +1811,10 @@ void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
         data.out_sg[i].iov_len = elem->out_sg[i].iov_len;
     }
     qemu_put_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
+
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_put_be32(f, elem->ndescs);
+    }
 }
 
 /* virtio device */
@@ -958,6 +1931,14 @@ void virtio_reset(void *opaque)
         vdev->vq[i].notification = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
         vdev->vq[i].inuse = 0;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
+        if (vdev->vq[i].irq_timer) {
+            timer_del(vdev->vq[i].irq_timer);
+        }
+        vdev->vq[i].irq_pending = false;
+        vdev->vq[i].irq_batched = 0;
+        virtio_init_region_cache(vdev, i);
     }
 }
 
@@ -1173,6 +2154,7 @@ void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
     vdev->vq[n].vring.desc = desc;
     vdev->vq[n].vring.avail = avail;
     vdev->vq[n].vring.used = used;
+    virtio_init_region_cache(vdev, n);
 }
 
 void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
@@ -1301,6 +2283,18 @@ void virtio_queue_set_vector(VirtIODevice *vdev, int n, uint16_t vector)
     }
 }
 
+static void virtio_irq_timer_cb(void *opaque);
+
+static void virtio_irq_timer_free(VirtQueue *vq)
+{
+    if (vq->irq_timer) {
+        timer_del(vq->irq_timer);
+        timer_free(vq->irq_timer);
+        vq->irq_timer = NULL;
+    }
+    vq->irq_pending = false;
+}
+
 VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
                             VirtIOHandleOutput handle_output)
 {
@@ -1319,6 +2313,9 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
     vdev->vq[i].handle_aio_output = NULL;
+    vdev->vq[i].used_elems = g_new0(VRingPackedUsed, VIRTQUEUE_MAX_SIZE);
+    vdev->vq[i].irq_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                         virtio_irq_timer_cb, &vdev->vq[i]);
 
     return &vdev->vq[i];
 }
@@ -1331,6 +2328,11 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
 
     vdev->vq[n].vring.num = 0;
     vdev->vq[n].vring.num_default = 0;
+    g_free(vdev->vq[n].used_elems);
+    vdev->vq[n].used_elems = NULL;
+    virtqueue_elem_pool_destroy(&vdev->vq[n]);
+    virtio_irq_timer_free(&vdev->vq[n]);
+    virtio_init_region_cache(vdev, n);
 }
 
 static void virtio_set_isr(VirtIODevice *vdev, int value)
@@ -1345,17 +2347,11 @@ static void virtio_set_isr(VirtIODevice *vdev, int value)
     }
 }
 
-bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+/* Called within rcu_read_lock().  */
+static bool virtio_split_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
     bool v;
-    /* We need to expose used array entries before checking used event. */
-    smp_mb();
-    /* Always notify when queue is empty (when feature acknowledge) */
-    if (virtio_vdev_has_feature(vdev, VIRTIO_F_NOTIFY_ON_EMPTY) &&
-        !vq->inuse && virtio_queue_empty(vq)) {
-        return true;
-    }
 
     if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
@@ -1368,9 +2364,181 @@ bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
     return !v || vring_need_event(vring_get_used_event(vq), new, old);
 }
 
+static bool vring_packed_need_event(VirtQueue *vq, bool wrap,
+                                    uint16_t off_wrap, uint16_t new,
+                                    uint16_t old)
+{
+    int off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    if (wrap != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+
+    return vring_need_event(off, new, old);
+}
+
+/* Called within rcu_read_lock().  */
+static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    VRingPackedDescEvent e;
+    uint16_t old, new;
+    bool v;
+
+    if (!caches) {
+        return false;
+    }
+
+    vring_packed_event_read(vdev, &caches->avail, &e);
+
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+
+    if (e.flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (e.flags == VRING_PACKED_EVENT_FLAG_ENABLE) {
+        return true;
+    }
+
+    return !v || vring_packed_need_event(vq, vq->used_wrap_counter,
+                                         e.off_wrap, new, old);
+}
+
+bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    bool ret;
+
+    /* We need to expose used array entries before checking used event. */
+    smp_mb();
+    /* Always notify when queue is empty (when feature acknowledge) */
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_NOTIFY_ON_EMPTY) &&
+        !vq->inuse && virtio_queue_empty(vq)) {
+        return true;
+    }
+
+    rcu_read_lock();
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        ret = virtio_packed_should_notify(vdev, vq);
+    } else {
+        ret = virtio_split_should_notify(vdev, vq);
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+/* Completion rates, in batches per second, between which the adaptive
+ * mode scales the delay from nothing up to irq-coalesce-usecs. */
+#define VIRTIO_IRQ_ADAPTIVE_LOW_RATE    10000
+#define VIRTIO_IRQ_ADAPTIVE_HIGH_RATE   100000
+#define VIRTIO_IRQ_RATE_WINDOW_NS       (10 * SCALE_MS)
+
+static int64_t virtio_irq_coalesce_delay(VirtIODevice *vdev, VirtQueue *vq,
+                                         int64_t now)
+{
+    VirtIOIRQCoalesceConf *conf = &vdev->irq_coalesce;
+    int64_t max_delay = (int64_t)conf->usecs * SCALE_US;
+    int64_t elapsed = now - vq->irq_rate_start;
+
+    vq->irq_rate_count++;
+    if (elapsed >= VIRTIO_IRQ_RATE_WINDOW_NS) {
+        vq->irq_rate = (uint64_t)vq->irq_rate_count * NANOSECONDS_PER_SECOND /
+                       elapsed;
+        vq->irq_rate_start = now;
+        vq->irq_rate_count = 0;
+
+        if (vq->irq_rate <= VIRTIO_IRQ_ADAPTIVE_LOW_RATE) {
+            vq->irq_delay_ns = 0;
+        } else if (vq->irq_rate >= VIRTIO_IRQ_ADAPTIVE_HIGH_RATE) {
+            vq->irq_delay_ns = max_delay;
+        } else {
+            vq->irq_delay_ns = max_delay *
+                (vq->irq_rate - VIRTIO_IRQ_ADAPTIVE_LOW_RATE) /
+                (VIRTIO_IRQ_ADAPTIVE_HIGH_RATE - VIRTIO_IRQ_ADAPTIVE_LOW_RATE);
+        }
+    }
+
+    return conf->adaptive ? vq->irq_delay_ns : max_delay;
+}
+
+/* Called for each completion batch, in the thread that completes requests.
+ * Returns true if an interrupt must be raised right away; otherwise it may
+ * have been left to irq_timer, which fires at most irq-coalesce-usecs
+ * after the first completion it covers.
+ */
+static bool virtio_irq_needed(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOIRQCoalesceConf *conf = &vdev->irq_coalesce;
+    int64_t now, delay;
+    bool notify;
+
+    if (!conf->usecs) {
+        notify = virtio_should_notify(vdev, vq);
+        vq->irq_raised += notify;
+        return notify;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    delay = virtio_irq_coalesce_delay(vdev, vq, now);
+    notify = virtio_should_notify(vdev, vq);
+    if (!notify && !atomic_read(&vq->irq_pending)) {
+        return false;
+    }
+
+    vq->irq_batched++;
+    if (!delay || (conf->frames && vq->irq_batched >= conf->frames)) {
+        /* Raise it now, covering whatever the timer was holding back */
+        if (atomic_xchg(&vq->irq_pending, false)) {
+            timer_del(vq->irq_timer);
+            vq->irq_coalesced++;
+        } else {
+            vq->irq_raised++;
+        }
+        vq->irq_batched = 0;
+        return true;
+    }
+
+    if (atomic_xchg(&vq->irq_pending, true)) {
+        vq->irq_coalesced++;
+    } else {
+        vq->irq_raised++;
+        vq->irq_batched = 1;
+        timer_mod(vq->irq_timer, now + delay);
+    }
+    return false;
+}
+
+/* Runs in the main loop, so it can use virtio_notify_vector() even for
+ * queues whose completions go through virtio_notify_irqfd().
+ */
+static void virtio_irq_timer_cb(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    if (atomic_xchg(&vq->irq_pending, false)) {
+        trace_virtio_notify(vq->vdev, vq);
+        virtio_set_isr(vq->vdev, 0x1);
+        virtio_notify_vector(vq->vdev, vq->vector);
+    }
+}
+
+/* Deliver any interrupt still held back, e.g. before the VM stops */
+static void virtio_irq_coalesce_flush(VirtIODevice *vdev)
+{
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].irq_timer) {
+            timer_del(vdev->vq[i].irq_timer);
+            virtio_irq_timer_cb(&vdev->vq[i]);
+        }
+    }
+}
+
 void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
 {
-    if (!virtio_should_notify(vdev, vq)) {
+    if (!virtio_irq_needed(vdev, vq)) {
         return;
     }
 
@@ -1397,7 +2565,7 @@ void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
 
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
-    if (!virtio_should_notify(vdev, vq)) {
+    if (!virtio_irq_needed(vdev, vq)) {
         return;
     }
 
@@ -1442,6 +2610,13 @@ static bool virtio_virtqueue_needed(void *opaque)
     return virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1);
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
 static bool virtio_ringsize_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1495,6 +2670,32 @@ static const VMStateDescription vmstate_virtio_virtqueues = {
     }
 };
 
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(last_avail_idx, struct VirtQueue),
+        VMSTATE_BOOL(last_avail_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(used_idx, struct VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT32(inuse, struct VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_packed_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ringsize = {
     .name = "ringsize_state",
     .version_id = 1,
@@ -1610,6 +2811,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_64bit_features,
         &vmstate_virtio_virtqueues,
         &vmstate_virtio_ringsize,
+        &vmstate_virtio_packed_virtqueues,
         &vmstate_virtio_broken,
         &vmstate_virtio_extra_state,
         NULL
@@ -1851,9 +3053,20 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
         }
     }
 
+    rcu_read_lock();
     for (i = 0; i < num; i++) {
         if (vdev->vq[i].vring.desc) {
             uint16_t nheads;
+
+            /* The virtio-1 ring addresses come from a subsection */
+            virtio_init_region_cache(vdev, i);
+
+            /* All of the packed ring state comes from a subsection too */
+            if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+                vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
+                continue;
+            }
+
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
             if (nheads > vdev->vq[i].vring.num) {
@@ -1862,6 +3075,7 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                              i, vdev->vq[i].vring.num,
                              vring_avail_idx(&vdev->vq[i]),
                              vdev->vq[i].last_avail_idx, nheads);
+                rcu_read_unlock();
                 return -1;
             }
             vdev->vq[i].used_idx = vring_used_idx(&vdev->vq[i]);
@@ -1881,17 +3095,31 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                              i, vdev->vq[i].vring.num,
                              vdev->vq[i].last_avail_idx,
                              vdev->vq[i].used_idx);
+                rcu_read_unlock();
                 return -1;
             }
         }
     }
+    rcu_read_unlock();
 
     return 0;
 }
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
     qemu_del_vm_change_state_handler(vdev->vmstate);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        VRingMemoryRegionCaches *caches = vdev->vq[i].vring.caches;
+
+        if (caches) {
+            call_rcu(caches, virtio_free_region_cache, rcu);
+        }
+        g_free(vdev->vq[i].used_elems);
+        virtqueue_elem_pool_destroy(&vdev->vq[i]);
+        virtio_irq_timer_free(&vdev->vq[i]);
+    }
     g_free(vdev->config);
     g_free(vdev->vq);
     g_free(vdev->vector_queues);
@@ -1916,6 +3144,10 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
     if (!backend_run) {
         virtio_set_status(vdev, vdev->status);
     }
+
+    if (!running) {
+        virtio_irq_coalesce_flush(vdev);
+    }
 }
 
 void virtio_instance_init_common(Object *proxy_obj, void *data,
@@ -1991,25 +3223,87 @@ hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint16_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
 
-uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
+/*
+ * For a packed ring, the low 16 bits hold last_avail_idx and the high
+ * 16 bits used_idx, each with its wrap counter in bit 15.  This is the
+ * layout vhost backends use for the ring base.
+ */
+unsigned int virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+    unsigned int avail, used;
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return vq->last_avail_idx;
+    }
+
+    avail = vq->last_avail_idx |
+        vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+    used = vq->used_idx |
+        vq->used_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+    return avail | used << 16;
+}
+
+void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n,
+                                     unsigned int idx)
 {
-    return vdev->vq[n].last_avail_idx;
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        vq->last_avail_idx = idx;
+        vq->shadow_avail_idx = idx;
+        return;
+    }
+
+    vq->last_avail_idx = idx & 0x7fff;
+    vq->shadow_avail_idx = vq->last_avail_idx;
+    vq->last_avail_wrap_counter = !!(idx & 0x8000);
+    idx >>= 16;
+    vq->used_idx = idx & 0x7fff;
+    vq->used_wrap_counter = !!(idx & 0x8000);
 }
 
-void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
+/*
+ * Rewind the ring to the last descriptor the device has returned, for
+ * when a vhost backend went away without telling us how far it got.
+ * Requests it had taken but not completed are seen again.
+ */
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
 {
-    vdev->vq[n].last_avail_idx = idx;
-    vdev->vq[n].shadow_avail_idx = idx;
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        /*
+         * No used index in guest memory, go by the last one we know.  That
+         * is stale if a vhost backend owned the ring, which is why vhost-user
+         * devices do not offer packed rings.
+         */
+        vq->last_avail_idx = vq->used_idx;
+        vq->shadow_avail_idx = vq->used_idx;
+        vq->last_avail_wrap_counter = vq->used_wrap_counter;
+    } else if (vq->vring.desc) {
+        rcu_read_lock();
+        vq->used_idx = vring_used_idx(vq);
+        vq->last_avail_idx = vq->used_idx;
+        vq->shadow_avail_idx = vq->used_idx;
+        rcu_read_unlock();
+    }
 }
 
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
@@ -2137,6 +3431,9 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         error_propagate(errp, err);
         return;
     }
+
+    vdev->listener.commit = virtio_memory_listener_commit;
+    memory_listener_register(&vdev->listener, &address_space_memory);
 }
 
 static void virtio_device_unrealize(DeviceState *dev, Error **errp)
@@ -2146,6 +3443,7 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     Error *err = NULL;
 
     virtio_bus_device_unplugged(vdev);
+    memory_listener_unregister(&vdev->listener);
 
     if (vdc->unrealize != NULL) {
         vdc->unrealize(dev, &err);
@@ -2256,6 +3554,37 @@ void virtio_device_release_ioeventfd(VirtIODevice *vdev)
     virtio_bus_release_ioeventfd(vbus);
 }
 
+/* Interrupt moderation statistics, summed over all queues */
+static void virtio_device_get_irq_stat(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(obj);
+    size_t offset = (uintptr_t)opaque;
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; vdev->vq && i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.num) {
+            value += *(uint64_t *)((void *)&vdev->vq[i] + offset);
+        }
+    }
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void virtio_device_instance_init(Object *obj)
+{
+    object_property_add(obj, "irq-raised", "uint64",
+                        virtio_device_get_irq_stat, NULL, NULL,
+                        (void *)offsetof(VirtQueue, irq_raised), NULL);
+    object_property_add(obj, "irq-coalesced", "uint64",
+                        virtio_device_get_irq_stat, NULL, NULL,
+                        (void *)offsetof(VirtQueue, irq_coalesced), NULL);
+    object_property_add(obj, "irq-rate", "uint64",
+                        virtio_device_get_irq_stat, NULL, NULL,
+                        (void *)offsetof(VirtQueue, irq_rate), NULL);
+}
+
 static void virtio_device_class_init(ObjectClass *klass, void *data)
 {
     /* Set the default value here. */
@@ -2284,6 +3613,7 @@ static const TypeInfo virtio_device_info = {
     .name = TYPE_VIRTIO_DEVICE,
     .parent = TYPE_DEVICE,
     .instance_size = sizeof(VirtIODevice),
+    .instance_init = virtio_device_instance_init,
     .class_init = virtio_device_class_init,
     .abstract = true,
     .class_size = sizeof(VirtioDeviceClass),
@@ -273,6 +273,8 @@ struct AddressSpace {
 
     /* Accessed via RCU.  */
     struct FlatView *current_map;
+    /* New view being installed by a transaction commit, NULL otherwise */
+    struct FlatView *next_map;
 
     int ioeventfd_nb;
     struct MemoryRegionIoeventfd *ioeventfds;
@@ -1530,6 +1532,114 @@ MemTxResult address_space_read(AddressSpace *as, hwaddr addr, MemTxAttrs attrs,
     return result;
 }
 
+/* MemoryRegionCache: a translation of a fixed range of an address space,
+ * for devices that access the same guest memory over and over (for
+ * example virtio rings).
+ *
+ * If the range lies entirely within RAM the cache holds a reference to
+ * the RAM's memory region and accesses go straight to the host pointer,
+ * skipping address_space_translate.  Otherwise every access falls back
+ * to the regular address_space_* functions.  Either way the cache must
+ * be rebuilt when the memory map changes, typically from the commit
+ * callback of a #MemoryListener; the old cache must only be destroyed
+ * after concurrent users are done with it, e.g. with call_rcu.
+ */
+typedef struct MemoryRegionCache {
+    void *ptr;
+    hwaddr xlat;
+    hwaddr addr;
+    hwaddr len;
+    AddressSpace *as;
+    MemoryRegion *mr;
+} MemoryRegionCache;
+
+#define MEMORY_REGION_CACHE_INVALID ((MemoryRegionCache) { .mr = NULL })
+
+/* address_space_cache_init: prepare for repeated access to a guest
+ * memory range
+ *
+ * @cache: #MemoryRegionCache to be filled
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @len: length of the range
+ * @is_write: whether the range will be written to
+ */
+void address_space_cache_init(MemoryRegionCache *cache, AddressSpace *as,
+                              hwaddr addr, hwaddr len, bool is_write);
+
+/* address_space_cache_invalidate: complete a write done through the host
+ * pointer of a #MemoryRegionCache, marking the range as dirty
+ *
+ * @cache: the #MemoryRegionCache
+ * @addr: offset of the written area within the cached range
+ * @access_len: length of the written area
+ */
+void address_space_cache_invalidate(MemoryRegionCache *cache, hwaddr addr,
+                                    hwaddr access_len);
+
+/* address_space_cache_destroy: release the resources held by a
+ * #MemoryRegionCache
+ *
+ * @cache: the #MemoryRegionCache
+ */
+void address_space_cache_destroy(MemoryRegionCache *cache);
+
+void address_space_write_cached(MemoryRegionCache *cache, hwaddr addr,
+                                const void *buf, int len);
+void address_space_stw_le_cached(MemoryRegionCache *cache, hwaddr addr,
+                                 uint32_t val, MemTxAttrs attrs,
+                                 MemTxResult *result);
+void address_space_stw_be_cached(MemoryRegionCache *cache, hwaddr addr,
+                                 uint32_t val, MemTxAttrs attrs,
+                                 MemTxResult *result);
+
+/* address_space_read_cached: read from a cached range.  @addr is relative
+ * to the start of the range and the access must lie within it.
+ */
+static inline void address_space_read_cached(MemoryRegionCache *cache,
+                                             hwaddr addr, void *buf, int len)
+{
+    assert(addr < cache->len && len <= cache->len - addr);
+    if (likely(cache->ptr)) {
+        memcpy(buf, cache->ptr + addr, len);
+    } else {
+        address_space_read(cache->as, cache->addr + addr,
+                           MEMTXATTRS_UNSPECIFIED, buf, len);
+    }
+}
+
+static inline uint32_t address_space_lduw_le_cached(MemoryRegionCache *cache,
+                                                    hwaddr addr,
+                                                    MemTxAttrs attrs,
+                                                    MemTxResult *result)
+{
+    assert(addr < cache->len && 2 <= cache->len - addr);
+    if (likely(cache->ptr)) {
+        if (result) {
+            *result = MEMTX_OK;
+        }
+        return lduw_le_p(cache->ptr + addr);
+    }
+    return address_space_lduw_le(cache->as, cache->addr + addr,
+                                 attrs, result);
+}
+
+static inline uint32_t address_space_lduw_be_cached(MemoryRegionCache *cache,
+                                                    hwaddr addr,
+                                                    MemTxAttrs attrs,
+                                                    MemTxResult *result)
+{
+    assert(addr < cache->len && 2 <= cache->len - addr);
+    if (likely(cache->ptr)) {
+        if (result) {
+            *result = MEMTX_OK;
+        }
+        return lduw_be_p(cache->ptr + addr);
+    }
+    return address_space_lduw_be(cache->as, cache->addr + addr,
+                                 attrs, result);
+}
+
 #endif
 
 #endif
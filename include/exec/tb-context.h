@@ -26,6 +26,12 @@
 #define CODE_GEN_HTABLE_BITS     15
 #define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
+/* code_gen_buffer is split into this many regions, filled in turn.  When
+ * the buffer is full, the oldest region is reclaimed instead of flushing
+ * all the translations.
+ */
+#define CODE_GEN_REGIONS         8
+
 typedef struct TranslationBlock TranslationBlock;
 typedef struct TBContext TBContext;
 
@@ -37,8 +43,19 @@ struct TBContext {
     /* any access to the tbs or the page table must use this lock */
     QemuMutex tb_lock;
 
+    /* Region N owns the code in [code_gen_buffer + N * region_size,
+     * code_gen_buffer + (N + 1) * region_size) and the TBs in
+     * tbs[N * region_max_tbs] onwards, sorted by tc_ptr.  The last
+     * region also gets whatever is left at the end of the buffer.
+     */
+    size_t region_size;
+    int region_max_tbs;
+    int region_cur;
+    int region_nb_tbs[CODE_GEN_REGIONS];
+
     /* statistics */
     unsigned tb_flush_count;
+    unsigned tb_region_evict_count;
     int tb_phys_invalidate_count;
 };
 
@@ -0,0 +1,36 @@
+/*
+ * vhost-user-blk host device
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#ifndef VHOST_USER_BLK_H
+#define VHOST_USER_BLK_H
+
+#include "standard-headers/linux/virtio_blk.h"
+#include "hw/qdev.h"
+#include "hw/virtio/virtio.h"
+#include "hw/virtio/vhost.h"
+#include "sysemu/char.h"
+
+#define TYPE_VHOST_USER_BLK "vhost-user-blk"
+#define VHOST_USER_BLK(obj) \
+        OBJECT_CHECK(VHostUserBlk, (obj), TYPE_VHOST_USER_BLK)
+
+typedef struct VHostUserBlk {
+    VirtIODevice parent_obj;
+    CharBackend chardev;
+    int32_t bootindex;
+    uint16_t num_queues;
+    uint32_t queue_size;
+
+    /* configuration space as read from the backend, little endian */
+    struct virtio_blk_config blkcfg;
+
+    Error *migration_blocker;
+    struct vhost_dev dev;
+} VHostUserBlk;
+
+#endif
@@ -36,6 +36,20 @@ struct vhost_log {
     vhost_log_chunk_t *log;
 };
 
+/*
+ * Shared memory in which the backend logs the descriptors it is
+ * processing, so that it can resubmit them after a reconnect.  The
+ * layout is up to the backend.  It belongs to the frontend and
+ * outlives the vhost_dev, which is torn down on disconnect.
+ */
+struct vhost_inflight {
+    int fd;
+    void *addr;
+    uint64_t size;
+    uint64_t offset;
+    uint16_t queue_size;
+};
+
 struct vhost_memory;
 struct vhost_dev {
     MemoryListener memory_listener;
@@ -61,9 +75,24 @@ struct vhost_dev {
     const VhostOps *vhost_ops;
     void *opaque;
     struct vhost_log *log;
+    struct vhost_inflight *inflight;
+    /* the device being served, set while the backend is started */
+    VirtIODevice *vdev;
+    /* look up worker_tid when the backend gets its owner */
+    bool find_worker;
+    /* host thread that processes the virtqueues, 0 if unknown */
+    pid_t worker_tid;
+    uint32_t busyloop_timeout;
     QLIST_ENTRY(vhost_dev) entry;
 };
 
+typedef struct VhostWorkerStats {
+    pid_t tid;
+    int cpu;                    /* the CPU the worker last ran on */
+    uint64_t utime_ms;
+    uint64_t stime_ms;
+} VhostWorkerStats;
+
 int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
                    VhostBackendType backend_type,
                    uint32_t busyloop_timeout);
@@ -88,6 +117,24 @@ void vhost_ack_features(struct vhost_dev *hdev, const int *feature_bits,
                         uint64_t features);
 bool vhost_has_free_slot(void);
 
+void vhost_dev_free_inflight(struct vhost_inflight *inflight);
+
+/* Change how long the backend polls each virtqueue before sleeping. */
+int vhost_dev_set_busyloop_timeout(struct vhost_dev *hdev, uint32_t timeout);
+
+/* Pin the worker thread of the backend to a single host CPU. */
+int vhost_dev_set_worker_affinity(struct vhost_dev *hdev, int cpu);
+
+/* Live statistics, for the monitor. */
+int vhost_dev_get_worker_stats(struct vhost_dev *hdev,
+                               VhostWorkerStats *stats);
+int vhost_virtqueue_get_indices(struct vhost_dev *hdev, int n,
+                                uint16_t *avail_idx, uint16_t *used_idx);
+
+/* Read the device configuration space from the backend. */
+int vhost_dev_get_config(struct vhost_dev *hdev, uint8_t *config,
+                         uint32_t config_len);
+
 int vhost_net_set_backend(struct vhost_dev *hdev,
                           struct vhost_vring_file *file);
 
@@ -34,6 +34,8 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *iothreads;            /* more IOThreads for the queues, ':' list */
+    char *vq_iothreads;         /* initial IOThread of each queue */
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
@@ -70,10 +72,15 @@ typedef struct VirtIOBlockReq {
     struct VirtIOBlockReq *next;
     struct VirtIOBlockReq *mr_next;
     BlockAcctCookie acct;
+    bool deferred;              /* to be pushed by the virtqueue's owner */
+    QSLIST_ENTRY(VirtIOBlockReq) done_next;
 } VirtIOBlockReq;
 
 #define VIRTIO_BLK_MAX_MERGE_REQS 32
 
+/* Requests taken off the queue per virtqueue_pop_batch() call */
+#define VIRTIO_BLK_POP_BATCH 32
+
 typedef struct MultiReqBuffer {
     VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
     unsigned int num_reqs;
@@ -81,5 +88,6 @@ typedef struct MultiReqBuffer {
 } MultiReqBuffer;
 
 void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
+void virtio_blk_push_request(VirtIOBlockReq *req);
 
 #endif
@@ -16,6 +16,7 @@
 
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -36,6 +37,8 @@ typedef struct virtio_net_conf
     int32_t txburst;
     char *tx;
     uint16_t rx_queue_size;
+    IOThread *iothread;
+    bool rx_coalesce;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -50,6 +53,16 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /* While rx_batch is non-zero, used buffers are only flushed to the
+     * guest (and the guest notified) when the batch ends; rx_pending
+     * counts the filled but not yet flushed elements.
+     */
+    int rx_batch;
+    unsigned int rx_pending;
+    /* Software coalescing of TCP segments received in a batch, only
+     * used when the peer cannot pass offloaded frames itself.
+     */
+    struct NetRxCoalesce *rsc;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -96,6 +109,11 @@ typedef struct VirtIONet {
     QEMUTimer *announce_timer;
     int announce_counter;
     bool needs_vnet_hdr_swap;
+    /* With an iothread, the rx/tx virtqueues and the peers' packet path
+     * run in its AioContext while the device is started without vhost.
+     */
+    AioContext *ctx;
+    bool dataplane_started;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
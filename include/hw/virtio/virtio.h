@@ -17,6 +17,7 @@
 #include "hw/hw.h"
 #include "net/net.h"
 #include "hw/qdev.h"
+#include "exec/memory.h"
 #include "sysemu/sysemu.h"
 #include "qemu/event_notifier.h"
 #include "standard-headers/linux/virtio_config.h"
@@ -44,6 +45,8 @@ typedef struct VirtQueue VirtQueue;
 typedef struct VirtQueueElement
 {
     unsigned int index;
+    unsigned int ndescs;    /* ring slots taken, for packed rings */
+    bool pooled;            /* recycled by virtqueue_free_element */
     unsigned int out_num;
     unsigned int in_num;
     hwaddr *in_addr;
@@ -54,6 +57,11 @@ typedef struct VirtQueueElement
 
 #define VIRTIO_QUEUE_MAX 1024
 
+/* Per-queue element pool used by virtqueue_pop_batch(): number of elements
+ * kept, and number of segments each of them has room for. */
+#define VIRTQUEUE_ELEM_POOL_SIZE 64
+#define VIRTQUEUE_ELEM_POOL_SG 16
+
 #define VIRTIO_NO_VECTOR 0xffff
 
 #define TYPE_VIRTIO_DEVICE "virtio-device"
@@ -70,6 +78,13 @@ enum virtio_device_endian {
     VIRTIO_DEVICE_ENDIAN_BIG,
 };
 
+/* Host-side interrupt moderation, see virtio_notify() */
+typedef struct VirtIOIRQCoalesceConf {
+    uint32_t usecs;     /* longest an interrupt may be held back, 0: off */
+    uint32_t frames;    /* completion batches per interrupt, 0: no limit */
+    bool adaptive;      /* scale the delay with the completion rate */
+} VirtIOIRQCoalesceConf;
+
 struct VirtIODevice
 {
     DeviceState parent_obj;
@@ -93,6 +108,8 @@ struct VirtIODevice
     uint8_t device_endian;
     bool use_guest_notifier_mask;
     QLIST_HEAD(, VirtQueue) *vector_queues;
+    MemoryListener listener;
+    VirtIOIRQCoalesceConf irq_coalesce;
 };
 
 typedef struct VirtioDeviceClass {
@@ -172,8 +189,12 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 
 void virtqueue_map(VirtQueueElement *elem);
 void *virtqueue_pop(VirtQueue *vq, size_t sz);
-void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz);
-void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem);
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max);
+void virtqueue_free_element(VirtQueue *vq, void *elem);
+void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz);
+void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
+                                VirtQueueElement *elem);
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
                           unsigned int out_bytes);
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
@@ -255,7 +276,14 @@ typedef struct VirtIORNGConf VirtIORNGConf;
     DEFINE_PROP_BIT64("notify_on_empty", _state, _field,  \
                       VIRTIO_F_NOTIFY_ON_EMPTY, true), \
     DEFINE_PROP_BIT64("any_layout", _state, _field, \
-                      VIRTIO_F_ANY_LAYOUT, true)
+                      VIRTIO_F_ANY_LAYOUT, true), \
+    DEFINE_PROP_BIT64("packed", _state, _field, \
+                      VIRTIO_F_RING_PACKED, false)
+
+#define DEFINE_VIRTIO_IRQ_COALESCE_PROPERTIES(_state, _field) \
+    DEFINE_PROP_UINT32("irq-coalesce-usecs", _state, _field.usecs, 0), \
+    DEFINE_PROP_UINT32("irq-coalesce-frames", _state, _field.frames, 0), \
+    DEFINE_PROP_BOOL("irq-coalesce-adaptive", _state, _field.adaptive, false)
 
 hwaddr virtio_queue_get_desc_addr(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_avail_addr(VirtIODevice *vdev, int n);
@@ -263,8 +291,10 @@ hwaddr virtio_queue_get_used_addr(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n);
-uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n);
-void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx);
+unsigned int virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n);
+void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n,
+                                     unsigned int idx);
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n);
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n);
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n);
 uint16_t virtio_get_queue_index(VirtQueue *vq);
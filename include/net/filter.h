@@ -28,7 +28,7 @@ typedef void (FilterCleanup) (NetFilterState *nf);
  *   0: finished handling the packet, we should continue
  *   size: filter stolen this packet, we stop pass this packet further
  */
-typedef ssize_t (FilterReceiveIOV)(NetFilterState *nc,
+typedef ssize_t (FilterReceiveIOV)(NetFilterQueue *fq,
                                    NetClientState *sender,
                                    unsigned flags,
                                    const struct iovec *iov,
@@ -46,8 +46,25 @@ typedef struct NetFilterClass {
     FilterStatusChanged *status_changed;
     /* mandatory */
     FilterReceiveIOV *receive_iov;
+    /* receive_iov may run for different queues of a multiqueue netdev
+     * concurrently, so it must only touch per-queue or thread-safe state.
+     * Filters without it can only be attached to single queue netdevs.
+     */
+    bool multiqueue;
 } NetFilterClass;
 
+/* The attachment of a filter to one queue of its netdev */
+struct NetFilterQueue {
+    NetFilterState *nf;
+    NetClientState *netdev;
+    int index;
+    /* Only updated from the context that runs the queue, so they can
+     * be read without locking; a reader may see slightly stale values.
+     */
+    uint64_t packets;
+    uint64_t bytes;
+    QTAILQ_ENTRY(NetFilterQueue) next;
+};
 
 struct NetFilterState {
     /* private */
@@ -55,13 +72,14 @@ struct NetFilterState {
 
     /* protected */
     char *netdev_id;
-    NetClientState *netdev;
+    NetClientState *netdev;         /* the first queue */
     NetFilterDirection direction;
     bool on;
-    QTAILQ_ENTRY(NetFilterState) next;
+    int queues;
+    NetFilterQueue *fq;             /* one per queue */
 };
 
-ssize_t qemu_netfilter_receive(NetFilterState *nf,
+ssize_t qemu_netfilter_receive(NetFilterQueue *fq,
                                NetFilterDirection direction,
                                NetClientState *sender,
                                unsigned flags,
@@ -69,7 +87,7 @@ ssize_t qemu_netfilter_receive(NetFilterState *nf,
                                int iovcnt,
                                NetPacketSent *sent_cb);
 
-/* pass the packet to the next filter */
+/* pass the packet to the filter after OPAQUE, a NetFilterQueue */
 ssize_t qemu_netfilter_pass_to_next(NetClientState *sender,
                                     unsigned flags,
                                     const struct iovec *iov,
@@ -50,6 +50,7 @@ typedef void (NetPoll)(NetClientState *, bool enable);
 typedef int (NetCanReceive)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef void (NetReceiveBatch)(NetClientState *, bool start);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
@@ -62,6 +63,7 @@ typedef void (SetOffload)(NetClientState *, int, int, int, int, int);
 typedef void (SetVnetHdrLen)(NetClientState *, int);
 typedef int (SetVnetLE)(NetClientState *, bool);
 typedef int (SetVnetBE)(NetClientState *, bool);
+typedef void (NetAioContextChanged)(NetClientState *, AioContext *old_ctx);
 typedef struct SocketReadState SocketReadState;
 typedef void (SocketReadStateFinalize)(SocketReadState *rs);
 
@@ -71,6 +73,11 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    /* Called with start=true before a burst of packets is delivered and
+     * with start=false once it is over, so that the receiver can defer
+     * per-packet work such as interrupting the guest.  Optional.
+     */
+    NetReceiveBatch *receive_batch;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
@@ -84,6 +91,10 @@ typedef struct NetClientInfo {
     SetVnetHdrLen *set_vnet_hdr_len;
     SetVnetLE *set_vnet_le;
     SetVnetBE *set_vnet_be;
+    /* Move the client's fd handlers etc. from OLD_CTX to nc->ctx.
+     * Clients without this hook can only run in the main loop.
+     */
+    NetAioContextChanged *aio_context_changed;
 } NetClientInfo;
 
 struct NetClientState {
@@ -100,7 +111,12 @@ struct NetClientState {
     unsigned int queue_index;
     unsigned rxfilter_notify_enabled:1;
     int vring_enable;
-    QTAILQ_HEAD(NetFilterHead, NetFilterState) filters;
+    QTAILQ_HEAD(NetFilterHead, NetFilterQueue) filters;
+    /* AioContext the packet path runs in, or NULL for the main loop.
+     * Code outside that context must hold it while sending packets or
+     * touching the queues and filters; see qemu_net_client_acquire.
+     */
+    AioContext *ctx;
 };
 
 typedef struct NICState {
@@ -154,6 +170,11 @@ ssize_t qemu_receive_packet_iov(NetClientState *nc,
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+void qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx);
+AioContext *qemu_net_client_acquire(NetClientState *nc);
+void qemu_net_client_release(AioContext *ctx);
+bool qemu_send_batch_begin(NetClientState *nc);
+void qemu_send_batch_end(NetClientState *nc, bool started);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
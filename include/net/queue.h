@@ -34,6 +34,13 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
 
+typedef struct NetQueueStats {
+    uint32_t len;               /* packets currently queued */
+    uint32_t highwater;         /* largest backlog seen */
+    uint64_t queued;            /* packets that had to be queued */
+    uint64_t dropped;           /* packets dropped because the queue was full */
+} NetQueueStats;
+
 /* Returns:
  *   >0 - success
  *    0 - queue packet for future redelivery
@@ -56,6 +63,8 @@ void qemu_net_queue_append_iov(NetQueue *queue,
 
 void qemu_del_net_queue(NetQueue *queue);
 
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats);
+
 ssize_t qemu_net_queue_receive(NetQueue *queue,
                                const uint8_t *data,
                                size_t size);
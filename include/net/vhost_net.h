@@ -11,7 +11,10 @@ typedef struct VhostNetOptions {
     VhostBackendType backend_type;
     NetClientState *net_backend;
     uint32_t busyloop_timeout;
+    /* host CPU for the worker thread of the backend, -1 to leave it alone */
+    int worker_cpu;
     void *opaque;
+    struct vhost_inflight *inflight;
 } VhostNetOptions;
 
 uint64_t vhost_net_get_max_queues(VHostNetState *net);
@@ -35,4 +38,8 @@ int vhost_set_vring_enable(NetClientState * nc, int enable);
 
 uint64_t vhost_net_get_acked_features(VHostNetState *net);
 
+uint32_t vhost_net_get_busyloop_timeout(VHostNetState *net);
+int vhost_net_set_busyloop_timeout(VHostNetState *net, uint32_t timeout);
+void vhost_net_print_info(Monitor *mon, VHostNetState *net);
+
 #endif
@@ -230,6 +230,23 @@ struct kvm_run;
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
 
+/* Second-level TB cache, indexed by the same physical hash as the global
+ * TB hash table.  Unlike tb_jmp_cache it survives TLB flushes.
+ */
+#define TB_PHYS_CACHE_BITS 10
+#define TB_PHYS_CACHE_SIZE (1 << TB_PHYS_CACHE_BITS)
+
+/* TB lookup statistics.  Only the vCPU thread updates them, with
+ * atomic_set, and other threads read them with atomic_read; they are
+ * unsigned long so that this works on 32-bit hosts too, where they wrap.
+ */
+typedef struct CPUTBLookupStats {
+    unsigned long jmp_cache_hits;
+    unsigned long phys_cache_hits;
+    unsigned long htable_lookups;
+    unsigned long translations;
+} CPUTBLookupStats;
+
 /* work queue */
 
 /* The union type allows passing of 64 bit target pointers on 32 bit
@@ -285,6 +302,8 @@ struct qemu_work_item;
  * @as: Pointer to the first AddressSpace, for the convenience of targets which
  *      only have a single AddressSpace
  * @env_ptr: Pointer to subclass-specific CPUArchState field.
+ * @tb_phys_cache: Per-vCPU cache of TBs, indexed by physical PC hash.
+ * @tb_stats: TB lookup statistics for this vCPU.
  * @gdb_regs: Additional GDB registers.
  * @gdb_num_regs: Number of total registers accessible to GDB.
  * @gdb_num_g_regs: Number of registers in GDB 'g' packets.
@@ -341,6 +360,12 @@ struct CPUState {
     /* Writes protected by tb_lock, reads not thread-safe  */
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
 
+    /* Written only by this vCPU and by tb_flush; entries are validated
+     * against the lookup key and tb->invalid, so no lock is needed.
+     */
+    struct TranslationBlock *tb_phys_cache[TB_PHYS_CACHE_SIZE];
+    CPUTBLookupStats tb_stats;
+
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
     int gdb_num_g_regs;
@@ -122,6 +122,21 @@ enum ListenerDirection { Forward, Reverse };
         }                                                               \
     } while (0)
 
+/* Like MEMORY_LISTENER_CALL_GLOBAL, but only for listeners whose address
+ * space gets a new FlatView in the transaction being committed.
+ */
+#define MEMORY_LISTENER_CALL_CHANGED(_callback)                         \
+    do {                                                                \
+        MemoryListener *_listener;                                      \
+                                                                        \
+        QTAILQ_FOREACH(_listener, &memory_listeners, link) {            \
+            if (_listener->_callback &&                                 \
+                _listener->address_space->next_map) {                   \
+                _listener->_callback(_listener);                        \
+            }                                                           \
+        }                                                               \
+    } while (0)
+
 #define MEMORY_LISTENER_CALL(_as, _callback, _direction, _section, _args...) \
     do {                                                                \
         MemoryListener *_listener;                                      \
@@ -255,6 +270,23 @@ static bool flatrange_equal(FlatRange *a, FlatRange *b)
         && a->readonly == b->readonly;
 }
 
+/* Same ranges, including dirty logging, so listeners would see no change */
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i]) ||
+            a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void flatview_init(FlatView *view)
 {
     view->ref = 1;
@@ -877,15 +909,172 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
-static void address_space_update_topology(AddressSpace *as)
+/* FlatViews rendered by the last transaction commit, keyed by the
+ * unaliased root region: address spaces whose roots resolve to the same
+ * region share one view, rendered only once.  While a commit renders the
+ * new views, old_flat_views holds the previous ones so that a view whose
+ * content did not change can be reused as is.  Each entry holds a
+ * reference to its view.
+ */
+static GHashTable *flat_views;
+static GHashTable *old_flat_views;
+
+/* Views being replaced in some address space by the current commit */
+static GHashTable *stale_views;
+
+static GHashTable *flatviews_new(void)
+{
+    return g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                 (GDestroyNotify) flatview_unref);
+}
+
+static void flatviews_begin(void)
+{
+    GHashTable *tmp;
+
+    if (!flat_views) {
+        flat_views = flatviews_new();
+        old_flat_views = flatviews_new();
+        stale_views = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+    tmp = old_flat_views;
+    old_flat_views = flat_views;
+    flat_views = tmp;
+}
+
+/* Drop what is not installed anymore, so that the regions it references
+ * can go away.
+ */
+static void flatviews_end(void)
+{
+    g_hash_table_remove_all(old_flat_views);
+    g_hash_table_remove_all(stale_views);
+}
+
+/* Find the region that really determines the topology below @mr, looking
+ * through aliases and containers that map a single region in its entirety
+ * at offset 0.  This is what makes the bus master address spaces of PCI
+ * devices, each an alias of the IOMMU or system memory root, share their
+ * FlatView (and hence their dispatch in exec.c).  NULL means empty.
+ */
+static MemoryRegion *memory_region_unalias_entire(MemoryRegion *mr)
+{
+    while (mr && mr->enabled) {
+        if (mr->readonly) {
+            return mr;
+        }
+        if (mr->alias) {
+            if (!mr->alias_offset && int128_ge(mr->size, mr->alias->size)) {
+                mr = mr->alias;
+                continue;
+            }
+        } else if (!mr->terminates) {
+            unsigned int found = 0;
+            MemoryRegion *child, *next = NULL;
+
+            QTAILQ_FOREACH(child, &mr->subregions, subregions_link) {
+                if (child->enabled) {
+                    if (++found > 1) {
+                        next = NULL;
+                        break;
+                    }
+                    if (!child->addr && int128_ge(mr->size, child->size)) {
+                        next = child;
+                    }
+                }
+            }
+            if (found == 0) {
+                return NULL;
+            }
+            if (next) {
+                mr = next;
+                continue;
+            }
+        }
+        return mr;
+    }
+    return NULL;
+}
+
+static FlatView *flatview_get_shared(MemoryRegion *root)
+{
+    FlatView *view = g_hash_table_lookup(flat_views, root);
+    FlatView *old_view;
+
+    if (!view) {
+        view = generate_memory_topology(root);
+        /* Nothing moved under this root: keep the view that is already
+         * installed, so that the address spaces using it stay untouched
+         * and those switching to it can share its dispatch.
+         */
+        old_view = g_hash_table_lookup(old_flat_views, root);
+        if (old_view && flatview_equal(view, old_view)) {
+            flatview_unref(view);
+            view = old_view;
+            flatview_ref(view);
+        }
+        g_hash_table_insert(flat_views, root, view);
+    }
+    flatview_ref(view);
+    return view;
+}
+
+/* Render the new topology of @as into as->next_map, leaving it NULL if
+ * listeners would see no difference.
+ */
+static void address_space_render_topology(AddressSpace *as)
 {
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view;
+
+    new_view = flatview_get_shared(memory_region_unalias_entire(as->root));
+
+    as->next_map = NULL;
+    if (new_view != old_view && !flatview_equal(new_view, old_view)) {
+        as->next_map = new_view;
+        g_hash_table_add(stale_views, old_view);
+    } else {
+        /* Keep the installed view even if another one is equal to it:
+         * exec.c keys shared dispatches by view, so a view must not be
+         * replaced behind its listeners' back.
+         */
+        flatview_unref(new_view);
+    }
+    flatview_unref(old_view);
+}
 
+/* Address spaces that had the same view share their dispatch, built by
+ * one of them (see mem_begin in exec.c).  When some of them move to a new
+ * view, have the ones staying behind go through begin/commit as well so
+ * that none is left with a dispatch built by an address space whose
+ * topology changed.
+ */
+static void address_space_rebuild_stale(AddressSpace *as)
+{
+    if (!as->next_map && g_hash_table_lookup(stale_views, as->current_map)) {
+        as->next_map = as->current_map;
+        flatview_ref(as->next_map);
+    }
+}
+
+static void address_space_update_topology(AddressSpace *as)
+{
+    FlatView *old_view;
+    FlatView *new_view = as->next_map;
+
+    if (!new_view) {
+        address_space_update_ioeventfds(as);
+        return;
+    }
+
+    old_view = address_space_get_flatview(as);
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
 
-    /* Writes are protected by the BQL.  */
+    /* Writes are protected by the BQL.  The reference taken by
+     * address_space_render_topology() goes to current_map; next_map
+     * stays set until the commit callbacks have run.
+     */
     atomic_rcu_set(&as->current_map, new_view);
     call_rcu(old_view, flatview_unref, rcu);
 
@@ -920,13 +1109,26 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
-            MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
+            flatviews_begin();
+            QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                address_space_render_topology(as);
+            }
+            QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                address_space_rebuild_stale(as);
+            }
+            flatviews_end();
+
+            MEMORY_LISTENER_CALL_CHANGED(begin);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_topology(as);
             }
 
-            MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            MEMORY_LISTENER_CALL_CHANGED(commit);
+
+            QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                as->next_map = NULL;
+            }
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -2364,6 +2566,7 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     as->malloced = false;
     as->current_map = g_new(FlatView, 1);
     flatview_init(as->current_map);
+    as->next_map = NULL;
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
     QTAILQ_INIT(&as->listeners);
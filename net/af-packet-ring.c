@@ -0,0 +1,65 @@
+/*
+ * AF_PACKET TPACKET_V3 rx ring walk
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "af-packet-ring.h"
+
+void af_packet_rx_ring_init(AfPacketRxRing *r, uint8_t *ring,
+                            unsigned int block_size, unsigned int block_nr)
+{
+    r->ring = ring;
+    r->block_size = block_size;
+    r->block_nr = block_nr;
+    r->block = 0;
+    r->pkt = NULL;
+    r->left = 0;
+}
+
+static struct tpacket_block_desc *af_packet_rx_ring_block(AfPacketRxRing *r)
+{
+    return (struct tpacket_block_desc *)(r->ring + r->block * r->block_size);
+}
+
+/*
+ * Return the next frame of the blocks the kernel has retired, in order,
+ * or NULL if there is none.  A block goes back to the kernel on the call
+ * after its last frame was returned, so the caller must be done with a
+ * frame before asking for the next one.  The walk can stop after any
+ * frame and resume there.
+ */
+struct tpacket3_hdr *af_packet_rx_ring_next(AfPacketRxRing *r)
+{
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr *hdr;
+
+    for (;;) {
+        bd = af_packet_rx_ring_block(r);
+        if (!r->pkt) {
+            if (!(atomic_read(&bd->hdr.bh1.block_status) & TP_STATUS_USER)) {
+                return NULL;
+            }
+            smp_rmb();
+            r->left = bd->hdr.bh1.num_pkts;
+            r->pkt = (struct tpacket3_hdr *)
+                ((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+        }
+
+        if (r->left) {
+            hdr = r->pkt;
+            r->left--;
+            r->pkt = (struct tpacket3_hdr *)
+                ((uint8_t *)hdr + hdr->tp_next_offset);
+            return hdr;
+        }
+
+        smp_mb();
+        atomic_set(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL);
+        r->pkt = NULL;
+        r->block = (r->block + 1) % r->block_nr;
+    }
+}
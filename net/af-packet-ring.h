@@ -0,0 +1,27 @@
+/*
+ * AF_PACKET TPACKET_V3 rx ring walk
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef NET_AF_PACKET_RING_H
+#define NET_AF_PACKET_RING_H
+
+#include <linux/if_packet.h>
+
+typedef struct AfPacketRxRing {
+    uint8_t *ring;
+    unsigned int block_size;
+    unsigned int block_nr;
+    /* block being walked, and the next frame in it if it was opened */
+    unsigned int block;
+    struct tpacket3_hdr *pkt;
+    uint32_t left;
+} AfPacketRxRing;
+
+void af_packet_rx_ring_init(AfPacketRxRing *r, uint8_t *ring,
+                            unsigned int block_size, unsigned int block_nr);
+struct tpacket3_hdr *af_packet_rx_ring_next(AfPacketRxRing *r);
+
+#endif
@@ -0,0 +1,498 @@
+/*
+ * AF_PACKET memory mapped ring network backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/atomic.h"
+#include "qemu/cutils.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "block/aio.h"
+#include "af-packet-ring.h"
+
+/*
+ * Each queue owns one AF_PACKET socket bound to the host interface.
+ * Received frames are read in place from a TPACKET_V3 rx ring and
+ * handed to the peer without copying unless the peer queues them.
+ * Transmitted frames are copied once into a tx ring and the kernel is
+ * kicked once per batch.  With several queues the sockets join a
+ * fanout group so that the kernel spreads flows over them.
+ */
+
+#define AF_PACKET_MAX_QUEUES        64
+#define AF_PACKET_FRAME_SIZE        2048
+#define AF_PACKET_BLOCK_SIZE        (256 * 1024)
+#define AF_PACKET_BLOCK_NR          16
+#define AF_PACKET_BLOCK_TIMEOUT_MS  1
+#define AF_PACKET_TX_BLOCK_SIZE     (64 * 1024)
+#define AF_PACKET_TX_FRAME_NR       512
+
+/* Frames delivered per wakeup, so that a busy socket cannot hog the loop */
+#define AF_PACKET_RX_BURST          64
+
+/* Offset of the payload in a tx frame, see tpacket_fill_skb */
+#define AF_PACKET_TX_DATA_OFFSET    TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+typedef struct AfPacketState {
+    NetClientState nc;
+    int fd;
+    char ifname[IFNAMSIZ];
+
+    uint8_t *map;
+    size_t map_len;
+
+    /* rx ring: blocks are handed back to the kernel once fully consumed */
+    AfPacketRxRing rx;
+
+    /* tx ring, NULL if the kernel does not support one for TPACKET_V3 */
+    uint8_t *tx_ring;
+    unsigned int tx_frame_nr;
+    unsigned int tx_head;
+    unsigned int tx_pending;
+    /* open receive batches; the kernel is kicked when the last one ends */
+    unsigned int tx_batch;
+
+    bool read_poll;
+    bool write_poll;
+} AfPacketState;
+
+static void af_packet_send(void *opaque);
+static void af_packet_writable(void *opaque);
+
+static void af_packet_set_fd_handler(AfPacketState *s, AioContext *ctx,
+                                     IOHandler *fd_read, IOHandler *fd_write)
+{
+    if (ctx) {
+        aio_set_fd_handler(ctx, s->fd, false, fd_read, fd_write, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
+}
+
+static void af_packet_update_fd_handler(AfPacketState *s)
+{
+    af_packet_set_fd_handler(s, s->nc.ctx,
+                             s->read_poll ? af_packet_send : NULL,
+                             s->write_poll ? af_packet_writable : NULL);
+}
+
+static void af_packet_read_poll(AfPacketState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_write_poll(AfPacketState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_poll(NetClientState *nc, bool enable)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->read_poll = enable;
+        s->write_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_aio_context_changed(NetClientState *nc,
+                                          AioContext *old_ctx)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    af_packet_set_fd_handler(s, old_ctx, NULL, NULL);
+    af_packet_update_fd_handler(s);
+}
+
+static struct tpacket3_hdr *af_packet_tx_frame(AfPacketState *s,
+                                               unsigned int i)
+{
+    return (struct tpacket3_hdr *)(s->tx_ring + i * AF_PACKET_FRAME_SIZE);
+}
+
+/* Ask the kernel to transmit every frame marked TP_STATUS_SEND_REQUEST. */
+static void af_packet_tx_kick(AfPacketState *s)
+{
+    if (!s->tx_pending) {
+        return;
+    }
+    s->tx_pending = 0;
+    if (send(s->fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN &&
+        errno != ENOBUFS) {
+        error_report("af-packet: transmit on %s failed: %s",
+                     s->ifname, strerror(errno));
+    }
+}
+
+static void af_packet_writable(void *opaque)
+{
+    AfPacketState *s = opaque;
+
+    af_packet_write_poll(s, false);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static ssize_t af_packet_receive_iov(NetClientState *nc,
+                                     const struct iovec *iov, int iovcnt)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
+    struct tpacket3_hdr *hdr;
+    struct msghdr msg;
+    ssize_t ret;
+
+    if (s->tx_ring &&
+        size <= AF_PACKET_FRAME_SIZE - AF_PACKET_TX_DATA_OFFSET) {
+        hdr = af_packet_tx_frame(s, s->tx_head);
+        if (atomic_read(&hdr->tp_status) != TP_STATUS_AVAILABLE) {
+            /* Ring full: let the kernel drain it and retry when writable */
+            af_packet_tx_kick(s);
+            af_packet_write_poll(s, true);
+            return 0;
+        }
+
+        iov_to_buf(iov, iovcnt, 0, (uint8_t *)hdr + AF_PACKET_TX_DATA_OFFSET,
+                   size);
+        hdr->tp_len = size;
+        hdr->tp_snaplen = size;
+        hdr->tp_next_offset = 0;
+        smp_wmb();
+        atomic_set(&hdr->tp_status, TP_STATUS_SEND_REQUEST);
+
+        s->tx_head = (s->tx_head + 1) % s->tx_frame_nr;
+        s->tx_pending++;
+        if (!s->tx_batch) {
+            af_packet_tx_kick(s);
+        }
+        return size;
+    }
+
+    /* Oversized frames, or no tx ring: keep the ring's frames in order */
+    af_packet_tx_kick(s);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    do {
+        ret = sendmsg(s->fd, &msg, MSG_DONTWAIT);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1 && (errno == EAGAIN || errno == ENOBUFS)) {
+        af_packet_write_poll(s, true);
+        return 0;
+    }
+
+    /* Other errors drop the packet, as a real wire would */
+    return size;
+}
+
+static ssize_t af_packet_receive(NetClientState *nc,
+                                 const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_packet_receive_iov(nc, &iov, 1);
+}
+
+static void af_packet_receive_batch(NetClientState *nc, bool start)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    if (start) {
+        s->tx_batch++;
+        return;
+    }
+    assert(s->tx_batch > 0);
+    if (--s->tx_batch == 0) {
+        af_packet_tx_kick(s);
+    }
+}
+
+static void af_packet_send_completed(NetClientState *nc, ssize_t len)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    af_packet_read_poll(s, true);
+}
+
+/*
+ * Deliver the frames of the blocks the kernel has retired.  A block is
+ * only returned to the kernel after every frame in it has been delivered
+ * or copied into the peer's queue.  When the burst limit is hit the
+ * socket stays readable, because the block being walked is still ours,
+ * and the walk resumes on the next wakeup.
+ */
+static void af_packet_send(void *opaque)
+{
+    AfPacketState *s = opaque;
+    struct tpacket3_hdr *hdr;
+    struct sockaddr_ll *sll;
+    ssize_t size;
+    int packets = 0;
+    bool batch;
+
+    batch = qemu_send_batch_begin(&s->nc);
+    while (packets < AF_PACKET_RX_BURST) {
+        hdr = af_packet_rx_ring_next(&s->rx);
+        if (!hdr) {
+            break;
+        }
+        packets++;
+
+        /* Frames we transmitted ourselves are looped back to us */
+        sll = (struct sockaddr_ll *)
+            ((uint8_t *)hdr + TPACKET_ALIGN(sizeof(*hdr)));
+        if (sll->sll_pkttype == PACKET_OUTGOING) {
+            continue;
+        }
+
+        size = qemu_send_packet_async(&s->nc, (uint8_t *)hdr + hdr->tp_mac,
+                                      hdr->tp_snaplen,
+                                      af_packet_send_completed);
+        if (size == 0) {
+            /* The packet was queued, wait for the peer to drain it */
+            af_packet_read_poll(s, false);
+            break;
+        }
+    }
+    qemu_send_batch_end(&s->nc, batch);
+}
+
+static void af_packet_cleanup(NetClientState *nc)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    if (s->fd >= 0) {
+        af_packet_poll(nc, false);
+        af_packet_tx_kick(s);
+        if (s->map) {
+            munmap(s->map, s->map_len);
+            s->map = NULL;
+        }
+        close(s->fd);
+        s->fd = -1;
+    }
+}
+
+static NetClientInfo net_af_packet_info = {
+    .type = NET_CLIENT_DRIVER_AF_PACKET,
+    .size = sizeof(AfPacketState),
+    .receive = af_packet_receive,
+    .receive_iov = af_packet_receive_iov,
+    .receive_batch = af_packet_receive_batch,
+    .poll = af_packet_poll,
+    .aio_context_changed = af_packet_aio_context_changed,
+    .cleanup = af_packet_cleanup,
+};
+
+static int af_packet_setup_rings(AfPacketState *s, unsigned int block_size,
+                                 unsigned int block_nr, Error **errp)
+{
+    struct tpacket_req3 rx, tx;
+    int version = TPACKET_V3;
+    int loss = 1;
+    int bypass = 1;
+    size_t rx_len, tx_len = 0;
+
+    if (setsockopt(s->fd, SOL_PACKET, PACKET_VERSION,
+                   &version, sizeof(version)) < 0) {
+        error_setg_errno(errp, errno, "TPACKET_V3 is not supported");
+        return -1;
+    }
+
+    memset(&rx, 0, sizeof(rx));
+    rx.tp_block_size = block_size;
+    rx.tp_block_nr = block_nr;
+    rx.tp_frame_size = AF_PACKET_FRAME_SIZE;
+    rx.tp_frame_nr = block_nr * (block_size / AF_PACKET_FRAME_SIZE);
+    rx.tp_retire_blk_tov = AF_PACKET_BLOCK_TIMEOUT_MS;
+    if (setsockopt(s->fd, SOL_PACKET, PACKET_RX_RING, &rx, sizeof(rx)) < 0) {
+        error_setg_errno(errp, errno, "Failed to set up the rx ring");
+        return -1;
+    }
+    rx_len = (size_t)block_size * block_nr;
+
+    /* TPACKET_V3 tx rings need Linux 4.11; fall back to sendmsg() */
+    setsockopt(s->fd, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss));
+    memset(&tx, 0, sizeof(tx));
+    tx.tp_block_size = AF_PACKET_TX_BLOCK_SIZE;
+    tx.tp_block_nr = AF_PACKET_TX_FRAME_NR /
+                     (AF_PACKET_TX_BLOCK_SIZE / AF_PACKET_FRAME_SIZE);
+    tx.tp_frame_size = AF_PACKET_FRAME_SIZE;
+    tx.tp_frame_nr = AF_PACKET_TX_FRAME_NR;
+    if (setsockopt(s->fd, SOL_PACKET, PACKET_TX_RING, &tx, sizeof(tx)) == 0) {
+        tx_len = (size_t)tx.tp_block_size * tx.tp_block_nr;
+        s->tx_frame_nr = tx.tp_frame_nr;
+    }
+
+    /* The guest's frames do not need to go through the host's qdisc */
+    setsockopt(s->fd, SOL_PACKET, PACKET_QDISC_BYPASS,
+               &bypass, sizeof(bypass));
+
+    s->map_len = rx_len + tx_len;
+    s->map = mmap(NULL, s->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  s->fd, 0);
+    if (s->map == MAP_FAILED) {
+        s->map = NULL;
+        error_setg_errno(errp, errno, "Failed to map the packet rings");
+        return -1;
+    }
+
+    af_packet_rx_ring_init(&s->rx, s->map, block_size, block_nr);
+    if (tx_len) {
+        s->tx_ring = s->map + rx_len;
+    }
+    return 0;
+}
+
+static int af_packet_bind(AfPacketState *s, int ifindex, int fanout_id,
+                          Error **errp)
+{
+    struct sockaddr_ll sll;
+    struct packet_mreq mreq;
+    int fanout;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+    if (bind(s->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        error_setg_errno(errp, errno, "Failed to bind to %s", s->ifname);
+        return -1;
+    }
+
+    /* The guest's MAC address is not the interface's */
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(s->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                   &mreq, sizeof(mreq)) < 0) {
+        error_setg_errno(errp, errno, "Failed to make %s promiscuous",
+                         s->ifname);
+        return -1;
+    }
+
+    if (fanout_id >= 0) {
+        fanout = fanout_id | (PACKET_FANOUT_HASH << 16);
+        if (setsockopt(s->fd, SOL_PACKET, PACKET_FANOUT,
+                       &fanout, sizeof(fanout)) < 0) {
+            error_setg_errno(errp, errno, "Failed to join fanout group %d",
+                             fanout_id);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int net_af_packet_init_one(const NetdevAfPacketOptions *opts,
+                                  NetClientState *peer, const char *name,
+                                  int ifindex, int queue, int fanout_id,
+                                  unsigned int block_size,
+                                  unsigned int block_nr, Error **errp)
+{
+    NetClientState *nc;
+    AfPacketState *s;
+    int fd;
+
+    fd = qemu_socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Failed to create AF_PACKET socket");
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_af_packet_info, peer, "af-packet", name);
+    s = DO_UPCAST(AfPacketState, nc, nc);
+    s->fd = fd;
+    pstrcpy(s->ifname, sizeof(s->ifname), opts->ifname);
+
+    if (af_packet_setup_rings(s, block_size, block_nr, errp) ||
+        af_packet_bind(s, ifindex, fanout_id, errp)) {
+        qemu_del_net_client(nc);
+        return -1;
+    }
+
+    snprintf(nc->info_str, sizeof(nc->info_str), "ifname=%s,queue=%d%s",
+             opts->ifname, queue, s->tx_ring ? "" : ",tx=sendmsg");
+    af_packet_read_poll(s, true);
+    return 0;
+}
+
+int net_init_af_packet(const Netdev *netdev, const char *name,
+                       NetClientState *peer, Error **errp)
+{
+    const NetdevAfPacketOptions *opts;
+    static int fanout_seq;
+    unsigned int block_size, block_nr;
+    int ifindex, queues, fanout_id = -1;
+    int i;
+
+    assert(netdev->type == NET_CLIENT_DRIVER_AF_PACKET);
+    opts = &netdev->u.af_packet;
+
+    queues = opts->has_queues ? opts->queues : 1;
+    if (queues < 1 || queues > AF_PACKET_MAX_QUEUES) {
+        error_setg(errp, "queues must be between 1 and %d",
+                   AF_PACKET_MAX_QUEUES);
+        return -1;
+    }
+
+    block_size = opts->has_block_size ? opts->block_size
+                                      : AF_PACKET_BLOCK_SIZE;
+    if (block_size < AF_PACKET_FRAME_SIZE || block_size > (1U << 30) ||
+        block_size % getpagesize()) {
+        error_setg(errp, "block-size must be a multiple of the page size "
+                   "between %d and 1G", AF_PACKET_FRAME_SIZE);
+        return -1;
+    }
+    block_nr = opts->has_blocks ? opts->blocks : AF_PACKET_BLOCK_NR;
+    if (block_nr < 2) {
+        error_setg(errp, "blocks must be at least 2");
+        return -1;
+    }
+
+    ifindex = if_nametoindex(opts->ifname);
+    if (!ifindex) {
+        error_setg_errno(errp, errno, "Unknown interface %s", opts->ifname);
+        return -1;
+    }
+
+    if (queues > 1) {
+        fanout_id = (getpid() + fanout_seq++) & 0xffff;
+    }
+
+    for (i = 0; i < queues; i++) {
+        if (net_af_packet_init_one(opts, peer, name, ifindex, i, fanout_id,
+                                   block_size, block_nr, errp)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -20,18 +20,246 @@
 #include "net/checksum.h"
 #include "net/eth.h"
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/*
+ * The one's complement sum does not depend on the byte order the words
+ * are read in, as long as the result is swapped back at the end
+ * (RFC 1071).  The kernels below therefore add up native-endian 16-bit
+ * words as fast as they can, and net_checksum_add_cont() converts the
+ * folded sum to the big-endian convention of its callers.
+ */
+
+static inline uint32_t net_checksum_fold(uint64_t sum)
 {
-    uint32_t sum = 0;
-    int i;
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
 
-    for (i = seq; i < seq + len; i++) {
-        if (i & 1) {
-            sum += (uint32_t)buf[i - seq];
-        } else {
-            sum += (uint32_t)buf[i - seq] << 8;
+static uint64_t net_checksum_int(const uint8_t *buf, size_t len)
+{
+    uint64_t sum = 0;
+
+    for (; len >= 8; buf += 8, len -= 8) {
+        uint64_t w = ldq_he_p(buf);
+        sum += (w & 0xffffffff) + (w >> 32);
+    }
+    if (len >= 4) {
+        sum += ldl_he_p(buf);
+        buf += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        sum += lduw_he_p(buf);
+        buf += 2;
+        len -= 2;
+    }
+    if (len) {
+        /* A trailing odd byte is the first byte of a zero padded word */
+        uint8_t tmp[2] = { buf[0], 0 };
+        sum += lduw_he_p(tmp);
+    }
+    return sum;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/* Each 32-bit lane grows by at most 2 * 0xffff per iteration, so the
+ * lanes are drained into the 64-bit sum well before they can overflow.
+ */
+#define NET_CHECKSUM_DRAIN  16384
+
+/* The vectorized functions take any BUF alignment and any LEN, the
+ * bytes short of a full vector being summed by net_checksum_int.
+ * select_accel_fn only uses them from 64 bytes on, below which the
+ * scalar loop is just as fast.
+ */
+
+static uint64_t net_checksum_sse2(const uint8_t *buf, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t sum = 0;
+
+    while (len >= 16) {
+        __m128i acc = zero;
+        size_t n = MIN(len / 16, NET_CHECKSUM_DRAIN);
+        uint32_t lanes[4];
+
+        len -= n * 16;
+        do {
+            __m128i v = _mm_loadu_si128((const __m128i *)buf);
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+            buf += 16;
+        } while (--n);
+
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    return sum + net_checksum_int(buf, len);
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static uint64_t net_checksum_avx2(const uint8_t *buf, size_t len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t sum = 0;
+
+    while (len >= 32) {
+        __m256i acc = zero;
+        size_t n = MIN(len / 32, NET_CHECKSUM_DRAIN);
+        uint32_t lanes[8];
+
+        len -= n * 32;
+        do {
+            __m256i v = _mm256_loadu_si256((const __m256i *)buf);
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+            buf += 32;
+        } while (--n);
+
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+               lanes[4] + lanes[5] + lanes[6] + lanes[7];
+    }
+
+    return sum + net_checksum_int(buf, len);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+/* Note that for test_net_checksum_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX2    1
+#define CACHE_SSE2    2
+
+/* Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support <cpuid.h>.
+ */
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ACCEL net_checksum_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ACCEL net_checksum_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static uint64_t (*checksum_accel)(const uint8_t *, size_t) = INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    uint64_t (*fn)(const uint8_t *, size_t) = net_checksum_int;
+    if (cache & CACHE_SSE2) {
+        fn = net_checksum_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = net_checksum_avx2;
+    }
+#endif
+    checksum_accel = fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
         }
     }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_net_checksum_next_accel(void)
+{
+    /* If no bits set, we just tested net_checksum_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+static uint64_t select_accel_fn(const uint8_t *buf, size_t len)
+{
+    if (likely(len >= 64)) {
+        return checksum_accel(buf, len);
+    }
+    return net_checksum_int(buf, len);
+}
+
+#else
+#define select_accel_fn  net_checksum_int
+bool test_net_checksum_next_accel(void)
+{
+    return false;
+}
+#endif
+
+/*
+ * Return the sum of LEN bytes at BUF as big-endian 16-bit words, BUF
+ * starting at byte offset SEQ of the checksummed data.  The result is
+ * folded to 16 bits; it is zero only if all the bytes are.
+ */
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    uint16_t sum;
+
+    if (len <= 0) {
+        return 0;
+    }
+
+    sum = net_checksum_fold(select_accel_fn(buf, len));
+    sum = cpu_to_be16(sum);
+    if (seq & 1) {
+        sum = bswap16(sum);
+    }
     return sum;
 }
 
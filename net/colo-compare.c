@@ -86,6 +86,12 @@ typedef struct CompareState {
     /* Timer used on the primary to find packets that are never matched */
     QEMUTimer *timer;
     QemuMutex timer_check_lock;
+
+    /* Statistics, only updated by the compare thread */
+    uint64_t compared;
+    uint64_t matched;
+    uint64_t miscompared;
+    uint64_t unsupported;
 } CompareState;
 
 typedef struct CompareClass {
@@ -103,9 +109,10 @@ static int compare_chr_send(CharBackend *out,
 
 /*
  * Return 0 on success, if return -1 means the pkt
- * is unsupported(arp and ipv6) and will be sent later
+ * is unsupported(arp and ipv6) and will be sent later.
+ * On success *con is the connection the packet was queued on.
  */
-static int packet_enqueue(CompareState *s, int mode)
+static int packet_enqueue(CompareState *s, int mode, Connection **con)
 {
     ConnectionKey key;
     Packet *pkt = NULL;
@@ -150,6 +157,7 @@ static int packet_enqueue(CompareState *s, int mode)
                          "drop packet");
         }
     }
+    *con = conn;
 
     return 0;
 }
@@ -183,6 +191,7 @@ static int colo_packet_compare(Packet *ppkt, Packet *spkt)
 static int colo_packet_compare_tcp(Packet *spkt, Packet *ppkt)
 {
     struct tcphdr *ptcp, *stcp;
+    bool full_hdrs;
     int res;
 
     trace_colo_compare_main("compare tcp");
@@ -196,6 +205,28 @@ static int colo_packet_compare_tcp(Packet *spkt, Packet *ppkt)
     ptcp = (struct tcphdr *)ppkt->transport_header;
     stcp = (struct tcphdr *)spkt->transport_header;
 
+    /* The IP headers may differ in length, so check both packets */
+    full_hdrs = ppkt->size >= (uint8_t *)(ptcp + 1) - ppkt->data &&
+                spkt->size >= (uint8_t *)(stcp + 1) - spkt->data;
+
+    /*
+     * Most candidates in the secondary list are a different segment of
+     * the same stream.  The sequence numbers, flags and checksum tell
+     * those apart without touching the payload; none of them depends on
+     * the IP identification fudged below.
+     */
+    if (full_hdrs &&
+        (ptcp->th_seq != stcp->th_seq ||
+         ptcp->th_ack != stcp->th_ack ||
+         ptcp->th_flags != stcp->th_flags ||
+         ptcp->th_sum != stcp->th_sum)) {
+        trace_colo_compare_tcp_header_mismatch(ntohl(ptcp->th_seq),
+                                               ntohl(stcp->th_seq),
+                                               ntohs(ptcp->th_sum),
+                                               ntohs(stcp->th_sum));
+        return -1;
+    }
+
     /*
      * The 'identification' field in the IP header is *very* random
      * it almost never matches.  Fudge this by ignoring differences in
@@ -214,17 +245,19 @@ static int colo_packet_compare_tcp(Packet *spkt, Packet *ppkt)
                 (spkt->size - ETH_HLEN));
 
     if (res != 0 && trace_event_get_state(TRACE_COLO_COMPARE_MISCOMPARE)) {
-        trace_colo_compare_pkt_info_src(inet_ntoa(ppkt->ip->ip_src),
-                                        ntohl(stcp->th_seq),
-                                        ntohl(stcp->th_ack),
-                                        res, stcp->th_flags,
-                                        spkt->size);
-
-        trace_colo_compare_pkt_info_dst(inet_ntoa(ppkt->ip->ip_dst),
-                                        ntohl(ptcp->th_seq),
-                                        ntohl(ptcp->th_ack),
-                                        res, ptcp->th_flags,
-                                        ppkt->size);
+        if (full_hdrs) {
+            trace_colo_compare_pkt_info_src(inet_ntoa(ppkt->ip->ip_src),
+                                            ntohl(stcp->th_seq),
+                                            ntohl(stcp->th_ack),
+                                            res, stcp->th_flags,
+                                            spkt->size);
+
+            trace_colo_compare_pkt_info_dst(inet_ntoa(ppkt->ip->ip_dst),
+                                            ntohl(ptcp->th_seq),
+                                            ntohl(ptcp->th_ack),
+                                            res, ptcp->th_flags,
+                                            ppkt->size);
+        }
 
         qemu_hexdump((char *)ppkt->data, stderr,
                      "colo-compare ppkt", ppkt->size);
@@ -358,6 +391,7 @@ static void colo_compare_connection(void *opaque, void *user_data)
         qemu_mutex_lock(&s->timer_check_lock);
         pkt = g_queue_pop_tail(&conn->primary_list);
         qemu_mutex_unlock(&s->timer_check_lock);
+        s->compared++;
         switch (conn->ip_proto) {
         case IPPROTO_TCP:
             result = g_queue_find_custom(&conn->secondary_list,
@@ -378,6 +412,7 @@ static void colo_compare_connection(void *opaque, void *user_data)
         }
 
         if (result) {
+            s->matched++;
             ret = compare_chr_send(&s->chr_out, pkt->data, pkt->size);
             if (ret < 0) {
                 error_report("colo_send_primary_packet failed");
@@ -392,6 +427,7 @@ static void colo_compare_connection(void *opaque, void *user_data)
              * until next comparison.
              */
             trace_colo_compare_main("packet different");
+            s->miscompared++;
             qemu_mutex_lock(&s->timer_check_lock);
             g_queue_push_tail(&conn->primary_list, pkt);
             qemu_mutex_unlock(&s->timer_check_lock);
@@ -407,25 +443,23 @@ static int compare_chr_send(CharBackend *out,
 {
     int ret = 0;
     uint32_t len = htonl(size);
+    uint8_t *msg;
 
     if (!size) {
         return 0;
     }
 
-    ret = qemu_chr_fe_write_all(out, (uint8_t *)&len, sizeof(len));
-    if (ret != sizeof(len)) {
-        goto err;
-    }
-
-    ret = qemu_chr_fe_write_all(out, (uint8_t *)buf, size);
-    if (ret != size) {
-        goto err;
+    /* One write per packet: the length and the payload go out together */
+    msg = g_malloc(sizeof(len) + size);
+    memcpy(msg, &len, sizeof(len));
+    memcpy(msg + sizeof(len), buf, size);
+    ret = qemu_chr_fe_write_all(out, msg, sizeof(len) + size);
+    g_free(msg);
+    if (ret != sizeof(len) + size) {
+        return ret < 0 ? ret : -EIO;
     }
 
     return 0;
-
-err:
-    return ret < 0 ? ret : -EIO;
 }
 
 static int compare_chr_can_read(void *opaque)
@@ -537,25 +571,27 @@ static void compare_set_outdev(Object *obj, const char *value, Error **errp)
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
+    Connection *conn = NULL;
 
-    if (packet_enqueue(s, PRIMARY_IN)) {
+    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
         trace_colo_compare_main("primary: unsupported packet in");
+        s->unsupported++;
         compare_chr_send(&s->chr_out, pri_rs->buf, pri_rs->packet_len);
     } else {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
+        /* Only the connection the packet belongs to can have changed */
+        colo_compare_connection(conn, s);
     }
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
+    Connection *conn = NULL;
 
-    if (packet_enqueue(s, SECONDARY_IN)) {
+    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
         trace_colo_compare_main("secondary: unsupported packet in");
     } else {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
+        colo_compare_connection(conn, s);
     }
 }
 
@@ -677,6 +713,8 @@ static void colo_compare_class_init(ObjectClass *oc, void *data)
 
 static void colo_compare_init(Object *obj)
 {
+    CompareState *s = COLO_COMPARE(obj);
+
     object_property_add_str(obj, "primary_in",
                             compare_get_pri_indev, compare_set_pri_indev,
                             NULL);
@@ -686,6 +724,13 @@ static void colo_compare_init(Object *obj)
     object_property_add_str(obj, "outdev",
                             compare_get_outdev, compare_set_outdev,
                             NULL);
+
+    object_property_add_uint64_ptr(obj, "compared", &s->compared, NULL);
+    object_property_add_uint64_ptr(obj, "matched", &s->matched, NULL);
+    object_property_add_uint64_ptr(obj, "miscompared", &s->miscompared,
+                                   NULL);
+    object_property_add_uint64_ptr(obj, "unsupported", &s->unsupported,
+                                   NULL);
 }
 
 static void colo_compare_finalize(Object *obj)
@@ -244,11 +244,11 @@ struct NetFilterDumpState {
 };
 typedef struct NetFilterDumpState NetFilterDumpState;
 
-static ssize_t filter_dump_receive_iov(NetFilterState *nf, NetClientState *sndr,
+static ssize_t filter_dump_receive_iov(NetFilterQueue *fq, NetClientState *sndr,
                                        unsigned flags, const struct iovec *iov,
                                        int iovcnt, NetPacketSent *sent_cb)
 {
-    NetFilterDumpState *nfds = FILTER_DUMP(nf);
+    NetFilterDumpState *nfds = FILTER_DUMP(fq->nf);
 
     dump_receive_iov(&nfds->ds, iov, iovcnt);
     return 0;
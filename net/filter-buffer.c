@@ -8,6 +8,7 @@
 
 #include "qemu/osdep.h"
 #include "net/filter.h"
+#include "net/net.h"
 #include "net/queue.h"
 #include "qapi/error.h"
 #include "qemu-common.h"
@@ -25,7 +26,7 @@
 typedef struct FilterBufferState {
     NetFilterState parent_obj;
 
-    NetQueue *incoming_queue;
+    NetQueue **incoming_queues;     /* one per queue of the netdev */
     uint32_t interval;
     QEMUTimer release_timer;
 } FilterBufferState;
@@ -33,10 +34,17 @@ typedef struct FilterBufferState {
 static void filter_buffer_flush(NetFilterState *nf)
 {
     FilterBufferState *s = FILTER_BUFFER(nf);
+    int i;
 
-    if (!qemu_net_queue_flush(s->incoming_queue)) {
-        /* Unable to empty the queue, purge remaining packets */
-        qemu_net_queue_purge(s->incoming_queue, nf->netdev);
+    for (i = 0; i < nf->queues; i++) {
+        NetClientState *netdev = nf->fq[i].netdev;
+        AioContext *ctx = qemu_net_client_acquire(netdev);
+
+        if (!qemu_net_queue_flush(s->incoming_queues[i])) {
+            /* Unable to empty the queue, purge remaining packets */
+            qemu_net_queue_purge(s->incoming_queues[i], netdev);
+        }
+        qemu_net_client_release(ctx);
     }
 }
 
@@ -58,14 +66,14 @@ static void filter_buffer_release_timer(void *opaque)
 }
 
 /* filter APIs */
-static ssize_t filter_buffer_receive_iov(NetFilterState *nf,
+static ssize_t filter_buffer_receive_iov(NetFilterQueue *fq,
                                          NetClientState *sender,
                                          unsigned flags,
                                          const struct iovec *iov,
                                          int iovcnt,
                                          NetPacketSent *sent_cb)
 {
-    FilterBufferState *s = FILTER_BUFFER(nf);
+    FilterBufferState *s = FILTER_BUFFER(fq->nf);
 
     /*
      * We return size when buffer a packet, the sender will take it as
@@ -81,7 +89,7 @@ static ssize_t filter_buffer_receive_iov(NetFilterState *nf,
      * the packets without caring about the receiver. This is suboptimal.
      * May need more thoughts (e.g keeping sent_cb).
      */
-    qemu_net_queue_append_iov(s->incoming_queue, sender, flags,
+    qemu_net_queue_append_iov(s->incoming_queues[fq->index], sender, flags,
                               iov, iovcnt, NULL);
     return iov_size(iov, iovcnt);
 }
@@ -95,9 +103,14 @@ static void filter_buffer_cleanup(NetFilterState *nf)
     }
 
     /* flush packets */
-    if (s->incoming_queue) {
+    if (s->incoming_queues) {
+        int i;
+
         filter_buffer_flush(nf);
-        g_free(s->incoming_queue);
+        for (i = 0; i < nf->queues; i++) {
+            qemu_del_net_queue(s->incoming_queues[i]);
+        }
+        g_free(s->incoming_queues);
     }
 }
 
@@ -117,6 +130,7 @@ static void filter_buffer_setup_timer(NetFilterState *nf)
 static void filter_buffer_setup(NetFilterState *nf, Error **errp)
 {
     FilterBufferState *s = FILTER_BUFFER(nf);
+    int i;
 
     /*
      * We may want to accept zero interval when VM FT solutions like MC
@@ -128,7 +142,11 @@ static void filter_buffer_setup(NetFilterState *nf, Error **errp)
         return;
     }
 
-    s->incoming_queue = qemu_new_net_queue(qemu_netfilter_pass_to_next, nf);
+    s->incoming_queues = g_new(NetQueue *, nf->queues);
+    for (i = 0; i < nf->queues; i++) {
+        s->incoming_queues[i] = qemu_new_net_queue(qemu_netfilter_pass_to_next,
+                                                   &nf->fq[i]);
+    }
     filter_buffer_setup_timer(nf);
 }
 
@@ -154,6 +172,7 @@ static void filter_buffer_class_init(ObjectClass *oc, void *data)
     nfc->cleanup = filter_buffer_cleanup;
     nfc->receive_iov = filter_buffer_receive_iov;
     nfc->status_changed = filter_buffer_status_changed;
+    nfc->multiqueue = true;
 }
 
 static void filter_buffer_get_interval(Object *obj, Visitor *v,
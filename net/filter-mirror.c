@@ -50,31 +50,27 @@ static int filter_mirror_send(CharBackend *chr_out,
     int ret = 0;
     ssize_t size = 0;
     uint32_t len =  0;
-    char *buf;
+    uint8_t *buf;
 
     size = iov_size(iov, iovcnt);
     if (!size) {
         return 0;
     }
 
+    /* Write the length and the packet at once, so that the records of
+     * queues running in different threads cannot interleave.
+     */
+    buf = g_malloc(sizeof(len) + size);
     len = htonl(size);
-    ret = qemu_chr_fe_write_all(chr_out, (uint8_t *)&len, sizeof(len));
-    if (ret != sizeof(len)) {
-        goto err;
-    }
-
-    buf = g_malloc(size);
-    iov_to_buf(iov, iovcnt, 0, buf, size);
-    ret = qemu_chr_fe_write_all(chr_out, (uint8_t *)buf, size);
+    memcpy(buf, &len, sizeof(len));
+    iov_to_buf(iov, iovcnt, 0, buf + sizeof(len), size);
+    ret = qemu_chr_fe_write_all(chr_out, buf, sizeof(len) + size);
     g_free(buf);
-    if (ret != size) {
-        goto err;
+    if (ret != sizeof(len) + size) {
+        return ret < 0 ? ret : -EIO;
     }
 
     return 0;
-
-err:
-    return ret < 0 ? ret : -EIO;
 }
 
 static void
@@ -85,14 +81,15 @@ redirector_to_filter(NetFilterState *nf, const uint8_t *buf, int len)
         .iov_len = len,
     };
 
+    /* Injected packets go to the first queue */
     if (nf->direction == NET_FILTER_DIRECTION_ALL ||
         nf->direction == NET_FILTER_DIRECTION_TX) {
-        qemu_netfilter_pass_to_next(nf->netdev, 0, &iov, 1, nf);
+        qemu_netfilter_pass_to_next(nf->netdev, 0, &iov, 1, &nf->fq[0]);
     }
 
     if (nf->direction == NET_FILTER_DIRECTION_ALL ||
         nf->direction == NET_FILTER_DIRECTION_RX) {
-        qemu_netfilter_pass_to_next(nf->netdev->peer, 0, &iov, 1, nf);
+        qemu_netfilter_pass_to_next(nf->netdev->peer, 0, &iov, 1, &nf->fq[0]);
      }
 }
 
@@ -130,14 +127,14 @@ static void redirector_chr_event(void *opaque, int event)
     }
 }
 
-static ssize_t filter_mirror_receive_iov(NetFilterState *nf,
+static ssize_t filter_mirror_receive_iov(NetFilterQueue *fq,
                                          NetClientState *sender,
                                          unsigned flags,
                                          const struct iovec *iov,
                                          int iovcnt,
                                          NetPacketSent *sent_cb)
 {
-    MirrorState *s = FILTER_MIRROR(nf);
+    MirrorState *s = FILTER_MIRROR(fq->nf);
     int ret;
 
     ret = filter_mirror_send(&s->chr_out, iov, iovcnt);
@@ -152,14 +149,14 @@ static ssize_t filter_mirror_receive_iov(NetFilterState *nf,
     return 0;
 }
 
-static ssize_t filter_redirector_receive_iov(NetFilterState *nf,
+static ssize_t filter_redirector_receive_iov(NetFilterQueue *fq,
                                              NetClientState *sender,
                                              unsigned flags,
                                              const struct iovec *iov,
                                              int iovcnt,
                                              NetPacketSent *sent_cb)
 {
-    MirrorState *s = FILTER_REDIRECTOR(nf);
+    MirrorState *s = FILTER_REDIRECTOR(fq->nf);
     int ret;
 
     if (qemu_chr_fe_get_driver(&s->chr_out)) {
@@ -213,8 +210,12 @@ static void redirector_rs_finalize(SocketReadState *rs)
 {
     MirrorState *s = container_of(rs, MirrorState, rs);
     NetFilterState *nf = NETFILTER(s);
+    AioContext *ctx;
 
+    /* the chardev is read from the main loop */
+    ctx = qemu_net_client_acquire(nf->netdev);
     redirector_to_filter(nf, rs->buf, rs->packet_len);
+    qemu_net_client_release(ctx);
 }
 
 static void filter_redirector_setup(NetFilterState *nf, Error **errp)
@@ -273,6 +274,7 @@ static void filter_mirror_class_init(ObjectClass *oc, void *data)
     nfc->setup = filter_mirror_setup;
     nfc->cleanup = filter_mirror_cleanup;
     nfc->receive_iov = filter_mirror_receive_iov;
+    nfc->multiqueue = true;
 }
 
 static void filter_redirector_class_init(ObjectClass *oc, void *data)
@@ -282,6 +284,7 @@ static void filter_redirector_class_init(ObjectClass *oc, void *data)
     nfc->setup = filter_redirector_setup;
     nfc->cleanup = filter_redirector_cleanup;
     nfc->receive_iov = filter_redirector_receive_iov;
+    nfc->multiqueue = true;
 }
 
 static char *filter_redirector_get_indev(Object *obj, Error **errp)
@@ -138,13 +138,14 @@ static int handle_secondary_tcp_pkt(NetFilterState *nf,
     return 0;
 }
 
-static ssize_t colo_rewriter_receive_iov(NetFilterState *nf,
+static ssize_t colo_rewriter_receive_iov(NetFilterQueue *fq,
                                          NetClientState *sender,
                                          unsigned flags,
                                          const struct iovec *iov,
                                          int iovcnt,
                                          NetPacketSent *sent_cb)
 {
+    NetFilterState *nf = fq->nf;
     RewriterState *s = FILTER_COLO_REWRITER(nf);
     Connection *conn;
     ConnectionKey key;
@@ -217,7 +218,7 @@ static void colo_rewriter_cleanup(NetFilterState *nf)
     /* flush packets */
     if (s->incoming_queue) {
         filter_rewriter_flush(nf);
-        g_free(s->incoming_queue);
+        qemu_del_net_queue(s->incoming_queue);
     }
 }
 
@@ -229,7 +230,8 @@ static void colo_rewriter_setup(NetFilterState *nf, Error **errp)
                                                       connection_key_equal,
                                                       g_free,
                                                       connection_destroy);
-    s->incoming_queue = qemu_new_net_queue(qemu_netfilter_pass_to_next, nf);
+    s->incoming_queue = qemu_new_net_queue(qemu_netfilter_pass_to_next,
+                                           &nf->fq[0]);
 }
 
 static void colo_rewriter_class_init(ObjectClass *oc, void *data)
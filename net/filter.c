@@ -23,7 +23,7 @@ static inline bool qemu_can_skip_netfilter(NetFilterState *nf)
     return !nf->on;
 }
 
-ssize_t qemu_netfilter_receive(NetFilterState *nf,
+ssize_t qemu_netfilter_receive(NetFilterQueue *fq,
                                NetFilterDirection direction,
                                NetClientState *sender,
                                unsigned flags,
@@ -31,29 +31,33 @@ ssize_t qemu_netfilter_receive(NetFilterState *nf,
                                int iovcnt,
                                NetPacketSent *sent_cb)
 {
+    NetFilterState *nf = fq->nf;
+
     if (qemu_can_skip_netfilter(nf)) {
         return 0;
     }
     if (nf->direction == direction ||
         nf->direction == NET_FILTER_DIRECTION_ALL) {
+        fq->packets++;
+        fq->bytes += iov_size(iov, iovcnt);
         return NETFILTER_GET_CLASS(OBJECT(nf))->receive_iov(
-                                   nf, sender, flags, iov, iovcnt, sent_cb);
+                                   fq, sender, flags, iov, iovcnt, sent_cb);
     }
 
     return 0;
 }
 
-static NetFilterState *netfilter_next(NetFilterState *nf,
+static NetFilterQueue *netfilter_next(NetFilterQueue *fq,
                                       NetFilterDirection dir)
 {
-    NetFilterState *next;
+    NetFilterQueue *next;
 
     if (dir == NET_FILTER_DIRECTION_TX) {
         /* forward walk through filters */
-        next = QTAILQ_NEXT(nf, next);
+        next = QTAILQ_NEXT(fq, next);
     } else {
         /* reverse order */
-        next = QTAILQ_PREV(nf, NetFilterHead, next);
+        next = QTAILQ_PREV(fq, NetFilterHead, next);
     }
 
     return next;
@@ -67,8 +71,9 @@ ssize_t qemu_netfilter_pass_to_next(NetClientState *sender,
 {
     int ret = 0;
     int direction;
-    NetFilterState *nf = opaque;
-    NetFilterState *next = NULL;
+    NetFilterQueue *fq = opaque;
+    NetFilterState *nf = fq->nf;
+    NetFilterQueue *next = NULL;
 
     if (!sender || !sender->peer) {
         /* no receiver, or sender been deleted, no need to pass it further */
@@ -76,7 +81,7 @@ ssize_t qemu_netfilter_pass_to_next(NetClientState *sender,
     }
 
     if (nf->direction == NET_FILTER_DIRECTION_ALL) {
-        if (sender == nf->netdev) {
+        if (sender == fq->netdev) {
             /* This packet is sent by netdev itself */
             direction = NET_FILTER_DIRECTION_TX;
         } else {
@@ -86,7 +91,7 @@ ssize_t qemu_netfilter_pass_to_next(NetClientState *sender,
         direction = nf->direction;
     }
 
-    next = netfilter_next(nf, direction);
+    next = netfilter_next(fq, direction);
     while (next) {
         /*
          * if qemu_netfilter_pass_to_next been called, means that
@@ -164,7 +169,7 @@ static void netfilter_set_status(Object *obj, const char *str, Error **errp)
         return;
     }
     nf->on = !nf->on;
-    if (nf->netdev && nfc->status_changed) {
+    if (nf->fq && nfc->status_changed) {
         nfc->status_changed(nf, errp);
     }
 }
@@ -192,7 +197,7 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
     NetFilterState *nf = NETFILTER(uc);
     NetClientState *ncs[MAX_QUEUE_NUM];
     NetFilterClass *nfc = NETFILTER_GET_CLASS(uc);
-    int queues;
+    int queues, i;
     Error *local_err = NULL;
 
     if (!nf->netdev_id) {
@@ -207,7 +212,7 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "netdev",
                    "a network backend id");
         return;
-    } else if (queues > 1) {
+    } else if (queues > 1 && !nfc->multiqueue) {
         error_setg(errp, "multiqueue is not supported");
         return;
     }
@@ -218,30 +223,52 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
     }
 
     nf->netdev = ncs[0];
+    nf->queues = queues;
+    nf->fq = g_new0(NetFilterQueue, queues);
+    for (i = 0; i < queues; i++) {
+        nf->fq[i].nf = nf;
+        nf->fq[i].netdev = ncs[i];
+        nf->fq[i].index = i;
+    }
 
     if (nfc->setup) {
         nfc->setup(nf, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
+            g_free(nf->fq);
+            nf->fq = NULL;
             return;
         }
     }
-    QTAILQ_INSERT_TAIL(&nf->netdev->filters, nf, next);
+    for (i = 0; i < queues; i++) {
+        AioContext *ctx = qemu_net_client_acquire(ncs[i]);
+
+        QTAILQ_INSERT_TAIL(&ncs[i]->filters, &nf->fq[i], next);
+        qemu_net_client_release(ctx);
+    }
 }
 
 static void netfilter_finalize(Object *obj)
 {
     NetFilterState *nf = NETFILTER(obj);
     NetFilterClass *nfc = NETFILTER_GET_CLASS(obj);
+    int i;
 
     if (nfc->cleanup) {
         nfc->cleanup(nf);
     }
 
-    if (nf->netdev && !QTAILQ_EMPTY(&nf->netdev->filters) &&
-        QTAILQ_IN_USE(nf, next)) {
-        QTAILQ_REMOVE(&nf->netdev->filters, nf, next);
+    for (i = 0; nf->fq && i < nf->queues; i++) {
+        NetFilterQueue *fq = &nf->fq[i];
+
+        if (!QTAILQ_EMPTY(&fq->netdev->filters) && QTAILQ_IN_USE(fq, next)) {
+            AioContext *ctx = qemu_net_client_acquire(fq->netdev);
+
+            QTAILQ_REMOVE(&fq->netdev->filters, fq, next);
+            qemu_net_client_release(ctx);
+        }
     }
+    g_free(nf->fq);
     g_free(nf->netdev_id);
 }
 
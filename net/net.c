@@ -42,10 +42,12 @@
 #include "hw/qdev.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
+#include "block/aio.h"
 #include "qapi-visit.h"
 #include "qapi/opts-visitor.h"
 #include "sysemu/sysemu.h"
 #include "net/filter.h"
+#include "net/vhost_net.h"
 #include "qapi/string-output-visitor.h"
 
 /* Net bridge is currently not supported for W32. */
@@ -358,7 +360,7 @@ void qemu_del_net_client(NetClientState *nc)
 {
     NetClientState *ncs[MAX_QUEUE_NUM];
     int queues, i;
-    NetFilterState *nf, *next;
+    NetFilterQueue *fq, *next;
 
     assert(nc->info->type != NET_CLIENT_DRIVER_NIC);
 
@@ -370,8 +372,8 @@ void qemu_del_net_client(NetClientState *nc)
                                           MAX_QUEUE_NUM);
     assert(queues != 0);
 
-    QTAILQ_FOREACH_SAFE(nf, &nc->filters, next, next) {
-        object_unparent(OBJECT(nf));
+    QTAILQ_FOREACH_SAFE(fq, &nc->filters, next, next) {
+        object_unparent(OBJECT(fq->nf));
     }
 
     /* If there is a peer NIC, delete and cleanup client, but do not free. */
@@ -555,19 +557,19 @@ static ssize_t filter_receive_iov(NetClientState *nc,
                                   NetPacketSent *sent_cb)
 {
     ssize_t ret = 0;
-    NetFilterState *nf = NULL;
+    NetFilterQueue *fq = NULL;
 
     if (direction == NET_FILTER_DIRECTION_TX) {
-        QTAILQ_FOREACH(nf, &nc->filters, next) {
-            ret = qemu_netfilter_receive(nf, direction, sender, flags, iov,
+        QTAILQ_FOREACH(fq, &nc->filters, next) {
+            ret = qemu_netfilter_receive(fq, direction, sender, flags, iov,
                                          iovcnt, sent_cb);
             if (ret) {
                 return ret;
             }
         }
     } else {
-        QTAILQ_FOREACH_REVERSE(nf, &nc->filters, NetFilterHead, next) {
-            ret = qemu_netfilter_receive(nf, direction, sender, flags, iov,
+        QTAILQ_FOREACH_REVERSE(fq, &nc->filters, NetFilterHead, next) {
+            ret = qemu_netfilter_receive(fq, direction, sender, flags, iov,
                                          iovcnt, sent_cb);
             if (ret) {
                 return ret;
@@ -594,18 +596,104 @@ static ssize_t filter_receive(NetClientState *nc,
     return filter_receive_iov(nc, direction, sender, flags, &iov, 1, sent_cb);
 }
 
+static void qemu_net_client_set_ctx(NetClientState *nc, AioContext *ctx)
+{
+    AioContext *old_ctx = nc->ctx;
+
+    if (old_ctx == ctx) {
+        return;
+    }
+    nc->ctx = ctx;
+    if (nc->info->aio_context_changed) {
+        nc->info->aio_context_changed(nc, old_ctx);
+    }
+}
+
+/* Run the packet path of NC and its peer in CTX, or in the main loop if
+ * CTX is NULL.  Called with the QEMU global mutex held; if either client
+ * currently runs in an AioContext, that context must be held as well.
+ */
+void qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    qemu_net_client_set_ctx(nc, ctx);
+    if (nc->peer) {
+        qemu_net_client_set_ctx(nc->peer, ctx);
+    }
+}
+
+/* Exclude the AioContext NC runs in, if any.  The lock is recursive, so
+ * this is also fine from within that context.  Returns what has to be
+ * passed to qemu_net_client_release.
+ */
+AioContext *qemu_net_client_acquire(NetClientState *nc)
+{
+    AioContext *ctx = nc->ctx;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    return ctx;
+}
+
+void qemu_net_client_release(AioContext *ctx)
+{
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
+static void qemu_receive_batch(NetClientState *nc, bool start)
+{
+    if (nc->info->receive_batch) {
+        nc->info->receive_batch(nc, start);
+    }
+}
+
+/* Bracket a burst of qemu_send_packet* calls from NC.  Packets that a
+ * filter holds back or that end up in the incoming queue are delivered
+ * later outside of the batch, so the peer must not rely on seeing all of
+ * them before qemu_send_batch_end.
+ *
+ * qemu_send_batch_begin returns whether it opened a batch on the peer,
+ * and that value must be passed to the matching qemu_send_batch_end.
+ * The link may change state during the burst, but the peer still sees
+ * exactly one end for every start.
+ */
+bool qemu_send_batch_begin(NetClientState *nc)
+{
+    if (nc->link_down || !nc->peer) {
+        return false;
+    }
+    qemu_receive_batch(nc->peer, true);
+    return true;
+}
+
+void qemu_send_batch_end(NetClientState *nc, bool started)
+{
+    if (started && nc->peer) {
+        qemu_receive_batch(nc->peer, false);
+    }
+}
+
 void qemu_purge_queued_packets(NetClientState *nc)
 {
+    AioContext *ctx;
+
     if (!nc->peer) {
         return;
     }
 
+    ctx = qemu_net_client_acquire(nc);
     qemu_net_queue_purge(nc->peer->incoming_queue, nc);
+    qemu_net_client_release(ctx);
 }
 
 static
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
 {
+    AioContext *ctx = qemu_net_client_acquire(nc);
+    bool flushed;
+
     nc->receive_disabled = 0;
 
     if (nc->peer && nc->peer->info->type == NET_CLIENT_DRIVER_HUBPORT) {
@@ -613,7 +701,12 @@ void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
             qemu_notify_event();
         }
     }
-    if (qemu_net_queue_flush(nc->incoming_queue)) {
+
+    qemu_receive_batch(nc, true);
+    flushed = qemu_net_queue_flush(nc->incoming_queue);
+    qemu_receive_batch(nc, false);
+
+    if (flushed) {
         /* We emptied the queue successfully, signal to the IO thread to repoll
          * the file descriptor (for tap, for example).
          */
@@ -622,6 +715,7 @@ void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
         /* Unable to empty the queue, purge remaining packets */
         qemu_net_queue_purge(nc->incoming_queue, nc);
     }
+    qemu_net_client_release(ctx);
 }
 
 void qemu_flush_queued_packets(NetClientState *nc)
@@ -698,8 +792,14 @@ ssize_t qemu_receive_packet_iov(NetClientState *nc, const struct iovec *iov,
 
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size)
 {
-    return qemu_send_packet_async_with_flags(nc, QEMU_NET_PACKET_FLAG_RAW,
-                                             buf, size, NULL);
+    /* Used from the main loop by qemu_announce_self().  */
+    AioContext *ctx = qemu_net_client_acquire(nc);
+    ssize_t ret;
+
+    ret = qemu_send_packet_async_with_flags(nc, QEMU_NET_PACKET_FLAG_RAW,
+                                            buf, size, NULL);
+    qemu_net_client_release(ctx);
+    return ret;
 }
 
 static ssize_t nc_sendv_compat(NetClientState *nc, const struct iovec *iov,
@@ -990,6 +1090,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_L2TPV3
         [NET_CLIENT_DRIVER_L2TPV3]    = net_init_l2tpv3,
 #endif
+#ifdef CONFIG_AF_PACKET
+        [NET_CLIENT_DRIVER_AF_PACKET] = net_init_af_packet,
+#endif
 };
 
 
@@ -1268,8 +1371,9 @@ void qmp_netdev_del(const char *id, Error **errp)
     qemu_opts_del(opts);
 }
 
-static void netfilter_print_info(Monitor *mon, NetFilterState *nf)
+static void netfilter_print_info(Monitor *mon, NetFilterQueue *fq)
 {
+    NetFilterState *nf = fq->nf;
     char *str;
     ObjectProperty *prop;
     ObjectPropertyIterator iter;
@@ -1288,28 +1392,44 @@ static void netfilter_print_info(Monitor *mon, NetFilterState *nf)
         monitor_printf(mon, ",%s=%s", prop->name, str);
         g_free(str);
     }
-    monitor_printf(mon, "\n");
+    monitor_printf(mon, " (queue %d: %" PRIu64 " packets, %" PRIu64 " bytes)\n",
+                   fq->index, fq->packets, fq->bytes);
 }
 
 void print_net_client(Monitor *mon, NetClientState *nc)
 {
-    NetFilterState *nf;
+    NetFilterQueue *fq;
+    NetQueueStats stats;
 
     monitor_printf(mon, "%s: index=%d,type=%s,%s\n", nc->name,
                    nc->queue_index,
                    NetClientDriver_lookup[nc->info->type],
                    nc->info_str);
+    qemu_net_queue_get_stats(nc->incoming_queue, &stats);
+    if (stats.queued) {
+        monitor_printf(mon, "incoming queue: %u packets, high-water %u, "
+                       "%" PRIu64 " queued, %" PRIu64 " dropped\n",
+                       stats.len, stats.highwater, stats.queued,
+                       stats.dropped);
+    }
     if (!QTAILQ_EMPTY(&nc->filters)) {
         monitor_printf(mon, "filters:\n");
     }
-    QTAILQ_FOREACH(nf, &nc->filters, next) {
-        char *path = object_get_canonical_path_component(OBJECT(nf));
+    QTAILQ_FOREACH(fq, &nc->filters, next) {
+        char *path = object_get_canonical_path_component(OBJECT(fq->nf));
 
         monitor_printf(mon, "  - %s: type=%s", path,
-                       object_get_typename(OBJECT(nf)));
-        netfilter_print_info(mon, nf);
+                       object_get_typename(OBJECT(fq->nf)));
+        netfilter_print_info(mon, fq);
         g_free(path);
     }
+    if (nc->info->type == NET_CLIENT_DRIVER_TAP) {
+        VHostNetState *net = get_vhost_net(nc);
+
+        if (net) {
+            vhost_net_print_info(mon, net);
+        }
+    }
 }
 
 RxFilterInfoList *qmp_query_rx_filter(bool has_name, const char *name,
@@ -1400,6 +1520,7 @@ void qmp_set_link(const char *name, bool up, Error **errp)
 {
     NetClientState *ncs[MAX_QUEUE_NUM];
     NetClientState *nc;
+    AioContext *ctx;
     int queues, i;
 
     queues = qemu_find_net_clients_except(name, ncs,
@@ -1413,28 +1534,32 @@ void qmp_set_link(const char *name, bool up, Error **errp)
     }
     nc = ncs[0];
 
+    /* The packet path may run in an iothread and test link_down there */
+    ctx = qemu_net_client_acquire(nc);
     for (i = 0; i < queues; i++) {
         ncs[i]->link_down = !up;
     }
 
+    /* Change peer link only if the peer is NIC and then notify peer.
+     * If the peer is a HUBPORT or a backend, we do not change the
+     * link status.
+     *
+     * This behavior is compatible with qemu vlans where there could be
+     * multiple clients that can still communicate with each other in
+     * disconnected mode. For now maintain this compatibility.
+     */
+    if (nc->peer && nc->peer->info->type == NET_CLIENT_DRIVER_NIC) {
+        for (i = 0; i < queues; i++) {
+            ncs[i]->peer->link_down = !up;
+        }
+    }
+    qemu_net_client_release(ctx);
+
     if (nc->info->link_status_changed) {
         nc->info->link_status_changed(nc);
     }
 
     if (nc->peer) {
-        /* Change peer link only if the peer is NIC and then notify peer.
-         * If the peer is a HUBPORT or a backend, we do not change the
-         * link status.
-         *
-         * This behavior is compatible with qemu vlans where there could be
-         * multiple clients that can still communicate with each other in
-         * disconnected mode. For now maintain this compatibility.
-         */
-        if (nc->peer->info->type == NET_CLIENT_DRIVER_NIC) {
-            for (i = 0; i < queues; i++) {
-                ncs[i]->peer->link_down = !up;
-            }
-        }
         if (nc->peer->info->link_status_changed) {
             nc->peer->info->link_status_changed(nc->peer);
         }
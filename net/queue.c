@@ -38,8 +38,16 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * Packets up to NET_QUEUE_SLOT_SIZE bytes are carved from fixed-size
+ * slots that are recycled through a per-queue free list, so that a
+ * backlog building up and draining again does not hit the allocator
+ * for every packet.
  */
 
+#define NET_QUEUE_SLOT_SIZE 2048
+#define NET_QUEUE_POOL_MAX  256
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
@@ -53,10 +61,17 @@ struct NetQueue {
     void *opaque;
     uint32_t nq_maxlen;
     uint32_t nq_count;
+    uint32_t nq_highwater;
+    uint64_t nq_queued;
+    uint64_t nq_dropped;
     NetQueueDeliverFunc *deliver;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
 
+    /* recycled slots of NET_QUEUE_SLOT_SIZE bytes */
+    QTAILQ_HEAD(, NetPacket) free_slots;
+    uint32_t nq_free;
+
     unsigned delivering : 1;
 };
 
@@ -72,6 +87,7 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     queue->deliver = deliver;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->free_slots);
 
     queue->delivering = 0;
 
@@ -86,10 +102,60 @@ void qemu_del_net_queue(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         g_free(packet);
     }
+    QTAILQ_FOREACH_SAFE(packet, &queue->free_slots, entry, next) {
+        QTAILQ_REMOVE(&queue->free_slots, packet, entry);
+        g_free(packet);
+    }
 
     g_free(queue);
 }
 
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats)
+{
+    stats->len = queue->nq_count;
+    stats->highwater = queue->nq_highwater;
+    stats->queued = queue->nq_queued;
+    stats->dropped = queue->nq_dropped;
+}
+
+static NetPacket *qemu_net_packet_alloc(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+
+    if (size > NET_QUEUE_SLOT_SIZE) {
+        return g_malloc(sizeof(NetPacket) + size);
+    }
+
+    packet = QTAILQ_FIRST(&queue->free_slots);
+    if (packet) {
+        QTAILQ_REMOVE(&queue->free_slots, packet, entry);
+        queue->nq_free--;
+        return packet;
+    }
+    return g_malloc(sizeof(NetPacket) + NET_QUEUE_SLOT_SIZE);
+}
+
+static void qemu_net_packet_free(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->size <= NET_QUEUE_SLOT_SIZE &&
+        queue->nq_free < NET_QUEUE_POOL_MAX) {
+        QTAILQ_INSERT_HEAD(&queue->free_slots, packet, entry);
+        queue->nq_free++;
+        return;
+    }
+    g_free(packet);
+}
+
+static void qemu_net_queue_insert(NetQueue *queue, NetPacket *packet)
+{
+    queue->nq_count++;
+    queue->nq_queued++;
+    if (queue->nq_count > queue->nq_highwater) {
+        queue->nq_highwater = queue->nq_count;
+    }
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -100,17 +166,17 @@ static void qemu_net_queue_append(NetQueue *queue,
     NetPacket *packet;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        queue->nq_dropped++;
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_packet_alloc(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
     memcpy(packet->data, buf, size);
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert(queue, packet);
 }
 
 void qemu_net_queue_append_iov(NetQueue *queue,
@@ -125,13 +191,14 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     int i;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        queue->nq_dropped++;
         return; /* drop if queue full and no callback */
     }
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_packet_alloc(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -144,8 +211,7 @@ void qemu_net_queue_append_iov(NetQueue *queue,
         packet->size += len;
     }
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert(queue, packet);
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -265,7 +331,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_packet_free(queue, packet);
         }
     }
 }
@@ -298,7 +364,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_packet_free(queue, packet);
     }
     return true;
 }
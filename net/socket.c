@@ -157,15 +157,21 @@ static void net_socket_send(void *opaque)
     int size;
     int ret;
     uint8_t buf1[NET_BUFSIZE];
-    const uint8_t *buf;
+    bool batch;
 
+    /* A single read can carry several packets */
+    batch = qemu_send_batch_begin(&s->nc);
     size = qemu_recv(s->fd, buf1, sizeof(buf1), 0);
-    if (size < 0) {
-        if (errno != EWOULDBLOCK)
-            goto eoc;
-    } else if (size == 0) {
-        /* end of connection */
-    eoc:
+    if (size > 0) {
+        ret = net_fill_rstate(&s->rs, buf1, size);
+    } else if (size < 0 && errno == EWOULDBLOCK) {
+        ret = 0;
+    } else {
+        /* end of connection or read error */
+        ret = -1;
+    }
+
+    if (ret == -1) {
         net_socket_read_poll(s, false);
         net_socket_write_poll(s, false);
         if (s->listen_fd != -1) {
@@ -177,16 +183,8 @@ static void net_socket_send(void *opaque)
         net_socket_rs_init(&s->rs, net_socket_rs_finalize);
         s->nc.link_down = true;
         memset(s->nc.info_str, 0, sizeof(s->nc.info_str));
-
-        return;
-    }
-    buf = buf1;
-
-    ret = net_fill_rstate(&s->rs, buf, size);
-
-    if (ret == -1) {
-        goto eoc;
     }
+    qemu_send_batch_end(&s->nc, batch);
 }
 
 static void net_socket_send_dgram(void *opaque)
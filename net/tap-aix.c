@@ -86,3 +86,8 @@ int tap_fd_get_ifname(int fd, char *ifname)
     return -1;
 }
 
+int tap_fd_set_tx_batch(int fd, unsigned int frames)
+{
+    return -ENOTSUP;
+}
+
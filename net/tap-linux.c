@@ -30,6 +30,8 @@
 
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
 
 #include "sysemu/sysemu.h"
 #include "qapi/error.h"
@@ -314,3 +316,40 @@ int tap_fd_get_ifname(int fd, char *ifname)
     pstrcpy(ifname, sizeof(ifr.ifr_name), ifr.ifr_name);
     return 0;
 }
+
+/*
+ * tun hands the frames written by vhost to the network stack in batches
+ * of up to this many.  The knob is per device and is exposed through the
+ * ethtool coalescing parameters since Linux 4.11.
+ */
+int tap_fd_set_tx_batch(int fd, unsigned int frames)
+{
+    struct ethtool_coalesce ec = { .cmd = ETHTOOL_GCOALESCE };
+    struct ifreq ifr;
+    int sock, ret = 0;
+
+    if (ioctl(fd, TUNGETIFF, &ifr) != 0) {
+        return -errno;
+    }
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        return -errno;
+    }
+
+    ifr.ifr_data = (void *)&ec;
+    if (ioctl(sock, SIOCETHTOOL, &ifr) != 0) {
+        ret = -errno;
+        goto out;
+    }
+
+    ec.cmd = ETHTOOL_SCOALESCE;
+    ec.rx_max_coalesced_frames = frames;
+    if (ioctl(sock, SIOCETHTOOL, &ifr) != 0) {
+        ret = -errno;
+    }
+
+out:
+    close(sock);
+    return ret;
+}
@@ -67,12 +67,21 @@ static void launch_script(const char *setup_script, const char *ifname,
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
 
+static void tap_set_fd_handler(TAPState *s, AioContext *ctx,
+                               IOHandler *fd_read, IOHandler *fd_write)
+{
+    if (ctx) {
+        aio_set_fd_handler(ctx, s->fd, false, fd_read, fd_write, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
+}
+
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    tap_set_fd_handler(s, s->nc.ctx,
+                       s->read_poll && s->enabled ? tap_send : NULL,
+                       s->write_poll && s->enabled ? tap_writable : NULL);
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -184,7 +193,12 @@ static void tap_send(void *opaque)
     TAPState *s = opaque;
     int size;
     int packets = 0;
+    bool batch;
 
+    /* Let the peer complete the whole burst at once, e.g. with a single
+     * guest interrupt, rather than once per packet.
+     */
+    batch = qemu_send_batch_begin(&s->nc);
     while (true) {
         uint8_t *buf = s->buf;
 
@@ -217,6 +231,7 @@ static void tap_send(void *opaque)
             break;
         }
     }
+    qemu_send_batch_end(&s->nc, batch);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -327,6 +342,17 @@ static void tap_cleanup(NetClientState *nc)
     s->fd = -1;
 }
 
+static void tap_aio_context_changed(NetClientState *nc, AioContext *old_ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    if (s->fd < 0) {
+        return;
+    }
+    tap_set_fd_handler(s, old_ctx, NULL, NULL);
+    tap_update_fd_handler(s);
+}
+
 static void tap_poll(NetClientState *nc, bool enable)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -359,6 +385,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .aio_context_changed = tap_aio_context_changed,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -638,15 +665,33 @@ static int net_tap_init(const NetdevTapOptions *tap, int *vnet_hdr,
 
 #define MAX_TAP_QUEUES 1024
 
+/* The CPU for the vhost worker of queue pair @index, or -1 */
+static int tap_vhost_cpu(const NetdevTapOptions *tap, int index)
+{
+    uint16List *cpus;
+    int n = 0;
+
+    for (cpus = tap->vhost_cpus; cpus; cpus = cpus->next) {
+        n++;
+    }
+    if (!n) {
+        return -1;
+    }
+    for (cpus = tap->vhost_cpus, n = index % n; n; n--) {
+        cpus = cpus->next;
+    }
+    return cpus->value;
+}
+
 static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
                              const char *model, const char *name,
                              const char *ifname, const char *script,
                              const char *downscript, const char *vhostfdname,
-                             int vnet_hdr, int fd, Error **errp)
+                             int vnet_hdr, int fd, int index, Error **errp)
 {
     Error *err = NULL;
     TAPState *s = net_tap_fd_init(peer, model, name, fd, vnet_hdr);
-    int vhostfd;
+    int vhostfd, ret;
 
     tap_set_sndbuf(s->fd, tap, &err);
     if (err) {
@@ -654,6 +699,14 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         return;
     }
 
+    if (tap->has_tx_batch) {
+        ret = tap_fd_set_tx_batch(s->fd, tap->tx_batch);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "tap: cannot set tx-batch");
+            return;
+        }
+    }
+
     if (tap->has_fd || tap->has_fds) {
         snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
     } else if (tap->has_helper) {
@@ -677,11 +730,13 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
 
         options.backend_type = VHOST_BACKEND_TYPE_KERNEL;
         options.net_backend = &s->nc;
+        options.inflight = NULL;
         if (tap->has_poll_us) {
             options.busyloop_timeout = tap->poll_us;
         } else {
             options.busyloop_timeout = 0;
         }
+        options.worker_cpu = tap_vhost_cpu(tap, index);
 
         if (vhostfdname) {
             vhostfd = monitor_fd_param(cur_mon, vhostfdname, &err);
@@ -707,6 +762,8 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         }
     } else if (vhostfdname) {
         error_setg(errp, "vhostfd(s)= is not valid without vhost");
+    } else if (tap->has_vhost_cpus) {
+        error_setg(errp, "vhost-cpus= is not valid without vhost");
     }
 }
 
@@ -782,7 +839,7 @@ int net_init_tap(const Netdev *netdev, const char *name,
 
         net_init_tap_one(tap, peer, "tap", name, NULL,
                          script, downscript,
-                         vhostfdname, vnet_hdr, fd, &err);
+                         vhostfdname, vnet_hdr, fd, 0, &err);
         if (err) {
             error_propagate(errp, err);
             return -1;
@@ -831,7 +888,7 @@ int net_init_tap(const Netdev *netdev, const char *name,
             net_init_tap_one(tap, peer, "tap", name, ifname,
                              script, downscript,
                              tap->has_vhostfds ? vhost_fds[i] : NULL,
-                             vnet_hdr, fd, &err);
+                             vnet_hdr, fd, i, &err);
             if (err) {
                 error_propagate(errp, err);
                 goto free_fail;
@@ -870,7 +927,7 @@ free_fail:
 
         net_init_tap_one(tap, peer, "bridge", name, ifname,
                          script, downscript, vhostfdname,
-                         vnet_hdr, fd, &err);
+                         vnet_hdr, fd, 0, &err);
         if (err) {
             error_propagate(errp, err);
             close(fd);
@@ -909,7 +966,7 @@ free_fail:
             net_init_tap_one(tap, peer, "tap", name, ifname,
                              i >= 1 ? "no" : script,
                              i >= 1 ? "no" : downscript,
-                             vhostfdname, vnet_hdr, fd, &err);
+                             vhostfdname, vnet_hdr, fd, i, &err);
             if (err) {
                 error_propagate(errp, err);
                 close(fd);
@@ -12,6 +12,7 @@
 #include "clients.h"
 #include "net/vhost_net.h"
 #include "net/vhost-user.h"
+#include "hw/virtio/vhost.h"
 #include "sysemu/char.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
@@ -22,6 +23,8 @@ typedef struct VhostUserState {
     NetClientState nc;
     CharBackend chr; /* only queue index 0 */
     VHostNetState *vhost_net;
+    /* survives backend restarts, see struct vhost_inflight */
+    struct vhost_inflight inflight;
     guint watch;
     uint64_t acked_features;
     bool started;
@@ -58,6 +61,8 @@ static void vhost_user_stop(int queues, NetClientState *ncs[])
                 s->acked_features = features;
             }
             vhost_net_cleanup(s->vhost_net);
+            g_free(s->vhost_net);
+            s->vhost_net = NULL;
         }
     }
 }
@@ -80,6 +85,8 @@ static int vhost_user_start(int queues, NetClientState *ncs[], CharBackend *be)
         options.net_backend = ncs[i];
         options.opaque      = be;
         options.busyloop_timeout = 0;
+        options.worker_cpu  = -1;
+        options.inflight    = &s->inflight;
         net = vhost_net_init(&options);
         if (!net) {
             error_report("failed to init vhost_net for queue %d", i);
@@ -150,6 +157,7 @@ static void vhost_user_cleanup(NetClientState *nc)
         g_free(s->vhost_net);
         s->vhost_net = NULL;
     }
+    vhost_dev_free_inflight(&s->inflight);
     if (nc->queue_index == 0) {
         qemu_chr_fe_deinit(&s->chr);
     }
@@ -248,9 +256,10 @@ static int net_vhost_user_init(NetClientState *peer, const char *device,
         snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user%d to %s",
                  i, chr->label);
         nc->queue_index = i;
+        s = DO_UPCAST(VhostUserState, nc, nc);
+        s->inflight.fd = -1;
         if (!nc0) {
             nc0 = nc;
-            s = DO_UPCAST(VhostUserState, nc, nc);
             if (!qemu_chr_fe_init(&s->chr, chr, &err)) {
                 error_report_err(err);
                 return -1;
@@ -1600,7 +1600,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev tap,id=str[,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile]\n"
     "         [,br=bridge][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off]\n"
     "         [,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
-    "         [,poll-us=n]\n"
+    "         [,poll-us=n][,vhost-cpus=c1[-c2]][,tx-batch=n]\n"
     "                configure a host TAP network backend with ID 'str'\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
@@ -1623,6 +1623,10 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'queues=n' to specify the number of queues to be created for multiqueue TAP\n"
     "                use 'poll-us=n' to speciy the maximum number of microseconds that could be\n"
     "                spent on busy polling for vhost net\n"
+    "                use 'vhost-cpus=c1[-c2]' to pin the vhost worker of each queue pair to\n"
+    "                one of the listed host CPUs (repeat the option to add CPUs);\n"
+    "                a worker that cannot be pinned only causes a warning\n"
+    "                use 'tx-batch=n' to let the tap device batch up to n transmitted frames\n"
     "-netdev bridge,id=str[,br=bridge][,helper=helper]\n"
     "                configure a host TAP network backend with ID 'str' that is\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
@@ -1654,6 +1658,11 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'counter=off' to force a 'cut-down' L2TPv3 with no counter\n"
     "                use 'pincounter=on' to work around broken counter handling in peer\n"
     "                use 'offset=X' to add an extra offset between header and data\n"
+    "-netdev af-packet,id=str,ifname=name[,queues=n][,block-size=n][,blocks=n]\n"
+    "                configure a network backend with ID 'str' attached to the\n"
+    "                host interface 'name' through memory mapped AF_PACKET rings\n"
+    "                use 'queues=n' to spread received flows over n queues\n"
+    "                use 'block-size=n' and 'blocks=n' to size the receive ring\n"
 #endif
     "-netdev socket,id=str[,fd=h][,listen=[host]:port][,connect=host:port]\n"
     "                configure a network backend to connect to another network\n"
@@ -2087,6 +2096,30 @@ qemu-system-i386 linux.img -net nic -net l2tpv3,src=4.2.3.1,dst=1.2.3.4,udp,srcp
 
 @end example
 
+@item -netdev af-packet,id=@var{id},ifname=@var{name}[,queues=@var{n}][,block-size=@var{n}][,blocks=@var{n}]
+Attach to the host network interface @var{name} with an AF_PACKET socket.
+Received frames are read in place from a memory mapped TPACKET_V3 ring
+shared with the kernel, and transmitted frames go through a memory mapped
+transmit ring where the kernel supports one (Linux 4.11 and later).  The
+interface is put into promiscuous mode.  This needs CAP_NET_RAW and is only
+available on Linux hosts.
+
+With @option{queues=@var{n}}, @var{n} sockets are opened and joined to a
+fanout group, so that the kernel spreads received flows over them; use
+it together with a multiqueue virtio-net device.  @option{block-size}
+(a multiple of the page size, 256K by default) and @option{blocks}
+(16 by default) size the receive ring of each queue.
+
+@example
+# create a veth pair and attach the guest to one end
+ip link add veth0 type veth peer name veth1
+ip link set veth0 up
+ip link set veth1 up
+qemu-system-x86_64 linux.img \
+                   -netdev af-packet,id=n0,ifname=veth0,queues=2 \
+                   -device virtio-net-pci,netdev=n0,mq=on,vectors=6
+@end example
+
 @item -netdev vde,id=@var{id}[,sock=@var{socketpath}][,port=@var{n}][,group=@var{groupname}][,mode=@var{octalmode}]
 @itemx -net vde[,vlan=@var{n}][,name=@var{name}][,sock=@var{socketpath}] [,port=@var{n}][,group=@var{groupname}][,mode=@var{octalmode}]
 Connect VLAN @var{n} to PORT @var{n} of a vde switch running on host and
@@ -3896,6 +3929,10 @@ queue @var{all|rx|tx} is an option that can be applied to any netfilter.
 @option{tx}: the filter is attached to the transmit queue of the netdev,
              where it will receive packets sent by the netdev.
 
+filter-buffer, filter-mirror and filter-redirector can be used with
+multiqueue netdevs; they are attached to every queue.  Packets read from
+the @option{indev} of filter-redirector are sent on the first queue.
+
 @item -object filter-mirror,id=@var{id},netdev=@var{netdevid},outdev=@var{chardevid}[,queue=@var{all|rx|tx}]
 
 filter-mirror on netdev @var{netdevid},mirror net packet to chardev
@@ -3940,6 +3977,10 @@ do checkpoint and send primary packet to outdev@var{chardevid}.
 
 we must use it with the help of filter-mirror and filter-redirector.
 
+The read-only properties @code{compared}, @code{matched}, @code{miscompared}
+and @code{unsupported} count the packets handled so far and can be read
+with @code{qom-get}.
+
 @example
 
 primary:
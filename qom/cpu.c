@@ -273,6 +273,9 @@ static void cpu_common_reset(CPUState *cpu)
     for (i = 0; i < TB_JMP_CACHE_SIZE; ++i) {
         atomic_set(&cpu->tb_jmp_cache[i], NULL);
     }
+    for (i = 0; i < TB_PHYS_CACHE_SIZE; ++i) {
+        atomic_set(&cpu->tb_phys_cache[i], NULL);
+    }
 }
 
 static bool cpu_common_has_work(CPUState *cs)
@@ -18,7 +18,11 @@
 #include "qemu/osdep.h"
 #include "slirp.h"
 
-#define MBUF_THRESH 30
+/*
+ * Number of freed mbufs kept around for reuse.  With many connections
+ * a fixed small pool makes nearly every packet go through malloc/free.
+ */
+#define MBUF_POOL_MAX 1024
 
 /*
  * Find a nice value for msize
@@ -58,9 +62,9 @@ void m_cleanup(Slirp *slirp)
  * Get an mbuf from the free list, if there are none
  * malloc one
  *
- * Because fragmentation can occur if we alloc new mbufs and
- * free old mbufs, we mark all mbufs above mbuf_thresh as M_DOFREE,
- * which tells m_free to actually free() it
+ * m_free() parks up to MBUF_POOL_MAX mbufs on the free list and
+ * free()s the others, so the pool follows the load without
+ * holding on to the memory of a past burst forever
  */
 struct mbuf *
 m_get(Slirp *slirp)
@@ -74,12 +78,11 @@ m_get(Slirp *slirp)
 		m = (struct mbuf *)malloc(SLIRP_MSIZE);
 		if (m == NULL) goto end_error;
 		slirp->mbuf_alloced++;
-		if (slirp->mbuf_alloced > MBUF_THRESH)
-			flags = M_DOFREE;
 		m->slirp = slirp;
 	} else {
 		m = (struct mbuf *) slirp->m_freelist.qh_link;
 		remque(m);
+		slirp->mbuf_free--;
 	}
 
 	/* Insert it in the used list */
@@ -118,11 +121,14 @@ m_free(struct mbuf *m)
 	/*
 	 * Either free() it or put it on the free list
 	 */
-	if (m->m_flags & M_DOFREE) {
+	if ((m->m_flags & M_DOFREE) ||
+	    ((m->m_flags & M_FREELIST) == 0 &&
+	     m->slirp->mbuf_free >= MBUF_POOL_MAX)) {
 		m->slirp->mbuf_alloced--;
 		free(m);
 	} else if ((m->m_flags & M_FREELIST) == 0) {
 		insque(m,&m->slirp->m_freelist);
+		m->slirp->mbuf_free++;
 		m->m_flags = M_FREELIST; /* Clobber other flags */
 	}
   } /* if(m) */
@@ -289,6 +289,11 @@ Slirp *slirp_init(int restricted, bool in_enabled, struct in_addr vnetwork,
     slirp->grand = g_rand_new();
     slirp->restricted = restricted;
 
+#ifdef CONFIG_EPOLL_CREATE1
+    slirp->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    slirp->epoll_pollfds_idx = -1;
+#endif
+
     slirp->in_enabled = in_enabled;
     slirp->in6_enabled = in6_enabled;
 
@@ -341,6 +346,13 @@ void slirp_cleanup(Slirp *slirp)
 
     g_rand_free(slirp->grand);
 
+#ifdef CONFIG_EPOLL_CREATE1
+    if (slirp->epoll_fd >= 0) {
+        close(slirp->epoll_fd);
+    }
+    g_free(slirp->epoll_events);
+#endif
+
     g_free(slirp->vdnssearch);
     g_free(slirp->tftp_prefix);
     g_free(slirp->bootp_filename);
@@ -376,6 +388,170 @@ static void slirp_update_timeout(uint32_t *timeout)
     *timeout = t;
 }
 
+/*
+ * Sockets are handed to the event engine with the events they are
+ * interested in for this main loop iteration.  With epoll, each socket
+ * stays registered across iterations and epoll_ctl() is only called
+ * when its interest changes, so that an idle connection costs nothing
+ * and the main loop polls a single file descriptor per slirp instance.
+ * Otherwise the socket is added to the pollfds array as before.
+ */
+#ifdef CONFIG_EPOLL_CREATE1
+static inline int slirp_epoll_events(int events)
+{
+    return (events & G_IO_IN ? EPOLLIN : 0) |
+           (events & G_IO_PRI ? EPOLLPRI : 0) |
+           (events & G_IO_OUT ? EPOLLOUT : 0) |
+           (events & G_IO_HUP ? EPOLLHUP : 0) |
+           (events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static inline int slirp_epoll_revents(int events)
+{
+    return (events & EPOLLIN ? G_IO_IN : 0) |
+           (events & EPOLLPRI ? G_IO_PRI : 0) |
+           (events & EPOLLOUT ? G_IO_OUT : 0) |
+           (events & EPOLLHUP ? G_IO_HUP : 0) |
+           (events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+static void slirp_epoll_disable(Slirp *slirp)
+{
+    close(slirp->epoll_fd);
+    slirp->epoll_fd = -1;
+}
+
+static void slirp_epoll_update(Slirp *slirp, struct socket *so, int events)
+{
+    struct epoll_event event = {
+        .events = slirp_epoll_events(events),
+        .data.ptr = so,
+    };
+    int ctl, r;
+
+    /* A closed fd has left the epoll set on its own */
+    if (so->poll_events && so->poll_fd != so->s) {
+        so->poll_fd = -1;
+        so->poll_events = 0;
+        slirp->epoll_nfds--;
+    }
+    if (so->poll_events == events) {
+        return;
+    }
+
+    if (!events) {
+        ctl = EPOLL_CTL_DEL;
+    } else if (!so->poll_events) {
+        ctl = EPOLL_CTL_ADD;
+    } else {
+        ctl = EPOLL_CTL_MOD;
+    }
+
+    r = epoll_ctl(slirp->epoll_fd, ctl, so->s, &event);
+    if (r && ctl == EPOLL_CTL_MOD && errno == ENOENT) {
+        /* The fd number was closed and reused since it was registered */
+        r = epoll_ctl(slirp->epoll_fd, EPOLL_CTL_ADD, so->s, &event);
+    }
+    if (r && ctl != EPOLL_CTL_DEL) {
+        error_report("slirp: epoll_ctl failed, falling back to poll: %s",
+                     strerror(errno));
+        slirp_epoll_disable(slirp);
+        return;
+    }
+
+    if (!events) {
+        slirp->epoll_nfds--;
+    } else if (!so->poll_events) {
+        slirp->epoll_nfds++;
+    }
+    so->poll_fd = events ? so->s : -1;
+    so->poll_events = events;
+}
+
+/* Collect the events of all ready sockets with a single epoll_wait() */
+static void slirp_epoll_dispatch(Slirp *slirp, GArray *pollfds)
+{
+    GPollFD *pfd;
+    int i, n;
+
+    if (slirp->epoll_fd < 0 || slirp->epoll_pollfds_idx < 0) {
+        return;
+    }
+    pfd = &g_array_index(pollfds, GPollFD, slirp->epoll_pollfds_idx);
+    if (!(pfd->revents & G_IO_IN) || !slirp->epoll_nfds) {
+        return;
+    }
+
+    if (slirp->epoll_max_events < slirp->epoll_nfds) {
+        slirp->epoll_max_events = slirp->epoll_nfds;
+        slirp->epoll_events = g_renew(struct epoll_event, slirp->epoll_events,
+                                      slirp->epoll_max_events);
+    }
+
+    do {
+        n = epoll_wait(slirp->epoll_fd, slirp->epoll_events,
+                       slirp->epoll_max_events, 0);
+    } while (n < 0 && errno == EINTR);
+
+    for (i = 0; i < n; i++) {
+        struct socket *so = slirp->epoll_events[i].data.ptr;
+
+        so->revents = slirp_epoll_revents(slirp->epoll_events[i].events);
+    }
+}
+#endif
+
+static void slirp_poll_socket(Slirp *slirp, GArray *pollfds,
+                              struct socket *so, int events)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    if (slirp->epoll_fd >= 0) {
+        slirp_epoll_update(slirp, so, events);
+        if (slirp->epoll_fd >= 0) {
+            return;
+        }
+    }
+#endif
+    if (events) {
+        GPollFD pfd = {
+            .fd = so->s,
+            .events = events,
+        };
+        so->pollfds_idx = pollfds->len;
+        g_array_append_val(pollfds, pfd);
+    }
+}
+
+static int slirp_socket_revents(GArray *pollfds, struct socket *so)
+{
+    int revents = so->revents;
+
+    so->revents = 0;
+    if (so->pollfds_idx != -1) {
+        revents |= g_array_index(pollfds, GPollFD, so->pollfds_idx).revents;
+    }
+    return revents;
+}
+
+/* Called before a socket is freed or its fd closed and replaced */
+void slirp_socket_unregister(struct socket *so)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    Slirp *slirp = so->slirp;
+
+    if (slirp->epoll_fd >= 0 && so->poll_events) {
+        if (so->poll_fd == so->s) {
+            /* Fails harmlessly if the fd is already closed */
+            epoll_ctl(slirp->epoll_fd, EPOLL_CTL_DEL, so->s, NULL);
+        }
+        slirp->epoll_nfds--;
+    }
+#endif
+    so->poll_fd = -1;
+    so->poll_events = 0;
+    so->revents = 0;
+}
+
 void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
 {
     Slirp *slirp;
@@ -418,6 +594,9 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
              * newly socreated() sockets etc. Don't want to select these.
              */
             if (so->so_state & SS_NOFDREF || so->s == -1) {
+                if (so->s != -1) {
+                    slirp_poll_socket(slirp, pollfds, so, 0);
+                }
                 continue;
             }
 
@@ -425,12 +604,8 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
              * Set for reading sockets which are accepting
              */
             if (so->so_state & SS_FACCEPTCONN) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                slirp_poll_socket(slirp, pollfds, so,
+                                  G_IO_IN | G_IO_HUP | G_IO_ERR);
                 continue;
             }
 
@@ -438,12 +613,7 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
              * Set for writing sockets which are connecting
              */
             if (so->so_state & SS_ISFCONNECTING) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_OUT | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                slirp_poll_socket(slirp, pollfds, so, G_IO_OUT | G_IO_ERR);
                 continue;
             }
 
@@ -464,14 +634,7 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
                 events |= G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_PRI;
             }
 
-            if (events) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = events,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-            }
+            slirp_poll_socket(slirp, pollfds, so, events);
         }
 
         /*
@@ -506,12 +669,10 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
              * (XXX <= 4 ?)
              */
             if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                slirp_poll_socket(slirp, pollfds, so,
+                                  G_IO_IN | G_IO_HUP | G_IO_ERR);
+            } else if (so->s != -1) {
+                slirp_poll_socket(slirp, pollfds, so, 0);
             }
         }
 
@@ -537,14 +698,24 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
             }
 
             if (so->so_state & SS_ISFCONNECTED) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                slirp_poll_socket(slirp, pollfds, so,
+                                  G_IO_IN | G_IO_HUP | G_IO_ERR);
+            } else if (so->s != -1) {
+                slirp_poll_socket(slirp, pollfds, so, 0);
             }
         }
+
+#ifdef CONFIG_EPOLL_CREATE1
+        slirp->epoll_pollfds_idx = -1;
+        if (slirp->epoll_fd >= 0) {
+            GPollFD pfd = {
+                .fd = slirp->epoll_fd,
+                .events = G_IO_IN,
+            };
+            slirp->epoll_pollfds_idx = pollfds->len;
+            g_array_append_val(pollfds, pfd);
+        }
+#endif
     }
     slirp_update_timeout(timeout);
 }
@@ -581,6 +752,10 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
          * Check sockets
          */
         if (!select_error) {
+#ifdef CONFIG_EPOLL_CREATE1
+            slirp_epoll_dispatch(slirp, pollfds);
+#endif
+
             /*
              * Check TCP sockets
              */
@@ -590,11 +765,7 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
 
                 so_next = so->so_next;
 
-                revents = 0;
-                if (so->pollfds_idx != -1) {
-                    revents = g_array_index(pollfds, GPollFD,
-                                            so->pollfds_idx).revents;
-                }
+                revents = slirp_socket_revents(pollfds, so);
 
                 if (so->so_state & SS_NOFDREF || so->s == -1) {
                     continue;
@@ -733,11 +904,7 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
 
                 so_next = so->so_next;
 
-                revents = 0;
-                if (so->pollfds_idx != -1) {
-                    revents = g_array_index(pollfds, GPollFD,
-                            so->pollfds_idx).revents;
-                }
+                revents = slirp_socket_revents(pollfds, so);
 
                 if (so->s != -1 &&
                     (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
@@ -754,11 +921,7 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
 
                     so_next = so->so_next;
 
-                    revents = 0;
-                    if (so->pollfds_idx != -1) {
-                        revents = g_array_index(pollfds, GPollFD,
-                                                so->pollfds_idx).revents;
-                    }
+                    revents = slirp_socket_revents(pollfds, so);
 
                     if (so->s != -1 &&
                         (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
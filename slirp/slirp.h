@@ -59,6 +59,10 @@ typedef char *caddr_t;
 # include <sys/filio.h>
 #endif
 
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
+
 /* Avoid conflicting with the libc insque() and remque(), which
    have different prototypes. */
 #define insque slirp_insque
@@ -179,6 +183,7 @@ struct Slirp {
     struct quehead m_freelist;
     struct quehead m_usedlist;
     int mbuf_alloced;
+    int mbuf_free;          /* mbufs parked on m_freelist */
 
     /* if states */
     struct quehead if_fastq;   /* fast queue (for interactive data) */
@@ -220,6 +225,15 @@ struct Slirp {
     GRand *grand;
     QEMUTimer *ra_timer;
 
+#ifdef CONFIG_EPOLL_CREATE1
+    /* socket event engine, sockets stay registered across main loops */
+    int epoll_fd;           /* -1 if sockets go through the pollfds array */
+    int epoll_pollfds_idx;
+    int epoll_nfds;         /* number of registered sockets */
+    int epoll_max_events;
+    struct epoll_event *epoll_events;
+#endif
+
     void *opaque;
 };
 
@@ -230,6 +244,7 @@ extern Slirp *slirp_instance;
 #endif
 
 void if_start(Slirp *);
+void slirp_socket_unregister(struct socket *so);
 
 #ifndef _WIN32
 #include <netdb.h>
@@ -55,6 +55,7 @@ socreate(Slirp *slirp)
     so->s = -1;
     so->slirp = slirp;
     so->pollfds_idx = -1;
+    so->poll_fd = -1;
   }
   return(so);
 }
@@ -88,6 +89,8 @@ sofree(struct socket *so)
 {
   Slirp *slirp = so->slirp;
 
+  slirp_socket_unregister(so);
+
   soqfree(so, &slirp->if_fastq);
   soqfree(so, &slirp->if_batchq);
 
@@ -21,6 +21,9 @@ struct socket {
   int s;                           /* The actual socket */
 
   int pollfds_idx;                 /* GPollFD GArray index */
+  int poll_fd;                     /* fd registered with the event engine */
+  int poll_events;                 /* events it is registered for */
+  int revents;                     /* events seen by the event engine */
 
   Slirp *slirp;			   /* managing slirp instance */
 
@@ -490,6 +490,7 @@ void tcp_connect(struct socket *inso)
     /* Close the accept() socket, set right state */
     if (inso->so_state & SS_FACCEPTONCE) {
         /* If we only accept once, close the accept() socket */
+        slirp_socket_unregister(so);
         closesocket(so->s);
 
         /* Don't select it yet, even though we have an FD */
@@ -21,6 +21,7 @@
 #include "cpu.h"
 #include "exec/exec-all.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "qemu/log.h"
 #include "arm_ldst.h"
 #include "translate.h"
@@ -545,6 +546,16 @@ static inline int vec_reg_offset(DisasContext *s, int regno,
     return offs;
 }
 
+/* Return the offset into CPUARMState of the full 128 bit vector
+ * register Qn, for use with the tcg_gen_gvec_* expanders.  The low
+ * 64 bits are always vfp.regs[2n], regardless of host endianness.
+ */
+static inline int vec_full_reg_offset(DisasContext *s, int regno)
+{
+    assert_fp_access_checked(s);
+    return offsetof(CPUARMState, vfp.regs[regno * 2]);
+}
+
 /* Return the offset into CPUARMState of a slice (from
  * the least significant end) of FP register Qn (ie
  * Dn, Sn, Hn or Bn).
@@ -5827,10 +5838,7 @@ static void handle_simd_dupe(DisasContext *s, int is_q, int rd, int rn,
                              int imm5)
 {
     int size = ctz32(imm5);
-    int esize = 8 << size;
-    int elements = (is_q ? 128 : 64) / esize;
-    int index, i;
-    TCGv_i64 tmp;
+    int index;
 
     if (size > 3 || (size == 3 && !is_q)) {
         unallocated_encoding(s);
@@ -5842,19 +5850,9 @@ static void handle_simd_dupe(DisasContext *s, int is_q, int rd, int rn,
     }
 
     index = imm5 >> (size + 1);
-
-    tmp = tcg_temp_new_i64();
-    read_vec_element(s, tmp, rn, index, size);
-
-    for (i = 0; i < elements; i++) {
-        write_vec_element(s, tmp, rd, i, size);
-    }
-
-    if (!is_q) {
-        clear_vec_high(s, rd);
-    }
-
-    tcg_temp_free_i64(tmp);
+    tcg_gen_gvec_dup_mem(size, cpu_env, vec_full_reg_offset(s, rd),
+                         vec_reg_offset(s, rn, index, size),
+                         is_q ? 16 : 8, 16);
 }
 
 /* C6.3.31 DUP (element, scalar)
@@ -5903,9 +5901,6 @@ static void handle_simd_dupg(DisasContext *s, int is_q, int rd, int rn,
                              int imm5)
 {
     int size = ctz32(imm5);
-    int esize = 8 << size;
-    int elements = (is_q ? 128 : 64)/esize;
-    int i = 0;
 
     if (size > 3 || ((size == 3) && !is_q)) {
         unallocated_encoding(s);
@@ -5916,12 +5911,8 @@ static void handle_simd_dupg(DisasContext *s, int is_q, int rd, int rn,
         return;
     }
 
-    for (i = 0; i < elements; i++) {
-        write_vec_element(s, cpu_reg(s, rn), rd, i, size);
-    }
-    if (!is_q) {
-        clear_vec_high(s, rd);
-    }
+    tcg_gen_gvec_dup_i64(size, cpu_env, vec_full_reg_offset(s, rd),
+                         is_q ? 16 : 8, 16, cpu_reg(s, rn));
 }
 
 /* C6.3.150 INS (Element)
@@ -9067,6 +9058,26 @@ static void disas_simd_3same_logic(DisasContext *s, uint32_t insn)
         return;
     }
 
+    /* Everything except the bitwise select ops maps directly onto
+     * the generic vector expanders.
+     */
+    if (!is_u || size == 0) {
+        static void (* const fns[5])(TCGv_env, uint32_t, uint32_t,
+                                     uint32_t, uint32_t, uint32_t) = {
+            tcg_gen_gvec_and,  /* AND */
+            tcg_gen_gvec_andc, /* BIC */
+            tcg_gen_gvec_or,   /* ORR */
+            tcg_gen_gvec_orc,  /* ORN */
+            tcg_gen_gvec_xor,  /* EOR */
+        };
+
+        fns[is_u ? 4 : size](cpu_env, vec_full_reg_offset(s, rd),
+                             vec_full_reg_offset(s, rn),
+                             vec_full_reg_offset(s, rm),
+                             is_q ? 16 : 8, 16);
+        return;
+    }
+
     tcg_op1 = tcg_temp_new_i64();
     tcg_op2 = tcg_temp_new_i64();
     tcg_res[0] = tcg_temp_new_i64();
@@ -9429,6 +9440,28 @@ static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
         return;
     }
 
+    switch (opcode) {
+    case 0x10: /* ADD, SUB */
+        if (u) {
+            tcg_gen_gvec_sub(size, cpu_env, vec_full_reg_offset(s, rd),
+                             vec_full_reg_offset(s, rn),
+                             vec_full_reg_offset(s, rm), is_q ? 16 : 8, 16);
+        } else {
+            tcg_gen_gvec_add(size, cpu_env, vec_full_reg_offset(s, rd),
+                             vec_full_reg_offset(s, rn),
+                             vec_full_reg_offset(s, rm), is_q ? 16 : 8, 16);
+        }
+        return;
+    case 0x11: /* CMTST, CMEQ */
+        if (u) {
+            tcg_gen_gvec_cmpeq(size, cpu_env, vec_full_reg_offset(s, rd),
+                               vec_full_reg_offset(s, rn),
+                               vec_full_reg_offset(s, rm), is_q ? 16 : 8, 16);
+            return;
+        }
+        break;
+    }
+
     if (size == 3) {
         assert(is_q);
         for (pass = 0; pass < 2; pass++) {
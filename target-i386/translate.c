@@ -23,6 +23,7 @@
 #include "disas/disas.h"
 #include "exec/exec-all.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "exec/cpu_ldst.h"
 
 #include "exec/helper-proto.h"
@@ -2939,6 +2940,67 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* Expand the simple integer and logical MMX/SSE ops inline with the
+ * generic vector expanders instead of calling out to a helper.
+ * Return false if B is not one of them.
+ */
+static bool gen_sse_gvec(int b, int is_xmm, int op1_offset, int op2_offset)
+{
+    int sz = is_xmm ? 16 : 8;
+
+    if (is_xmm) {
+        /* The low 128 bits are in reverse order on big-endian hosts.  */
+        int lo = MIN(offsetof(ZMMReg, ZMM_Q(0)), offsetof(ZMMReg, ZMM_Q(1)));
+        op1_offset += lo;
+        op2_offset += lo;
+    }
+
+    switch (b) {
+    case 0x54: /* andps, andpd */
+    case 0xdb: /* pand */
+        tcg_gen_gvec_and(cpu_env, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0x55: /* andnps, andnpd */
+    case 0xdf: /* pandn */
+        tcg_gen_gvec_andc(cpu_env, op1_offset, op2_offset, op1_offset, sz, sz);
+        break;
+    case 0x56: /* orps, orpd */
+    case 0xeb: /* por */
+        tcg_gen_gvec_or(cpu_env, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0x57: /* xorps, xorpd */
+    case 0xef: /* pxor */
+        tcg_gen_gvec_xor(cpu_env, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0x74: /* pcmpeqb */
+    case 0x75: /* pcmpeqw */
+    case 0x76: /* pcmpeql */
+        tcg_gen_gvec_cmpeq(b - 0x74, cpu_env, op1_offset, op1_offset,
+                           op2_offset, sz, sz);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_gvec_add(MO_64, cpu_env, op1_offset, op1_offset,
+                         op2_offset, sz, sz);
+        break;
+    case 0xfc: /* paddb */
+    case 0xfd: /* paddw */
+    case 0xfe: /* paddl */
+        tcg_gen_gvec_add(b - 0xfc, cpu_env, op1_offset, op1_offset,
+                         op2_offset, sz, sz);
+        break;
+    case 0xf8: /* psubb */
+    case 0xf9: /* psubw */
+    case 0xfa: /* psubl */
+    case 0xfb: /* psubq */
+        tcg_gen_gvec_sub(b - 0xf8, cpu_env, op1_offset, op1_offset,
+                         op2_offset, sz, sz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4365,6 +4427,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_gvec(b, is_xmm, op1_offset, op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
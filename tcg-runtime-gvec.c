@@ -0,0 +1,72 @@
+/*
+ * Generic vectorized operation runtime
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "cpu.h"
+#include "exec/helper-proto.h"
+
+/* Virtually all hosts support 16-byte vectors.  Those that don't can
+ * emulate them via GCC's generic vector extension.  This turns out to
+ * be simpler and more reliable than getting the compiler to autovectorize.
+ *
+ * The operands live in CPUArchState and are only guaranteed 8-byte
+ * alignment, which a typedef is allowed to relax the vector type to.
+ */
+typedef uint8_t vec8 __attribute__((vector_size(16), aligned(8)));
+typedef uint16_t vec16 __attribute__((vector_size(16), aligned(8)));
+typedef uint32_t vec32 __attribute__((vector_size(16), aligned(8)));
+typedef uint64_t vec64 __attribute__((vector_size(16), aligned(8)));
+
+/* The caller guarantees OPRSZ to be a multiple of 16 whenever the
+ * operation is not expanded inline.
+ */
+#define DO_3(NAME, TYPE, OP)                                            \
+void HELPER(NAME)(void *d, void *a, void *b, uint32_t oprsz)            \
+{                                                                       \
+    uint32_t i;                                                         \
+                                                                        \
+    for (i = 0; i < oprsz; i += sizeof(TYPE)) {                         \
+        TYPE aa = *(TYPE *)(a + i);                                     \
+        TYPE bb = *(TYPE *)(b + i);                                     \
+        *(TYPE *)(d + i) = OP;                                          \
+    }                                                                   \
+}
+
+DO_3(gvec_add8, vec8, aa + bb)
+DO_3(gvec_add16, vec16, aa + bb)
+DO_3(gvec_add32, vec32, aa + bb)
+DO_3(gvec_add64, vec64, aa + bb)
+
+DO_3(gvec_sub8, vec8, aa - bb)
+DO_3(gvec_sub16, vec16, aa - bb)
+DO_3(gvec_sub32, vec32, aa - bb)
+DO_3(gvec_sub64, vec64, aa - bb)
+
+/* Vector comparisons yield all-ones or all-zeros in each lane.  */
+DO_3(gvec_cmpeq8, vec8, (vec8)(aa == bb))
+DO_3(gvec_cmpeq16, vec16, (vec16)(aa == bb))
+DO_3(gvec_cmpeq32, vec32, (vec32)(aa == bb))
+DO_3(gvec_cmpeq64, vec64, (vec64)(aa == bb))
+
+DO_3(gvec_and, vec64, aa & bb)
+DO_3(gvec_or, vec64, aa | bb)
+DO_3(gvec_xor, vec64, aa ^ bb)
+DO_3(gvec_andc, vec64, aa & ~bb)
+DO_3(gvec_orc, vec64, aa | ~bb)
+
+#undef DO_3
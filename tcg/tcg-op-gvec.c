@@ -0,0 +1,445 @@
+/*
+ * Generic vector operation expansion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "tcg.h"
+#include "tcg-op.h"
+#include "tcg-op-gvec.h"
+
+/* Vectors of at most this many 64-bit words are expanded inline;
+ * anything larger goes out of line.  This covers 128-bit guest
+ * vectors (NEON, SSE) completely with a handful of host insns.
+ */
+#define MAX_UNROLL  4
+
+typedef void GVecGen2Fn(unsigned, TCGv_i64, TCGv_i64);
+typedef void GVecGen3Fn(unsigned, TCGv_i64, TCGv_i64, TCGv_i64);
+typedef void GVecGen3OolFn(TCGv_ptr, TCGv_ptr, TCGv_ptr, TCGv_i32);
+
+static void check_size_align(uint32_t oprsz, uint32_t maxsz, uint32_t ofs)
+{
+    tcg_debug_assert(oprsz > 0 && oprsz <= maxsz);
+    tcg_debug_assert((oprsz & 7) == 0);
+    tcg_debug_assert((maxsz & 7) == 0);
+    tcg_debug_assert((ofs & 7) == 0);
+}
+
+/* Clear MAXSZ - OPRSZ bytes following the operation.  */
+static void expand_clr(TCGv_env env, uint32_t dofs, uint32_t oprsz,
+                       uint32_t maxsz)
+{
+    TCGv_i64 zero;
+    uint32_t i;
+
+    if (oprsz == maxsz) {
+        return;
+    }
+    zero = tcg_const_i64(0);
+    for (i = oprsz; i < maxsz; i += 8) {
+        tcg_gen_st_i64(zero, env, dofs + i);
+    }
+    tcg_temp_free_i64(zero);
+}
+
+static void expand_2_i64(unsigned vece, TCGv_env env, uint32_t dofs,
+                         uint32_t aofs, uint32_t oprsz, GVecGen2Fn *fni)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, env, aofs + i);
+        fni(vece, t0, t0);
+        tcg_gen_st_i64(t0, env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+}
+
+static void expand_3_i64(unsigned vece, TCGv_env env, uint32_t dofs,
+                         uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                         GVecGen3Fn *fni)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, env, aofs + i);
+        tcg_gen_ld_i64(t1, env, bofs + i);
+        fni(vece, t2, t0, t1);
+        tcg_gen_st_i64(t2, env, dofs + i);
+    }
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t0);
+}
+
+static void expand_3_ool(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                         uint32_t bofs, uint32_t oprsz, GVecGen3OolFn *fno)
+{
+    TCGv_ptr d = tcg_temp_new_ptr();
+    TCGv_ptr a = tcg_temp_new_ptr();
+    TCGv_ptr b = tcg_temp_new_ptr();
+    TCGv_i32 desc = tcg_const_i32(oprsz);
+
+    tcg_gen_addi_ptr(d, env, dofs);
+    tcg_gen_addi_ptr(a, env, aofs);
+    tcg_gen_addi_ptr(b, env, bofs);
+    fno(d, a, b, desc);
+
+    tcg_temp_free_i32(desc);
+    tcg_temp_free_ptr(b);
+    tcg_temp_free_ptr(a);
+    tcg_temp_free_ptr(d);
+}
+
+static void do_gvec_3(unsigned vece, TCGv_env env, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                      uint32_t maxsz, GVecGen3Fn *fni, GVecGen3OolFn *fno)
+{
+    check_size_align(oprsz, maxsz, dofs | aofs | bofs);
+
+    if (oprsz <= MAX_UNROLL * 8) {
+        expand_3_i64(vece, env, dofs, aofs, bofs, oprsz, fni);
+    } else {
+        tcg_debug_assert((oprsz & 15) == 0);
+        expand_3_ool(env, dofs, aofs, bofs, oprsz, fno);
+    }
+    expand_clr(env, dofs, oprsz, maxsz);
+}
+
+/* Perform a vector addition using normal addition and a mask.  The mask
+ * should be the sign bit of each lane.  This 6-operation form is more
+ * efficient than separate additions when there are 4 or more lanes in
+ * the 64-bit operation.
+ */
+static void gen_addv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andc_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_subv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_or_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_add_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1, t2;
+
+    switch (vece) {
+    case MO_8:
+    case MO_16:
+        t1 = tcg_const_i64(dup_const(vece, 1ull << ((8 << vece) - 1)));
+        gen_addv_mask(d, a, b, t1);
+        tcg_temp_free_i64(t1);
+        break;
+    case MO_32:
+        /* Clearing the low half of A keeps the low lane from carrying
+           into the high lane; the low lane is then taken from a plain
+           64-bit addition.  */
+        t1 = tcg_temp_new_i64();
+        t2 = tcg_temp_new_i64();
+        tcg_gen_andi_i64(t1, a, ~0xffffffffull);
+        tcg_gen_add_i64(t2, a, b);
+        tcg_gen_add_i64(t1, t1, b);
+        tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+        tcg_temp_free_i64(t1);
+        tcg_temp_free_i64(t2);
+        break;
+    default:
+        tcg_gen_add_i64(d, a, b);
+        break;
+    }
+}
+
+static void gen_sub_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1, t2;
+
+    switch (vece) {
+    case MO_8:
+    case MO_16:
+        t1 = tcg_const_i64(dup_const(vece, 1ull << ((8 << vece) - 1)));
+        gen_subv_mask(d, a, b, t1);
+        tcg_temp_free_i64(t1);
+        break;
+    case MO_32:
+        t1 = tcg_temp_new_i64();
+        t2 = tcg_temp_new_i64();
+        tcg_gen_andi_i64(t1, b, ~0xffffffffull);
+        tcg_gen_sub_i64(t2, a, b);
+        tcg_gen_sub_i64(t1, a, t1);
+        tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+        tcg_temp_free_i64(t1);
+        tcg_temp_free_i64(t2);
+        break;
+    default:
+        tcg_gen_sub_i64(d, a, b);
+        break;
+    }
+}
+
+/* Set each lane of D to all ones if the corresponding lanes of A and B
+ * are equal, and to zero otherwise.  For sub-word lanes, X = A ^ B is
+ * zero exactly in the equal lanes; adding the per-lane maximum signed
+ * value to the low bits of X sets the sign bit of every lane that has
+ * any low bit set, without carrying into the next lane.  What remains
+ * is then spread from the sign bit over the whole lane.
+ */
+static void gen_cmpeq_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    unsigned esize = 8 << vece;
+    TCGv_i64 t1, t2;
+
+    if (vece == MO_64) {
+        tcg_gen_setcond_i64(TCG_COND_EQ, d, a, b);
+        tcg_gen_neg_i64(d, d);
+        return;
+    }
+
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+
+    tcg_gen_xor_i64(t1, a, b);
+    tcg_gen_andi_i64(t2, t1, dup_const(vece, (1ull << (esize - 1)) - 1));
+    tcg_gen_addi_i64(t2, t2, dup_const(vece, (1ull << (esize - 1)) - 1));
+    tcg_gen_or_i64(t2, t2, t1);
+    tcg_gen_ori_i64(t2, t2, dup_const(vece, (1ull << (esize - 1)) - 1));
+    tcg_gen_not_i64(t2, t2);
+
+    /* Each lane of T2 now holds only its sign bit.  Move that down to
+       bit 0 and multiply by the all-ones lane value, as (x << esize) - x;
+       no lane can borrow from its neighbour.  */
+    tcg_gen_shri_i64(t2, t2, esize - 1);
+    tcg_gen_shli_i64(t1, t2, esize);
+    tcg_gen_sub_i64(d, t1, t2);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+static void gen_and_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_or_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_xor_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gen_andc_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+static void gen_orc_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_orc_i64(d, a, b);
+}
+
+static void gen_not_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a)
+{
+    tcg_gen_not_i64(d, a);
+}
+
+static void gen_mov_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a)
+{
+    tcg_gen_mov_i64(d, a);
+}
+
+void tcg_gen_gvec_add(unsigned vece, TCGv_env env, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    static GVecGen3OolFn * const fns[4] = {
+        gen_helper_gvec_add8, gen_helper_gvec_add16,
+        gen_helper_gvec_add32, gen_helper_gvec_add64,
+    };
+    do_gvec_3(vece, env, dofs, aofs, bofs, oprsz, maxsz,
+              gen_add_i64, fns[vece]);
+}
+
+void tcg_gen_gvec_sub(unsigned vece, TCGv_env env, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    static GVecGen3OolFn * const fns[4] = {
+        gen_helper_gvec_sub8, gen_helper_gvec_sub16,
+        gen_helper_gvec_sub32, gen_helper_gvec_sub64,
+    };
+    do_gvec_3(vece, env, dofs, aofs, bofs, oprsz, maxsz,
+              gen_sub_i64, fns[vece]);
+}
+
+void tcg_gen_gvec_cmpeq(unsigned vece, TCGv_env env, uint32_t dofs,
+                        uint32_t aofs, uint32_t bofs,
+                        uint32_t oprsz, uint32_t maxsz)
+{
+    static GVecGen3OolFn * const fns[4] = {
+        gen_helper_gvec_cmpeq8, gen_helper_gvec_cmpeq16,
+        gen_helper_gvec_cmpeq32, gen_helper_gvec_cmpeq64,
+    };
+    do_gvec_3(vece, env, dofs, aofs, bofs, oprsz, maxsz,
+              gen_cmpeq_i64, fns[vece]);
+}
+
+void tcg_gen_gvec_and(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    do_gvec_3(MO_64, env, dofs, aofs, bofs, oprsz, maxsz,
+              gen_and_i64, gen_helper_gvec_and);
+}
+
+void tcg_gen_gvec_or(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    do_gvec_3(MO_64, env, dofs, aofs, bofs, oprsz, maxsz,
+              gen_or_i64, gen_helper_gvec_or);
+}
+
+void tcg_gen_gvec_xor(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    do_gvec_3(MO_64, env, dofs, aofs, bofs, oprsz, maxsz,
+              gen_xor_i64, gen_helper_gvec_xor);
+}
+
+void tcg_gen_gvec_andc(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    do_gvec_3(MO_64, env, dofs, aofs, bofs, oprsz, maxsz,
+              gen_andc_i64, gen_helper_gvec_andc);
+}
+
+void tcg_gen_gvec_orc(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    do_gvec_3(MO_64, env, dofs, aofs, bofs, oprsz, maxsz,
+              gen_orc_i64, gen_helper_gvec_orc);
+}
+
+/* Unary operations are cheap enough that they are always expanded
+ * inline: there is at most one host operation per 64-bit word.
+ */
+void tcg_gen_gvec_not(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    check_size_align(oprsz, maxsz, dofs | aofs);
+    expand_2_i64(MO_64, env, dofs, aofs, oprsz, gen_not_i64);
+    expand_clr(env, dofs, oprsz, maxsz);
+}
+
+void tcg_gen_gvec_mov(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    check_size_align(oprsz, maxsz, dofs | aofs);
+    if (dofs != aofs) {
+        expand_2_i64(MO_64, env, dofs, aofs, oprsz, gen_mov_i64);
+    }
+    expand_clr(env, dofs, oprsz, maxsz);
+}
+
+void tcg_gen_gvec_dup_i64(unsigned vece, TCGv_env env, uint32_t dofs,
+                          uint32_t oprsz, uint32_t maxsz, TCGv_i64 in)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz, dofs);
+
+    switch (vece) {
+    case MO_8:
+        tcg_gen_ext8u_i64(t0, in);
+        tcg_gen_muli_i64(t0, t0, 0x0101010101010101ull);
+        break;
+    case MO_16:
+        tcg_gen_ext16u_i64(t0, in);
+        tcg_gen_muli_i64(t0, t0, 0x0001000100010001ull);
+        break;
+    case MO_32:
+        tcg_gen_deposit_i64(t0, in, in, 32, 32);
+        break;
+    default:
+        tcg_gen_mov_i64(t0, in);
+        break;
+    }
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_st_i64(t0, env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+    expand_clr(env, dofs, oprsz, maxsz);
+}
+
+void tcg_gen_gvec_dup_mem(unsigned vece, TCGv_env env, uint32_t dofs,
+                          uint32_t aofs, uint32_t oprsz, uint32_t maxsz)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+
+    switch (vece) {
+    case MO_8:
+        tcg_gen_ld8u_i64(t0, env, aofs);
+        break;
+    case MO_16:
+        tcg_gen_ld16u_i64(t0, env, aofs);
+        break;
+    case MO_32:
+        tcg_gen_ld32u_i64(t0, env, aofs);
+        break;
+    default:
+        tcg_gen_ld_i64(t0, env, aofs);
+        break;
+    }
+    tcg_gen_gvec_dup_i64(vece, env, dofs, oprsz, maxsz, t0);
+    tcg_temp_free_i64(t0);
+}
@@ -0,0 +1,84 @@
+/*
+ * Generic vector operation expansion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCG_TCG_OP_GVEC_H
+#define TCG_TCG_OP_GVEC_H
+
+/*
+ * "Generic" vectors.  All operands are given as offsets from ENV,
+ * and therefore cannot also be allocated via tcg_global_mem_new_*.
+ * OPRSZ is the byte size of the vector upon which the operation is
+ * performed.  MAXSZ is the byte size of the full vector; bytes beyond
+ * OPRSZ are cleared.  Both must be a multiple of 8 and all offsets
+ * must be 8-byte aligned.  Input and output operands may be identical,
+ * but must not otherwise overlap.
+ *
+ * VECE is the log2 of the element size, as with TCGMemOp MO_8..MO_64.
+ *
+ * Small vectors are expanded inline using 64-bit integer operations,
+ * processing all of the lanes of each 64-bit word at once.  Larger
+ * vectors are handed off to out-of-line helpers in tcg-runtime-gvec.c.
+ */
+
+void tcg_gen_gvec_add(unsigned vece, TCGv_env env, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_sub(unsigned vece, TCGv_env env, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_cmpeq(unsigned vece, TCGv_env env, uint32_t dofs,
+                        uint32_t aofs, uint32_t bofs,
+                        uint32_t oprsz, uint32_t maxsz);
+
+void tcg_gen_gvec_and(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_or(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_xor(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_andc(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_orc(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_not(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_mov(TCGv_env env, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz);
+
+/* Replicate the low VECE-sized element of IN across the destination.  */
+void tcg_gen_gvec_dup_i64(unsigned vece, TCGv_env env, uint32_t dofs,
+                          uint32_t oprsz, uint32_t maxsz, TCGv_i64 in);
+/* Replicate the VECE-sized element at env+AOFS across the destination.  */
+void tcg_gen_gvec_dup_mem(unsigned vece, TCGv_env env, uint32_t dofs,
+                          uint32_t aofs, uint32_t oprsz, uint32_t maxsz);
+
+/* Replicate the low VECE-sized element of C across a 64-bit word.  */
+static inline uint64_t dup_const(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case MO_8:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case MO_16:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case MO_32:
+        return 0x0000000100000001ull * (uint32_t)c;
+    default:
+        return c;
+    }
+}
+
+#endif
@@ -9,18 +9,419 @@
 
 #include "qemu/osdep.h"
 #include "libqtest.h"
+#include "libqos/libqos-pc.h"
+#include "qemu/bswap.h"
 
-/* Tests only initialization so far. TODO: Replace with functional tests */
+#define NVME_SLOT           4
+#define TEST_IMAGE_SIZE     (1024 * 1024)
+#define QUEUE_SIZE          16
+#define SECTOR_SIZE         512
+#define TIMEOUT_US          (5 * 1000 * 1000)
+
+/* Controller registers */
+#define NVME_REG_CC         0x14
+#define NVME_REG_CSTS       0x1c
+#define NVME_REG_AQA        0x24
+#define NVME_REG_ASQ        0x28
+#define NVME_REG_ACQ        0x30
+#define NVME_REG_DBS        0x1000
+
+#define NVME_CC_ENABLE      ((6 << 16) | (4 << 20) | 1)
+#define NVME_CSTS_RDY       1
+
+#define NVME_ADM_CREATE_SQ  0x01
+#define NVME_ADM_CREATE_CQ  0x05
+#define NVME_ADM_GET_FEAT   0x0a
+#define NVME_ADM_DBBUF      0x7c
+#define NVME_IO_WRITE       0x01
+#define NVME_IO_READ        0x02
+
+#define NVME_FEAT_NUM_QUEUES    0x07
+
+/* PSDT in the flags byte: SGL, with a contiguous metadata buffer */
+#define NVME_FLAGS_SGL      (1 << 6)
+#define NVME_SGL_DATA_BLOCK (0x0 << 4)
+#define NVME_SGL_LAST_SEG   (0x3 << 4)
+
+typedef struct NvmeSqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t rsvd2;
+    uint64_t mptr;
+    uint64_t dptr[2];
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} QEMU_PACKED NvmeSqe;
+
+typedef struct NvmeCqe {
+    uint32_t result;
+    uint32_t rsvd;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;
+} QEMU_PACKED NvmeCqe;
+
+typedef struct NvmeSgl {
+    uint64_t addr;
+    uint32_t len;
+    uint8_t rsvd[3];
+    uint8_t type;
+} QEMU_PACKED NvmeSgl;
+
+typedef struct NvmeQueue {
+    uint16_t qid;
+    uint64_t sq;
+    uint64_t cq;
+    uint16_t tail;
+    uint16_t head;
+    uint16_t cid;
+    bool phase;
+} NvmeQueue;
+
+typedef struct NvmeTest {
+    QTestState *global;
+    QOSState *qs;
+    QPCIDevice *dev;
+    QPCIBar bar;
+    NvmeQueue admin;
+} NvmeTest;
+
+/* Tests only initialization */
 static void nop(void)
 {
 }
 
+static void nvme_queue_init(NvmeTest *t, NvmeQueue *q, uint16_t qid)
+{
+    q->qid = qid;
+    q->sq = guest_alloc(t->qs->alloc, QUEUE_SIZE * sizeof(NvmeSqe));
+    q->cq = guest_alloc(t->qs->alloc, QUEUE_SIZE * sizeof(NvmeCqe));
+    qmemset(q->cq, 0, QUEUE_SIZE * sizeof(NvmeCqe));
+    q->tail = q->head = q->cid = 0;
+    q->phase = true;
+}
+
+/* Submit CMD on Q and wait for its completion, returns the status field */
+static uint16_t nvme_submit(NvmeTest *t, NvmeQueue *q, NvmeSqe *cmd,
+                            uint32_t *result)
+{
+    NvmeCqe cqe;
+    gint64 end_time;
+    uint16_t cid = ++q->cid;
+
+    cmd->cid = cpu_to_le16(cid);
+    memwrite(q->sq + q->tail * sizeof(*cmd), cmd, sizeof(*cmd));
+    q->tail = (q->tail + 1) % QUEUE_SIZE;
+    qpci_io_writel(t->dev, t->bar, NVME_REG_DBS + (q->qid << 3), q->tail);
+
+    end_time = g_get_monotonic_time() + TIMEOUT_US;
+    for (;;) {
+        memread(q->cq + q->head * sizeof(cqe), &cqe, sizeof(cqe));
+        if ((le16_to_cpu(cqe.status) & 1) == q->phase) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() < end_time);
+        g_usleep(1000);
+    }
+
+    g_assert_cmpint(le16_to_cpu(cqe.cid), ==, cid);
+    g_assert_cmpint(le16_to_cpu(cqe.sq_id), ==, q->qid);
+    q->head = (q->head + 1) % QUEUE_SIZE;
+    if (!q->head) {
+        q->phase = !q->phase;
+    }
+    qpci_io_writel(t->dev, t->bar, NVME_REG_DBS + (q->qid << 3) + 4, q->head);
+
+    if (result) {
+        *result = le32_to_cpu(cqe.result);
+    }
+    return le16_to_cpu(cqe.status) >> 1;
+}
+
+static uint16_t nvme_admin(NvmeTest *t, uint8_t opcode, uint64_t prp1,
+                           uint64_t prp2, uint32_t cdw10, uint32_t cdw11,
+                           uint32_t *result)
+{
+    NvmeSqe cmd = {
+        .opcode = opcode,
+        .dptr[0] = cpu_to_le64(prp1),
+        .dptr[1] = cpu_to_le64(prp2),
+        .cdw10 = cpu_to_le32(cdw10),
+        .cdw11 = cpu_to_le32(cdw11),
+    };
+
+    return nvme_submit(t, &t->admin, &cmd, result);
+}
+
+/* Create the I/O queue pair QID, its completion queue has the same id */
+static void nvme_create_queue_pair(NvmeTest *t, NvmeQueue *q, uint16_t qid)
+{
+    uint32_t size = qid | ((QUEUE_SIZE - 1) << 16);
+
+    nvme_queue_init(t, q, qid);
+    g_assert_cmpint(nvme_admin(t, NVME_ADM_CREATE_CQ, q->cq, 0, size, 1,
+                               NULL), ==, 0);
+    g_assert_cmpint(nvme_admin(t, NVME_ADM_CREATE_SQ, q->sq, 0, size,
+                               1 | (qid << 16), NULL), ==, 0);
+}
+
+static uint16_t nvme_rw(NvmeTest *t, NvmeQueue *q, uint8_t opcode,
+                        uint64_t lba, uint64_t buf)
+{
+    NvmeSqe cmd = {
+        .opcode = opcode,
+        .nsid = cpu_to_le32(1),
+        .dptr[0] = cpu_to_le64(buf),
+        .cdw10 = cpu_to_le32(lba),
+        .cdw11 = cpu_to_le32(lba >> 32),
+        .cdw12 = 0, /* one block */
+    };
+
+    return nvme_submit(t, q, &cmd, NULL);
+}
+
+static uint16_t nvme_rw_sgl(NvmeTest *t, NvmeQueue *q, uint8_t opcode,
+                            uint64_t lba, const NvmeSgl *sgl)
+{
+    NvmeSqe cmd = {
+        .opcode = opcode,
+        .flags = NVME_FLAGS_SGL,
+        .nsid = cpu_to_le32(1),
+        .cdw10 = cpu_to_le32(lba),
+        .cdw11 = cpu_to_le32(lba >> 32),
+    };
+
+    memcpy(cmd.dptr, sgl, sizeof(cmd.dptr));
+    return nvme_submit(t, q, &cmd, NULL);
+}
+
+static void nvme_write_pattern(NvmeTest *t, NvmeQueue *q, uint64_t lba,
+                               uint8_t pattern)
+{
+    uint64_t buf = guest_alloc(t->qs->alloc, SECTOR_SIZE);
+
+    qmemset(buf, pattern, SECTOR_SIZE);
+    g_assert_cmpint(nvme_rw(t, q, NVME_IO_WRITE, lba, buf), ==, 0);
+    guest_free(t->qs->alloc, buf);
+}
+
+static void nvme_check_pattern(NvmeTest *t, NvmeQueue *q, uint64_t lba,
+                               uint8_t pattern)
+{
+    uint64_t buf = guest_alloc(t->qs->alloc, SECTOR_SIZE);
+    uint8_t data[SECTOR_SIZE];
+    int i;
+
+    qmemset(buf, ~pattern, SECTOR_SIZE);
+    g_assert_cmpint(nvme_rw(t, q, NVME_IO_READ, lba, buf), ==, 0);
+    memread(buf, data, SECTOR_SIZE);
+    for (i = 0; i < SECTOR_SIZE; i++) {
+        g_assert_cmphex(data[i], ==, pattern);
+    }
+    guest_free(t->qs->alloc, buf);
+}
+
+static NvmeTest *nvme_test_start(const char *opts)
+{
+    NvmeTest *t = g_new0(NvmeTest, 1);
+    char tmp_path[] = "/tmp/qtest.XXXXXX";
+    gint64 end_time;
+    int fd, ret;
+
+    /* Create a temporary raw image */
+    fd = mkstemp(tmp_path);
+    g_assert_cmpint(fd, >=, 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+
+    t->global = global_qtest;
+    t->qs = qtest_pc_boot("-drive id=drv0,if=none,file=%s,format=raw "
+                          "-device nvme,drive=drv0,serial=foo,addr=%x.0%s",
+                          tmp_path, NVME_SLOT, opts);
+    unlink(tmp_path);
+
+    t->dev = qpci_device_find(t->qs->pcibus, QPCI_DEVFN(NVME_SLOT, 0));
+    g_assert(t->dev);
+    qpci_device_enable(t->dev);
+    t->bar = qpci_iomap(t->dev, 0, NULL);
+
+    nvme_queue_init(t, &t->admin, 0);
+    qpci_io_writel(t->dev, t->bar, NVME_REG_CC, 0);
+    qpci_io_writel(t->dev, t->bar, NVME_REG_AQA,
+                   (QUEUE_SIZE - 1) | ((QUEUE_SIZE - 1) << 16));
+    qpci_io_writel(t->dev, t->bar, NVME_REG_ASQ, t->admin.sq);
+    qpci_io_writel(t->dev, t->bar, NVME_REG_ASQ + 4, t->admin.sq >> 32);
+    qpci_io_writel(t->dev, t->bar, NVME_REG_ACQ, t->admin.cq);
+    qpci_io_writel(t->dev, t->bar, NVME_REG_ACQ + 4, t->admin.cq >> 32);
+    qpci_io_writel(t->dev, t->bar, NVME_REG_CC, NVME_CC_ENABLE);
+
+    end_time = g_get_monotonic_time() + TIMEOUT_US;
+    while (!(qpci_io_readl(t->dev, t->bar, NVME_REG_CSTS) & NVME_CSTS_RDY)) {
+        g_assert(g_get_monotonic_time() < end_time);
+        g_usleep(1000);
+    }
+    return t;
+}
+
+static void nvme_test_end(NvmeTest *t)
+{
+    qpci_io_writel(t->dev, t->bar, NVME_REG_CC, 0);
+    qpci_iounmap(t->dev, t->bar);
+    g_free(t->dev);
+    qtest_shutdown(t->qs);
+    global_qtest = t->global;
+    g_free(t);
+}
+
+static void test_rw(void)
+{
+    NvmeTest *t = nvme_test_start("");
+    NvmeQueue q;
+
+    nvme_create_queue_pair(t, &q, 1);
+    nvme_write_pattern(t, &q, 3, 0x5a);
+    nvme_check_pattern(t, &q, 3, 0x5a);
+    nvme_check_pattern(t, &q, 4, 0);
+
+    nvme_test_end(t);
+}
+
+/*
+ * Write a block through one data block descriptor, read it back through a
+ * last segment that splits it in two buffers.
+ */
+static void test_sgl(void)
+{
+    NvmeTest *t = nvme_test_start("");
+    QGuestAllocator *alloc = t->qs->alloc;
+    uint8_t data[SECTOR_SIZE], out[SECTOR_SIZE];
+    uint64_t buf, seg, half[2];
+    NvmeSgl sgl, list[2];
+    NvmeQueue q;
+    int i;
+
+    nvme_create_queue_pair(t, &q, 1);
+
+    for (i = 0; i < SECTOR_SIZE; i++) {
+        data[i] = i * 7;
+    }
+    buf = guest_alloc(alloc, SECTOR_SIZE);
+    memwrite(buf, data, SECTOR_SIZE);
+    memset(&sgl, 0, sizeof(sgl));
+    sgl.addr = cpu_to_le64(buf);
+    sgl.len = cpu_to_le32(SECTOR_SIZE);
+    sgl.type = NVME_SGL_DATA_BLOCK;
+    g_assert_cmpint(nvme_rw_sgl(t, &q, NVME_IO_WRITE, 9, &sgl), ==, 0);
+
+    memset(list, 0, sizeof(list));
+    for (i = 0; i < 2; i++) {
+        half[i] = guest_alloc(alloc, SECTOR_SIZE / 2);
+        qmemset(half[i], 0xff, SECTOR_SIZE / 2);
+        list[i].addr = cpu_to_le64(half[i]);
+        list[i].len = cpu_to_le32(SECTOR_SIZE / 2);
+        list[i].type = NVME_SGL_DATA_BLOCK;
+    }
+    seg = guest_alloc(alloc, sizeof(list));
+    memwrite(seg, list, sizeof(list));
+    sgl.addr = cpu_to_le64(seg);
+    sgl.len = cpu_to_le32(sizeof(list));
+    sgl.type = NVME_SGL_LAST_SEG;
+    g_assert_cmpint(nvme_rw_sgl(t, &q, NVME_IO_READ, 9, &sgl), ==, 0);
+
+    memread(half[0], out, SECTOR_SIZE / 2);
+    memread(half[1], out + SECTOR_SIZE / 2, SECTOR_SIZE / 2);
+    g_assert(!memcmp(data, out, SECTOR_SIZE));
+
+    /* A data block shorter than the transfer is rejected */
+    sgl.addr = cpu_to_le64(buf);
+    sgl.len = cpu_to_le32(SECTOR_SIZE / 2);
+    sgl.type = NVME_SGL_DATA_BLOCK;
+    g_assert_cmpint(nvme_rw_sgl(t, &q, NVME_IO_READ, 9, &sgl), !=, 0);
+
+    nvme_test_end(t);
+}
+
+/*
+ * Configure the doorbell buffer twice with live I/O queues: the second
+ * command only moves the shadow doorbells.
+ */
+static void test_dbbuf_twice(void)
+{
+    NvmeTest *t = nvme_test_start("");
+    QGuestAllocator *alloc = t->qs->alloc;
+    uint64_t dbs[2], eis[2];
+    NvmeQueue q;
+    int i;
+
+    nvme_create_queue_pair(t, &q, 1);
+    for (i = 0; i < 2; i++) {
+        dbs[i] = guest_alloc(alloc, 4096);
+        eis[i] = guest_alloc(alloc, 4096);
+        qmemset(dbs[i], 0, 4096);
+        qmemset(eis[i], 0, 4096);
+        g_assert_cmpint(nvme_admin(t, NVME_ADM_DBBUF, dbs[i], eis[i],
+                                   0, 0, NULL), ==, 0);
+    }
+
+    nvme_write_pattern(t, &q, 1, 0xa5);
+    nvme_check_pattern(t, &q, 1, 0xa5);
+
+    /* Only the second buffer follows the submission queue tail */
+    g_assert_cmpint(readl(dbs[1] + (1 << 3)), ==, q.tail);
+    g_assert_cmpint(readl(eis[1] + (1 << 3)), ==, q.tail);
+    g_assert_cmpint(readl(dbs[0] + (1 << 3)), ==, 0);
+
+    nvme_test_end(t);
+}
+
+/* Three I/O queue pairs spread over two IOThreads */
+static void test_multiqueue(void)
+{
+    NvmeTest *t = nvme_test_start(",num_queues=4,iothreads=io0:io1 "
+                                  "-object iothread,id=io0 "
+                                  "-object iothread,id=io1");
+    NvmeQueue q[3];
+    uint32_t result;
+    int i;
+
+    g_assert_cmpint(nvme_admin(t, NVME_ADM_GET_FEAT, 0, 0,
+                               NVME_FEAT_NUM_QUEUES, 0, &result), ==, 0);
+    g_assert_cmphex(result, ==, 2 | (2 << 16));
+
+    for (i = 0; i < 3; i++) {
+        nvme_create_queue_pair(t, &q[i], i + 1);
+    }
+    for (i = 0; i < 3; i++) {
+        nvme_write_pattern(t, &q[i], 16 + i, 0x10 + i);
+    }
+    for (i = 0; i < 3; i++) {
+        nvme_check_pattern(t, &q[(i + 1) % 3], 16 + i, 0x10 + i);
+    }
+
+    nvme_test_end(t);
+}
+
 int main(int argc, char **argv)
 {
+    const char *arch = qtest_get_arch();
     int ret;
 
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/nvme/nop", nop);
+    if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
+        qtest_add_func("/nvme/rw", test_rw);
+        qtest_add_func("/nvme/sgl", test_sgl);
+        qtest_add_func("/nvme/dbbuf-twice", test_dbbuf_twice);
+        qtest_add_func("/nvme/multiqueue", test_multiqueue);
+    }
 
     qtest_start("-drive id=drv0,if=none,file=/dev/null,format=raw "
                 "-device nvme,drive=drv0,serial=foo");
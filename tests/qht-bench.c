@@ -20,6 +20,7 @@ struct thread_stats {
     size_t not_rm;
     size_t rz;
     size_t not_rz;
+    size_t jc_hit;
 };
 
 struct thread_info {
@@ -28,6 +29,7 @@ struct thread_info {
     uint64_t r;
     bool write_op; /* writes alternate between insertions and removals */
     bool resize_down;
+    long **jmp_cache; /* private lookup cache, as with tb_jmp_cache */
 } QEMU_ALIGNED(64); /* avoid false sharing among threads */
 
 static struct qht ht;
@@ -61,6 +63,16 @@ static uint64_t resize_threshold;
 static size_t qht_n_elems = DEFAULT_QHT_N_ELEMS;
 static int qht_mode;
 
+/*
+ * TB lookup workload: most lookups go to a small hot set of keys, and each
+ * thread first looks into a private direct-mapped cache before falling back
+ * to the hash table, which is what vCPU threads do with tb_jmp_cache.
+ */
+static unsigned long jmp_cache_size;
+static unsigned long hot_range;
+static double hot_rate; /* 0.0 to 1.0 */
+static uint64_t hot_threshold;
+
 static bool test_start;
 static bool test_stop;
 
@@ -84,7 +96,11 @@ static const char commands_string[] =
     " -R = enable auto-resize\n"
     " -S = resize rate (0.0 to 100.0)\n"
     " -D = delay (in us) between potential resizes\n"
-    " -N = number of resize threads";
+    " -N = number of resize threads\n"
+    "\n"
+    " -j = per-thread lookup cache size, 0 to disable (will be rounded up to pow2)\n"
+    " -H = hot range of lookup keys (will be rounded up to pow2)\n"
+    " -L = rate of lookups that go to the hot range (0.0 to 100.0)";
 
 static void usage_complete(int argc, char *argv[])
 {
@@ -139,6 +155,45 @@ static void do_rz(struct thread_info *info)
     g_usleep(resize_delay);
 }
 
+static inline long *lookup_key(struct thread_info *info)
+{
+    /* use the high bits, the low ones pick the key */
+    if (hot_range && (info->r >> 32) < hot_threshold) {
+        return &keys[info->r & (hot_range - 1)];
+    }
+    return &keys[info->r & (lookup_range - 1)];
+}
+
+/*
+ * Like tb_jmp_cache, the cache is not invalidated on removals; it is meant
+ * for read-mostly runs.
+ */
+static void do_lookup(struct thread_info *info, long *p)
+{
+    struct thread_stats *stats = &info->stats;
+    uint32_t hash = h(*p);
+    long **entry = NULL;
+    long *read;
+
+    if (jmp_cache_size) {
+        entry = &info->jmp_cache[hash & (jmp_cache_size - 1)];
+        if (*entry && **entry == *p) {
+            stats->jc_hit++;
+            stats->rd++;
+            return;
+        }
+    }
+    read = qht_lookup(&ht, is_equal, p, hash);
+    if (read) {
+        stats->rd++;
+        if (entry) {
+            *entry = read;
+        }
+    } else {
+        stats->not_rd++;
+    }
+}
+
 static void do_rw(struct thread_info *info)
 {
     struct thread_stats *stats = &info->stats;
@@ -146,16 +201,7 @@ static void do_rw(struct thread_info *info)
     long *p;
 
     if (info->r >= update_threshold) {
-        bool read;
-
-        p = &keys[info->r & (lookup_range - 1)];
-        hash = h(*p);
-        read = qht_lookup(&ht, is_equal, p, hash);
-        if (read) {
-            stats->rd++;
-        } else {
-            stats->not_rd++;
-        }
+        do_lookup(info, lookup_key(info));
     } else {
         p = &keys[info->r & (update_range - 1)];
         hash = h(*p);
@@ -219,6 +265,8 @@ static void prepare_thread_info(struct thread_info *info, int i)
     info->resize_down = true;
 
     memset(&info->stats, 0, sizeof(info->stats));
+    info->jmp_cache = jmp_cache_size ?
+        g_new0(long *, jmp_cache_size) : NULL;
 }
 
 static void
@@ -268,6 +316,13 @@ static void pr_params(void)
     printf(" initial key range: %zu\n", init_range);
     printf(" lookup range:      %lu\n", lookup_range);
     printf(" update range:      %lu\n", update_range);
+    if (hot_range) {
+        printf(" hot range:         %lu\n", hot_range);
+        printf(" hot lookup rate:   %f%%\n", hot_rate * 100.0);
+    }
+    if (jmp_cache_size) {
+        printf(" lookup cache size: %lu\n", jmp_cache_size);
+    }
 }
 
 static void do_threshold(double rate, uint64_t *threshold)
@@ -298,6 +353,9 @@ static void htable_init(void)
     /* compute thresholds */
     do_threshold(update_rate, &update_threshold);
     do_threshold(resize_rate, &resize_threshold);
+    /* compared against the high 32 bits of the RNG output */
+    hot_threshold = hot_rate * UINT32_MAX;
+    g_assert_cmpuint(hot_range, <=, lookup_range);
 
     if (resize_rate) {
         resize_min = n / 2;
@@ -349,6 +407,8 @@ static void add_stats(struct thread_stats *s, struct thread_info *info, int n)
 
         s->rz += stats->rz;
         s->not_rz += stats->not_rz;
+
+        s->jc_hit += stats->jc_hit;
     }
 }
 
@@ -371,6 +431,11 @@ static void pr_stats(void)
            (double)s.rd / 1e6,
            (double)s.rd / (s.rd + s.not_rd) * 100,
            (double)(s.rd + s.not_rd) / 1e6);
+    if (jmp_cache_size) {
+        printf(" Lookup cache hits: %.2f M (%.2f%% of reads)\n",
+               (double)s.jc_hit / 1e6,
+               s.rd ? (double)s.jc_hit / s.rd * 100 : 0.0);
+    }
     printf(" Inserted:          %.2f M (%.2f%% of %.2fM)\n",
            (double)s.in / 1e6,
            (double)s.in / (s.in + s.not_in) * 100,
@@ -412,7 +477,7 @@ static void parse_args(int argc, char *argv[])
     int c;
 
     for (;;) {
-        c = getopt(argc, argv, "d:D:g:k:K:l:hn:N:o:r:Rs:S:u:");
+        c = getopt(argc, argv, "d:D:g:H:j:k:K:l:L:hn:N:o:r:Rs:S:u:");
         if (c < 0) {
             break;
         }
@@ -433,6 +498,12 @@ static void parse_args(int argc, char *argv[])
         case 'h':
             usage_complete(argc, argv);
             exit(0);
+        case 'H':
+            hot_range = pow2ceil(atol(optarg));
+            break;
+        case 'j':
+            jmp_cache_size = atol(optarg) ? pow2ceil(atol(optarg)) : 0;
+            break;
         case 'k':
             init_size = atol(optarg);
             break;
@@ -442,6 +513,12 @@ static void parse_args(int argc, char *argv[])
         case 'l':
             lookup_range = pow2ceil(atol(optarg));
             break;
+        case 'L':
+            hot_rate = atof(optarg) / 100.0;
+            if (hot_rate > 1.0) {
+                hot_rate = 1.0;
+            }
+            break;
         case 'n':
             n_rw_threads = atoi(optarg);
             break;
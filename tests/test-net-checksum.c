@@ -0,0 +1,126 @@
+/*
+ * QEMU network checksum test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+
+static uint8_t buffer[64 * 1024 + 64];
+
+/* Byte at a time, as the checksum is defined */
+static uint64_t reference_add(int len, const uint8_t *buf, int seq)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        sum += (seq + i) & 1 ? buf[i] : (uint32_t)buf[i] << 8;
+    }
+    return sum;
+}
+
+static uint16_t reference_finish(uint64_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static void check(int len, int off, int seq)
+{
+    uint64_t ref = reference_add(len, buffer + off, seq);
+    uint32_t sum = net_checksum_add_cont(len, buffer + off, seq);
+
+    g_assert_cmphex(net_checksum_finish(sum), ==, reference_finish(ref));
+    g_assert_cmpint(sum == 0, ==, ref == 0);
+}
+
+static void fill(GRand *rand, size_t len, int mode)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        switch (mode) {
+        case 0:
+            buffer[i] = g_rand_int(rand);
+            break;
+        case 1:
+            buffer[i] = 0xff;
+            break;
+        default:
+            buffer[i] = g_rand_int_range(rand, 0, 64) ? 0 : g_rand_int(rand);
+            break;
+        }
+    }
+}
+
+static void test_1(void)
+{
+    GRand *rand = g_rand_new_with_seed(0x12345678);
+    int mode, len, off, i;
+
+    for (mode = 0; mode < 3; mode++) {
+        fill(rand, sizeof(buffer), mode);
+
+        /* Every small length and alignment, for the unaligned tails */
+        for (off = 0; off < 32; off++) {
+            for (len = 0; len <= 256; len++) {
+                check(len, off, off);
+            }
+        }
+
+        /* Large buffers, up to a full IP datagram */
+        for (i = 0; i < 200; i++) {
+            len = g_rand_int_range(rand, 0, 64 * 1024);
+            off = g_rand_int_range(rand, 0, 64);
+            check(len, off, g_rand_int_range(rand, 0, 4));
+        }
+    }
+
+    g_rand_free(rand);
+}
+
+static void test_iov(void)
+{
+    struct iovec iov[3];
+    uint64_t ref;
+    int i;
+
+    for (i = 0; i < 1500; i++) {
+        buffer[i] = i * 7;
+    }
+
+    /* Odd sized chunks shift the byte parity of the following ones */
+    iov[0].iov_base = buffer;
+    iov[0].iov_len = 13;
+    iov[1].iov_base = buffer + 13;
+    iov[1].iov_len = 1000;
+    iov[2].iov_base = buffer + 1013;
+    iov[2].iov_len = 487;
+
+    ref = reference_add(1500 - 5, buffer + 5, 0);
+    g_assert_cmphex(net_checksum_finish(net_checksum_add_iov(iov, 3, 5,
+                                                             1500 - 5, 0)),
+                    ==, reference_finish(ref));
+}
+
+static void test_2(void)
+{
+    do {
+        test_1();
+        test_iov();
+    } while (test_net_checksum_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/checksum", test_2);
+
+    return g_test_run();
+}
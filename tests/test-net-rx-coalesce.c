@@ -0,0 +1,215 @@
+/*
+ * QEMU software receive coalescing test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+#include "hw/net/net_rx_coalesce.h"
+
+#define HDR_LEN     (ETH_HLEN + sizeof(struct ip_header) + sizeof(tcp_header))
+#define MSS         100
+#define SEQ         1000
+
+typedef struct TestFrame {
+    uint8_t buf[HDR_LEN + MSS];
+    size_t size;
+} TestFrame;
+
+static uint8_t payload(uint32_t seq)
+{
+    return seq * 7 + 3;
+}
+
+/* A TCP/IPv4 segment of flow SPORT carrying LEN bytes from sequence SEQ */
+static void build(TestFrame *f, uint16_t sport, uint32_t seq, size_t len,
+                  uint8_t flags)
+{
+    struct eth_header *eth = (struct eth_header *)f->buf;
+    struct ip_header *ip = (struct ip_header *)(f->buf + ETH_HLEN);
+    tcp_header *tcp = (tcp_header *)(ip + 1);
+    uint8_t *data = (uint8_t *)(tcp + 1);
+    size_t i;
+
+    memset(f->buf, 0, HDR_LEN);
+    memset(eth->h_dest, 0x52, ETH_ALEN);
+    memset(eth->h_source, 0x54, ETH_ALEN);
+    eth->h_proto = cpu_to_be16(ETH_P_IP);
+
+    ip->ip_ver_len = 0x45;
+    ip->ip_len = cpu_to_be16(HDR_LEN - ETH_HLEN + len);
+    ip->ip_off = cpu_to_be16(IP_DF);
+    ip->ip_ttl = 64;
+    ip->ip_p = IP_PROTO_TCP;
+    ip->ip_src = cpu_to_be32(0x0a000001);
+    ip->ip_dst = cpu_to_be32(0x0a000002);
+    ip->ip_sum = cpu_to_be16(net_raw_checksum((uint8_t *)ip, sizeof(*ip)));
+
+    tcp->th_sport = cpu_to_be16(sport);
+    tcp->th_dport = cpu_to_be16(80);
+    tcp->th_seq = cpu_to_be32(seq);
+    tcp->th_ack = cpu_to_be32(1);
+    tcp->th_offset_flags = cpu_to_be16((5 << 12) | TH_ACK | flags);
+    tcp->th_win = cpu_to_be16(0x1000);
+
+    for (i = 0; i < len; i++) {
+        data[i] = payload(seq + i);
+    }
+
+    f->size = HDR_LEN + len;
+    net_checksum_calculate(f->buf, f->size);
+}
+
+static void add(NetRxCoalesce *c, uint16_t sport, uint32_t seq, size_t len,
+                uint8_t flags, bool expected)
+{
+    TestFrame f;
+
+    build(&f, sport, seq, len, flags);
+    g_assert_cmpint(net_rx_coalesce_add(c, f.buf, f.size), ==, expected);
+}
+
+/*
+ * Check that the completed frame carries SEGS segments worth of payload
+ * from SEQ on, and that a guest finishing its checksum gets a valid one
+ */
+static void check_complete(NetRxCoalesce *c, uint32_t seq, size_t len,
+                           uint16_t segs)
+{
+    NetRxCoalesceFrame frame;
+    struct ip_header *ip;
+    tcp_header *tcp;
+    uint8_t buf[ETH_HLEN + 0xffff];
+    size_t i, l4_len;
+
+    g_assert(net_rx_coalesce_complete(c, &frame));
+    g_assert_cmpint(net_rx_coalesce_pending_size(c), ==, 0);
+    g_assert_cmpint(frame.segs, ==, segs);
+    g_assert_cmpint(frame.size, ==, HDR_LEN + len);
+    g_assert_cmpint(frame.hdr_len, ==, HDR_LEN);
+    g_assert_cmpint(frame.csum_start, ==, ETH_HLEN + sizeof(*ip));
+
+    memcpy(buf, frame.data, frame.size);
+    ip = (struct ip_header *)(buf + ETH_HLEN);
+    tcp = (tcp_header *)(ip + 1);
+    g_assert_cmpint(be16_to_cpu(ip->ip_len), ==, frame.size - ETH_HLEN);
+    g_assert_cmphex(net_raw_checksum((uint8_t *)ip, sizeof(*ip)), ==, 0);
+    g_assert_cmpint(be32_to_cpu(tcp->th_seq), ==, seq);
+    for (i = 0; i < len; i++) {
+        g_assert_cmphex(buf[HDR_LEN + i], ==, payload(seq + i));
+    }
+
+    l4_len = frame.size - frame.csum_start;
+    if (segs > 1) {
+        /* What the guest does with VIRTIO_NET_HDR_F_NEEDS_CSUM */
+        g_assert_cmpint(frame.mss, ==, MSS);
+        stw_be_p(buf + frame.csum_start + frame.csum_offset,
+                 net_checksum_finish(net_checksum_add(l4_len,
+                                     buf + frame.csum_start)));
+    }
+    g_assert_cmphex(net_checksum_tcpudp(l4_len, IP_PROTO_TCP,
+                                        (uint8_t *)&ip->ip_src,
+                                        (uint8_t *)tcp), ==, 0);
+}
+
+static void test_merge(void)
+{
+    NetRxCoalesce *c = net_rx_coalesce_new(ETH_HLEN + 0xffff);
+    NetRxCoalesceFrame frame;
+    int i;
+
+    g_assert(!net_rx_coalesce_complete(c, &frame));
+
+    for (i = 0; i < 4; i++) {
+        add(c, 1234, SEQ + i * MSS, MSS, 0, true);
+        g_assert(!net_rx_coalesce_full(c));
+    }
+    g_assert_cmpint(net_rx_coalesce_pending_size(c), ==, HDR_LEN + 4 * MSS);
+    check_complete(c, SEQ, 4 * MSS, 4);
+
+    /* A short segment ends the frame */
+    add(c, 1234, SEQ, MSS, 0, true);
+    add(c, 1234, SEQ + MSS, MSS / 2, 0, true);
+    g_assert(net_rx_coalesce_full(c));
+    add(c, 1234, SEQ + MSS + MSS / 2, MSS, 0, false);
+    check_complete(c, SEQ, MSS + MSS / 2, 2);
+
+    net_rx_coalesce_free(c);
+}
+
+static void test_out_of_order(void)
+{
+    NetRxCoalesce *c = net_rx_coalesce_new(ETH_HLEN + 0xffff);
+
+    add(c, 1234, SEQ, MSS, 0, true);
+    add(c, 1234, SEQ + MSS, MSS, 0, true);
+
+    /* A hole, a retransmission, another flow: the frame is left alone */
+    add(c, 1234, SEQ + 3 * MSS, MSS, 0, false);
+    add(c, 1234, SEQ, MSS, 0, false);
+    add(c, 4321, SEQ + 2 * MSS, MSS, 0, false);
+    add(c, 1234, SEQ + 2 * MSS, MSS, TH_SYN, false);
+    g_assert_cmpint(net_rx_coalesce_pending_size(c), ==, HDR_LEN + 2 * MSS);
+
+    /* The caller flushes, then the segment starts a new frame */
+    check_complete(c, SEQ, 2 * MSS, 2);
+    add(c, 1234, SEQ + 3 * MSS, MSS, 0, true);
+    check_complete(c, SEQ + 3 * MSS, MSS, 1);
+
+    net_rx_coalesce_free(c);
+}
+
+static void test_push(void)
+{
+    NetRxCoalesce *c = net_rx_coalesce_new(ETH_HLEN + 0xffff);
+    NetRxCoalesceFrame frame;
+    const tcp_header *tcp;
+
+    add(c, 1234, SEQ, MSS, 0, true);
+    add(c, 1234, SEQ + MSS, MSS, TH_PUSH, true);
+    g_assert(net_rx_coalesce_full(c));
+    add(c, 1234, SEQ + 2 * MSS, MSS, 0, false);
+
+    g_assert(net_rx_coalesce_complete(c, &frame));
+    g_assert_cmpint(frame.segs, ==, 2);
+    tcp = (const tcp_header *)(frame.data + frame.csum_start);
+    g_assert_cmphex(TCP_HEADER_FLAGS(tcp), ==, TH_ACK | TH_PUSH);
+
+    /* Nothing is pending after a flush, even if full was set */
+    g_assert(!net_rx_coalesce_full(c));
+    add(c, 1234, SEQ + 2 * MSS, MSS, 0, true);
+    net_rx_coalesce_reset(c);
+    g_assert_cmpint(net_rx_coalesce_pending_size(c), ==, 0);
+    g_assert(!net_rx_coalesce_complete(c, &frame));
+
+    net_rx_coalesce_free(c);
+}
+
+static void test_max_size(void)
+{
+    NetRxCoalesce *c = net_rx_coalesce_new(HDR_LEN + 3 * MSS);
+
+    add(c, 1234, SEQ, MSS, 0, true);
+    add(c, 1234, SEQ + MSS, MSS, 0, true);
+    g_assert(!net_rx_coalesce_full(c));
+    add(c, 1234, SEQ + 2 * MSS, MSS, 0, true);
+    g_assert(net_rx_coalesce_full(c));
+    check_complete(c, SEQ, 3 * MSS, 3);
+
+    net_rx_coalesce_free(c);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/rx-coalesce/merge", test_merge);
+    g_test_add_func("/net/rx-coalesce/out-of-order", test_out_of_order);
+    g_test_add_func("/net/rx-coalesce/push", test_push);
+    g_test_add_func("/net/rx-coalesce/max-size", test_max_size);
+
+    return g_test_run();
+}
@@ -24,6 +24,7 @@
 
 #include "libqos/malloc-pc.h"
 #include "hw/virtio/virtio-net.h"
+#include "standard-headers/linux/virtio_blk.h"
 
 #include <linux/vhost.h>
 #include <linux/virtio_ids.h>
@@ -57,6 +58,7 @@
 #define VHOST_USER_F_PROTOCOL_FEATURES 30
 #define VHOST_USER_PROTOCOL_F_MQ 0
 #define VHOST_USER_PROTOCOL_F_LOG_SHMFD 1
+#define VHOST_USER_PROTOCOL_F_CONFIG 9
 
 #define VHOST_LOG_PAGE 0x1000
 
@@ -80,6 +82,7 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_PROTOCOL_FEATURES = 16,
     VHOST_USER_GET_QUEUE_NUM = 17,
     VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_CONFIG = 24,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -101,6 +104,15 @@ typedef struct VhostUserLog {
     uint64_t mmap_offset;
 } VhostUserLog;
 
+#define VHOST_USER_MAX_CONFIG_SIZE 256
+
+typedef struct VhostUserConfig {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_MAX_CONFIG_SIZE];
+} VhostUserConfig;
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
@@ -116,6 +128,7 @@ typedef struct VhostUserMsg {
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
         VhostUserLog log;
+        VhostUserConfig config;
     } payload;
 } QEMU_PACKED VhostUserMsg;
 
@@ -152,6 +165,8 @@ typedef struct TestServer {
     bool test_fail;
     int test_flags;
     int queues;
+    /* if non-zero, the capacity of the block device given to GET_CONFIG */
+    uint64_t blk_capacity;
 } TestServer;
 
 static const char *tmpfs;
@@ -325,6 +340,9 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         if (s->queues > 1) {
             msg.payload.u64 |= 1 << VHOST_USER_PROTOCOL_F_MQ;
         }
+        if (s->blk_capacity) {
+            msg.payload.u64 |= 1 << VHOST_USER_PROTOCOL_F_CONFIG;
+        }
         p = (uint8_t *) &msg;
         qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
         break;
@@ -382,6 +400,19 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         s->rings |= 0x1ULL << msg.payload.state.index;
         break;
 
+    case VHOST_USER_GET_CONFIG: {
+        struct virtio_blk_config blkcfg = { };
+
+        g_assert_cmpint(msg.payload.config.offset, ==, 0);
+        g_assert_cmpint(msg.payload.config.size, <=, sizeof(blkcfg));
+        blkcfg.capacity = cpu_to_le64(s->blk_capacity);
+        memcpy(msg.payload.config.region, &blkcfg, msg.payload.config.size);
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        p = (uint8_t *) &msg;
+        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
+        break;
+    }
+
     case VHOST_USER_GET_QUEUE_NUM:
         msg.flags |= VHOST_USER_REPLY_MASK;
         msg.size = sizeof(m.payload.u64);
@@ -914,6 +945,42 @@ static void test_multiqueue(void)
     test_server_free(s);
 }
 
+static void test_blk_get_config(void)
+{
+    TestServer *s = test_server_new("blk");
+    QTestState *global = global_qtest;
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    char *cmd;
+
+    s->blk_capacity = 0x12345;
+    test_server_listen(s);
+
+    cmd = g_strdup_printf(QEMU_CMD_MEM QEMU_CMD_CHR
+                          " -device vhost-user-blk-pci,chardev=%s",
+                          512, 512, root, s->chr_name,
+                          s->socket_path, "", s->chr_name);
+    qtest_start(cmd);
+    g_free(cmd);
+
+    bus = qpci_init_pc(NULL);
+    dev = qvirtio_pci_device_find(bus, VIRTIO_ID_BLOCK);
+    g_assert_nonnull(dev);
+    qvirtio_pci_device_enable(dev);
+
+    /* The configuration space comes from the backend */
+    g_assert_cmphex(qvirtio_config_readq(&dev->vdev, 0), ==, 0x12345);
+
+    qvirtio_pci_device_disable(dev);
+    g_free(dev->pdev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+
+    test_server_free(s);
+    global_qtest = global;
+}
+
 int main(int argc, char **argv)
 {
     QTestState *s = NULL;
@@ -960,6 +1027,7 @@ int main(int argc, char **argv)
     qtest_add_data_func("/vhost-user/read-guest-mem", server, read_guest_mem);
     qtest_add_func("/vhost-user/migrate", test_migrate);
     qtest_add_func("/vhost-user/multiqueue", test_multiqueue);
+    qtest_add_func("/vhost-user/blk/get-config", test_blk_get_config);
 #ifdef CONFIG_HAS_GLIB_SUBPROCESS_TESTS
     qtest_add_func("/vhost-user/reconnect/subprocess",
                    test_reconnect_subprocess);
@@ -17,6 +17,8 @@
 #include "libqos/virtio.h"
 #include "libqos/virtio-pci.h"
 #include "qemu/bswap.h"
+#include "net/checksum.h"
+#include "net/eth.h"
 #include "hw/virtio/virtio-net.h"
 #include "standard-headers/linux/virtio_ids.h"
 #include "standard-headers/linux/virtio_ring.h"
@@ -51,17 +53,17 @@ static QVirtioPCIDevice *virtio_net_pci_init(QPCIBus *bus, int slot)
     return dev;
 }
 
-static QOSState *pci_test_start(int socket)
+static QOSState *pci_test_start(const char *netdev, const char *props)
 {
     const char *arch = qtest_get_arch();
-    const char *cmd = "-netdev socket,fd=%d,id=hs0 -device "
-                      "virtio-net-pci,netdev=hs0";
+    const char *cmd = "-netdev socket,%s,id=hs0 -device "
+                      "virtio-net-pci,netdev=hs0%s";
 
     if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
-        return qtest_pc_boot(cmd, socket);
+        return qtest_pc_boot(cmd, netdev, props);
     }
     if (strcmp(arch, "ppc64") == 0) {
-        return qtest_spapr_boot(cmd, socket);
+        return qtest_spapr_boot(cmd, netdev, props);
     }
     g_printerr("virtio-net tests are only available on x86 or ppc64\n");
     exit(EXIT_FAILURE);
@@ -215,11 +217,14 @@ static void pci_basic(gconstpointer data)
                   QVirtQueue *tvq,
                   int socket) = data;
     int sv[2], ret;
+    char *netdev;
 
     ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
     g_assert_cmpint(ret, !=, -1);
 
-    qs = pci_test_start(sv[1]);
+    netdev = g_strdup_printf("fd=%d", sv[1]);
+    qs = pci_test_start(netdev, "");
+    g_free(netdev);
     dev = virtio_net_pci_init(qs->pcibus, PCI_SLOT);
 
     rx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 0);
@@ -237,6 +242,229 @@ static void pci_basic(gconstpointer data)
     g_free(dev);
     qtest_shutdown(qs);
 }
+
+static int tcp_free_port(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    int fd, ret;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint(fd, !=, -1);
+    ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    g_assert_cmpint(ret, ==, 0);
+    ret = getsockname(fd, (struct sockaddr *)&addr, &len);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+
+    return ntohs(addr.sin_port);
+}
+
+static int tcp_connect(int port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int fd, ret;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint(fd, !=, -1);
+    ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    g_assert_cmpint(ret, ==, 0);
+
+    return fd;
+}
+
+/*
+ * The socket backend takes its link down when the connection ends, in
+ * the middle of the receive batch it opened on virtio-net.  That batch
+ * must still be closed, or the packets of the next connection are never
+ * signalled to the guest.
+ */
+static void pci_rx_link_down_in_batch(void)
+{
+    QVirtioPCIDevice *dev;
+    QOSState *qs;
+    QVirtQueuePCI *tx, *rx;
+    char *netdev;
+    int port, fd;
+
+    port = tcp_free_port();
+    netdev = g_strdup_printf("listen=127.0.0.1:%d", port);
+    qs = pci_test_start(netdev, "");
+    g_free(netdev);
+    dev = virtio_net_pci_init(qs->pcibus, PCI_SLOT);
+
+    rx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 0);
+    tx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 1);
+
+    driver_init(&dev->vdev);
+
+    fd = tcp_connect(port);
+    rx_test(&dev->vdev, qs->alloc, &rx->vq, fd);
+    close(fd);
+
+    /* Only accepted once the backend has seen the first one go away */
+    fd = tcp_connect(port);
+    rx_test(&dev->vdev, qs->alloc, &rx->vq, fd);
+    close(fd);
+
+    qvirtqueue_cleanup(dev->vdev.bus, &tx->vq, qs->alloc);
+    qvirtqueue_cleanup(dev->vdev.bus, &rx->vq, qs->alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev->pdev);
+    g_free(dev);
+    qtest_shutdown(qs);
+}
+
+#define RSC_HDR_LEN (ETH_HLEN + sizeof(struct ip_header) + sizeof(tcp_header))
+#define RSC_MSS     100
+#define RSC_SEGS    3
+
+/* Send RSC_SEGS in-order TCP/IPv4 segments in one go, i.e. one batch */
+static void rsc_send_segments(int socket, uint32_t seq)
+{
+    uint8_t buf[RSC_SEGS * (4 + RSC_HDR_LEN + RSC_MSS)];
+    int i, ret;
+
+    memset(buf, 0, sizeof(buf));
+    for (i = 0; i < RSC_SEGS; i++) {
+        uint8_t *frame = buf + i * (4 + RSC_HDR_LEN + RSC_MSS) + 4;
+        struct ip_header *ip = (struct ip_header *)(frame + ETH_HLEN);
+        tcp_header *tcp = (tcp_header *)(ip + 1);
+
+        stl_be_p(frame - 4, RSC_HDR_LEN + RSC_MSS);
+        memset(frame, 0xff, ETH_ALEN);
+        stw_be_p(frame + 12, ETH_P_IP);
+
+        ip->ip_ver_len = 0x45;
+        ip->ip_len = cpu_to_be16(RSC_HDR_LEN - ETH_HLEN + RSC_MSS);
+        ip->ip_ttl = 64;
+        ip->ip_p = IP_PROTO_TCP;
+        ip->ip_src = cpu_to_be32(0x0a000001);
+        ip->ip_dst = cpu_to_be32(0x0a000002);
+        ip->ip_sum = cpu_to_be16(net_raw_checksum((uint8_t *)ip,
+                                                  sizeof(*ip)));
+
+        tcp->th_sport = cpu_to_be16(1234);
+        tcp->th_dport = cpu_to_be16(80);
+        tcp->th_seq = cpu_to_be32(seq + i * RSC_MSS);
+        tcp->th_offset_flags = cpu_to_be16((5 << 12) | TH_ACK);
+        tcp->th_win = cpu_to_be16(0x1000);
+        memset(tcp + 1, 'a' + i, RSC_MSS);
+
+        net_checksum_calculate(frame, RSC_HDR_LEN + RSC_MSS);
+    }
+
+    ret = send(socket, buf, sizeof(buf), 0);
+    g_assert_cmpint(ret, ==, sizeof(buf));
+}
+
+/* Check the used element IDX, for a frame of SEGS segments in BUF */
+static void rsc_check_used(QVirtQueue *vq, uint16_t idx, uint64_t buf,
+                           int segs)
+{
+    uint64_t used = vq->used + 4 + (idx % vq->size) * 8;
+    int i;
+
+    g_assert_cmpint(readl(used + 4), ==,
+                    VNET_HDR_SIZE + RSC_HDR_LEN + segs * RSC_MSS);
+    g_assert_cmpint(readw(buf + offsetof(struct virtio_net_hdr_mrg_rxbuf,
+                                         num_buffers)), ==, 1);
+    if (segs > 1) {
+        g_assert_cmpint(readb(buf), ==, VIRTIO_NET_HDR_F_NEEDS_CSUM);
+        g_assert_cmpint(readb(buf + 1), ==, VIRTIO_NET_HDR_GSO_TCPV4);
+        g_assert_cmpint(readw(buf + 2), ==, RSC_HDR_LEN);
+        g_assert_cmpint(readw(buf + 4), ==, RSC_MSS);
+    } else {
+        g_assert_cmpint(readb(buf + 1), ==, VIRTIO_NET_HDR_GSO_NONE);
+    }
+    for (i = 0; i < segs; i++) {
+        g_assert_cmpint(readb(buf + VNET_HDR_SIZE + RSC_HDR_LEN +
+                              i * RSC_MSS), ==, 'a' + i);
+    }
+}
+
+/*
+ * With rx-coalesce=on and a backend without vnet headers, the segments
+ * received in one batch reach the guest as a single TSO frame, but only
+ * as long as the guest keeps the offloads that frame depends on.
+ */
+static void pci_rx_coalesce(void)
+{
+    QVirtioPCIDevice *dev;
+    QOSState *qs;
+    QVirtQueuePCI *tx, *rx, *ctrl;
+    uint64_t bufs[RSC_SEGS + 1], req_addr;
+    uint32_t free_head;
+    uint8_t req[10];
+    char *netdev;
+    int sv[2], ret, i;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+
+    netdev = g_strdup_printf("fd=%d", sv[1]);
+    qs = pci_test_start(netdev, ",rx-coalesce=on");
+    g_free(netdev);
+    dev = virtio_net_pci_init(qs->pcibus, PCI_SLOT);
+
+    rx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 0);
+    tx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 1);
+    ctrl = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 2);
+
+    driver_init(&dev->vdev);
+
+    for (i = 0; i < ARRAY_SIZE(bufs); i++) {
+        bufs[i] = guest_alloc(qs->alloc, 2048);
+        free_head = qvirtqueue_add(&rx->vq, bufs[i], 2048, true, false);
+        qvirtqueue_kick(&dev->vdev, &rx->vq, free_head);
+    }
+
+    rsc_send_segments(sv[0], 1000);
+    qvirtio_wait_queue_isr(&dev->vdev, &rx->vq, QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(readw(rx->vq.used + 2), ==, 1);
+    rsc_check_used(&rx->vq, 0, bufs[0], RSC_SEGS);
+
+    /* Without TSO the frames go through one by one */
+    req[0] = VIRTIO_NET_CTRL_GUEST_OFFLOADS;
+    req[1] = VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET;
+    stq_le_p(req + 2, 1ull << VIRTIO_NET_F_GUEST_CSUM);
+    req_addr = guest_alloc(qs->alloc, sizeof(req) + 1);
+    memwrite(req_addr, req, sizeof(req));
+    writeb(req_addr + sizeof(req), 0xff);
+    free_head = qvirtqueue_add(&ctrl->vq, req_addr, sizeof(req), false, true);
+    qvirtqueue_add(&ctrl->vq, req_addr + sizeof(req), 1, true, false);
+    qvirtqueue_kick(&dev->vdev, &ctrl->vq, free_head);
+    qvirtio_wait_queue_isr(&dev->vdev, &ctrl->vq, QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(readb(req_addr + sizeof(req)), ==, VIRTIO_NET_OK);
+    guest_free(qs->alloc, req_addr);
+
+    rsc_send_segments(sv[0], 1000 + RSC_SEGS * RSC_MSS);
+    qvirtio_wait_queue_isr(&dev->vdev, &rx->vq, QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(readw(rx->vq.used + 2), ==, 1 + RSC_SEGS);
+    for (i = 0; i < RSC_SEGS; i++) {
+        g_assert_cmpint(readl(rx->vq.used + 4 + (1 + i) * 8), ==, 1 + i);
+        rsc_check_used(&rx->vq, 1 + i, bufs[1 + i], 1);
+    }
+
+    close(sv[0]);
+    for (i = 0; i < ARRAY_SIZE(bufs); i++) {
+        guest_free(qs->alloc, bufs[i]);
+    }
+    qvirtqueue_cleanup(dev->vdev.bus, &ctrl->vq, qs->alloc);
+    qvirtqueue_cleanup(dev->vdev.bus, &tx->vq, qs->alloc);
+    qvirtqueue_cleanup(dev->vdev.bus, &rx->vq, qs->alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev->pdev);
+    g_free(dev);
+    qtest_shutdown(qs);
+}
 #endif
 
 static void hotplug(void)
@@ -261,6 +489,13 @@ int main(int argc, char **argv)
     qtest_add_data_func("/virtio/net/pci/basic", send_recv_test, pci_basic);
     qtest_add_data_func("/virtio/net/pci/rx_stop_cont",
                         stop_cont_test, pci_basic);
+    qtest_add_func("/virtio/net/pci/rx_link_down_in_batch",
+                   pci_rx_link_down_in_batch);
+    if (strcmp(qtest_get_arch(), "i386") == 0 ||
+        strcmp(qtest_get_arch(), "x86_64") == 0) {
+        /* The checks assume a little-endian legacy device */
+        qtest_add_func("/virtio/net/pci/rx_coalesce", pci_rx_coalesce);
+    }
 #endif
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
 
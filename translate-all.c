@@ -97,7 +97,12 @@ typedef struct PageDesc {
     TranslationBlock *first_tb;
 #ifdef CONFIG_SOFTMMU
     /* in order to optimize self modifying code, we count the number
-       of lookups we do to a given page to use a bitmap */
+       of lookups we do to a given page to use a bitmap.  The bitmap
+       holds the bytes covered by TBs and lets writes to the data
+       parts of a mixed code/data page skip invalidation altogether.
+       Once built it is kept up to date as TBs come and go; the count
+       is only reset by tb_flush, so that pages known to be written
+       to get their bitmap back as soon as they hold code again.  */
     unsigned int code_write_count;
     unsigned long *code_bitmap;
 #else
@@ -837,40 +842,96 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
+static inline void *region_start(int region)
+{
+    return tcg_ctx.code_gen_buffer + region * tcg_ctx.tb_ctx.region_size;
+}
+
+static inline void *region_end(int region)
+{
+    if (region == CODE_GEN_REGIONS - 1) {
+        return tcg_ctx.code_gen_buffer + tcg_ctx.code_gen_buffer_size;
+    }
+    return region_start(region + 1);
+}
+
+static inline TranslationBlock *region_tbs(int region)
+{
+    return &tcg_ctx.tb_ctx.tbs[region * tcg_ctx.tb_ctx.region_max_tbs];
+}
+
+/* Start emitting code at the beginning of REGION.  Called with tb_lock
+   held, and with nothing left in REGION.  */
+static void region_set_current(int region)
+{
+    tcg_ctx.tb_ctx.region_cur = region;
+    tcg_ctx.code_gen_ptr = region_start(region);
+    /* Same slack as tcg_prologue_init leaves at the end of the buffer.  */
+    tcg_ctx.code_gen_highwater = region_end(region) - 1024;
+}
+
+/* The regions can only be laid out once tcg_prologue_init has carved
+   the prologue out of code_gen_buffer, which happens late for user-mode
+   emulation.  */
+static void tb_regions_init(void)
+{
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+
+    tb_ctx->region_size = QEMU_ALIGN_DOWN(tcg_ctx.code_gen_buffer_size
+                                          / CODE_GEN_REGIONS, CODE_GEN_ALIGN);
+    tb_ctx->region_max_tbs = tcg_ctx.code_gen_max_blocks / CODE_GEN_REGIONS;
+    memset(tb_ctx->region_nb_tbs, 0, sizeof(tb_ctx->region_nb_tbs));
+    region_set_current(0);
+}
+
 /*
- * Allocate a new translation block. Flush the translation buffer if
- * too many translation blocks or too much generated code.
+ * Allocate a new translation block in the current region.  Return NULL
+ * if the region has run out of translation blocks; the caller then has
+ * to make room with tb_evict_region.
  *
  * Called with tb_lock held.
  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
     TranslationBlock *tb;
+    int region;
 
     assert_tb_lock();
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks) {
+    if (unlikely(tb_ctx->region_size == 0)) {
+        tb_regions_init();
+    }
+    region = tb_ctx->region_cur;
+    if (tb_ctx->region_nb_tbs[region] >= tb_ctx->region_max_tbs) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &region_tbs(region)[tb_ctx->region_nb_tbs[region]++];
+    tb_ctx->nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
-    tb->invalid = false;
+    /* Until tb_gen_code links it in, the TB is not on any page or jump
+       list and must be left alone when its region is evicted.  */
+    tb->invalid = true;
     return tb;
 }
 
 /* Called with tb_lock held.  */
 void tb_free(TranslationBlock *tb)
 {
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    int region = tb_ctx->region_cur;
+    int nb_tbs = tb_ctx->region_nb_tbs[region];
+
     assert_tb_lock();
 
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    if (nb_tbs > 0 && tb == &region_tbs(region)[nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
-        tcg_ctx.tb_ctx.nb_tbs--;
+        tb_ctx->region_nb_tbs[region]--;
+        tb_ctx->nb_tbs--;
     }
 }
 
@@ -879,7 +940,6 @@ static inline void invalidate_page_bitmap(PageDesc *p)
 #ifdef CONFIG_SOFTMMU
     g_free(p->code_bitmap);
     p->code_bitmap = NULL;
-    p->code_write_count = 0;
 #endif
 }
 
@@ -897,6 +957,9 @@ static void page_flush_tb_1(int level, void **lp)
         for (i = 0; i < V_L2_SIZE; ++i) {
             pd[i].first_tb = NULL;
             invalidate_page_bitmap(pd + i);
+#ifdef CONFIG_SOFTMMU
+            pd[i].code_write_count = 0;
+#endif
         }
     } else {
         void **pp = *lp;
@@ -946,13 +1009,21 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
         for (i = 0; i < TB_JMP_CACHE_SIZE; ++i) {
             atomic_set(&cpu->tb_jmp_cache[i], NULL);
         }
+        for (i = 0; i < TB_PHYS_CACHE_SIZE; ++i) {
+            atomic_set(&cpu->tb_phys_cache[i], NULL);
+        }
     }
 
+    /* The guest is likely to translate about as much code again, so keep
+     * the hash table at the size it has grown to instead of resizing it
+     * up step by step all over again.
+     */
+    qht_reset_size(&tcg_ctx.tb_ctx.htable,
+                   MAX(CODE_GEN_HTABLE_SIZE, tcg_ctx.tb_ctx.nb_tbs));
     tcg_ctx.tb_ctx.nb_tbs = 0;
-    qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    tb_regions_init();
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     atomic_mb_set(&tcg_ctx.tb_ctx.tb_flush_count,
@@ -971,6 +1042,56 @@ void tb_flush(CPUState *cpu)
     }
 }
 
+/* Reclaim the oldest region of code_gen_buffer, i.e. the one after the
+ * current region, and start generating code there.  Every TB living in
+ * it is invalidated, which also unlinks any jump into it from the TBs
+ * that stay behind.
+ */
+static void do_tb_evict_region(CPUState *cpu, run_on_cpu_data evict_count)
+{
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    TranslationBlock *tbs;
+    int region, i;
+
+    tb_lock();
+
+    /* If it is already been done on request of another CPU,
+     * just retry.
+     */
+    if (tb_ctx->tb_region_evict_count != evict_count.host_int) {
+        goto done;
+    }
+
+    region = (tb_ctx->region_cur + 1) % CODE_GEN_REGIONS;
+    tbs = region_tbs(region);
+    for (i = 0; i < tb_ctx->region_nb_tbs[region]; i++) {
+        if (!tbs[i].invalid) {
+            tb_phys_invalidate(&tbs[i], -1);
+        }
+    }
+    tb_ctx->nb_tbs -= tb_ctx->region_nb_tbs[region];
+    tb_ctx->region_nb_tbs[region] = 0;
+    region_set_current(region);
+
+    atomic_mb_set(&tb_ctx->tb_region_evict_count,
+                  tb_ctx->tb_region_evict_count + 1);
+
+done:
+    tb_unlock();
+}
+
+/* Make room in code_gen_buffer.  Only the oldest region is thrown away,
+ * so the guest's working set usually survives; tb_flush is still there
+ * for callers that need every translation gone.
+ */
+static void tb_evict_region(CPUState *cpu)
+{
+    unsigned evict_count = atomic_mb_read(&tcg_ctx.tb_ctx.tb_region_evict_count);
+
+    async_safe_run_on_cpu(cpu, do_tb_evict_region,
+                          RUN_ON_CPU_HOST_INT(evict_count));
+}
+
 #ifdef DEBUG_TB_CHECK
 
 static void
@@ -1113,16 +1234,23 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     h = tb_hash_func(phys_pc, tb->pc, tb->flags);
     qht_remove(&tcg_ctx.tb_ctx.htable, tb, h);
 
-    /* remove the TB from the page list */
+    h &= TB_PHYS_CACHE_SIZE - 1;
+    CPU_FOREACH(cpu) {
+        if (atomic_read(&cpu->tb_phys_cache[h]) == tb) {
+            atomic_set(&cpu->tb_phys_cache[h], NULL);
+        }
+    }
+
+    /* remove the TB from the page list.  The code bitmap of the page,
+       if any, still covers the TB; the stale bits only send writes to
+       the slow path, which rebuilds the bitmap.  */
     if (tb->page_addr[0] != page_addr) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
     }
     if (tb->page_addr[1] != -1 && tb->page_addr[1] != page_addr) {
         p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
     }
 
     /* remove the TB from the hash list */
@@ -1144,31 +1272,44 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 }
 
 #ifdef CONFIG_SOFTMMU
+/* Mark in the code bitmap of P the bytes covered by TB, P being the
+   Nth page of TB.  */
+static void page_bitmap_add_tb(PageDesc *p, TranslationBlock *tb, int n)
+{
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        /* NOTE: tb_end may be after the end of the page, but
+           it is not a problem */
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE) {
+            tb_end = TARGET_PAGE_SIZE;
+        }
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+}
+
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
+    int n;
     TranslationBlock *tb;
 
-    p->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
+    if (p->code_bitmap) {
+        bitmap_zero(p->code_bitmap, TARGET_PAGE_SIZE);
+    } else {
+        p->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
+    }
 
     tb = p->first_tb;
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE) {
-                tb_end = TARGET_PAGE_SIZE;
-             }
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+        page_bitmap_add_tb(p, tb, n);
         tb = tb->page_next[n];
     }
 }
@@ -1195,7 +1336,11 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     page_already_protected = p->first_tb != NULL;
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
-    invalidate_page_bitmap(p);
+#ifdef CONFIG_SOFTMMU
+    if (p->code_bitmap) {
+        page_bitmap_add_tb(p, tb, n);
+    }
+#endif
 
 #if defined(CONFIG_USER_ONLY)
     if (p->flags & PAGE_WRITE) {
@@ -1287,8 +1432,11 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
  buffer_overflow:
-        /* flush must be done */
-        tb_flush(cpu);
+        /* the current region is full, reclaim the oldest one */
+        if (tb) {
+            tb_free(tb);
+        }
+        tb_evict_region(cpu);
         mmap_unlock();
         cpu_loop_exit(cpu);
     }
@@ -1393,6 +1541,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
      * memory barrier is required before tb_link_page() makes the TB visible
      * through the physical hash table and physical page list.
      */
+    tb->invalid = false;
     tb_link_page(tb, phys_pc, phys_page2);
     return tb;
 }
@@ -1527,6 +1676,14 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         tlb_unprotect_code(start);
     }
 #endif
+#ifdef CONFIG_SOFTMMU
+    /* drop the bits of the TBs invalidated above, and any left behind
+       by earlier invalidations, so that further writes to those bytes
+       are recognized as data writes */
+    if (p->code_bitmap) {
+        build_page_bitmap(p);
+    }
+#endif
 #ifdef TARGET_HAS_PRECISE_SMC
     if (current_tb_modified) {
         /* we generate a block containing just the instruction
@@ -1666,23 +1823,33 @@ static bool tb_invalidate_phys_page(tb_page_addr_t addr, uintptr_t pc)
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    int m_min, m_max, m, region;
     uintptr_t v;
-    TranslationBlock *tb;
+    TranslationBlock *tb, *tbs;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tb_ctx->nb_tbs <= 0) {
         return NULL;
     }
     if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
+        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_buffer
+                  + tcg_ctx.code_gen_buffer_size) {
+        return NULL;
+    }
+    /* only the TBs of the region holding tc_ptr need to be searched */
+    region = MIN((tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer)
+                 / tb_ctx->region_size, CODE_GEN_REGIONS - 1);
+    if (region == tb_ctx->region_cur &&
         tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
         return NULL;
     }
+    tbs = region_tbs(region);
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = tb_ctx->region_nb_tbs[region] - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1692,7 +1859,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return m_max < 0 ? NULL : &tbs[m_max];
 }
 
 #if !defined(CONFIG_USER_ONLY)
@@ -1874,10 +2041,14 @@ static void print_qht_statistics(FILE *f, fprintf_function cpu_fprintf,
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    size_t code_size;
     TranslationBlock *tb;
     struct qht_stats hst;
+    CPUTBLookupStats lookup;
+    CPUState *cpu;
 
     tb_lock();
 
@@ -1886,27 +2057,35 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
+    /* regions other than the current one are counted as full */
+    code_size = tcg_ctx.code_gen_ptr - region_start(tb_ctx->region_cur);
+    for (i = 0; i < CODE_GEN_REGIONS; i++) {
+        if (i != tb_ctx->region_cur && tb_ctx->region_nb_tbs[i]) {
+            code_size += region_end(i) - region_start(i);
         }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
-            direct_jmp_count++;
-            if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
-                direct_jmp2_count++;
+        for (j = 0; j < tb_ctx->region_nb_tbs[i]; j++) {
+            tb = &region_tbs(i)[j];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
+                direct_jmp_count++;
+                if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_highwater - tcg_ctx.code_gen_buffer);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_size, tcg_ctx.code_gen_buffer_size);
+    cpu_fprintf(f, "code regions        %d (current %d)\n",
+                CODE_GEN_REGIONS, tb_ctx->region_cur);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
@@ -1914,12 +2093,10 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
+            tcg_ctx.tb_ctx.nb_tbs ? (ptrdiff_t)code_size /
                                      tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+                target_code_size ? (double) code_size /
+                                            target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1938,9 +2115,25 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %u\n",
             atomic_read(&tcg_ctx.tb_ctx.tb_flush_count));
+    cpu_fprintf(f, "TB region evictions %u\n",
+            atomic_read(&tcg_ctx.tb_ctx.tb_region_evict_count));
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+
+    memset(&lookup, 0, sizeof(lookup));
+    CPU_FOREACH(cpu) {
+        CPUTBLookupStats *stats = &cpu->tb_stats;
+
+        lookup.jmp_cache_hits += atomic_read(&stats->jmp_cache_hits);
+        lookup.phys_cache_hits += atomic_read(&stats->phys_cache_hits);
+        lookup.htable_lookups += atomic_read(&stats->htable_lookups);
+        lookup.translations += atomic_read(&stats->translations);
+    }
+    cpu_fprintf(f, "TB jmp cache hits   %lu\n", lookup.jmp_cache_hits);
+    cpu_fprintf(f, "TB phys cache hits  %lu\n", lookup.phys_cache_hits);
+    cpu_fprintf(f, "TB hash lookups     %lu\n", lookup.htable_lookups);
+    cpu_fprintf(f, "TB translations     %lu\n", lookup.translations);
     tcg_dump_info(f, cpu_fprintf);
 
     tb_unlock();